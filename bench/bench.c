@@ -0,0 +1,118 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* What the benchmarks share: timing, and setting up the shared memory of a
+ * hub the way main() does, with the files in a directory of their own.  */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+
+#include "main.h"
+#include "utils.h"
+#include "fileio.h"
+#include "userlist.h"
+#include "bench.h"
+
+static char bench_dir[] = "/tmp/odch-bench-XXXXXX";
+
+/* Returns the time in seconds.  */
+double bench_time(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Returns argument number i as an integer, or def if there aren't that many
+ * arguments.  */
+int bench_arg(int argc, char *argv[], int i, int def)
+{
+   return (argc > i) ? atoi(argv[i]) : def;
+}
+
+/* Creates an empty file in config_dir.  */
+static int create_file(char *name)
+{
+   char path[MAX_FDP_LEN+1];
+   FILE *fp;
+
+   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, name);
+   if((fp = fopen(path, "w")) == NULL)
+     {
+	perror(path);
+	return -1;
+     }
+   fclose(fp);
+   return 1;
+}
+
+/* Sets up the semaphores, the user list and the registry, with config_dir
+ * in a new directory. Returns -1 on error.  */
+int bench_init_hub(void)
+{
+   if(mkdtemp(bench_dir) == NULL)
+     {
+	perror("mkdtemp");
+	return -1;
+     }
+   strcpy(config_dir, bench_dir);
+   if((create_file(REG_FILE) == -1) || (create_file(OP_PERM_FILE) == -1))
+     return -1;
+
+   verbosity = 0;
+   pid = getpid();
+
+   if((init_sem(&total_share_sem) == -1) || (init_sem(&user_list_sem) == -1)
+      || (init_sem(&reg_list_sem) == -1) || (init_share_shm() == -1)
+      || (init_user_list() == -1) || (init_reg_list() == -1))
+     {
+	fprintf(stderr, "Couldn't set up the shared memory of the hub\n");
+	return -1;
+     }
+
+   return 1;
+}
+
+/* Removes what bench_init_hub() set up.  */
+void bench_exit_hub(void)
+{
+   char cmd[MAX_FDP_LEN+16];
+
+   semctl(total_share_sem, 0, IPC_RMID, NULL);
+   shmctl(total_share_shm, IPC_RMID, NULL);
+   semctl(user_list_sem, 0, IPC_RMID, NULL);
+   shmctl(get_user_list_shm_id(), IPC_RMID, NULL);
+   shmctl(user_list_shm_shm, IPC_RMID, NULL);
+   semctl(reg_list_sem, 0, IPC_RMID, NULL);
+   remove_reg_list();
+
+   snprintf(cmd, sizeof(cmd), "rm -rf %s", bench_dir);
+   system(cmd);
+}
@@ -0,0 +1,22 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+double bench_time(void);
+int    bench_arg(int argc, char *argv[], int i, int def);
+int    bench_init_hub(void);
+void   bench_exit_hub(void);
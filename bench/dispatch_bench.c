@@ -0,0 +1,157 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Measures how long it takes to find the handler of a command, with the
+ * command table, and with the strncmp chain it replaced, which tried the
+ * commands in the order of command_list. If a file is given, the commands
+ * are taken from its lines, from the first '$' on, so the log of a hub with
+ * verbosity 5 can be used. Otherwise a mix like the one a busy hub gets,
+ * mostly $Search, $SR and $MyINFO, is used.
+ * Usage: dispatch_bench [lookups] [file]  */
+
+/* main.c is included, since the table and find_command() are static.  */
+#define main hub_main
+#include "../src/main.c"
+#undef main
+
+#include "bench.h"
+
+#define MAX_COMMANDS 100000
+
+static char *default_mix[] =
+{
+   "$Search 10.0.0.1:412 F?F?0?1?linux$iso|",
+   "$Search Hub:user_12 T?F?1048576?1?mp3|",
+   "$Search 10.0.0.7:412 F?T?0?9?TTH:ABCDEFGHIJKLMNOPQRSTUVWXYZ234567ABCDEFGHIJK|",
+   "$Search Hub:[SE]foo_123 F?F?0?1?the$quick$brown$fox|",
+   "$Search 10.0.0.9:412 F?F?0?2?album|",
+   "$SR user_12 linux.iso\0051073741824 3/4\005Hub (10.0.0.1:411)\005[SE]foo_123|",
+   "$SR user_44 music\\song.mp3\0054194304 1/2\005Hub (10.0.0.1:411)\005user_12|",
+   "$SR user_45 share\\file.txt\0051024 2/2\005Hub (10.0.0.1:411)\005user_9|",
+   "$MyINFO $ALL user_12 desc<++ V:0.668,M:A,H:1/0/0,S:3>$ $DSL\001$user@host$1073741824$|",
+   "$MyINFO $ALL [SE]foo_123 $ $Cable\001$$53687091200$|",
+   "$ConnectToMe user_12 10.0.0.1:412|",
+   "$RevConnectToMe [SE]foo_123 user_12|",
+   "$To: user_12 From: user_44 $<user_44> hello|",
+   "$GetINFO user_12 user_44|",
+   "$GetNickList|",
+   "$Version 1,0091|",
+   "$Key abcdef|",
+   "$ValidateNick user_99|",
+   "$MultiSearch 10.0.0.1:412 F?F?0?1?linux|",
+   "$Kick user_13|",
+   NULL
+};
+
+static char *commands[MAX_COMMANDS];
+static int command_count = 0;
+
+/* Reads the commands in file, one per line, starting at the first '$'. The
+ * lines without a '$' are skipped.  */
+static void read_commands(char *file)
+{
+   char line[4096];
+   char *cmd;
+   FILE *fp;
+
+   if((fp = fopen(file, "r")) == NULL)
+     {
+	perror(file);
+	exit(EXIT_FAILURE);
+     }
+   while((command_count < MAX_COMMANDS)
+	 && (fgets(line, sizeof(line), fp) != NULL))
+     {
+	if((cmd = strchr(line, '$')) == NULL)
+	  continue;
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+	if((commands[command_count] = strdup(cmd)) == NULL)
+	  exit(EXIT_FAILURE);
+	command_count++;
+     }
+   fclose(fp);
+}
+
+/* Finds the command in buf the way handle_command() did before the table,
+ * by trying each command in turn.  */
+static struct command_t *find_command_chain(char *buf)
+{
+   struct command_t *cmd;
+
+   for(cmd = command_list; cmd->name != NULL; cmd++)
+     if(((cmd->nocase != 0)
+	 ? strncasecmp(buf, cmd->name, cmd->len)
+	 : strncmp(buf, cmd->name, cmd->len)) == 0)
+       return cmd;
+   return NULL;
+}
+
+/* Looks up every command rounds times with find and returns the time it
+ * took per command in nanoseconds. The types of the found commands are
+ * added up in sum, so the lookups can't be left out.  */
+static double run(struct command_t *(*find)(char *), int rounds,
+		  unsigned long *sum)
+{
+   struct command_t *cmd;
+   double start;
+   int i, j;
+
+   *sum = 0;
+   start = bench_time();
+   for(i = 0; i < rounds; i++)
+     for(j = 0; j < command_count; j++)
+       if(((cmd = find(commands[j])) != NULL) && ((cmd->types & REGULAR) != 0))
+	 *sum += cmd->types;
+
+   return (bench_time() - start) * 1e9 / ((double)rounds * command_count);
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned long table_sum, chain_sum;
+   double table_ns, chain_ns;
+   int lookups, rounds;
+   int i;
+
+   lookups = bench_arg(argc, argv, 1, 4000000);
+   if(argc > 2)
+     read_commands(argv[2]);
+   else
+     for(i = 0; default_mix[i] != NULL; i++)
+       commands[command_count++] = default_mix[i];
+   if(command_count == 0)
+     {
+	fprintf(stderr, "No commands to look up\n");
+	return EXIT_FAILURE;
+     }
+   if((rounds = lookups / command_count) == 0)
+     rounds = 1;
+
+   init_commands();
+
+   chain_ns = run(find_command_chain, rounds, &chain_sum);
+   table_ns = run(find_command, rounds, &table_sum);
+
+   printf("%d commands, %d rounds\n", command_count, rounds);
+   printf("strncmp chain: %6.1f ns per command\n", chain_ns);
+   printf("table:         %6.1f ns per command\n", table_ns);
+   if(chain_sum != table_sum)
+     printf("The chain and the table found different commands\n");
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Measures the hashtable of human users, both the open addressed one in
+ * main.c and the chained one with get_hash() that it replaced, which is
+ * kept here. It times looking up every nick, with the case changed, and
+ * logging a user out and in again. If a file is given, the nicks are taken
+ * from its lines, so the nicks of a real hub can be used. Otherwise nicks
+ * like the ones on a hub are made up, with tags, words and numbers.
+ * Usage: hash_bench [users] [lookups] [file]  */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "main.h"
+#include "bench.h"
+
+static char *tags[] = { "", "", "", "[SE]", "[DE]", "[NL]", "[FI]", "[ISP]",
+     "[DSL]", "[10MB]", NULL };
+static char *words[] = { "foo", "bar", "Anna", "john", "Dragon", "music",
+     "linux_fan", "Shadow", "xXx", "kalle", "DVDking", "Storm", "neo",
+     "Peter", "MrBig", NULL };
+static char *seps[] = { "", "_", "-", "|", NULL };
+
+/* The chained table from before, in user_t->next.  */
+static struct user_t **chain_table;
+
+/* The old get_hash(), from a few bits of the first and last characters of
+ * the nick.  */
+static int get_hash(char *nick)
+{
+   register char *s1, *s2;
+   register int i = 0;
+   register int hash = 0;
+
+   s1 = nick;
+   s2 = nick + strlen(nick) - 1;
+
+   do
+     {
+	hash |= ((*s1 & 0x1) << i);
+	i++;
+	hash |= ((*s2 & 0x1) << i);
+	i++;
+	s1++;
+	s2--;
+     } while((s1 <= s2) && (hash < max_sockets));
+
+   while(hash > max_sockets)
+     hash >>= 1;
+
+   return hash;
+}
+
+static void add_chain(struct user_t *user)
+{
+   int hashv;
+
+   hashv = get_hash(user->nick);
+   user->next = chain_table[hashv];
+   chain_table[hashv] = user;
+}
+
+static struct user_t *get_chain(char *nick)
+{
+   struct user_t *user;
+
+   user = chain_table[get_hash(nick)];
+   while((user != NULL)
+	 && !((strncasecmp(user->nick, nick, strlen(nick)) == 0)
+	      && (strlen(nick) == strlen(user->nick))))
+     user = user->next;
+
+   return user;
+}
+
+static void remove_chain(char *nick)
+{
+   struct user_t *user, *last_user;
+   int hashv;
+
+   hashv = get_hash(nick);
+   user = chain_table[hashv];
+   last_user = NULL;
+
+   while(user != NULL)
+     {
+	if((strncmp(user->nick, nick, strlen(nick)) == 0)
+	   && (strlen(nick) == strlen(user->nick)))
+	  {
+	     if(last_user == NULL)
+	       chain_table[hashv] = user->next;
+	     else
+	       last_user->next = user->next;
+	     return;
+	  }
+	last_user = user;
+	user = user->next;
+     }
+}
+
+/* Reads up to count nicks from file into users, one per line. Returns the
+ * number read.  */
+static int read_nicks(char *file, struct user_t *users, int count)
+{
+   char line[1024];
+   FILE *fp;
+   int n = 0;
+
+   if((fp = fopen(file, "r")) == NULL)
+     {
+	perror(file);
+	exit(EXIT_FAILURE);
+     }
+   while((n < count) && (fgets(line, sizeof(line), fp) != NULL))
+     {
+	line[strcspn(line, " \t\r\n")] = '\0';
+	if(line[0] == '\0')
+	  continue;
+	line[MAX_NICK_LEN] = '\0';
+	strcpy(users[n].nick, line);
+	n++;
+     }
+   fclose(fp);
+   return n;
+}
+
+/* Makes up count nicks in users. The number at the end keeps them apart.  */
+static void make_nicks(struct user_t *users, int count)
+{
+   int ntags, nwords, nseps;
+   int i;
+
+   for(ntags = 0; tags[ntags] != NULL; ntags++);
+   for(nwords = 0; words[nwords] != NULL; nwords++);
+   for(nseps = 0; seps[nseps] != NULL; nseps++);
+
+   srand(1);
+   for(i = 0; i < count; i++)
+     snprintf(users[i].nick, MAX_NICK_LEN+1, "%s%s%s%d", tags[rand() % ntags],
+	      words[rand() % nwords], seps[rand() % nseps], i);
+}
+
+/* Returns the length of the longest chain in the old table.  */
+static int longest_chain(void)
+{
+   struct user_t *user;
+   int i, len, longest = 0;
+
+   for(i = 0; i <= max_sockets; i++)
+     {
+	for(len = 0, user = chain_table[i]; user != NULL; user = user->next)
+	  len++;
+	if(len > longest)
+	  longest = len;
+     }
+   return longest;
+}
+
+/* Looks up every nick in lookup rounds times with get, and returns the time
+ * it took per lookup in nanoseconds. found is set to the number found.  */
+static double run_lookups(struct user_t *(*get)(char *), char **lookup,
+			  int count, int rounds, long *found)
+{
+   double start;
+   int i, j;
+
+   *found = 0;
+   start = bench_time();
+   for(i = 0; i < rounds; i++)
+     for(j = 0; j < count; j++)
+       if(get(lookup[j]) != NULL)
+	 (*found)++;
+
+   return (bench_time() - start) * 1e9 / ((double)rounds * count);
+}
+
+/* Removes and adds every user rounds times, and returns the time per user
+ * in nanoseconds.  */
+static double run_relogs(void (*add)(struct user_t *), void (*remove)(char *),
+			 struct user_t *users, int count, int rounds)
+{
+   double start;
+   int i, j;
+
+   start = bench_time();
+   for(i = 0; i < rounds; i++)
+     for(j = 0; j < count; j++)
+       {
+	  remove(users[j].nick);
+	  add(&users[j]);
+       }
+
+   return (bench_time() - start) * 1e9 / ((double)rounds * count);
+}
+
+int main(int argc, char *argv[])
+{
+   struct user_t *users;
+   char **lookup;
+   long chain_found, table_found;
+   double chain_ns, table_ns;
+   int count, lookups, rounds;
+   char *s;
+   int i;
+
+   count = bench_arg(argc, argv, 1, 2000);
+   lookups = bench_arg(argc, argv, 2, 4000000);
+   if(count <= 0)
+     {
+	fprintf(stderr, "No users\n");
+	return EXIT_FAILURE;
+     }
+
+   if(((users = calloc(count, sizeof(struct user_t))) == NULL)
+      || ((lookup = calloc(count, sizeof(char *))) == NULL))
+     {
+	perror("calloc");
+	return EXIT_FAILURE;
+     }
+   if(argc > 3)
+     count = read_nicks(argv[3], users, count);
+   else
+     make_nicks(users, count);
+   if(count == 0)
+     {
+	fprintf(stderr, "No nicks\n");
+	return EXIT_FAILURE;
+     }
+   if((rounds = lookups / count) == 0)
+     rounds = 1;
+
+   /* The users are looked up with the case of the nick changed, as when a
+    * command gives a nick in another case.  */
+   for(i = 0; i < count; i++)
+     {
+	if((lookup[i] = strdup(users[i].nick)) == NULL)
+	  return EXIT_FAILURE;
+	for(s = lookup[i]; *s != '\0'; s++)
+	  *s = islower((int)*s) ? toupper((int)*s) : tolower((int)*s);
+     }
+
+   /* The old table was sized the way main() sized it.  */
+   max_sockets = getdtablesize();
+   if((chain_table = calloc(max_sockets + 1, sizeof(struct user_t *))) == NULL)
+     {
+	perror("calloc");
+	return EXIT_FAILURE;
+     }
+   memset(&human_hash_table, 0, sizeof(struct human_table));
+   human_hash_table.size = HUMAN_HASH_SPACES;
+   if((human_hash_table.slots = calloc(HUMAN_HASH_SPACES, sizeof(struct user_t *))) == NULL)
+     {
+	perror("calloc");
+	return EXIT_FAILURE;
+     }
+
+   /* The chained table is filled and timed first, since it uses
+    * user->next.  */
+   for(i = 0; i < count; i++)
+     add_chain(&users[i]);
+   printf("%d users, %d rounds, %d buckets in the chained table, "
+	  "longest chain %d\n", count, rounds, max_sockets + 1, longest_chain());
+
+   chain_ns = run_lookups(get_chain, lookup, count, rounds, &chain_found);
+   printf("chained lookup:              %6.1f ns per user\n", chain_ns);
+   printf("chained log out and in:      %6.1f ns per user\n",
+	  run_relogs(add_chain, remove_chain, users, count, rounds / 10 + 1));
+
+   for(i = 0; i < count; i++)
+     add_human_to_hash(&users[i]);
+
+   table_ns = run_lookups(get_human_user, lookup, count, rounds, &table_found);
+   printf("open addressed lookup:       %6.1f ns per user\n", table_ns);
+   printf("open addressed log out and in: %4.1f ns per user\n",
+	  run_relogs(add_human_to_hash, remove_human_from_hash, users, count,
+		     rounds / 10 + 1));
+
+   if(chain_found != table_found)
+     printf("The tables found different numbers of users\n");
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Measures what the logging on the $Search path costs per message when the
+ * messages aren't logged: the verbosity 5 line for each received command in
+ * socket_action(), and the verbosity 4 lines for a bad $Search in search().
+ * Each is done the way it was before the logging macros, by calling the
+ * function, which evaluated the arguments and checked the verbosity inside,
+ * and through the macros, which check the verbosity first.
+ * Usage: log_bench [messages] [verbosity]  */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "main.h"
+#include "fileio.h"
+#include "bench.h"
+
+static char search_buf[] = "$Search 10.0.0.1:412 F?F?0?1?the$quick$brown$fox|";
+
+/* The logging of one received $Search, as it was done before.  */
+static void log_search_function(struct user_t *user, int bad)
+{
+   (logprintf)(5, "PID: %d Received command from %s, type 0x%X: %s\n",
+	       (int)getpid(), user->hostname, user->type, search_buf);
+   if(bad != 0)
+     {
+	(logprintf)(4, "Received bad $Search command from %s at %s:\n",
+		    user->nick, user->hostname);
+	if(strlen(search_buf) < 3500)
+	  (logprintf)(4, "%s\n", search_buf);
+	else
+	  (logprintf)(4, "too large buf\n");
+     }
+}
+
+/* And as it's done now.  */
+static void log_search_macro(struct user_t *user, int bad)
+{
+   logprintf(5, "PID: %d Received command from %s, type 0x%X: %s\n",
+	     (int)getpid(), user->hostname, user->type, search_buf);
+   if(bad != 0)
+     {
+	logprintf(4, "Received bad $Search command from %s at %s:\n",
+		  user->nick, user->hostname);
+	logbuf(4, search_buf);
+     }
+}
+
+/* Does the logging of messages $Searches with log, and returns the time per message in
+ * nanoseconds.  */
+static double run(void (*log)(struct user_t *, int), struct user_t *user,
+		  int messages, int bad)
+{
+   double start;
+   int i;
+
+   start = bench_time();
+   for(i = 0; i < messages; i++)
+     log(user, bad);
+
+   return (bench_time() - start) * 1e9 / messages;
+}
+
+int main(int argc, char *argv[])
+{
+   struct user_t user;
+   int messages;
+
+   messages = bench_arg(argc, argv, 1, 5000000);
+   verbosity = bench_arg(argc, argv, 2, 3);
+   if(verbosity >= 4)
+     {
+	fprintf(stderr, "The messages are only left out below verbosity 4\n");
+	return EXIT_FAILURE;
+     }
+
+   memset(&user, 0, sizeof(struct user_t));
+   strcpy(user.nick, "[SE]foo_123");
+   strcpy(user.hostname, "10.0.0.1");
+   user.type = REGULAR;
+
+   printf("verbosity %d, %d messages\n", verbosity, messages);
+   printf("received $Search, function: %6.1f ns per message\n",
+	  run(log_search_function, &user, messages, 0));
+   printf("received $Search, macro:    %6.1f ns per message\n",
+	  run(log_search_macro, &user, messages, 0));
+   printf("bad $Search, function:      %6.1f ns per message\n",
+	  run(log_search_function, &user, messages, 1));
+   printf("bad $Search, macro:         %6.1f ns per message\n",
+	  run(log_search_macro, &user, messages, 1));
+
+   return EXIT_SUCCESS;
+}
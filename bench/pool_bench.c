@@ -0,0 +1,184 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Measures what a connection costs in allocations, with the pools and with
+ * malloc() and free() as before. A connection gets a user, an input buffer
+ * of IN_BUF_SIZE bytes, a description and an email, and gives them back
+ * when it goes away. Connections are replaced one at a time in random
+ * order, as users come and go, and then all at once, as in a reconnect
+ * storm after the hub has been unreachable.
+ * Usage: pool_bench [connections] [rounds]  */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "main.h"
+#include "utils.h"
+#include "bench.h"
+
+/* What a connection has allocated.  */
+struct conn_t
+{
+   struct user_t *user;
+   char *buf;
+   char *desc;
+   char *email;
+};
+
+/* The sizes of the descriptions and emails, made up once so that both ways
+ * of allocating get the same ones.  */
+static int *desc_sizes;
+static int *email_sizes;
+
+static void connect_malloc(struct conn_t *conn, int i)
+{
+   conn->user = malloc(sizeof(struct user_t));
+   conn->buf = malloc(IN_BUF_SIZE);
+   conn->desc = malloc(desc_sizes[i]);
+   conn->email = malloc(email_sizes[i]);
+   if((conn->user == NULL) || (conn->buf == NULL) || (conn->desc == NULL)
+      || (conn->email == NULL))
+     exit(EXIT_FAILURE);
+   conn->user->sock = i;
+   conn->buf[0] = conn->desc[0] = conn->email[0] = '\0';
+}
+
+static void disconnect_malloc(struct conn_t *conn)
+{
+   free(conn->email);
+   free(conn->desc);
+   free(conn->buf);
+   free(conn->user);
+}
+
+static void connect_pool(struct conn_t *conn, int i)
+{
+   conn->user = pool_alloc(POOL_USER);
+   conn->buf = alloc_string(IN_BUF_SIZE);
+   conn->desc = alloc_string(desc_sizes[i]);
+   conn->email = alloc_string(email_sizes[i]);
+   if((conn->user == NULL) || (conn->buf == NULL) || (conn->desc == NULL)
+      || (conn->email == NULL))
+     exit(EXIT_FAILURE);
+   conn->user->sock = i;
+   conn->buf[0] = conn->desc[0] = conn->email[0] = '\0';
+}
+
+static void disconnect_pool(struct conn_t *conn)
+{
+   free_string(conn->email);
+   free_string(conn->desc);
+   free_string(conn->buf);
+   pool_free(POOL_USER, conn->user);
+}
+
+/* Connects count connections and replaces them rounds times, one at a time
+ * in the order of order if storm is zero and all at once otherwise. Returns
+ * the time per replaced connection in nanoseconds.  */
+static double run(void (*connect)(struct conn_t *, int),
+		  void (*disconnect)(struct conn_t *), struct conn_t *conns,
+		  int *order, int count, int rounds, int storm)
+{
+   double start, elapsed;
+   int i, j;
+
+   for(i = 0; i < count; i++)
+     connect(&conns[i], i);
+
+   start = bench_time();
+   for(i = 0; i < rounds; i++)
+     {
+	if(storm == 0)
+	  for(j = 0; j < count; j++)
+	    {
+	       disconnect(&conns[order[j]]);
+	       connect(&conns[order[j]], order[j]);
+	    }
+	else
+	  {
+	     for(j = 0; j < count; j++)
+	       disconnect(&conns[order[j]]);
+	     for(j = 0; j < count; j++)
+	       connect(&conns[j], j);
+	  }
+     }
+   elapsed = bench_time() - start;
+
+   for(i = 0; i < count; i++)
+     disconnect(&conns[i]);
+
+   return elapsed * 1e9 / ((double)rounds * count);
+}
+
+int main(int argc, char *argv[])
+{
+   struct conn_t *conns;
+   int *order;
+   int count, rounds;
+   int i, j, tmp;
+
+   count = bench_arg(argc, argv, 1, 5000);
+   rounds = bench_arg(argc, argv, 2, 200);
+   if((count <= 0) || (rounds <= 0))
+     {
+	fprintf(stderr, "Nothing to do\n");
+	return EXIT_FAILURE;
+     }
+
+   if(((conns = calloc(count, sizeof(struct conn_t))) == NULL)
+      || ((order = malloc(count * sizeof(int))) == NULL)
+      || ((desc_sizes = malloc(count * sizeof(int))) == NULL)
+      || ((email_sizes = malloc(count * sizeof(int))) == NULL))
+     {
+	perror("malloc");
+	return EXIT_FAILURE;
+     }
+
+   srand(1);
+   for(i = 0; i < count; i++)
+     {
+	order[i] = i;
+	desc_sizes[i] = 8 + rand() % 120;
+	email_sizes[i] = 1 + rand() % 40;
+     }
+   for(i = count - 1; i > 0; i--)
+     {
+	j = rand() % (i + 1);
+	tmp = order[i];
+	order[i] = order[j];
+	order[j] = tmp;
+     }
+
+   printf("%d connections, %d rounds\n", count, rounds);
+   printf("one at a time, malloc: %6.1f ns per connection\n",
+	  run(connect_malloc, disconnect_malloc, conns, order, count, rounds, 0));
+   printf("one at a time, pools:  %6.1f ns per connection\n",
+	  run(connect_pool, disconnect_pool, conns, order, count, rounds, 0));
+   printf("all at once, malloc:   %6.1f ns per connection\n",
+	  run(connect_malloc, disconnect_malloc, conns, order, count, rounds, 1));
+   printf("all at once, pools:    %6.1f ns per connection\n",
+	  run(connect_pool, disconnect_pool, conns, order, count, rounds, 1));
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Measures what the timer wheel costs the hub, with one login timer for
+ * each user: starting and cancelling a timer, as for a user that logs in,
+ * calling run_timers() when nothing is due, as the main loop does after
+ * each round of events, and firing timers. For comparison, it also times
+ * the sweep over all users that the alarm signal did every ALARM_TIME
+ * seconds before the wheel.
+ * Usage: timer_bench [users] [rounds]  */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "main.h"
+#include "utils.h"
+#include "bench.h"
+
+/* Times the timers are fired, each taking up to a second.  */
+#define FIRE_TURNS 3
+
+static long fired = 0;
+
+static void count_timeout(void *arg)
+{
+   fired++;
+}
+
+/* Starts and cancels the timer of every user rounds times, with the timers
+ * of all users running. Returns the time per start and cancel in
+ * nanoseconds.  */
+static double run_restarts(struct user_t **users, int count, int rounds)
+{
+   double start;
+   int i, j;
+
+   start = bench_time();
+   for(i = 0; i < rounds; i++)
+     for(j = 0; j < count; j++)
+       {
+	  cancel_timer(&users[j]->timers[TIMER_LOGIN]);
+	  add_timer(&users[j]->timers[TIMER_LOGIN], LOGIN_TIMEOUT, count_timeout, users[j]);
+       }
+
+   return (bench_time() - start) * 1e9 / ((double)rounds * count);
+}
+
+/* Calls run_timers() calls times with nothing due, and returns the time per
+ * call in nanoseconds.  */
+static double run_idle(int calls)
+{
+   double start;
+   int i;
+
+   run_timers();
+   start = bench_time();
+   for(i = 0; i < calls; i++)
+     run_timers();
+
+   return (bench_time() - start) * 1e9 / calls;
+}
+
+/* Lets the timers of all users expire and fires them, turns times. The
+ * timers are run in the second after they expire, so each turn waits for
+ * the next second first. Returns the time per fired timer in nanoseconds,
+ * without the waiting.  */
+static double run_fires(struct user_t **users, int count, int turns)
+{
+   double start, elapsed = 0;
+   int i, j;
+
+   fired = 0;
+   for(i = 0; i < turns; i++)
+     {
+	for(j = 0; j < count; j++)
+	  add_timer(&users[j]->timers[TIMER_LOGIN], 0, count_timeout, users[j]);
+	usleep(timer_wait() * 1000);
+	start = bench_time();
+	run_timers();
+	elapsed += bench_time() - start;
+     }
+
+   return elapsed * 1e9 / ((double)turns * count);
+}
+
+/* The sweep over the users from the old alarm_signal(). Returns the time per
+ * user in nanoseconds.  */
+static double run_sweeps(struct user_t **users, int count, int rounds)
+{
+   double start;
+   long found = 0;
+   int i, j;
+
+   start = bench_time();
+   for(i = 0; i < rounds; i++)
+     for(j = 0; j < count; j++)
+       if((users[j]->type & (UNKEYED | NON_LOGGED | NON_LOGGED_ADM)) != 0)
+	 found++;
+
+   if(found == 0)
+     printf("No users to time out\n");
+   return (bench_time() - start) * 1e9 / ((double)rounds * count);
+}
+
+int main(int argc, char *argv[])
+{
+   struct user_t **users;
+   int count, rounds;
+   int i;
+
+   count = bench_arg(argc, argv, 1, 5000);
+   rounds = bench_arg(argc, argv, 2, 400);
+   if((count <= 0) || (rounds <= 0))
+     {
+	fprintf(stderr, "Nothing to do\n");
+	return EXIT_FAILURE;
+     }
+
+   if((users = calloc(count, sizeof(struct user_t *))) == NULL)
+     {
+	perror("calloc");
+	return EXIT_FAILURE;
+     }
+   for(i = 0; i < count; i++)
+     {
+	if((users[i] = calloc(1, sizeof(struct user_t))) == NULL)
+	  {
+	     perror("calloc");
+	     return EXIT_FAILURE;
+	  }
+	users[i]->type = (i % 10 == 0) ? NON_LOGGED : REGULAR;
+	add_timer(&users[i]->timers[TIMER_LOGIN], LOGIN_TIMEOUT, count_timeout, users[i]);
+     }
+
+   printf("%d users, %d rounds\n", count, rounds);
+   printf("start and cancel:   %6.1f ns per timer\n",
+	  run_restarts(users, count, rounds));
+   printf("run_timers(), idle: %6.1f ns per call\n",
+	  run_idle(rounds * count));
+   printf("fire:               %6.1f ns per timer\n",
+	  run_fires(users, count, FIRE_TURNS));
+   if(fired != (long)FIRE_TURNS * count)
+     printf("%ld timers of %ld fired\n", fired, (long)FIRE_TURNS * count);
+   printf("old alarm sweep:    %6.1f ns per user, every %d seconds\n",
+	  run_sweeps(users, count, rounds), ALARM_TIME);
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Measures how many $NickLists per second reader processes get out of the
+ * user list, first with nothing else going on and then while writer
+ * processes add users and remove them again, as logins and quits do. The
+ * readers don't take a lock, so the rate should hold up with the writers
+ * running.
+ * Usage: userlist_bench [readers] [writers] [users] [seconds]  */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "main.h"
+#include "userlist.h"
+#include "bench.h"
+
+/* Counts of the processes, in memory shared with them.  */
+static volatile long *counts;
+static volatile int *stop;
+
+/* Adds the user nick to the list, and makes room for it if needed.  */
+static void add_nick(struct user_t *user, char *nick)
+{
+   strcpy(user->nick, nick);
+   if(add_user_to_list(user) == 0)
+     {
+	increase_user_list();
+	add_user_to_list(user);
+     }
+}
+
+/* Reads the $NickList until told to stop.  */
+static void reader(int n)
+{
+   char *list;
+
+   while(*stop == 0)
+     {
+	if((list = get_nick_list()) != NULL)
+	  free(list);
+	counts[n]++;
+     }
+   _exit(EXIT_SUCCESS);
+}
+
+/* Logs users in and out until told to stop.  */
+static void writer(int n)
+{
+   struct user_t user;
+   char nick[MAX_NICK_LEN+1];
+   int i = 0;
+
+   memset(&user, 0, sizeof(struct user_t));
+   strcpy(user.hostname, "127.0.0.1");
+   user.type = REGULAR;
+
+   while(*stop == 0)
+     {
+	snprintf(nick, sizeof(nick), "writer%d_%d", n, i);
+	add_nick(&user, nick);
+	remove_user_from_list(nick);
+	i = (i + 1) % 1000;
+	counts[n]++;
+     }
+   _exit(EXIT_SUCCESS);
+}
+
+/* Runs readers and writers for seconds and prints what they did.  */
+static void run(int readers, int writers, int seconds)
+{
+   long reads = 0, joins = 0;
+   double start, elapsed;
+   int i;
+
+   memset((void *)counts, 0, sizeof(long) * (readers + writers));
+   *stop = 0;
+   fflush(stdout);
+   start = bench_time();
+
+   for(i = 0; i < readers + writers; i++)
+     if(fork() == 0)
+       {
+	  if(i < readers)
+	    reader(i);
+	  writer(i);
+       }
+
+   sleep(seconds);
+   *stop = 1;
+   while(wait(NULL) > 0);
+   elapsed = bench_time() - start;
+
+   for(i = 0; i < readers; i++)
+     reads += counts[i];
+   for(; i < readers + writers; i++)
+     joins += counts[i];
+
+   printf("%d readers, %d writers: %.0f nick lists/s, %.0f joins and quits/s\n",
+	  readers, writers, reads / elapsed, joins / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+   struct user_t user;
+   char nick[MAX_NICK_LEN+1];
+   int readers, writers, users, seconds;
+   void *shared;
+   int i;
+
+   readers = bench_arg(argc, argv, 1, 4);
+   writers = bench_arg(argc, argv, 2, 2);
+   users = bench_arg(argc, argv, 3, 5000);
+   seconds = bench_arg(argc, argv, 4, 3);
+
+   if((shared = mmap(NULL, sizeof(long) * (readers + writers + 1),
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		     -1, 0)) == MAP_FAILED)
+     {
+	perror("mmap");
+	return EXIT_FAILURE;
+     }
+   counts = (long *)shared;
+   stop = (int *)(counts + readers + writers);
+
+   if(bench_init_hub() == -1)
+     return EXIT_FAILURE;
+
+   memset(&user, 0, sizeof(struct user_t));
+   strcpy(user.hostname, "127.0.0.1");
+   user.type = REGULAR;
+   for(i = 0; i < users; i++)
+     {
+	snprintf(nick, sizeof(nick), "[SE]user_%d", i);
+	add_nick(&user, nick);
+     }
+   printf("%d users on the list\n", count_all_users());
+
+   run(readers, 0, seconds);
+   run(readers, writers, seconds);
+
+   bench_exit_hub();
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+/*  Open DC Hub - A Linux/Unix version of the Direct Connect hub.
+ *  Copyright (C) 2002,2003  Jonatan Nilsson
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Checks that the user list can be made smaller after a mass quit, when
+ * the $NickList and $OpList haven't been built since the quits and are
+ * longer than what fits in the smaller list, and that the lists are right
+ * afterwards. Run by "make -C bench check".
+ * Usage: userlist_check [users]  */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "main.h"
+#include "userlist.h"
+#include "fileio.h"
+#include "bench.h"
+
+static int failed = 0;
+
+/* Makes the nick of user number i, as long as a nick can be.  */
+static void make_nick(char *nick, int i)
+{
+   memset(nick, 'x', MAX_NICK_LEN);
+   nick[MAX_NICK_LEN] = '\0';
+   sprintf(nick, "user_%d_", i);
+   nick[strlen(nick)] = 'x';
+}
+
+/* Compares list with what it should be.  */
+static void check_list(char *what, char *list, char *expected)
+{
+   if(list == NULL)
+     {
+	printf("%s: couldn't get the list\n", what);
+	failed = 1;
+	return;
+     }
+   if(strcmp(list, expected) != 0)
+     {
+	printf("%s: got %.60s..., expected %.60s...\n", what, list, expected);
+	failed = 1;
+     }
+   free(list);
+}
+
+int main(int argc, char *argv[])
+{
+   struct user_t user;
+   char nick[MAX_NICK_LEN+1];
+   char expected[2 * (MAX_NICK_LEN + 2) + 32];
+   char reg[MAX_NICK_LEN+32];
+   int users;
+   int i;
+
+   users = bench_arg(argc, argv, 1, 4000);
+
+   if(bench_init_hub() == -1)
+     return EXIT_FAILURE;
+
+   memset(&user, 0, sizeof(struct user_t));
+   strcpy(user.hostname, "127.0.0.1");
+   user.type = OP;
+   for(i = 0; i < users; i++)
+     {
+	make_nick(user.nick, i);
+	
+	/* They are all registered as ops, to be on the $OpList too.  */
+	sprintf(reg, "$AddRegUser %s pass 2|", user.nick);
+	add_reg_user(reg, NULL);
+	if(add_user_to_list(&user) == 0)
+	  {
+	     increase_user_list();
+	     add_user_to_list(&user);
+	  }
+     }
+
+   /* Everyone quits, which leaves both lists stale and as long as they were
+    * with all the users, and then the list is made smaller.  */
+   for(i = 0; i < users; i++)
+     {
+	make_nick(nick, i);
+	remove_user_from_list(nick);
+     }
+   purge_user_list();
+
+   check_list("$NickList after the quits", get_nick_list(), "$NickList ||");
+   check_list("$OpList after the quits", get_op_list(), "$OpList ||");
+
+   /* And the smaller list still works.  */
+   make_nick(user.nick, 0);
+   add_user_to_list(&user);
+   sprintf(expected, "$NickList %s$$||", user.nick);
+   check_list("$NickList after a login", get_nick_list(), expected);
+   sprintf(expected, "$OpList %s$$||", user.nick);
+   check_list("$OpList after a login", get_op_list(), expected);
+   if(count_all_users() != 1)
+     {
+	printf("%d users on the list, expected 1\n", count_all_users());
+	failed = 1;
+     }
+
+   bench_exit_hub();
+
+   printf("userlist_check: %s\n", (failed == 0) ? "ok" : "FAILED");
+   return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -57,15 +57,33 @@
 /* Define if you have the <grp.h> header file.  */
 /* #undef HAVE_GRP_H */
 
+/* Define if you have the <linux/futex.h> header file.  */
+#define HAVE_LINUX_FUTEX_H 1
+
 /* Define if you have the <malloc.h> header file.  */
 #define HAVE_MALLOC_H 1
 
+/* Define if you have the <pthread.h> header file.  */
+#define HAVE_PTHREAD_H 1
+
 /* Define if you have the <pwd.h> header file.  */
 /* #undef HAVE_PWD_H */
 
 /* Define if you have the <sys/capability.h> header file.  */
 /* #undef HAVE_SYS_CAPABILITY_H */
 
+/* Define if you have the <sys/epoll.h> header file.  */
+#define HAVE_SYS_EPOLL_H 1
+
+/* Define if you have the <sys/eventfd.h> header file.  */
+#define HAVE_SYS_EVENTFD_H 1
+
+/* Define if you have the <sys/inotify.h> header file.  */
+#define HAVE_SYS_INOTIFY_H 1
+
+/* Define if you have the <sys/mman.h> header file.  */
+#define HAVE_SYS_MMAN_H 1
+
 /* Define if you have the <sys/poll.h> header file.  */
 #define HAVE_SYS_POLL_H 1
 
@@ -93,6 +111,9 @@
 /* Define if you have the nsl library (-lnsl).  */
 #define HAVE_LIBNSL 1
 
+/* Define if you have the pthread library (-lpthread).  */
+#define HAVE_LIBPTHREAD 1
+
 /* Define if you have the socket library (-lsocket).  */
 /* #undef HAVE_LIBSOCKET */
 
@@ -111,3 +132,6 @@
 /* Define HAVE_PERL */
 /* #undef HAVE_PERL */
 
+/* Highest verbosity of the log messages that are built */
+/* #undef MAX_VERBOSITY */
+
@@ -94,10 +94,7 @@ void sr(char *buf, struct user_t *user)
 	  {	     
 	     logprintf(4, "Received bad $SR command from %s at %s:\n", 
 		       user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }	
      }
@@ -106,10 +103,7 @@ void sr(char *buf, struct user_t *user)
    if(tonick[0] == '\0')
      {
 	logprintf(4, "Received bad $SR command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    if((user->type & (REGULAR | REGISTERED | OP | OP_ADMIN | ADMIN)) != 0)
@@ -118,11 +112,8 @@ void sr(char *buf, struct user_t *user)
 	   || (strlen(fromnick) != strlen(user->nick)))
 	  {
 	     logprintf(3, "User %s at %s claims to be someone else in $SR:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(3, "%s\n", buf);
-	     else
-	       logprintf(3, "too large buf\n");
-	     user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	     logbuf(3, buf);
+	     set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	     return;
 	  }
      }
@@ -144,8 +135,8 @@ void sr(char *buf, struct user_t *user)
    if((to_user = get_human_user(tonick)) != NULL)
      send_to_user(send_buf, to_user);
    else   
-     /* If user wasn't found, forward to other processes */
-     send_to_non_humans(buf, FORKED, user);
+     /* If user wasn't found, forward to the process the user is on */
+     send_to_owner(buf, tonick, user);
    
    free(send_buf);
 }
@@ -162,7 +153,6 @@ void search(char *buf, struct user_t *user)
    char byte1, byte2, byte3;
    char pattern[51]; /* It's the last argument, so it doesn't matter if it fits in the string */
    long long unsigned size;
-   time_t now;
 
    /* Don't bother to check the command if it was sent from a forked process */
    if(user->type != FORKED)
@@ -171,10 +161,7 @@ void search(char *buf, struct user_t *user)
 		  command, ip, port, &byte1, &byte2, &size, &byte3, pattern) != 8)
 	  {
 	     logprintf(4, "Received bad $Search command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
 	
@@ -187,7 +174,7 @@ void search(char *buf, struct user_t *user)
                   || (is_internal_address(user->ip) == 0)))
 	       {
 		  logprintf(1, "%s from %s claims to be someone else in $Search, removing user\n", user->nick, user->hostname);
-		  user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 		  return;
 	       }	
 	  }
@@ -195,10 +182,7 @@ void search(char *buf, struct user_t *user)
 	if(pattern[0] == '\0')
 	  {
 	     logprintf(4, "Received bad $Search command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
      }
@@ -206,15 +190,20 @@ void search(char *buf, struct user_t *user)
    if(user->type != FORKED)
      {
 	
-	now = time(NULL);
-	if((searchspam_time > 0) && 
-	   (difftime(now, user->last_search) <= (double)searchspam_time))
-	  {
-	     user->last_search = now;
-	     uprintf(user, "<Hub-Security> Search ignored.  Please leave at least %d seconds between search attempts.|", searchspam_time);
-	     return;
+	/* A search, even an ignored one, makes the user wait searchspam_time
+	 * seconds before the next. The timer clears search_wait in the second
+	 * after the wait.  */
+	if(searchspam_time > 0)
+	  {
+	     add_timer(&user->timers[TIMER_SEARCH], searchspam_time + 1,
+		       search_wait_timeout, user);
+	     if(user->search_wait != 0)
+	       {
+		  uprintf(user, "<Hub-Security> Search ignored.  Please leave at least %d seconds between search attempts.|", searchspam_time);
+		  return;
+	       }
+	     user->search_wait = 1;
 	  }
-	user->last_search = now;
    
    /* If you want to control searches, here is the place to add the source.
     * The search pattern is in the variable pattern. A couple of examples: */
@@ -232,7 +221,7 @@ void search(char *buf, struct user_t *user)
    if(strstr(pattern, "bad word") != NULL)
      {
 	uprintf(user, "<Hub-Security> No searches for bad words in this hub!|");
-	user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	return;
      }
     */					 
@@ -240,7 +229,7 @@ void search(char *buf, struct user_t *user)
    
    /* Now, forward to all users */
    send_to_humans(buf, REGULAR | REGISTERED |  OP | OP_ADMIN, NULL);
-   send_to_non_humans(buf, FORKED, user);
+   relay_to_non_humans(REC_SEARCH, buf, FORKED, user);
 }
 
 /* Search on linked hubs, same format as $Search */
@@ -258,20 +247,14 @@ void multi_search(char *buf, struct user_t *user)
 	     command, ip, &port, &byte1, &byte2, &size, &byte3, pattern) != 8)
      {	
 	logprintf(4, "Received bad $MultiSearch command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
    if(pattern[0] == '\0')
      {                                                                               
 	logprintf(4, "Received bad $MultiSearch command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
@@ -310,10 +293,7 @@ void multi_connect_to_me(char *buf, struct user_t *user)
 	     ip, &port, hubip) != 5)
      {                                                                           
 	logprintf(4, "Received bad $MultiConnectToMe command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
@@ -323,10 +303,7 @@ void multi_connect_to_me(char *buf, struct user_t *user)
 	if(port == 0)
 	  {                                                                                  
 	     logprintf(4, "Received bad $MultiConnectToMe command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
      }
@@ -377,30 +354,21 @@ void chat(char *buf, struct user_t *user)
 	if(sscanf(buf, "<%50[^>]> %30[^|]|", nick, chatstring) < 1)
 	  {                                                                             
 	     logprintf(4, "Received bad chat command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
 	  
 	if(chatstring[0] == '\0')
 	  {                                                                             
 	     logprintf(4, "Received bad chat command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
 	if((strncmp(buf + 1, user->nick, strlen(nick)) != 0) || (strlen(nick) != strlen(user->nick)))
 	  {
 	     logprintf(3, "User %s at %s claims to be someone else in chat:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(3, "%s\n", buf);
-	     else
-	       logprintf(3, "too large buf\n");
-	     user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	     logbuf(3, buf);
+	     set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	     return;
 	  }
      }
@@ -430,6 +398,8 @@ void chat(char *buf, struct user_t *user)
 		  
 		  if (add_line_to_file(tempstr, path) > 0)
 		    {
+		       update_reg_user(user->nick, tempstr);
+		       update_op_in_user_list(user->nick);
 		       uprintf(user, "<Hub-Security> Password changed|");
 		       logprintf(4, "User %s changed it's password\n", user->nick);
 		    }
@@ -649,7 +619,7 @@ void chat(char *buf, struct user_t *user)
 	else if((user->type == OP_ADMIN) && (strncmp(temp, "!exit", 5) == 0))
 	  {
 	     logprintf(1, "Got exit from OP Admin %s at %s, haning up\n", user->nick, user->hostname);
-	     user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	     set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	  }
 	else if((user->type == OP_ADMIN) && (strncasecmp(temp, "!redirectall ", 13) == 0))
 	  {
@@ -745,10 +715,7 @@ void rev_connect_to_me(char *buf, struct user_t *user)
    if(sscanf(buf, "%20s %50s %50[^|]|", command, requesting, requested) != 3)
      {                                                                           
 	logprintf(4, "Received bad $RevConnectToMe command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
   
@@ -757,21 +724,15 @@ void rev_connect_to_me(char *buf, struct user_t *user)
 	if(requested[0] == '\0')
 	  {	                                                                               
 	     logprintf(4, "Received bad $RevConnectToMe command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
 	if((strncmp(requesting, user->nick, strlen(requesting)) != 0) 
 	    || (strlen(requesting) != strlen(user->nick)))
 	    {	                                                                                   
 	       logprintf(3, "User %s at %s claims to be someone else in $RevConnectToMe:\n", user->nick, user->hostname);
-	       if(strlen(buf) < 3500)
-		 logprintf(3, "%s\n", buf);
-	       else
-		 logprintf(3, "too large buf\n");
-	       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	       logbuf(3, buf);
+	       set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	       return;
 	    }
      }
@@ -780,7 +741,7 @@ void rev_connect_to_me(char *buf, struct user_t *user)
    if((to_user = get_human_user(requested)) != NULL)
      send_to_user(buf, to_user);
    else
-     send_to_non_humans(buf, FORKED, user);
+     send_to_owner(buf, requested, user);
 }
        
 
@@ -797,10 +758,7 @@ void connect_to_me(char *buf, struct user_t *user)
    if(sscanf(buf, "%20s %50s %121[^:]:%u|", command, requested, ip, &port) != 4)
      {                                                                        
 	logprintf(4, "Received bad $ConnectToMe command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
@@ -810,10 +768,7 @@ void connect_to_me(char *buf, struct user_t *user)
 	if(port == 0)
 	  {	                                                                            
 	     logprintf(4, "Received bad $ConnectToMe command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
      }
@@ -822,7 +777,7 @@ void connect_to_me(char *buf, struct user_t *user)
    if((to_user = get_human_user(requested)) != NULL)
      send_to_user(buf, to_user);
    else
-     send_to_non_humans(buf, FORKED, user);
+     send_to_owner(buf, requested, user);
 }
    
 /* Send message from user to specified user, has the following format:
@@ -839,10 +794,7 @@ void to_from(char *buf, struct user_t *user)
    if(sscanf(buf, "%5s %50s From: %50s $<%50[^>]> %10[^|]|", command, tonick, fromnick, chatnick, message) != 5)
      {                                                                
 	logprintf(4, "Received bad $To command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
@@ -851,10 +803,7 @@ void to_from(char *buf, struct user_t *user)
 	if(message[0] == '\0')
 	  {	                                                                    
 	     logprintf(4, "Received bad $To command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
 	if((user->type & (REGULAR | REGISTERED)) != 0)
@@ -865,11 +814,8 @@ void to_from(char *buf, struct user_t *user)
 		    || (strlen(chatnick) != strlen(user->nick))))
 	       {	                                                                   	                        
 		  logprintf(3, "User %s at %s claims to be someone else in $To:\n", user->nick, user->hostname);
-		  if(strlen(buf) < 3500)
-		    logprintf(3, "%s\n", buf);
-		  else
-		    logprintf(3, "too large buf\n");
-		  user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+		  logbuf(3, buf);
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 		  return;
 	       }
 	  }	
@@ -879,7 +825,7 @@ void to_from(char *buf, struct user_t *user)
    if((to_user = get_human_user(tonick)) != NULL)
      send_to_user(buf, to_user);
    else
-     send_to_non_humans(buf, FORKED, user);
+     send_to_owner(buf, tonick, user);
 }
   
 
@@ -895,10 +841,7 @@ void get_info(char *buf, struct user_t *user)
    if(sscanf(buf, "%10s %50s %50[^|]|", command, requested, requesting) != 3)
      {                                                                    
 	logprintf(4, "Received bad $GetINFO command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
@@ -907,21 +850,15 @@ void get_info(char *buf, struct user_t *user)
 	if(requesting[0] == '\0')
 	  {                                                                         
 	     logprintf(4, "Received bad $GetINFO command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
 	if((strncmp(requesting, user->nick, strlen(requesting)) != 0) 
 	    || (strlen(requesting) != strlen(user->nick)))
 	    {	                                                                       	                      
 	       logprintf(3, "User %s at %s claims to be someone else in $GetINFO:\n", user->nick, user->hostname);
-	       if(strlen(buf) < 3500)
-		 logprintf(3, "%s\n", buf);
-	       else
-		 logprintf(3, "too large buf\n");
-	       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	       logbuf(3, buf);
+	       set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	       return;
 	    }
      }
@@ -954,7 +891,7 @@ void get_info(char *buf, struct user_t *user)
 	  send_user_info(from_user, requesting, PRIV);
      }   
    else
-     send_to_non_humans(buf, FORKED, user);
+     send_to_owner(buf, requested, user);
 }
 
 /* Handles the MyINFO command. Returns 0 if user should be removed. 
@@ -989,7 +926,7 @@ int my_info(char *org_buf, struct user_t *user)
 	/* If user is a process, just forward the command.  */
 	if(user->type == FORKED)
 	  {	     
-	     send_to_non_humans(org_buf, FORKED | SCRIPT, user);
+	     relay_to_non_humans(REC_MYINFO, org_buf, FORKED | SCRIPT, user);
 	     send_to_humans(org_buf, REGULAR | REGISTERED | OP | OP_ADMIN, 
 			    user);
 	     return 1;
@@ -1043,9 +980,9 @@ int my_info(char *org_buf, struct user_t *user)
 	     free(send_buf);
 	  }
 	else
-	  /* The user wasn't connected to this process, forward to other 
-	   * processes.  */
-	  send_to_non_humans(org_buf, FORKED, user);
+	  /* The user wasn't connected to this process, forward to the 
+	   * process the user is on.  */
+	  send_to_owner(org_buf, to_nick, user);
 	
 	return 1;
      }  
@@ -1097,7 +1034,7 @@ int my_info(char *org_buf, struct user_t *user)
    
    if(user->desc != NULL)
      {
-	free(user->desc);
+	free_string(user->desc);
 	user->desc = 0;
      }
      
@@ -1106,9 +1043,9 @@ int my_info(char *org_buf, struct user_t *user)
 	k = cut_string(buf, '$');
 	if((max_desc_len == 0) || (k <= max_desc_len))
 	  {
-	     if((user->desc = (char *) malloc(sizeof(char) * (k + 1))) == NULL)
+	     if((user->desc = alloc_string(k + 1)) == NULL)
 	       {
-		  logprintf(1, "Error - In my_info()/malloc(): ");
+		  logprintf(1, "Error - In my_info()/alloc_string(): ");
 		  logerror(1, errno);
 		  quit = 1;
 		  return -1;
@@ -1193,7 +1130,7 @@ int my_info(char *org_buf, struct user_t *user)
 	
    if(user->email != NULL)
      {
-	free(user->email);
+	free_string(user->email);
 	user->email = 0;
      }
 
@@ -1203,9 +1140,9 @@ int my_info(char *org_buf, struct user_t *user)
 	k = cut_string(buf, '$');
 	if((max_email_len == 0) || (k <= max_email_len))
 	  {
-	     if((user->email = (char *) malloc(sizeof(char) * (k + 1))) == NULL)
+	     if((user->email = alloc_string(k + 1)) == NULL)
 	       {
-		  logprintf(1, "Error - In my_info()/malloc(): ");
+		  logprintf(1, "Error - In my_info()/alloc_string(): ");
 		  logerror(1, errno);
 		  quit = 1;
 		  return -1;
@@ -1264,11 +1201,11 @@ int my_info(char *org_buf, struct user_t *user)
 		    {
 		       remove_user_from_list(user->nick);
 		       remove_human_from_hash(user->nick);
-		       user->type = NON_LOGGED;
+		       set_user_type(user, NON_LOGGED);
 		       sprintf(quit_string, "$Quit %s|", user->nick);
 		       send_to_humans(quit_string, REGULAR | REGISTERED | OP 
 				      | OP_ADMIN, user);
-		       send_to_non_humans(quit_string, FORKED, NULL);
+		       relay_to_non_humans(REC_QUIT, quit_string, FORKED, NULL);
 #ifdef HAVE_PERL		       
 		       command_to_scripts("$Script user_disconnected %c%c", '\005', '\005');
 		       non_format_to_scripts(user->nick);
@@ -1293,11 +1230,11 @@ int my_info(char *org_buf, struct user_t *user)
 		    {
 		       remove_user_from_list(user->nick);
 		       remove_human_from_hash(user->nick);
-		       user->type = NON_LOGGED;
+		       set_user_type(user, NON_LOGGED);
 		       sprintf(quit_string, "$Quit %s|", user->nick);
 		       send_to_humans(quit_string, REGULAR | REGISTERED | OP 
 				      | OP_ADMIN, user);
-		       send_to_non_humans(quit_string, FORKED, NULL);
+		       relay_to_non_humans(REC_QUIT, quit_string, FORKED, NULL);
 #ifdef HAVE_PERL		       
 		       command_to_scripts("$Script user_disconnected %c%c", '\005', '\005');
 		       non_format_to_scripts(user->nick);
@@ -1340,7 +1277,7 @@ int my_info(char *org_buf, struct user_t *user)
      * as logged in.  */
    if(user->type == NON_LOGGED)
      {	
-	user->type = REGULAR;
+	set_user_type(user, REGULAR);
 	logprintf(1, "%s logged in from %s\n", user->nick, user->hostname);
      }       
    
@@ -1357,7 +1294,7 @@ int my_info(char *org_buf, struct user_t *user)
 #endif
    
    /* And then send the MyINFO string. */
-   send_to_non_humans(org_buf, FORKED | SCRIPT, user);
+   relay_to_non_humans(REC_MYINFO, org_buf, FORKED | SCRIPT, user);
    
    send_to_humans(org_buf, REGULAR | REGISTERED | OP | OP_ADMIN, NULL);     
    
@@ -1407,7 +1344,7 @@ int validate_nick(char *buf, struct user_t *user)
    char command[21];
    char kickstring[MAX_NICK_LEN+10];
    char hello_buf[MAX_NICK_LEN+10];
-   struct sock_t *sock;
+   int i;
    struct user_t *non_human;
    char *user_list_nick;
    char *op_list;
@@ -1415,10 +1352,7 @@ int validate_nick(char *buf, struct user_t *user)
    if(sscanf(buf, "%20s %50s|", command, temp_nick) != 2)
      {                                                                         
 	logprintf(4, "Received bad $ValidateNick command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return 0;
      }
    
@@ -1533,17 +1467,15 @@ int validate_nick(char *buf, struct user_t *user)
 	     add_user_to_list(user);
 	  }	
 	sprintf(hello_buf, "$Hello %s|", user->nick);
-	sock = human_sock_list;
 	op_list = get_op_list();
-	while(sock != NULL)
+	for(i = 0; i < human_sock_count; i++)
 	  {
-	     if(((sock->user->type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
-		&& (user != sock->user))
+	     if(((human_socks[i].type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
+		&& (user != human_socks[i].user))
 	       {
-		  send_to_user(hello_buf, sock->user);
-		  send_to_user(op_list, sock->user);
+		  send_to_user(hello_buf, human_socks[i].user);
+		  send_to_user(op_list, human_socks[i].user);
 	       }
-	     sock = sock->next;
 	  }
 	non_human = non_human_user_list;
 	while(non_human != NULL)
@@ -1567,10 +1499,7 @@ int version(char *buf, struct user_t *user)
    if(sscanf(buf, "$Version %30[^ |]|", user->version) != 1)
      {                                                                    
 	logprintf(4, "Received bad $Version command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return 0;
      }
    
@@ -1591,7 +1520,7 @@ int version(char *buf, struct user_t *user)
 int my_pass(char *buf, struct user_t *user)
 {
    int ret;
-   struct sock_t *sock;
+   int i;
    struct user_t *non_human;
    char hello_buf[MAX_NICK_LEN+10];
    char *op_list;
@@ -1614,14 +1543,14 @@ int my_pass(char *buf, struct user_t *user)
 	     sprintf(quit_string, "$Quit %s|", user_list_nick);
 	     send_to_humans(quit_string, REGULAR | REGISTERED | OP | OP_ADMIN,
 			    user);
-	     send_to_non_humans(quit_string, FORKED, NULL);	     
+	     relay_to_non_humans(REC_QUIT, quit_string, FORKED, NULL);	     
 	     if((d_user = get_human_user(user->nick)) != NULL)
 	       {		 
 		  remove_human_from_hash(user->nick);
 		  /* Change the nick so that it won't be removed from the
 		   * hashtable after it has been added again.  */
 		  strcpy(d_user->nick, "removed user");
-		  d_user->rem = REMOVE_USER;
+		  set_user_rem(d_user, REMOVE_USER);
 	       }    
 	     else
 	       {		  
@@ -1632,17 +1561,17 @@ int my_pass(char *buf, struct user_t *user)
 	
 	add_human_to_hash(user);
 	
+	set_user_type(user, OP_ADMIN);
+	
 	/* Add to user list */
 	if(add_user_to_list(user) == 0)
 	  {
 	     increase_user_list();
 	     add_user_to_list(user);
 	  }
-	user->type = OP_ADMIN;
 	user->permissions = 0xFFFF;
 	hub_mess(user, LOGGED_IN_MESS);
 	hub_mess(user, OP_LOGGED_IN_MESS);
-	sock = human_sock_list;
 	if((op_list = get_op_list()) == NULL)
 	  return 0;
 	
@@ -1660,15 +1589,14 @@ int my_pass(char *buf, struct user_t *user)
 	if((op_list = get_op_list()) == NULL)
 	  return 0;
 	
-	while(sock != NULL)
+	for(i = 0; i < human_sock_count; i++)
 	  {
-	     if(((sock->user->type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
-		&& (user != sock->user))
+	     if(((human_socks[i].type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
+		&& (user != human_socks[i].user))
 	       {
-		  send_to_user(hello_buf, sock->user);
-		  send_to_user(op_list, sock->user);
+		  send_to_user(hello_buf, human_socks[i].user);
+		  send_to_user(op_list, human_socks[i].user);
 	       }
-	     sock = sock->next;
 	  }
 	non_human = non_human_user_list;
 	while(non_human != NULL)
@@ -1694,12 +1622,12 @@ int my_pass(char *buf, struct user_t *user)
 	     sprintf(quit_string, "$Quit %s|", user_list_nick);
 	     send_to_humans(quit_string, REGULAR | REGISTERED | OP | OP_ADMIN,
 			    user);
-	     send_to_non_humans(quit_string, FORKED, NULL);
+	     relay_to_non_humans(REC_QUIT, quit_string, FORKED, NULL);
 	     if((d_user = get_human_user(user->nick)) != NULL)
 	       {
 		  remove_human_from_hash(user->nick);
 		  strcpy(d_user->nick, "removed user");
-		  d_user->rem = REMOVE_USER;
+		  set_user_rem(d_user, REMOVE_USER);
 	       }   
 	     else
 	       {		  
@@ -1710,13 +1638,14 @@ int my_pass(char *buf, struct user_t *user)
 	
 	add_human_to_hash(user);
 	
+	set_user_type(user, OP);
+	
 	/* Add to user list */
 	if(add_user_to_list(user) == 0)
 	  {
 	     increase_user_list();
 	     add_user_to_list(user);
 	  }
-	user->type = OP;
 	user->permissions = get_permissions(user->nick);
 	hub_mess(user, LOGGED_IN_MESS);
 	hub_mess(user, OP_LOGGED_IN_MESS);
@@ -1737,16 +1666,14 @@ int my_pass(char *buf, struct user_t *user)
 	/* Send the Hello and op list to all users */
 	sprintf(hello_buf, "$Hello %s|", user->nick);
 	op_list = get_op_list();
-	sock = human_sock_list;
-	while(sock != NULL)
+	for(i = 0; i < human_sock_count; i++)
 	  {
-	     if(((sock->user->type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
-		&& (user != sock->user))
+	     if(((human_socks[i].type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
+		&& (user != human_socks[i].user))
 	       {
-		  send_to_user(hello_buf, sock->user);
-		  send_to_user(op_list, sock->user);
+		  send_to_user(hello_buf, human_socks[i].user);
+		  send_to_user(op_list, human_socks[i].user);
 	       }
-	     sock = sock->next;
 	  }
 	non_human = non_human_user_list;
 	while(non_human != NULL)
@@ -1773,12 +1700,12 @@ int my_pass(char *buf, struct user_t *user)
 	     sprintf(quit_string, "$Quit %s|", user_list_nick);
 	     send_to_humans(quit_string, REGULAR | REGISTERED | OP | OP_ADMIN,
 			    user);
-	     send_to_non_humans(quit_string, FORKED, NULL);
+	     relay_to_non_humans(REC_QUIT, quit_string, FORKED, NULL);
 	     if((d_user = get_human_user(user->nick)) != NULL)
 	       {		 
 		  remove_human_from_hash(user->nick);
 		  strcpy(d_user->nick, "removed user");
-		  d_user->rem = REMOVE_USER;
+		  set_user_rem(d_user, REMOVE_USER);
 	       }   
 	     else
 	       {		  
@@ -1789,25 +1716,23 @@ int my_pass(char *buf, struct user_t *user)
 	
 	add_human_to_hash(user);
 	
+	set_user_type(user, REGISTERED);
+	
 	if(add_user_to_list(user) == 0)
 	  {
 	     increase_user_list();
 	     add_user_to_list(user);
 	  }	
-	user->type = REGISTERED;
 	hub_mess(user, LOGGED_IN_MESS);
 	if(welcome_mess(user) == -1)
 	  return 0;
 	logprintf(1, "Registered user %s logged in from %s\n", user->nick, user->hostname);
 	sprintf(hello_buf, "$Hello %s|", user->nick);
-	sock = human_sock_list;
-	while(sock != NULL)
+	for(i = 0; i < human_sock_count; i++)
 	  {
-	     if(((sock->user->type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
-		&& (user != sock->user))
-	       send_to_user(hello_buf, sock->user);
-	     
-	     sock = sock->next;
+	     if(((human_socks[i].type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
+		&& (user != human_socks[i].user))
+	       send_to_user(hello_buf, human_socks[i].user);
 	  }
 	
 	non_human = non_human_user_list;
@@ -1832,26 +1757,24 @@ int my_pass(char *buf, struct user_t *user)
 
 	add_human_to_hash(user);
 
+	set_user_type(user, REGULAR);
+
 	if(add_user_to_list(user) == 0)
 	  {
 	     increase_user_list();
 	     add_user_to_list(user);
           }
-	user->type = REGULAR;
 	hub_mess(user, LOGGED_IN_MESS);
 	if(welcome_mess(user) == -1)
 	  return 0;
 	logprintf(1, "Regular user %s logged in from %s\n", user->nick, user->hostname);
 	sprintf(hello_buf, "$Hello %s|", user->nick);
-	sock = human_sock_list;
-	while(sock != NULL)
+	for(i = 0; i < human_sock_count; i++)
 	  {
-	     if(((sock->user->type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
-	        && (user != sock->user))
-	       send_to_user(hello_buf, sock->user);
-
-	     sock = sock->next;
-          }
+	     if(((human_socks[i].type & (REGULAR | REGISTERED | OP | OP_ADMIN | FORKED)) != 0)
+		&& (user != human_socks[i].user))
+	       send_to_user(hello_buf, human_socks[i].user);
+	  }
 
 	non_human = non_human_user_list;
 	while(non_human != NULL)
@@ -1887,7 +1810,7 @@ void disc_user(char *buf, struct user_t *user)
 	if((remove_user = get_human_user(nick)) != NULL)
 	  {
 	     remove_human_from_hash(nick);
-	     remove_user->rem = REMOVE_USER;
+	     set_user_rem(remove_user, REMOVE_USER);
 	  }
      }
 }
@@ -1905,10 +1828,7 @@ void kick(char *buf, struct user_t *user, int tempban)
    if(sscanf(buf, "%10s %50[^|]|", command, nick) != 2)
      {                                                                 
 	logprintf(4, "Received bad $Kick command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
@@ -1961,7 +1881,7 @@ void kick(char *buf, struct user_t *user, int tempban)
    
    if((to_user = get_human_user(nick)) != NULL)
      {	
-	to_user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	set_user_rem(to_user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	return;
      }
    
@@ -1992,6 +1912,8 @@ void quit_program(void)
 	semctl(user_list_sem, 0, IPC_RMID, NULL);
 	shmctl(get_user_list_shm_id(), IPC_RMID, NULL);
 	shmctl(user_list_shm_shm, IPC_RMID, NULL);	
+	semctl(reg_list_sem, 0, IPC_RMID, NULL);
+	remove_reg_list();
 	write_config_file();	  
 	
 	/* If we are the parent, close the listening sockets and close the temp file */
@@ -2019,7 +1941,7 @@ int check_admin_pass(char *buf, struct user_t *user)
 	     return 0;
 	  }		
 	send_to_user("\r\nPassword accepted\r\n", user);
-	user->type = ADMIN;
+	set_user_type(user, ADMIN);
 	remove_human_from_hash(user->nick);
 	strcpy(user->nick, "Administrator");
 	add_human_to_hash(user);
@@ -2184,6 +2106,24 @@ void set_var(char *org_buf, struct user_t *user)
 	else if(user->type == OP_ADMIN)
 	  uprintf(user, "<Hub-Security> Users Per Fork set to %d|", users_per_fork);
      }      
+   else if(strncmp(buf, "send_threads ", 13) == 0)
+     {
+	buf += 13;
+	send_threads = atoi(buf);
+	if(user->type == ADMIN)
+	  uprintf(user, "\r\nSend Threads set to %d\r\n", send_threads);
+	else if(user->type == OP_ADMIN)
+	  uprintf(user, "<Hub-Security> Send Threads set to %d|", send_threads);
+     }      
+   else if(strncmp(buf, "accept_workers ", 15) == 0)
+     {
+	buf += 15;
+	accept_workers = atoi(buf);
+	if(user->type == ADMIN)
+	  uprintf(user, "\r\nAccept Workers set to %d\r\n", accept_workers);
+	else if(user->type == OP_ADMIN)
+	  uprintf(user, "<Hub-Security> Accept Workers set to %d|", accept_workers);
+     }      
    else if(!strncmp(buf, "listening_port ", 15))
      {	
 	buf += 15;
@@ -2771,20 +2711,14 @@ void op_force_move(char *buf, struct user_t *user)
 	if(num != 4)
 	  {		
 	     logprintf(4, "Received bad $OpForceMove command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
 	
 	if(message[0] == '\0')
 	  {                                                         
 	     logprintf(4, "Received bad $OpForceMove command from %s at %s:\n", user->nick, user->hostname);
-	     if(strlen(buf) < 3500)
-	       logprintf(4, "%s\n", buf);
-	     else
-	       logprintf(4, "too large buf\n");
+	     logbuf(4, buf);
 	     return;
 	  }
      }
@@ -2792,10 +2726,7 @@ void op_force_move(char *buf, struct user_t *user)
    if((temp = strstr(buf, "$Msg:")) == NULL)
      {                                                         
 	logprintf(4, "Received bad $OpForceMove command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
@@ -2835,7 +2766,7 @@ void op_force_move(char *buf, struct user_t *user)
 	uprintf(to_user, "$ForceMove %s|", ip);
 	remove_user_from_list(to_user->nick);
 	remove_human_from_hash(to_user->nick);
-	to_user->type = NON_LOGGED;
+	set_user_type(to_user, NON_LOGGED);
 	
 	/* Remove the users share from the total share.  */
 	if(to_user->share > 0)
@@ -2844,7 +2775,7 @@ void op_force_move(char *buf, struct user_t *user)
 	sprintf(quit_string, "$Quit %s|", to_user->nick);
 	send_to_humans(quit_string, REGULAR | REGISTERED | OP 
 		       | OP_ADMIN, to_user);
-	send_to_non_humans(quit_string, FORKED, NULL);
+	relay_to_non_humans(REC_QUIT, quit_string, FORKED, NULL);
 #ifdef HAVE_PERL		       
 	command_to_scripts("$Script user_disconnected %c%c", '\005', '\005');
 	non_format_to_scripts(to_user->nick);
@@ -2894,20 +2825,14 @@ void up_cmd(char *buf, int port)
    if(sscanf(buf, "%10s %50s %121[^|]|", cmd, pass, ip) != 3)
      {                                          
 	logprintf(4, "Received bad $Up command:\n");
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
    if((strncmp(pass, link_pass, strlen(pass)) != 0) || (strlen(pass) != strlen(link_pass)))
      {
 	logprintf(2, "Linked hub sent bad password:\n");
-	if(strlen(buf) < 3500)
-	  logprintf(2, "%s\n", buf);
-	else
-	  logprintf(2, "too large buf\n");
+	logbuf(2, buf);
 	return;
      }
    
@@ -2964,9 +2889,9 @@ void up_cmd(char *buf, int port)
 	   && (max_sockets >= (count_users(0xFFFF)+5)))
 	  {  
 	     /* Allocate space for the new user */
-	     if((user = malloc(sizeof(struct user_t))) == NULL)
+	     if((user = pool_alloc(POOL_USER)) == NULL)
 	       {		  
-		  logprintf(1, "Error - In up_cmd()/malloc(): ");
+		  logprintf(1, "Error - In up_cmd()/pool_alloc(): ");
 		  logerror(1, errno);
 		  quit = 1;
 		  return;
@@ -2979,10 +2904,22 @@ void up_cmd(char *buf, int port)
 	     /* Since key isn't used with linked hubs, it's used for the port here instead */
 	     user->key = port;
 	     user->buf = NULL;
-	     user->outbuf = NULL;
+	     user->buf_len = 0;
+	     user->buf_size = 0;
+	     user->out_head = NULL;
+	     user->out_tail = NULL;
+	     user->out_len = 0;
+	     user->out_full = 0;
+	     user->out_pending = 0;
+	     user->channel = NULL;
+	     user->sock_index = -1;
+	     user->counted = 0;
+	     user->accepting = 0;
+	     init_user_timers(user);
 	     
 	     /* Add the user to the non-human user list.  */
 	     add_non_human_to_list(user);
+	     add_timer(&user->timers[TIMER_KEEPALIVE], ALARM_TIME, linked_hub_timeout, user);
 	     
 	     logprintf(2, "Linked hub is up at %s, port %d\n", user->hostname, user->key);
 	     
@@ -3028,10 +2965,7 @@ void get_host(char *buf, struct user_t *user, int type)
    if(sscanf(buf, "%10s %50[^|]|", command, nick) != 2)
      {
 	logprintf(4, "Received bad $OpForceMove command from %s at %s:\n", user->nick, user->hostname);
-	if(strlen(buf) < 3500)
-	  logprintf(4, "%s\n", buf);
-	else
-	  logprintf(4, "too large buf\n");
+	logbuf(4, buf);
 	return;
      }
    
@@ -3213,6 +3147,9 @@ void send_commands(struct user_t *user)
    if((user->type & (ADMIN | OP_ADMIN)) != 0)
      uprintf(user, "Displays the motd file.\r\n\r\n");
    
+   if(user->type == ADMIN)
+     uprintf(user, "$getstats|\r\nDisplays statistics of the process that the administration connection\r\nis handled by.\r\n\r\n");
+   
    if(user->type == ADMIN)
     uprintf(user, "$quitprogram|\r\n");
    else if(user->type == OP_ADMIN)
@@ -3304,12 +3241,8 @@ void send_commands(struct user_t *user)
 
 void send_mass_message(char *buffy, struct user_t *user)
 {
-   char *buf, *bufp;   
+   char *nicks, *nickp, *endp;
    char *sendbuf;
-   char temp_nick[MAX_NICK_LEN+1];
-   char temp_host[MAX_HOST_LEN+1];
-   int spaces=0, entries=0;
-   int i;
    
    if((sendbuf = malloc(sizeof(char) * (50 + MAX_NICK_LEN + strlen(buffy)))) == NULL)
      {
@@ -3319,44 +3252,23 @@ void send_mass_message(char *buffy, struct user_t *user)
 	return;
      }
    
-   sem_take(user_list_sem);
-   
-   /* Attach to the shared segment */
-   if((buf = shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In send_mass_message()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
-     }
-   
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
-     {	
-	logprintf(1, "Error - In send_mass_message(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
+   if((nicks = get_user_list_nicks()) == NULL)
+     {
+	free(sendbuf);
 	return;
      }
    
-   bufp = buf + 30;
-   
-   for(i = 1; i <= spaces; i++)
+   /* Every nick in the string is followed by a space.  */
+   nickp = nicks;
+   while((endp = strchr(nickp, ' ')) != NULL)
      {
-	if(*bufp != '\0')
-	  {	     
-	     sscanf(bufp, "%50s %120s", temp_nick, temp_host);
-	     sprintf(sendbuf, "$To: %s From: Hub-Mass-Message $<Hub-Mass-Message> %s", temp_nick, buffy);
-	     to_from(sendbuf, user);
-	  }
-	bufp += USER_LIST_ENT_SIZE;
+	*endp = '\0';
+	sprintf(sendbuf, "$To: %s From: Hub-Mass-Message $<Hub-Mass-Message> %s", nickp, buffy);
+	to_from(sendbuf, user);
+	nickp = endp + 1;
      }
    
-   shmdt(buf);
-   sem_give(user_list_sem);
-   
+   free(nicks);
    free(sendbuf);
    
    /* Send to scripts */
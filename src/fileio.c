@@ -57,10 +57,21 @@
 # endif
 #endif
 #include <errno.h>
+#include <signal.h>
 #include <dirent.h>
+#include <sched.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#if HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
 #ifdef HAVE_SYSLOG_H
 # include <syslog.h>
 #endif
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+# include <pthread.h>
+# define LOG_WRITER_THREAD
+#endif
 #ifdef SWITCH_USER
 # include <pwd.h>
 #endif
@@ -69,6 +80,7 @@
 #include "utils.h"
 #include "fileio.h"
 #include "network.h"
+#include "userlist.h"
 #ifdef HAVE_PERL
 # include "perl_utils.h"
 #endif
@@ -79,6 +91,55 @@
 # endif
 #endif
 
+#if HAVE_SYS_INOTIFY_H
+/* The files that are kept in memory, in some form, and watched.  */
+static char *watched_files[] = 
+{
+   BAN_FILE, ALLOW_FILE, NICKBAN_FILE, REG_FILE, OP_PERM_FILE, CONFIG_FILE, NULL
+};
+
+/* The files as the parent last knew them. Files are opened for writing and
+ * closed without being changed now and then, so an event is only acted on
+ * if the file really is different.  */
+static struct stat watched_st[sizeof(watched_files) / sizeof(char *)];
+
+/* Returns 1 if watched file number j isn't the one that the parent last 
+ * knew, and takes note of it.  */
+static int watched_file_changed(int j)
+{
+   char path[MAX_FDP_LEN+1];
+   struct stat st;
+   int changed;
+   
+   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, watched_files[j]);
+   if(stat(path, &st) < 0)
+     return 0;
+   
+   changed = ((st.st_mtim.tv_sec != watched_st[j].st_mtim.tv_sec)
+	      || (st.st_mtim.tv_nsec != watched_st[j].st_mtim.tv_nsec)
+	      || (st.st_size != watched_st[j].st_size)
+	      || (st.st_ino != watched_st[j].st_ino)) ? 1 : 0;
+   
+   memcpy(&watched_st[j], &st, sizeof(struct stat));
+   return changed;
+}
+#endif
+
+/* Takes note of the config file after it has been written, so that the 
+ * parent doesn't take its own writes for changes.  */
+static void note_config_file(void)
+{
+#if HAVE_SYS_INOTIFY_H
+   int j;
+   
+   for(j = 0; watched_files[j] != NULL; j++)
+     {
+	if(strcmp(watched_files[j], CONFIG_FILE) == 0)
+	  watched_file_changed(j);
+     }
+#endif
+}
+
 /* Reads config file */
 int read_config(void)
 {
@@ -168,6 +229,20 @@ int read_config(void)
 		    i++;
 		  users_per_fork = atoi(line + i);
 	       }
+	     /* Number of threads that help sending */
+	     else if(strncmp(line + i, "send_threads", 12) == 0)
+	       {
+		  while(!isdigit((int)line[i]))
+		    i++;
+		  send_threads = atoi(line + i);
+	       }
+	     /* Number of processes that accept users at once */
+	     else if(strncmp(line + i, "accept_workers", 14) == 0)
+	       {
+		  while(!isdigit((int)line[i]))
+		    i++;
+		  accept_workers = atoi(line + i);
+	       }
 	     
 	     /* The message displayed if hub is full */
 	     else if(strncmp(line + i, "hub_full_mess", 13) == 0)
@@ -189,6 +264,9 @@ int read_config(void)
 		       
 		       return -1;
 		    }
+		  /* The config may be read again while the hub is running.  */
+		  if(hub_full_mess != NULL)
+		    free(hub_full_mess);
 		  if((hub_full_mess = malloc(sizeof(char) 
 		       * (strlen(line+i+1) + 1))) == NULL)
 		    {
@@ -925,692 +1003,963 @@ void create_linklist(void)
      }
 }
 
-/* Returns 1 if user is on the banlist.  */
-int check_if_banned(struct user_t *user, int type)
+/* 1 if the parent watches config_dir with inotify. Then the lists are read
+ * again when the parent says that their files have changed, instead of the
+ * files being checked with stat() on every lookup. Set before the first 
+ * process is forked, so every process has it.  */
+static int watching = 0;
+
+/* A node in the radix trie that holds the ip and subnet entries of the ban
+ * and allow lists. Each node has a prefix of len bits, and its children
+ * continue the prefix with the next bit set to 0 and 1. Nodes with only
+ * one child are skipped by extending the prefix, so the trie is at most 33
+ * nodes deep. entry is 1 if the prefix itself is on the list, and then
+ * expire is the time it expires, or 0 if it never does.  */
+struct ip_node
 {
-   int i, j;
+   unsigned int prefix;
+   int len;
+   int entry;
+   time_t expire;
+   struct ip_node *child[2];
+};
+
+/* A hostname entry, which may contain wildcards.  */
+struct host_entry
+{
+   char *host;
+   time_t expire;
+};
+
+/* The ban or allow list, as it was when the file was last read.  */
+struct ip_list
+{
+   struct ip_node *root;
+   struct host_entry *hosts;
+   int host_count;
+   time_t mtime;                      /* Identifies the file that was read */
+   off_t size;
+   ino_t ino;
+};
+
+static struct ip_list *ban_list = NULL;
+static struct ip_list *allow_list = NULL;
+
+/* Returns the first len bits of ip.  */
+static unsigned int ip_prefix(unsigned int ip, int len)
+{
+   if(len == 0)
+     return 0;
+   return ip & (0xFFFFFFFFU << (32 - len));
+}
+
+/* Returns the bit after the first len bits of ip.  */
+static int ip_bit(unsigned int ip, int len)
+{
+   return (ip >> (31 - len)) & 1;
+}
+
+static struct ip_node *new_ip_node(unsigned int prefix, int len)
+{
+   struct ip_node *node;
+   
+   if((node = malloc(sizeof(struct ip_node))) == NULL)
+     {
+	logprintf(1, "Error - In new_ip_node()/malloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return NULL;
+     }
+   node->prefix = prefix;
+   node->len = len;
+   node->entry = 0;
+   node->expire = 0;
+   node->child[0] = NULL;
+   node->child[1] = NULL;
+   return node;
+}
+
+static void free_ip_nodes(struct ip_node *node)
+{
+   if(node == NULL)
+     return;
+   free_ip_nodes(node->child[0]);
+   free_ip_nodes(node->child[1]);
+   free(node);
+}
+
+/* Adds the subnet ip/len to the trie. If it's already there, the entry 
+ * that expires last is kept. Returns -1 on error.  */
+static int add_ip_node(struct ip_node **root, unsigned int ip, int len, 
+		       time_t expire)
+{
+   struct ip_node **nodep;
+   struct ip_node *node, *split;
+   unsigned int diff;
+   int common;
+   
+   ip = ip_prefix(ip, len);
+   nodep = root;
+   while((node = *nodep) != NULL)
+     {
+	/* Find how many bits the node and the subnet have in common */
+	common = (node->len < len) ? node->len : len;
+	diff = node->prefix ^ ip;
+	while((common > 0) && (ip_prefix(diff, common) != 0))
+	  common--;
+	
+	if(common < node->len)
+	  {
+	     /* The subnet branches off in the middle of the nodes prefix, so
+	      * the node is split there.  */
+	     if((split = new_ip_node(ip_prefix(ip, common), common)) == NULL)
+	       return -1;
+	     split->child[ip_bit(node->prefix, common)] = node;
+	     *nodep = split;
+	     if(common == len)
+	       {
+		  split->entry = 1;
+		  split->expire = expire;
+		  return 1;
+	       }
+	     nodep = &split->child[ip_bit(ip, common)];
+	     break;
+	  }
+	
+	if(node->len == len)
+	  {
+	     if((node->entry == 0) || (expire == 0)
+		|| ((node->expire != 0) && (expire > node->expire)))
+	       node->expire = expire;
+	     node->entry = 1;
+	     return 1;
+	  }
+	nodep = &node->child[ip_bit(ip, node->len)];
+     }
+   
+   if((node = new_ip_node(ip, len)) == NULL)
+     return -1;
+   node->entry = 1;
+   node->expire = expire;
+   *nodep = node;
+   return 1;
+}
+
+/* Returns 1 if ip is in a subnet in the trie that hasn't expired.  */
+static int find_ip_node(struct ip_node *node, unsigned int ip, time_t now_time)
+{
+   while((node != NULL) && (ip_prefix(ip, node->len) == node->prefix))
+     {
+	if((node->entry != 0) 
+	   && ((node->expire == 0) || (node->expire > now_time)))
+	  return 1;
+	if(node->len == 32)
+	  break;
+	node = node->child[ip_bit(ip, node->len)];
+     }
+   return 0;
+}
+
+static void free_ip_list(struct ip_list *list)
+{
+   int i;
+   
+   if(list == NULL)
+     return;
+   free_ip_nodes(list->root);
+   for(i = 0; i < list->host_count; i++)
+     free(list->hosts[i].host);
+   if(list->hosts != NULL)
+     free(list->hosts);
+   free(list);
+}
+
+/* Adds a hostname entry to the list. Returns -1 on error.  */
+static int add_host_entry(struct ip_list *list, char *host, time_t expire)
+{
+   struct host_entry *hosts;
+   
+   if((list->host_count & (list->host_count - 1)) == 0)
+     {
+	if((hosts = realloc(list->hosts, sizeof(struct host_entry)
+			    * ((list->host_count == 0) ? 1 : list->host_count * 2)))
+	   == NULL)
+	  {
+	     logprintf(1, "Error - In add_host_entry()/realloc(): ");
+	     logerror(1, errno);
+	     quit = 1;
+	     return -1;
+	  }
+	list->hosts = hosts;
+     }
+   if((list->hosts[list->host_count].host = strdup(host)) == NULL)
+     {
+	logprintf(1, "Error - In add_host_entry()/strdup(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   list->hosts[list->host_count].expire = expire;
+   list->host_count++;
+   return 1;
+}
+
+/* Reads a ban or allow list file. Entries that are ip addresses or subnets
+ * go in the trie and the rest are kept as hostnames. Returns the list, or
+ * NULL on error.  */
+static struct ip_list *read_ip_list(char *path, struct stat *st)
+{
+   int i;
    int fd;
    int erret;
    FILE *fp;
-   char path[MAX_FDP_LEN+1];
    char line[1024];
-   char ban_host[MAX_HOST_LEN+1];
-   char *string_ip = NULL;
-   unsigned long userip = 0;
-   unsigned long fileip = 0;
-   int byte1, byte2, byte3, byte4, mask;
-   time_t ban_time;
-   time_t now_time;
+   char host[MAX_HOST_LEN+1];
+   int byte1, byte2, byte3, byte4, mask, end;
+   time_t expire;
+   struct ip_list *list;
    
-   if(type == BAN)
-	snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, BAN_FILE);
-   else if(type == NICKBAN)
-	snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, NICKBAN_FILE);
-   else
-	return -1;
-   	
    while(((fd = open(path, O_RDONLY)) < 0) && (errno == EINTR))
-     logprintf(1, "Error - In check_if_banned()/open(): Interrupted system call. Trying again.\n");   
+     logprintf(1, "Error - In read_ip_list()/open(): Interrupted system call. Trying again.\n");   
    
    if(fd < 0)
      {
-	logprintf(1, "Error - In check_if_banned()/open(): ");
+	logprintf(1, "Error - In read_ip_list()/open(): ");
 	logerror(1, errno);
-	return -1;	
+	return NULL;
      }
    
    /* Set the lock */
    if(set_lock(fd, F_RDLCK) == 0)
      {
-	logprintf(1, "Error - In check_if_banned(): Couldn't set file lock\n");
+	logprintf(1, "Error - In read_ip_list(): Couldn't set file lock\n");
 	close(fd);
-	return -1;
+	return NULL;
      }   
    
    if((fp = fdopen(fd, "r")) == NULL)
      {
-	logprintf(1, "Error - In check_if_banned()/fdopen(): ");
+	logprintf(1, "Error - In read_ip_list()/fdopen(): ");
 	logerror(1, errno);
 	set_lock(fd, F_UNLCK);
 	close(fd);
-	return -1;
+	return NULL;
      }
    
-   now_time = time(NULL);
-   
-   if(type == BAN)
-     {	
-	if((string_ip = ip_to_string(user->ip)) == NULL)
-	  {
-	     set_lock(fd, F_UNLCK);
-	     
-	     while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-	       logprintf(1, "Error - In check_if_banned()/fclose(): Interrupted system call. Trying again.\n");
-	     
-	     if(erret != 0)
-	       {
-		  logprintf(1, "Error - In check_if_banned()/fclose(): ");
-		  logerror(1, errno);
-		  return -1;
-	       }
-   
-	     return 0;
-	  }
-	userip = ntohl(user->ip);
+   if((list = malloc(sizeof(struct ip_list))) == NULL)
+     {
+	logprintf(1, "Error - In read_ip_list()/malloc(): ");
+	logerror(1, errno);
+	quit = 1;
+     }
+   else
+     {
+	list->root = NULL;
+	list->hosts = NULL;
+	list->host_count = 0;
+	list->mtime = st->st_mtime;
+	list->size = st->st_size;
+	list->ino = st->st_ino;
      }
    
-   while(fgets(line, 1023, fp) != NULL)
+   while((list != NULL) && (fgets(line, 1023, fp) != NULL))
      {
 	trim_string(line);
-	ban_time = 0;
+	if(line[0] == '\0')
+	  continue;
 	
-	j = strlen(line);
-	if(j != 0)
+	/* Jump to next char which isn't a space */
+	i = 0;
+	while(line[i] == ' ')
+	  i++;
+	
+	expire = 0;
+	if(sscanf(line+i, "%120s %lu", host, &expire) < 1)
+	  continue;
+	
+	/* It's either a subnet, an ip address or a hostname.  */
+	end = 0;
+	mask = 32;
+	if(((sscanf(host, "%d.%d.%d.%d/%d%n", &byte1, &byte2, &byte3, 
+		    &byte4, &mask, &end) == 5) && (host[end] == '\0')
+	    && (mask > 0) && (mask <= 32))
+	   || ((sscanf(host, "%d.%d.%d.%d%n", &byte1, &byte2, &byte3, 
+		       &byte4, &end) == 4) && (host[end] == '\0')))
 	  {
-	     /* Jump to next char which isn't a space */
-	     i = 0;
-	     while(line[i] == ' ')
-	       i++;
-	     
-	     sscanf(line+i, "%120s %lu", ban_host, &ban_time);
-	     if(type == BAN)
-	       {		  
-		  /* Check if it's part of user's ip */
-		  /* First, check if it's a subnet.  */
-		  if((sscanf(ban_host, "%d.%d.%d.%d/%d", 
-			     &byte1, &byte2, &byte3, &byte4, &mask) == 5)
-		     && (mask > 0) && (mask <= 32))
-		    {
-		       fileip = (byte1<<24) | (byte2<<16) | (byte3<<8) | byte4;
-		       if((((0xFFFF << (32-mask)) & userip) 
-			   == ((0xFFFF << (32-mask)) & fileip))
-			  && ((ban_time == 0) || (ban_time > now_time)))
-			 {
-			    set_lock(fd, F_UNLCK);
-			    
-			    while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			      logprintf(1, "Error - In check_if_banned()/fclose(): Interrupted system call. Trying again.\n");
-			    
-			    if(erret != 0)
-			      {
-				 logprintf(1, "Error - In check_if_banned()/fclose(): ");
-				 logerror(1, errno);
-				 return -1;
-			      }
-			  
-			    return 1;
-			 }
-		    }
-		  /* If not, it has to be an exact match.  */
-		  else if((strncmp(string_ip, ban_host, strlen(ban_host)) == 0)
-			  && (strlen(ban_host) == strlen(string_ip))
-			  && ((ban_time == 0) || (ban_time > now_time)))
-		    {
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_if_banned()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_if_banned()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		      
-		       return 1;
-	            }
-		  
-		  /* Check if users hostname is banned.  */
-		  if((user->hostname != NULL)
-		     && (strncmp(user->hostname, string_ip, strlen(string_ip)) != 0))
-		    {
-		       if(match_with_wildcards(user->hostname, ban_host) != 0)
-			 {
-			    set_lock(fd, F_UNLCK);
-			    
-			    while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			      logprintf(1, "Error - In check_if_banned()/fclose(): Interrupted system call. Trying again.\n");
-			    
-			    if(erret != 0)
-			      {
-				 logprintf(1, "Error - In check_if_banned()/fclose(): ");
-				 logerror(1, errno);
-				 return -1;
-			      }
-			    
-			    return 1;
-			 }
-		    }		       
-	       }	     
-	     else
-	       {
-		  /* Check if a nickname is banned.  */
-		  if(((ban_time == 0) || (ban_time > now_time))
-		     && (match_with_wildcards(user->nick, ban_host) != 0))
-		    {
-		       set_lock(fd, F_UNLCK);
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_if_banned()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_if_banned()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return 1;
-		    }
-	       }	
-          }
+	     if((byte1 & ~0xFF) || (byte2 & ~0xFF) || (byte3 & ~0xFF) 
+		|| (byte4 & ~0xFF))
+	       continue;
+	     erret = add_ip_node(&list->root, 
+				 ((unsigned int)byte1 << 24) | (byte2 << 16) 
+				 | (byte3 << 8) | byte4, mask, expire);
+	  }
+	else
+	  erret = add_host_entry(list, host, expire);
+	
+	if(erret == -1)
+	  {
+	     free_ip_list(list);
+	     list = NULL;
+	  }
      }
+   
    set_lock(fd, F_UNLCK);
    
    while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-     logprintf(1, "Error - In check_if_banned()/fclose(): Interrupted system call. Trying again.\n");
+     logprintf(1, "Error - In read_ip_list()/fclose(): Interrupted system call. Trying again.\n");
    
    if(erret != 0)
      {
-	logprintf(1, "Error - In check_if_banned()/fclose(): ");
+	logprintf(1, "Error - In read_ip_list()/fclose(): ");
 	logerror(1, errno);
-	return -1;
+     }
+   
+   return list;
+}
+
+/* Makes sure that *list is up to date with the file. If the file has 
+ * changed, or if force is 1, it's read into a new list which then replaces
+ * the old one, so a list is never used half read. Returns -1 if there is no
+ * list.  */
+static int update_ip_list(struct ip_list **list, char *file, int force)
+{
+   char path[MAX_FDP_LEN+1];
+   struct stat st;
+   struct ip_list *new_list;
+   
+   if((*list != NULL) && (force == 0) && (watching != 0))
+     return 1;
+   
+   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, file);
+   
+   if(stat(path, &st) < 0)
+     {
+	logprintf(1, "Error - In update_ip_list()/stat(): ");
+	logerror(1, errno);
+	return (*list == NULL) ? -1 : 1;
+     }
+   
+   if((*list != NULL) && (force == 0) && ((*list)->mtime == st.st_mtime) 
+      && ((*list)->size == st.st_size) && ((*list)->ino == st.st_ino))
+     return 1;
+   
+   if((new_list = read_ip_list(path, &st)) == NULL)
+     return (*list == NULL) ? -1 : 1;
+   
+   free_ip_list(*list);
+   *list = new_list;
+   return 1;
+}
+
+/* Returns 1 if users ip or hostname is on the list.  */
+static int check_ip_list(struct ip_list *list, struct user_t *user)
+{
+   int i;
+   char *string_ip;
+   time_t now_time;
+   
+   now_time = time(NULL);
+   
+   if(find_ip_node(list->root, ntohl(user->ip), now_time) != 0)
+     return 1;
+   
+   if((list->host_count == 0) || ((string_ip = ip_to_string(user->ip)) == NULL))
+     return 0;
+   
+   /* Check if users hostname is on the list.  */
+   if(strncmp(user->hostname, string_ip, strlen(string_ip)) != 0)
+     {
+	for(i = 0; i < list->host_count; i++)
+	  if(((list->hosts[i].expire == 0) || (list->hosts[i].expire > now_time))
+	     && (match_with_wildcards(user->hostname, list->hosts[i].host) != 0))
+	    return 1;
      }
    
    return 0;
 }
 
-/* Returns 1 if user is on the allowlist.  */
-int check_if_allowed(struct user_t *user)
+/* The nickban list, as it was when the file was last read. Expired entries
+ * are left out, and the list is read again when the next one expires.  */
+struct nickban_list
 {
-   int i, j;
+   struct wildcard_set *set;
+   time_t next_expire;                /* 0 if no entry expires */
+   time_t mtime;                      /* Identifies the file that was read */
+   off_t size;
+   ino_t ino;
+};
+
+static struct nickban_list *nickban_list = NULL;
+
+static void free_nickban_list(struct nickban_list *list)
+{
+   if(list == NULL)
+     return;
+   free_wildcard_set(list->set);
+   free(list);
+}
+
+/* Reads the nickban file and compiles the entries that haven't expired 
+ * into one wildcard set. Returns the list, or NULL on error.  */
+static struct nickban_list *read_nickban_list(char *path, struct stat *st)
+{
+   int i;
    int fd;
    int erret;
    FILE *fp;
-   char path[MAX_FDP_LEN+1];
    char line[1024];
-   char allow_host[MAX_HOST_LEN+1];
-   char *string_ip = NULL;
-   unsigned long userip = 0;
-   unsigned long fileip = 0;
-   int byte1, byte2, byte3, byte4, mask;
-   time_t allow_time;
+   char ban_host[MAX_HOST_LEN+1];
+   time_t ban_time;
    time_t now_time;
-   
-   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, ALLOW_FILE);
+   struct nickban_list *list;
    
    while(((fd = open(path, O_RDONLY)) < 0) && (errno == EINTR))
-     logprintf(1, "Error - In check_if_allowed()/open(): Interrupted system call. Trying again.\n");   
+     logprintf(1, "Error - In read_nickban_list()/open(): Interrupted system call. Trying again.\n");   
    
    if(fd < 0)
      {
-	logprintf(1, "Error - In check_if_allowed()/open(): ");
+	logprintf(1, "Error - In read_nickban_list()/open(): ");
 	logerror(1, errno);
-	return -1;	
+	return NULL;
      }
    
    /* Set the lock */
    if(set_lock(fd, F_RDLCK) == 0)
      {
-	logprintf(1, "Error - In check_if_allowed(): Couldn't set file lock\n");
+	logprintf(1, "Error - In read_nickban_list(): Couldn't set file lock\n");
 	close(fd);
-	return -1;
-     }
+	return NULL;
+     }   
    
    if((fp = fdopen(fd, "r")) == NULL)
      {
-	logprintf(1, "Error - In check_if_allowed()/fdopen(): ");
+	logprintf(1, "Error - In read_nickban_list()/fdopen(): ");
 	logerror(1, errno);
 	set_lock(fd, F_UNLCK);
 	close(fd);
-	return -1;
+	return NULL;
      }
    
-   now_time = time(NULL);
-   
-   if((string_ip = ip_to_string(user->ip)) == NULL)
+   if((list = malloc(sizeof(struct nickban_list))) == NULL)
      {
-	set_lock(fd, F_UNLCK);
-	
-	while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-	  logprintf(1, "Error - In check_if_allowed()/fclose(): Interrupted system call. Trying again.\n");
-	
-	if(erret != 0)
-	  {
-	     logprintf(1, "Error - In check_if_allowed()/fclose(): ");
-	     logerror(1, errno);
-	     return -1;
-	  }
-      
-	return 0;
+	logprintf(1, "Error - In read_nickban_list()/malloc(): ");
+	logerror(1, errno);
+	quit = 1;
+     }
+   else if((list->set = new_wildcard_set()) == NULL)
+     {
+	free(list);
+	list = NULL;
+     }
+   else
+     {
+	list->next_expire = 0;
+	list->mtime = st->st_mtime;
+	list->size = st->st_size;
+	list->ino = st->st_ino;
      }
-   userip = ntohl(user->ip);   
    
-   while(fgets(line, 1023, fp) != NULL)
+   now_time = time(NULL);
+   
+   while((list != NULL) && (fgets(line, 1023, fp) != NULL))
      {
 	trim_string(line);
-	allow_time = 0;
+	if(line[0] == '\0')
+	  continue;
 	
-	j = strlen(line);
-	if(j != 0)
+	/* Jump to next char which isn't a space */
+	i = 0;
+	while(line[i] == ' ')
+	  i++;
+	
+	ban_time = 0;
+	if(sscanf(line+i, "%120s %lu", ban_host, &ban_time) < 1)
+	  continue;
+	
+	if(ban_time != 0)
 	  {
-	     /* Jump to next char which isn't a space */
-	     i = 0;
-	     while(line[i] == ' ')
-	       i++;
-	     
-	     sscanf(line+i, "%120s %lu", allow_host, &allow_time);
-	     	  		  
-	     /* Check if it's part of user's ip */
-	     /* First, check if it's a subnet.  */
-	     if((sscanf(allow_host, "%d.%d.%d.%d/%d", 
-			&byte1, &byte2, &byte3, &byte4, &mask) == 5)
-		&& (mask > 0) && (mask <= 32))
-	       {
-		  fileip = (byte1<<24) | (byte2<<16) | (byte3<<8) | byte4;
-		  if((((0xFFFF << (32-mask)) & userip) 
-		      == ((0xFFFF << (32-mask)) & fileip)) 
-		     && ((allow_time == 0) || (allow_time > now_time)))
-		    {
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_if_allowed()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_if_allowed()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return 1;
-		    }
-	       }
-	     
-	     /* If not, it has to be an exact match.  */
-	     else if((strncmp(string_ip, allow_host, strlen(allow_host)) == 0)
-		     && (strlen(allow_host) == strlen(string_ip))
-		     &&((allow_time == 0) || (allow_time > now_time)))
-	       {
-		  set_lock(fd, F_UNLCK);
-		  
-		  while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-		    logprintf(1, "Error - In check_if_allowed()/fclose(): Interrupted system call. Trying again.\n");
-		  
-		  if(erret != 0)
-		    {
-		       logprintf(1, "Error - In check_if_allowed()/fclose(): ");
-		       logerror(1, errno);
-		       return -1;
-		    }
-		  
-		  return 1;
-	       }
-	     
-	     /* Check users hostname is allowed.  */
-	     if((user->hostname != NULL)
-		&& (strncmp(user->hostname, string_ip, strlen(string_ip)) != 0))
-	       {
-		  if(match_with_wildcards(user->hostname, allow_host) != 0)
-		    {
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_if_allowed()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_if_allowed()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return 1;
-		    }
-	       }	
-	  }	
+	     if(ban_time <= now_time)
+	       continue;
+	     if((list->next_expire == 0) || (ban_time < list->next_expire))
+	       list->next_expire = ban_time;
+	  }
+	
+	if(add_wildcard(list->set, ban_host) == -1)
+	  {
+	     free_nickban_list(list);
+	     list = NULL;
+	  }
      }
    
    set_lock(fd, F_UNLCK);
+   
    while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-     logprintf(1, "Error - In check_if_allowed()/fclose(): Interrupted system call. Trying again.\n");
+     logprintf(1, "Error - In read_nickban_list()/fclose(): Interrupted system call. Trying again.\n");
    
    if(erret != 0)
      {
-	logprintf(1, "Error - In check_if_allowed()/fclose(): ");
+	logprintf(1, "Error - In read_nickban_list()/fclose(): ");
 	logerror(1, errno);
-	return -1;
      }
    
-   return 0;
+   return list;
 }
 
-/* Returns 1 if a nick is on the registered list, 2 if nick is op and 3 if 
- * user is op_admin.  */
-int check_if_registered(char *user_nick)
+/* Makes sure that the nickban list is up to date with the file and that no
+ * entry in it has expired. If force is 1, it's read again anyway. Returns 
+ * -1 if there is no list.  */
+static int update_nickban_list(int force)
 {
-   int i, j;
-   int fd;
-   int erret;
-   FILE *fp;
    char path[MAX_FDP_LEN+1];
-   char line[1024];
+   struct stat st;
+   struct nickban_list *new_list;
    
-   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, REG_FILE);
+   if((nickban_list != NULL) && (force == 0) && (watching != 0)
+      && ((nickban_list->next_expire == 0) 
+	  || (nickban_list->next_expire > time(NULL))))
+     return 1;
    
-   while(((fd = open(path, O_RDONLY)) < 0) && (errno == EINTR))
-     logprintf(1, "Error - In check_if_registered()/open(): Interrupted system call. Trying again.\n");   
+   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, NICKBAN_FILE);
    
-   if(fd < 0)
+   if(stat(path, &st) < 0)
      {
-	logprintf(1, "Error - In check_if_registered()/open(): ");
+	logprintf(1, "Error - In update_nickban_list()/stat(): ");
 	logerror(1, errno);
-	return -1;	
+	return (nickban_list == NULL) ? -1 : 1;
      }
    
-   /* Set the lock */
-   if(set_lock(fd, F_RDLCK) == 0)
+   if((nickban_list != NULL) && (force == 0) 
+      && (nickban_list->mtime == st.st_mtime) 
+      && (nickban_list->size == st.st_size) 
+      && (nickban_list->ino == st.st_ino)
+      && ((nickban_list->next_expire == 0) 
+	  || (nickban_list->next_expire > time(NULL))))
+     return 1;
+   
+   if((new_list = read_nickban_list(path, &st)) == NULL)
+     return (nickban_list == NULL) ? -1 : 1;
+   
+   free_nickban_list(nickban_list);
+   nickban_list = new_list;
+   return 1;
+}
+
+/* Returns 1 if user is on the banlist.  */
+int check_if_banned(struct user_t *user, int type)
+{
+   if(type == BAN)
      {
-	logprintf(1, "Error - In check_if_registered(): Couldn't set lock\n");
-	close(fd);
-	return -1;
+	if(update_ip_list(&ban_list, BAN_FILE, 0) < 0)
+	  return -1;
+	return check_ip_list(ban_list, user);
      }
+   else if(type == NICKBAN)
+     {
+	if(update_nickban_list(0) < 0)
+	  return -1;
+	return match_wildcard_set(nickban_list->set, user->nick);
+     }
+   return -1;
+}
+
+/* Returns 1 if user is on the allowlist.  */
+int check_if_allowed(struct user_t *user)
+{
+   if(update_ip_list(&allow_list, ALLOW_FILE, 0) < 0)
+     return -1;
+   return check_ip_list(allow_list, user);
+}
+
+/* The registry holds what the reglist and the op_permlist say about each
+ * nick, in a shared memory segment that is laid out like the user list: a
+ * header, an open addressed index hashed on the case folded nick, and then
+ * the entries. Entries are never taken out of it, a nick that is removed from
+ * both files keeps its entry, marked as not registered and without 
+ * permissions, until the files are read again. So the index never has any
+ * removed slots.
+ * The files are still what is saved on disk. Whoever changes one of them 
+ * changes the entry in place afterwards and notes the new state of the file
+ * in the control segment. When the parent sees that a file has been changed
+ * by someone else, or a lookup does when the files aren't watched, that file
+ * is read into a new segment that replaces the old one, the same way the user
+ * list is moved when it grows. Readers copy the entry and check the sequence number in the 
+ * control segment, writers exclude each other with the lock in it.  */
+
+struct reg_list_ctl
+{
+   int shm_id;                        /* Id of the registry segment */
+   unsigned int generation;           /* Increased every time the registry is
+				       * moved to a new segment */
+   unsigned int seq;                  /* Odd while an entry is being changed */
+   int lock;                          /* Futex taken by writers */
+   time_t reg_mtime;                  /* Identifies the reglist that was read */
+   off_t reg_size;
+   ino_t reg_ino;
+   time_t perm_mtime;                 /* and the op_permlist */
+   off_t perm_size;
+   ino_t perm_ino;
+};
+
+struct reg_list_head
+{
+   int spaces;                        /* Number of slots in the index, always
+				       * a power of two */
+   int capacity;                      /* Number of entries there is room for */
+   int entries;
+};
+
+struct reg_ent
+{
+   unsigned int hash;                 /* nick_hash() of the nick */
+   char nick[MAX_NICK_LEN+1];
+   char pass[51];                     /* Password as it's compared */
+   char class;                        /* Last character of the reglist line, 
+				       * 0 if the nick isn't registered */
+   char pass_class;                   /* Character after the password, 0 if
+				       * the line has no password */
+   int perms;                         /* From the op_permlist */
+};
+
+static int reg_list_shm = -1;
+static struct reg_list_ctl *reg_list_ctl = NULL;
+static struct reg_list_head *reg_list = NULL;
+static unsigned int reg_list_gen;
+
+#define REG_LIST_INDEX(head) ((int *)((head) + 1))
+#define REG_LIST_ENTRIES(head) ((struct reg_ent *)(REG_LIST_INDEX(head) + (head)->spaces))
+
+/* Returns the size of a registry segment with spaces slots.  */
+static size_t reg_list_size(int spaces)
+{
+   return sizeof(struct reg_list_head) + spaces * sizeof(int) 
+     + (spaces / 2) * sizeof(struct reg_ent);
+}
+
+/* Returns this process' mapping of the registry, and maps it again if it has
+ * been moved to a new segment since the last call.  */
+static struct reg_list_head *attach_reg_list(void)
+{
+   struct reg_list_head *head;
    
+   if((reg_list != NULL) && (reg_list_gen == reg_list_ctl->generation))
+     return reg_list;
    
-   if((fp = fdopen(fd, "r")) == NULL)
-     {
-	logprintf(1, "Error - In check_if_registered()/fdopen(): ");
+   if((head = (struct reg_list_head *)shmat(reg_list_ctl->shm_id, NULL, 0))
+      == (struct reg_list_head *)-1)
+     {	
+	logprintf(1, "Error - In attach_reg_list()/shmat(): ");
 	logerror(1, errno);
-	set_lock(fd, F_UNLCK);
-	close(fd);
-	return -1;
+	quit = 1;
+	return NULL;
      }
    
-   while(fgets(line, 1023, fp) != NULL)
-     {
-	trim_string(line);
-	
-	j = strlen(line);
-	if(j != 0)
-	  {
-	     /* Jump to next char which isn't a space */
-	     i = 0;
-	     while(line[i] == ' ')
-	       i++;
-	     
-	     if((strncasecmp(line + i, user_nick, cut_string(line + i, ' ')) == 0)
-		&& (cut_string(line + i, ' ') == strlen(user_nick)))
-	       {
-		  set_lock(fd, F_UNLCK);
-		  
-		  while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-		    logprintf(1, "Error - In check_if_registered()/fclose(): Interrupted system call. Trying again.\n");
-		  
-		  if(erret != 0)
-		    {
-		       logprintf(1, "Error - In check_if_registered()/fclose(): ");
-		       logerror(1, errno);
-		       return -1;
-		    }
-		  
-		  /* Return 3 if user is op admin */
-		  if(line[j-1] == '2')
-		    return 3;
-		  
-		  /* Return 2 if user is op */
-		  if(line[j-1] == '1')
-		    return 2;
-		  return 1;
-	       }
-	  }
-     }
-   set_lock(fd, F_UNLCK);
+   if(reg_list != NULL)
+     shmdt((char *)reg_list);
    
-   while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-     logprintf(1, "Error - In check_if_registered()/fclose(): Interrupted system call. Trying again.\n");
+   reg_list = head;
+   reg_list_gen = reg_list_ctl->generation;
    
-   if(erret != 0)
+   return reg_list;
+}
+
+static void lock_reg_list(void)
+{
+#if HAVE_LINUX_FUTEX_H
+   futex_take(&reg_list_ctl->lock);
+#else
+   sem_take(reg_list_sem);
+#endif
+}
+
+static void unlock_reg_list(void)
+{
+#if HAVE_LINUX_FUTEX_H
+   futex_give(&reg_list_ctl->lock);
+#else
+   sem_give(reg_list_sem);
+#endif
+}
+
+/* Marks the registry as being changed, or as done being changed. Only done
+ * with the lock taken.  */
+static void bump_reg_list_seq(void)
+{
+   __sync_synchronize();
+   reg_list_ctl->seq++;
+   __sync_synchronize();
+}
+
+/* Returns the entry number of nick, or -1 if it isn't in the registry. The 
+ * probe is bounded and the entry numbers are checked, since readers may see
+ * the index while it's being changed.  */
+static int find_reg_ent(struct reg_list_head *head, char *nick, unsigned int hash)
+{
+   int *index;
+   struct reg_ent *ent;
+   int mask;
+   int i, n, k;
+   
+   index = REG_LIST_INDEX(head);
+   ent = REG_LIST_ENTRIES(head);
+   mask = head->spaces - 1;
+   
+   for(i = hash & mask, n = 0; n < head->spaces; i = (i + 1) & mask, n++)
      {
-	logprintf(1, "Error - In check_if_registered()/fclose(): ");
-	logerror(1, errno);
-	return -1;
+	if((k = index[i]) == 0)
+	  break;
+	if((k > 0) && (k <= head->capacity) && (ent[k-1].hash == hash)
+	   && (strcasecmp(ent[k-1].nick, nick) == 0))
+	  return k - 1;
      }
    
-   return 0;
+   return -1;
 }
 
-/* Returns 0 if user is not on the list, 2 if user is registered, 3 if user
- * is OP, 4 if user is Op Admin and -1 if error */
-int check_pass(char *buf, struct user_t *user)
+/* Puts entry number entnum in the first free slot of its probe sequence.  */
+static void insert_reg_slot(struct reg_list_head *head, int entnum)
 {
-   int i, j;
-   int fd;
-   int erret;
-   FILE *fp;
-   char path[MAX_FDP_LEN+1];
-   char line[1024];
-   char reg_passwd[51];
-   char this_passwd[51];
-   char* tmp;
+   int *index;
+   int mask;
+   int i;
    
-   strncpy(this_passwd,buf,50);
-   this_passwd[strlen(this_passwd)-1] = '\0';	
+   index = REG_LIST_INDEX(head);
+   mask = head->spaces - 1;
    
-   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, REG_FILE);
+   for(i = REG_LIST_ENTRIES(head)[entnum].hash & mask; index[i] != 0;
+       i = (i + 1) & mask);
    
-   while(((fd = open(path, O_RDONLY)) < 0) && (errno == EINTR))
-     logprintf(1, "Error - In check_pass()/open(): Interrupted system call. Trying again.\n");   
+   index[i] = entnum + 1;
+}
+
+/* Creates an empty registry segment with room for spaces slots and puts its
+ * id in shm_id. Returns the mapping, or NULL on error.  */
+static struct reg_list_head *new_reg_list(int spaces, int *shm_id)
+{
+   struct reg_list_head *head;
    
-   if(fd < 0)
-     {
-	logprintf(1, "Error - In check_pass()/open(): ");
+   if((*shm_id = shmget(IPC_PRIVATE, reg_list_size(spaces), 0600)) < 0)
+     {	
+	logprintf(1, "Error - In new_reg_list()/shmget(): ");
 	logerror(1, errno);
-	return -1;	
+	quit = 1;
+	return NULL;
      }
    
-   /* Set the lock */
-   if(set_lock(fd, F_RDLCK) == 0)
+   if((head = (struct reg_list_head *)shmat(*shm_id, NULL, 0))
+      == (struct reg_list_head *)-1)
      {	
-	logprintf(1, "Error - In check_pass(): Couldn't set file lock\n");
-	close(fd);
-	return -1;
-     }      
-   
-   if((fp = fdopen(fd, "r")) == NULL)
-     {
-	logprintf(1, "Error - In check_pass()/fdopen(): ");
+	logprintf(1, "Error - In new_reg_list()/shmat(): ");
 	logerror(1, errno);
-	set_lock(fd, F_UNLCK);
-	close(fd);
-	return -1;
+	shmctl(*shm_id, IPC_RMID, NULL);
+	quit = 1;
+	return NULL;
      }
    
-   while(fgets(line, 1023, fp) != NULL)
+   /* A new segment is zeroed, so the index is already empty.  */
+   head->spaces = spaces;
+   head->capacity = spaces / 2;
+   head->entries = 0;
+   
+   return head;
+}
+
+/* Copies the registry at head to a new segment that is twice as large. The
+ * old segment is left as it is. Returns the new mapping, or NULL on error.  */
+static struct reg_list_head *grow_reg_list(struct reg_list_head *head, int *shm_id)
+{
+   struct reg_list_head *newhead;
+   int i;
+   
+   if((newhead = new_reg_list(head->spaces * 2, shm_id)) == NULL)
+     return NULL;
+   
+   memcpy(REG_LIST_ENTRIES(newhead), REG_LIST_ENTRIES(head),
+	  head->entries * sizeof(struct reg_ent));
+   newhead->entries = head->entries;
+   
+   for(i = 0; i < newhead->entries; i++)
+     insert_reg_slot(newhead, i);
+   
+   return newhead;
+}
+
+/* Makes the segment shm_id, mapped at head, the registry and removes the old
+ * one. Only done with the lock taken.  */
+static void replace_reg_list(int shm_id, struct reg_list_head *head)
+{
+   int old_shm_id;
+   
+   old_shm_id = reg_list_ctl->shm_id;
+   
+   bump_reg_list_seq();
+   
+   /* The old segment is destroyed when the last process has detached from 
+    * it, so readers that still use it are safe.  */
+   if(reg_list != NULL)
+     shmdt((char *)reg_list);
+   if(old_shm_id != -1)
+     shmctl(old_shm_id, IPC_RMID, NULL);
+   
+   reg_list_ctl->shm_id = shm_id;
+   __sync_synchronize();
+   reg_list_ctl->generation++;
+   
+   bump_reg_list_seq();
+   
+   reg_list = head;
+   reg_list_gen = reg_list_ctl->generation;
+}
+
+/* Returns the entry of nick in the registry at *head, and adds an empty 
+ * entry for it if there is none. If the registry has to grow, *head and 
+ * *shm_id are changed to a new segment and the old one is removed, so this
+ * is only used on a registry that isn't published yet, or one that has room
+ * for the entry. Returns NULL on error.  */
+static struct reg_ent *get_reg_ent(struct reg_list_head **head, int *shm_id,
+				   char *nick)
+{
+   struct reg_list_head *newhead;
+   struct reg_ent *ent;
+   unsigned int hash;
+   int entnum;
+   int new_shm_id;
+   
+   hash = nick_hash(nick);
+   
+   if((entnum = find_reg_ent(*head, nick, hash)) != -1)
+     return REG_LIST_ENTRIES(*head) + entnum;
+   
+   if((*head)->entries >= (*head)->capacity)
      {
-	trim_string(line);
-	
-	j = strlen(line);
-	if(j != 0)
-	  {
-	     /* Jump to next char which isn't a space */
-	     i = 0;
-	     while(line[i] == ' ')
-	       i++;
-	     
-	     if((strncasecmp(line + i, user->nick, cut_string(line + i, ' ')) == 0)
-		&& (cut_string(line + i, ' ') == strlen(user->nick)))
-	       {
-		  /* User is on the list */
-		  if((i = cut_string(line + i, ' ')) == -1)
-		    {
-		       logprintf(1, "Error - In check_pass(): Erroneous line in file\n");
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_pass()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_pass()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return -1;
-		    }
-	    		  
-		  while(line[i] == ' ')
-		    i++;
-		  if(line[i] == '\0')
-		    {
-		       logprintf(1, "Error - In check_pass(): Erroneous line in file\n");
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_pass()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_pass()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return -1;
-		    }
-		  if((j = i + cut_string(line + i, ' ')) == -1)
-		    {
-		       logprintf(1, "Error - In check_pass(): Erroneous line in file\n");
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_pass()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_pass()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return -1;
-		    }
-		  
-		  /* The password check. */
-
-		  strncpy(reg_passwd,line+i,50);
-		  reg_passwd[strlen(reg_passwd)-2] = '\0';
-
-		  if(crypt_enable != 0)
-		    tmp = crypt(this_passwd,reg_passwd);
-		  else
-		    tmp = this_passwd;
+	if((newhead = grow_reg_list(*head, &new_shm_id)) == NULL)
+	  return NULL;
+	shmdt((char *)*head);
+	shmctl(*shm_id, IPC_RMID, NULL);
+	*head = newhead;
+	*shm_id = new_shm_id;
+     }
+   
+   entnum = (*head)->entries;
+   ent = REG_LIST_ENTRIES(*head) + entnum;
+   memset(ent, 0, sizeof(struct reg_ent));
+   ent->hash = hash;
+   strcpy(ent->nick, nick);
+   
+   (*head)->entries++;
+   insert_reg_slot(*head, entnum);
+   
+   return ent;
+}
 
-		  if(strcmp(tmp,reg_passwd) == 0) 
-		    {
-		       /* Users password is correct */
+/* Splits a line from the reglist into the nick and the rest of the entry.
+ * Returns 0 if the line is empty or the nick is too long.  */
+static int parse_reg_line(char *line, char *nick, struct reg_ent *ent)
+{
+   int i, j, len;
+   
+   trim_string(line);
+   
+   /* Jump to next char which isn't a space */
+   i = 0;
+   while(line[i] == ' ')
+     i++;
+   
+   if(line[i] == '\0')
+     return 0;
+   
+   if((len = cut_string(line + i, ' ')) == -1)
+     len = strlen(line + i);
+   if(len > MAX_NICK_LEN)
+     return 0;
+   
+   memcpy(nick, line + i, len);
+   nick[len] = '\0';
+   
+   ent->class = line[strlen(line) - 1];
+   ent->pass[0] = '\0';
+   ent->pass_class = 0;
+   
+   /* The password runs to the last two characters of the line, and then 
+    * comes the class.  */
+   i += len;
+   while(line[i] == ' ')
+     i++;
+   if((line[i] == '\0') || ((j = cut_string(line + i, ' ')) == -1))
+     return 1;
+   
+   strncpy(ent->pass, line + i, 50);
+   ent->pass[50] = '\0';
+   if(strlen(ent->pass) < 2)
+     return 1;
+   ent->pass[strlen(ent->pass) - 2] = '\0';
+   
+   j += i;
+   while(line[j] == ' ')
+     j++;
+   ent->pass_class = line[j];
+   
+   return 1;
+}
 
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_pass()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_pass()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       	 
-		       while(line[j] == ' ')
-			 j++;
-		       if(line[j] == '2')
-			 {
-			    /* User is OP Admin */
-			    return 4;
-			 }
-		       else if(line[j] == '1')
-			 {
-			    /* User is OP */
-			    return 3;
-			 }
-		       else if(line[j] == '0')
-			 {
-			    /* User is registered */
-			    return 2;
-			 }
-		       else
-			 {
-			    logprintf(1, "Error - In check_pass(): Erroneous line in file\n");
-			    return -1;
-			 }
-		    }
-		  else
-		    {
-		       logprintf(1, "User at %s provided bad password for %s\n", user->hostname, user->nick);
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In check_pass()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In check_pass()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return 0;
-		    }
-	       }
-	  }
-     }
-  
-   while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-     logprintf(1, "Error - In check_pass()/fclose(): Interrupted system call. Trying again.\n");
+/* Splits a line from the op_permlist into the nick and the permissions.
+ * Returns 0 if the line is empty or the nick is too long.  */
+static int parse_perm_line(char *line, char *nick, int *perms)
+{
+   int i, len;
    
-   if(erret != 0)
-     {
-	logprintf(1, "Error - In check_pass()/fclose(): ");
-	logerror(1, errno);
-	return -1;
-     }
- 
-   if(strlen(default_pass) > 0)
-     {
-        if(strcmp(this_passwd,default_pass) == 0)
-          {
-            /* User is regular but default pass required */
-            return 1;
-          }
-        else
-	  {
-            return 0;
-          }
-     }
- 
-   return -1;
+   trim_string(line);
+   
+   i = 0;
+   while(line[i] == ' ')
+     i++;
+   
+   if(line[i] == '\0')
+     return 0;
+   
+   if((len = cut_string(line + i, ' ')) == -1)
+     len = strlen(line + i);
+   if(len > MAX_NICK_LEN)
+     return 0;
+   
+   memcpy(nick, line + i, len);
+   nick[len] = '\0';
+   
+   i += len;
+   while(line[i] == ' ')
+     i++;
+   
+   /* An entry without permissions is an error when it's looked up.  */
+   *perms = (line[i] == '\0') ? -1 : atoi(line + i);
+   
+   return 1;
 }
 
-int get_permissions(char *user_nick)
+/* Reads the reglist, or the op_permlist if perm is 1, into the registry at
+ * *head, which may be moved to a new segment like in get_reg_ent(). The 
+ * first line of a nick in the reglist and the last one in the op_permlist 
+ * are the ones that count. Returns -1 on error.  */
+static int read_reg_file(struct reg_list_head **head, int *shm_id, char *file,
+			 int perm, struct stat *st)
 {
-   FILE *fp;
    int fd;
    int erret;
-   int perms = 0;
+   int perms;
+   int ret = 1;
+   FILE *fp;
    char path[MAX_FDP_LEN+1];
    char line[1024];
-   int i,j;
+   char nick[MAX_NICK_LEN+1];
+   struct reg_ent new_ent;
+   struct reg_ent *ent;
    
-   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, OP_PERM_FILE);
+   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, file);
    
    while(((fd = open(path, O_RDONLY)) < 0) && (errno == EINTR))
-     logprintf(1, "Error - In get_permissions()/open(): Interrupted system call. Trying again.\n");   
+     logprintf(1, "Error - In read_reg_file()/open(): Interrupted system call. Trying again.\n");   
    
    if(fd < 0)
      {
-	logprintf(1, "Error - In get_permissions()/open(): ");
+	logprintf(1, "Error - In read_reg_file()/open(): ");
 	logerror(1, errno);
 	return -1;	
      }
@@ -1618,14 +1967,25 @@ int get_permissions(char *user_nick)
    /* Set the lock */
    if(set_lock(fd, F_RDLCK) == 0)
      {
-	logprintf(1, "Error - In get_permissions(): Couldn't set file lock\n");
+	logprintf(1, "Error - In read_reg_file(): Couldn't set lock\n");
+	close(fd);
+	return -1;
+     }
+   
+   /* The file is identified while it's locked, so a change that is made 
+    * after it has been read is noticed.  */
+   if(fstat(fd, st) < 0)
+     {
+	logprintf(1, "Error - In read_reg_file()/fstat(): ");
+	logerror(1, errno);
+	set_lock(fd, F_UNLCK);
 	close(fd);
 	return -1;
      }
    
    if((fp = fdopen(fd, "r")) == NULL)
      {
-	logprintf(1, "Error - In get_permissions()/fdopen(): ");
+	logprintf(1, "Error - In read_reg_file()/fdopen(): ");
 	logerror(1, errno);
 	set_lock(fd, F_UNLCK);
 	close(fd);
@@ -1634,92 +1994,650 @@ int get_permissions(char *user_nick)
    
    while(fgets(line, 1023, fp) != NULL)
      {
-	trim_string(line);
+	if(perm != 0)
+	  {
+	     if(parse_perm_line(line, nick, &perms) == 0)
+	       continue;
+	     if((ent = get_reg_ent(head, shm_id, nick)) == NULL)
+	       {
+		  ret = -1;
+		  break;
+	       }
+	     ent->perms = perms;
+	  }
+	else
+	  {
+	     if(parse_reg_line(line, nick, &new_ent) == 0)
+	       continue;
+	     if((ent = get_reg_ent(head, shm_id, nick)) == NULL)
+	       {
+		  ret = -1;
+		  break;
+	       }
+	     if(ent->class == 0)
+	       {
+		  ent->class = new_ent.class;
+		  ent->pass_class = new_ent.pass_class;
+		  strcpy(ent->pass, new_ent.pass);
+	       }
+	  }
+     }
+   
+   set_lock(fd, F_UNLCK);
+   
+   while(((erret = fclose(fp)) != 0) && (errno == EINTR))
+     logprintf(1, "Error - In read_reg_file()/fclose(): Interrupted system call. Trying again.\n");
+   
+   if(erret != 0)
+     {
+	logprintf(1, "Error - In read_reg_file()/fclose(): ");
+	logerror(1, errno);
+	return -1;
+     }
+   
+   return ret;
+}
+
+#define REG_PART  1                   /* The reglist part of the entries */
+#define PERM_PART 2                   /* and the op_permlist part */
+
+/* Reads the files in parts into a new registry and makes it the current
+ * one. The part that isn't read is copied from the current registry. Only
+ * done with the lock taken. Returns -1 on error, and then the current 
+ * registry is kept.  */
+static int load_reg_list(int parts)
+{
+   struct reg_list_head *head, *old;
+   struct reg_ent *ent, *old_ent;
+   struct stat reg_st, perm_st;
+   int shm_id;
+   int i;
+   
+   if((reg_list_ctl->shm_id == -1) || ((old = attach_reg_list()) == NULL))
+     {
+	parts = REG_PART | PERM_PART;
+	old = NULL;
+     }
+   
+   if((head = new_reg_list(REG_LIST_SPACES, &shm_id)) == NULL)
+     return -1;
+   
+   /* The segment may move while it's filled in, it's removed with the id 
+    * that it has in the end.  */
+   for(i = 0; (old != NULL) && (i < old->entries); i++)
+     {
+	old_ent = REG_LIST_ENTRIES(old) + i;
+	if((parts & REG_PART) == 0)
+	  {
+	     if(old_ent->class == 0)
+	       continue;
+	  }
+	else if((parts & PERM_PART) == 0)
+	  {
+	     if(old_ent->perms == 0)
+	       continue;
+	  }
 	
-	j = strlen(line);
-	if(j != 0)
+	if((ent = get_reg_ent(&head, &shm_id, old_ent->nick)) == NULL)
 	  {
-	     /* Jump to next char which isn't a space */
-	     i = 0;
-	     while(line[i] == ' ')
-	       i++;
-	     
-	     if((strncasecmp(line + i, user_nick, cut_string(line + i, ' ')) == 0)
-		&& (cut_string(line + i, ' ') == strlen(user_nick)))
+	     shmdt((char *)head);
+	     shmctl(shm_id, IPC_RMID, NULL);
+	     return -1;
+	  }
+	
+	if((parts & REG_PART) == 0)
+	  {
+	     ent->class = old_ent->class;
+	     ent->pass_class = old_ent->pass_class;
+	     strcpy(ent->pass, old_ent->pass);
+	  }
+	else
+	  ent->perms = old_ent->perms;
+     }
+   
+   if((((parts & REG_PART) != 0) 
+       && (read_reg_file(&head, &shm_id, REG_FILE, 0, &reg_st) == -1))
+      || (((parts & PERM_PART) != 0) 
+	  && (read_reg_file(&head, &shm_id, OP_PERM_FILE, 1, &perm_st) == -1)))
+     {
+	shmdt((char *)head);
+	shmctl(shm_id, IPC_RMID, NULL);
+	return -1;
+     }
+   
+   replace_reg_list(shm_id, head);
+   
+   if((parts & REG_PART) != 0)
+     {	
+	reg_list_ctl->reg_mtime = reg_st.st_mtime;
+	reg_list_ctl->reg_size = reg_st.st_size;
+	reg_list_ctl->reg_ino = reg_st.st_ino;
+     }
+   if((parts & PERM_PART) != 0)
+     {	
+	reg_list_ctl->perm_mtime = perm_st.st_mtime;
+	reg_list_ctl->perm_size = perm_st.st_size;
+	reg_list_ctl->perm_ino = perm_st.st_ino;
+     }
+   
+   return 1;
+}
+
+/* Returns the parts of the registry whose files have been changed since 
+ * they were read. A file that can't be checked is taken as unchanged.  */
+static int changed_reg_parts(void)
+{
+   char path[MAX_FDP_LEN+1];
+   struct stat st;
+   int parts = 0;
+   
+   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, REG_FILE);
+   if(stat(path, &st) < 0)
+     {
+	logprintf(1, "Error - In changed_reg_parts()/stat(): ");
+	logerror(1, errno);
+     }
+   else if((reg_list_ctl->reg_mtime != st.st_mtime)
+	   || (reg_list_ctl->reg_size != st.st_size)
+	   || (reg_list_ctl->reg_ino != st.st_ino))
+     parts |= REG_PART;
+   
+   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, OP_PERM_FILE);
+   if(stat(path, &st) < 0)
+     {
+	logprintf(1, "Error - In changed_reg_parts()/stat(): ");
+	logerror(1, errno);
+     }
+   else if((reg_list_ctl->perm_mtime != st.st_mtime)
+	   || (reg_list_ctl->perm_size != st.st_size)
+	   || (reg_list_ctl->perm_ino != st.st_ino))
+     parts |= PERM_PART;
+   
+   return parts;
+}
+
+/* Reads the files that have been changed since the registry was made from
+ * them into a new registry.  */
+static void refresh_reg_list(void)
+{
+   int parts;
+   
+   /* Another process may have read the files while we waited for the lock.  */
+   lock_reg_list();
+   if(reg_list_ctl->shm_id == -1)
+     load_reg_list(REG_PART | PERM_PART);
+   else if((parts = changed_reg_parts()) != 0)
+     load_reg_list(parts);
+   unlock_reg_list();
+}
+
+/* Makes sure that the registry is up to date with the files. When the 
+ * parent watches the files, it does that itself, otherwise they are checked
+ * here. If they can't be checked or read, the registry is used as it is. 
+ * Returns -1 if there is no registry.  */
+static int update_reg_list(void)
+{
+   if(reg_list_ctl == NULL)
+     return -1;
+   
+   if((reg_list_ctl->shm_id == -1) 
+      || ((watching == 0) && (changed_reg_parts() != 0)))
+     refresh_reg_list();
+   
+   return (reg_list_ctl->shm_id == -1) ? -1 : 1;
+}
+
+/* Copies the registry entry of nick to ent. Returns 1 if the nick has an 
+ * entry, 0 if it hasn't and -1 on error.  */
+static int lookup_reg_ent(char *nick, struct reg_ent *ent)
+{
+   struct reg_list_head *head;
+   unsigned int seq, hash;
+   int entnum;
+   
+   if(strlen(nick) > MAX_NICK_LEN)
+     return 0;
+   
+   if(update_reg_list() == -1)
+     return -1;
+   
+   hash = nick_hash(nick);
+   
+   do
+     {
+	while(((seq = *(volatile unsigned int *)&reg_list_ctl->seq) & 1) != 0)
+	  sched_yield();
+	__sync_synchronize();
+	
+	if((head = attach_reg_list()) == NULL)
+	  return -1;
+	
+	if((entnum = find_reg_ent(head, nick, hash)) != -1)
+	  memcpy(ent, REG_LIST_ENTRIES(head) + entnum, sizeof(struct reg_ent));
+	
+	__sync_synchronize();
+     } while(*(volatile unsigned int *)&reg_list_ctl->seq != seq);
+   
+   return (entnum == -1) ? 0 : 1;
+}
+
+/* Notes that file has been changed by this process, so that the change isn't
+ * taken for one made by someone else. Only done with the lock taken.  */
+static void note_reg_file(char *file)
+{
+   char path[MAX_FDP_LEN+1];
+   struct stat st;
+   
+   snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, file);
+   if(stat(path, &st) < 0)
+     {
+	logprintf(1, "Error - In note_reg_file()/stat(): ");
+	logerror(1, errno);
+	return;
+     }
+   
+   if(strcmp(file, REG_FILE) == 0)
+     {
+	reg_list_ctl->reg_mtime = st.st_mtime;
+	reg_list_ctl->reg_size = st.st_size;
+	reg_list_ctl->reg_ino = st.st_ino;
+     }
+   else
+     {	
+	reg_list_ctl->perm_mtime = st.st_mtime;
+	reg_list_ctl->perm_size = st.st_size;
+	reg_list_ctl->perm_ino = st.st_ino;
+     }
+}
+
+/* Changes the entry of nick in the registry after file has been changed. 
+ * For the reglist, line is the line that nick now has in it, or NULL if nick
+ * has been removed from it. For the op_permlist, perms is the permissions
+ * that nick now has.  */
+static void change_reg_ent(char *nick, char *line, int perms, char *file)
+{
+   struct reg_list_head *head;
+   struct reg_ent new_ent;
+   struct reg_ent *ent;
+   char line_nick[MAX_NICK_LEN+1];
+   char temp[1024];
+   int reg, found;
+   int shm_id;
+   
+   if((reg_list_ctl == NULL) || (strlen(nick) > MAX_NICK_LEN))
+     return;
+   
+   reg = (strcmp(file, REG_FILE) == 0) ? 1 : 0;
+   
+   memset(&new_ent, 0, sizeof(struct reg_ent));
+   if((reg != 0) && (line != NULL))
+     {
+	strncpy(temp, line, 1023);
+	temp[1023] = '\0';
+	if(parse_reg_line(temp, line_nick, &new_ent) == 0)
+	  return;
+     }
+   
+   lock_reg_list();
+   
+   if((reg_list_ctl->shm_id == -1) || ((head = attach_reg_list()) == NULL))
+     {
+	unlock_reg_list();
+	return;
+     }
+   
+   found = (find_reg_ent(head, nick, nick_hash(nick)) == -1) ? 0 : 1;
+   
+   /* The registry is published, so if it has to grow, the new segment 
+    * replaces it before the entry is added. A nick that isn't there doesn't
+    * need an entry to be taken off the reglist.  */
+   if((found == 0) && (reg != 0) && (line == NULL))
+     {
+	note_reg_file(file);
+	unlock_reg_list();
+	return;
+     }
+   
+   if((found == 0) && (head->entries >= head->capacity))
+     {
+	if((head = grow_reg_list(head, &shm_id)) == NULL)
+	  {
+	     unlock_reg_list();
+	     return;
+	  }
+	replace_reg_list(shm_id, head);
+     }
+   
+   shm_id = reg_list_ctl->shm_id;
+   
+   bump_reg_list_seq();
+   if((ent = get_reg_ent(&head, &shm_id, nick)) != NULL)
+     {
+	if(reg != 0)
+	  {	     
+	     ent->class = new_ent.class;
+	     ent->pass_class = new_ent.pass_class;
+	     strcpy(ent->pass, new_ent.pass);
+	  }
+	else
+	  ent->perms = perms;
+     }
+   bump_reg_list_seq();
+   
+   note_reg_file(file);
+   unlock_reg_list();
+}
+
+/* Tells the registry that nick has been added to the reglist with line, or
+ * taken off it if line is NULL.  */
+void update_reg_user(char *nick, char *line)
+{
+   change_reg_ent(nick, line, 0, REG_FILE);
+}
+
+/* Tells the registry that nick now has perms in the op_permlist.  */
+void update_reg_perms(char *nick, int perms)
+{
+   change_reg_ent(nick, NULL, perms, OP_PERM_FILE);
+}
+
+/* Creates the control segment of the registry and reads the files into it.
+ * Children inherit the mapping when they are forked.  */
+int init_reg_list(void)
+{
+   if((reg_list_shm = shmget(IPC_PRIVATE, sizeof(struct reg_list_ctl), 
+			     0600)) < 0)
+     {	 
+	logprintf(1, "Error - In init_reg_list()/shmget(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   
+   /* This one never moves, so it's mapped for good.  */
+   if((reg_list_ctl = (struct reg_list_ctl *)shmat(reg_list_shm, NULL, 0))
+      == (struct reg_list_ctl *)-1)
+     {	
+	logprintf(1, "Error - In init_reg_list()/shmat(): ");
+	logerror(1, errno);
+	shmctl(reg_list_shm, IPC_RMID, NULL);
+	reg_list_ctl = NULL;
+	quit = 1;
+	return -1;
+     }
+   
+   memset(reg_list_ctl, 0, sizeof(struct reg_list_ctl));
+   reg_list_ctl->shm_id = -1;
+   
+   return load_reg_list(REG_PART | PERM_PART);
+}
+
+/* Removes the shared memory segments of the registry.  */
+void remove_reg_list(void)
+{
+   if(reg_list_ctl == NULL)
+     return;
+   
+   if(reg_list_ctl->shm_id != -1)
+     shmctl(reg_list_ctl->shm_id, IPC_RMID, NULL);
+   shmctl(reg_list_shm, IPC_RMID, NULL);
+}
+
+/* Returns 1 if a nick is on the registered list, 2 if nick is op and 3 if 
+ * user is op_admin.  */
+int check_if_registered(char *user_nick)
+{
+   struct reg_ent ent;
+   int ret;
+   
+   if((ret = lookup_reg_ent(user_nick, &ent)) <= 0)
+     return ret;
+   
+   if(ent.class == 0)
+     return 0;
+   
+   /* Return 3 if user is op admin */
+   if(ent.class == '2')
+     return 3;
+   
+   /* Return 2 if user is op */
+   if(ent.class == '1')
+     return 2;
+   return 1;
+}
+
+/* Returns 0 if user is not on the list, 2 if user is registered, 3 if user
+ * is OP, 4 if user is Op Admin and -1 if error */
+int check_pass(char *buf, struct user_t *user)
+{
+   struct reg_ent ent;
+   char this_passwd[51];
+   char* tmp;
+   int ret;
+   
+   strncpy(this_passwd,buf,50);
+   this_passwd[50] = '\0';
+   this_passwd[strlen(this_passwd)-1] = '\0';	
+   
+   if((ret = lookup_reg_ent(user->nick, &ent)) == -1)
+     return -1;
+   
+   if((ret == 1) && (ent.class != 0))
+     {
+	/* User is on the list */
+	if(ent.pass_class == 0)
+	  {
+	     logprintf(1, "Error - In check_pass(): Erroneous line in file\n");
+	     return -1;
+	  }
+	
+	/* The password check. */
+	if(crypt_enable != 0)
+	  tmp = crypt(this_passwd,ent.pass);
+	else
+	  tmp = this_passwd;
+	
+	if(strcmp(tmp,ent.pass) == 0) 
+	  {
+	     /* Users password is correct */
+	     if(ent.pass_class == '2')
 	       {
-		  /* User is on the list */
-		  if((i = cut_string(line + i, ' ')) == -1)
-		    {
-		       logprintf(1, "Error - In get_permissions(): Erroneous line in file\n");
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In get_permissions()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In get_permissions()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return -1;
-		    }
-	    		  
-		  while(line[i] == ' ')
-		    i++;
-		  if(line[i] == '\0')
-		    {
-		       logprintf(1, "Error - In get_permissions(): Erroneous line in file\n");
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In get_permissions()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In get_permissions()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return -1;
-		    }
-		  if((j = i + cut_string(line + i, ' ')) == -1)
-		    {
-		       logprintf(1, "Error - In get_permissions(): Erroneous line in file\n");
-		       set_lock(fd, F_UNLCK);
-		       
-		       while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-			 logprintf(1, "Error - In get_permissions()/fclose(): Interrupted system call. Trying again.\n");
-		       
-		       if(erret != 0)
-			 {
-			    logprintf(1, "Error - In get_permissions()/fclose(): ");
-			    logerror(1, errno);
-			    return -1;
-			 }
-		       
-		       return -1;
-		    }
-		  
-		  perms = atoi(line + i);
+		  /* User is OP Admin */
+		  return 4;
+	       }
+	     else if(ent.pass_class == '1')
+	       {
+		  /* User is OP */
+		  return 3;
+	       }
+	     else if(ent.pass_class == '0')
+	       {
+		  /* User is registered */
+		  return 2;
+	       }
+	     else
+	       {
+		  logprintf(1, "Error - In check_pass(): Erroneous line in file\n");
+		  return -1;
 	       }
 	  }
+	else
+	  {
+	     logprintf(1, "User at %s provided bad password for %s\n", user->hostname, user->nick);
+	     return 0;
+	  }
+     }
+   
+   if(strlen(default_pass) > 0)
+     {
+        if(strcmp(this_passwd,default_pass) == 0)
+          {
+            /* User is regular but default pass required */
+            return 1;
+          }
+        else
+	  {
+            return 0;
+          }
+     }
+ 
+   return -1;
+}
+
+int get_permissions(char *user_nick)
+{
+   struct reg_ent ent;
+   int ret;
+   
+   if((ret = lookup_reg_ent(user_nick, &ent)) <= 0)
+     return ret;
+   
+   if(ent.perms == -1)
+     logprintf(1, "Error - In get_permissions(): Erroneous line in file\n");
+   
+   return ent.perms;
+}
+
+/* Starts watching config_dir for changes to the files that are kept in 
+ * memory. Done by the parent before anything is forked. Returns -1 if the
+ * files can't be watched, and then they are checked on each lookup 
+ * instead.  */
+int init_watch(void)
+{
+#if HAVE_SYS_INOTIFY_H
+   int j;
+   
+   if((watch_fd = inotify_init()) < 0)
+     {
+	logprintf(1, "Error - In init_watch()/inotify_init(): ");
+	logerror(1, errno);
+	watch_fd = -1;
+	return -1;
      }
-   set_lock(fd, F_UNLCK);
    
-   while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-     logprintf(1, "Error - In get_permissions()/fclose(): Interrupted system call. Trying again.\n");
+   if(fcntl(watch_fd, F_SETFL, O_NONBLOCK) < 0)
+     {
+	logprintf(1, "Error - In init_watch()/fcntl(): ");
+	logerror(1, errno);
+	close(watch_fd);
+	watch_fd = -1;
+	return -1;
+     }
    
-   if(erret != 0)
+   /* Files are either written and closed, or replaced by renaming a new 
+    * file over them.  */
+   if(inotify_add_watch(watch_fd, config_dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
      {
-	logprintf(1, "Error - In get_permissions()/fclose(): ");
+	logprintf(1, "Error - In init_watch()/inotify_add_watch(): ");
 	logerror(1, errno);
+	close(watch_fd);
+	watch_fd = -1;
 	return -1;
      }
    
-   return perms;
+   /* Take note of the files as they are now.  */
+   for(j = 0; watched_files[j] != NULL; j++)
+     watched_file_changed(j);
+   
+   watching = 1;
+   return 1;
+#else
+   watch_fd = -1;
+   return -1;
+#endif
+}
+
+/* Reads a list again after the parent has said that its file has changed.
+ * Lists that this process hasn't read yet are left until they are needed.
+ * Format is: $ReloadList <file>|  */
+void reload_list(char *buf)
+{
+   char file[MAX_FDP_LEN+1];
+   
+   if(sscanf(buf, "$ReloadList %100[^|]|", file) != 1)
+     return;
+   
+   if((strcmp(file, BAN_FILE) == 0) && (ban_list != NULL))
+     update_ip_list(&ban_list, BAN_FILE, 1);
+   else if((strcmp(file, ALLOW_FILE) == 0) && (allow_list != NULL))
+     update_ip_list(&allow_list, ALLOW_FILE, 1);
+   else if((strcmp(file, NICKBAN_FILE) == 0) && (nickban_list != NULL))
+     update_nickban_list(1);
+   else if(strcmp(file, CONFIG_FILE) == 0)
+     read_config();
+}
+
+/* Handles the events on watch_fd in the parent. Only the files that have 
+ * changed are read again. The registry is shared, so the parent reads it
+ * for everyone, the other lists are read again by each process when it's 
+ * told to.  */
+void watch_action(void)
+{
+#if HAVE_SYS_INOTIFY_H
+   union
+     {
+	struct inotify_event event;
+	char buf[4096];
+     } events;
+   struct inotify_event *event;
+   char command[MAX_FDP_LEN+16];
+   int changed = 0;
+   int len, i, j;
+   
+   while((len = read(watch_fd, &events, sizeof(events))) > 0)
+     {
+	i = 0;
+	while(i < len)
+	  {
+	     event = (struct inotify_event *)(events.buf + i);
+	     i += sizeof(struct inotify_event) + event->len;
+	     
+	     /* If events were lost, everything is read again.  */
+	     if((event->mask & IN_Q_OVERFLOW) != 0)
+	       changed = ~0;
+	     
+	     if(event->len == 0)
+	       continue;
+	     
+	     for(j = 0; watched_files[j] != NULL; j++)
+	       {
+		  if(strcmp(event->name, watched_files[j]) == 0)
+		    changed |= 1 << j;
+	       }
+	  }
+     }
+   
+   if((len < 0) && (errno != EAGAIN) && (errno != EINTR))
+     {
+	logprintf(1, "Error - In watch_action()/read(): ");
+	logerror(1, errno);
+     }
+   
+   for(j = 0; watched_files[j] != NULL; j++)
+     {
+	if((changed & (1 << j)) == 0)
+	  continue;
+	
+	/* Writes made through the hub have already been applied to the 
+	 * registry, so it's only read if the file isn't the one it knows.  */
+	if((strcmp(watched_files[j], REG_FILE) == 0)
+	   || (strcmp(watched_files[j], OP_PERM_FILE) == 0))
+	  {
+	     if(reg_list_ctl != NULL)
+	       refresh_reg_list();
+	     continue;
+	  }
+	
+	if(watched_file_changed(j) == 0)
+	  continue;
+	
+	logprintf(4, "%s has changed, reading it again\n", watched_files[j]);
+	
+	snprintf(command, MAX_FDP_LEN+15, "$ReloadList %s|", watched_files[j]);
+	reload_list(command);
+	send_to_non_humans(command, FORKED, NULL);
+     }
+#endif
 }
 
 /* Write config file */
@@ -1780,6 +2698,10 @@ int write_config_file(void)
    
    fprintf(fp, "users_per_fork = %d\n\n", users_per_fork);
    
+   fprintf(fp, "send_threads = %d\n\n", send_threads);
+   
+   fprintf(fp, "accept_workers = %d\n\n", accept_workers);
+   
    fprintf(fp, "listening_port = %u\n\n", listening_port);
    
    fprintf(fp, "admin_port = %u\n\n", admin_port);
@@ -1836,6 +2758,8 @@ int write_config_file(void)
 	return -1;
      }
    
+   note_config_file();
+   
    return 1;
 }
      
@@ -1874,6 +2798,7 @@ int remove_reg_user(char *buf, struct user_t *user)
    char nick[MAX_NICK_LEN+1];
    char path[MAX_FDP_LEN+1];
    int line_nbr;
+   int ret;
    
    line_nbr = 0;
    temp = NULL;
@@ -1891,7 +2816,16 @@ int remove_reg_user(char *buf, struct user_t *user)
       (check_if_registered(nick) > check_if_registered(user->nick)))
      return -1;
    
-   return remove_line_from_file(nick, path, 0);
+   ret = remove_line_from_file(nick, path, 0);
+   
+   /* Take the user off the op list if it's online.  */
+   if(ret > 0)
+     {	
+	update_reg_user(nick, NULL);
+	update_op_in_user_list(nick);
+     }
+   
+   return ret;
 }
    
 
@@ -1929,6 +2863,12 @@ int add_reg_user(char *buf, struct user_t *user)
    
    ret = add_line_to_file(line, path);
    
+   if(ret == 1)
+     update_reg_user(nick, line);
+   
+   if((ret == 1) && (type != 0))
+     update_op_in_user_list(nick);
+   
    /* Send the event to script */
 #ifdef HAVE_PERL
    if(ret == 1)
@@ -2041,93 +2981,389 @@ int init_dirs(void)
    return 1;
 }
 
-/* Print to log file */
-void logprintf(int verb, const char *format, ...)
+/* Log messages are queued in log_ring and written out in batches by a
+ * writer thread, so logprintf never waits on the log file.  The ring has
+ * several producers, the main thread and the signal handlers that may
+ * interrupt it, which reserve space by moving log_head with a CAS.  Each
+ * record starts with a log_rec and is followed by the message.  If the
+ * ring is full, the message is dropped and counted.  */
+#define LOG_REC_ALIGN      32
+#define LOG_PAD            0x01            /* Fills out the end of the ring */
+#define LOG_STAMP          0x02            /* Message is prefixed with the time */
+#define LOG_ERRNO          0x04            /* Message is from logerror() */
+
+struct log_rec
 {
-   static char buf[4096];
-   char path[MAX_FDP_LEN+1];
-   FILE *fp = NULL;
-   int fd=0;
-   int erret;
-   char *localtime;
-   char *temp;
-   time_t current_time;
-   int priority;
+   unsigned int len;                       /* Bytes used, including this header */
+   volatile int ready;                     /* Set when the message is written */
+   int verb;
+   int flags;
+   time_t stamp;
+};
+
+static char log_ring[LOG_RING_SIZE] __attribute__ ((aligned (LOG_REC_ALIGN)));
+static volatile unsigned long log_head;
+static volatile unsigned long log_tail;
+static volatile unsigned long log_dropped;
+static volatile sig_atomic_t log_reopen;
+static volatile int log_draining;
+static char log_batch[LOG_BATCH_SIZE];
+static int log_batch_len;
+static int log_fd = -1;
+static char log_path[MAX_FDP_LEN+1];
+#ifdef LOG_WRITER_THREAD
+static pthread_t log_thread;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int log_stop;
+static volatile int log_writer;            /* 1 if running, -1 if it couldn't be started */
+#endif
+
+/* Reserves size bytes in the ring. Returns NULL if there isn't room.  */
+static struct log_rec *reserve_log_rec(unsigned int size)
+{
+   struct log_rec *rec;
+   unsigned long head;
+   unsigned long off;
+   unsigned long pad;
    
-   if(verb > verbosity)
-     return;
+   size = (size + LOG_REC_ALIGN - 1) & ~(LOG_REC_ALIGN - 1);
+   
+   do
+     {
+	head = log_head;
+	off = head & (LOG_RING_SIZE - 1);
+	
+	/* Records don't wrap, the rest of the ring is padded instead.  */
+	pad = (off + size > LOG_RING_SIZE) ? LOG_RING_SIZE - off : 0;
+	
+	if(head + pad + size - log_tail > LOG_RING_SIZE)
+	  {
+	     __sync_fetch_and_add(&log_dropped, 1);
+	     return NULL;
+	  }
+     } while(!__sync_bool_compare_and_swap(&log_head, head, head + pad + size));
    
-   if ((syslog_enable == 0) && (syslog_switch == 0))
+   if(pad != 0)
      {
-	if (strlen(logfile) > 1)
-	  strncpy(path, logfile, MAX_FDP_LEN);
-	else									/* If no preset logfile. */
-	  snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, LOG_FILE);
+	rec = (struct log_rec *)(log_ring + off);
+	rec->len = pad;
+	rec->flags = LOG_PAD;
+	__sync_synchronize();
+	rec->ready = 1;
+	off = 0;
      }
    
-   if(format)
+   rec = (struct log_rec *)(log_ring + off);
+   rec->len = size;
+   return rec;
+}
+
+/* Writes out what's gathered in log_batch.  */
+static void flush_log_batch(void)
+{
+   int done = 0;
+   int ret;
+   
+   while((done < log_batch_len) && (log_fd != -1))
      {
-	va_list args;
-	va_start(args, format);
-	vsnprintf(buf, 4095, format, args);
-	va_end(args);
-	
-	if((syslog_enable == 0) && (syslog_switch == 0))
+	if((ret = write(log_fd, log_batch + done, log_batch_len - done)) < 0)
 	  {
-	     while(((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) && (errno == EINTR))
-	       {
-	       }	     
-	     
-	     if(fd < 0)
-	       return;
-	     
-	     /* Set the lock */
-	     if(set_lock(fd, F_WRLCK) == 0)
-	       {
-		  close(fd);
-		  return;
-	       }
+	     if(errno == EINTR)
+	       continue;
 	     
-	     if((fp = fdopen(fd, "a")) == NULL)
-	       {
-		  set_lock(fd, F_UNLCK);
-		  close(fd);
-		 return;
-	      }
+	     /* Try opening the file again on the next flush.  */
+	     if(log_fd != STDOUT_FILENO)
+	       close(log_fd);
+	     log_fd = -1;
 	  }
-	
-	current_time = time(NULL);
-	localtime = ctime(&current_time);
-	temp = localtime;
-	temp += 4;
-	localtime[strlen(localtime)-6] = 0;
-	if(debug != 0)
-	  printf("%s %s", temp, buf);
+	else
+	  done += ret;
+     }
+   log_batch_len = 0;
+}
+
+/* Makes sure log_fd refers to the current log file. Returns 0 if it
+ * couldn't be opened.  */
+static int open_log_file(void)
+{
+   char path[MAX_FDP_LEN+1];
+   
+   if(debug != 0)
+     {
+	log_fd = STDOUT_FILENO;
+	return 1;
+     }
+   
+   if(strlen(logfile) > 1)
+     strncpy(path, logfile, MAX_FDP_LEN);
+   else									/* If no preset logfile. */
+     snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, LOG_FILE);
+   path[MAX_FDP_LEN] = '\0';
+   
+   if((log_fd != -1) && (log_reopen == 0) && (strcmp(path, log_path) == 0))
+     return 1;
+   
+   log_reopen = 0;
+   if(log_fd != -1)
+     close(log_fd);
+   strcpy(log_path, path);
+   
+   while(((log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) < 0) 
+	 && (errno == EINTR))
+     {
+     }
+   
+   return (log_fd < 0) ? 0 : 1;
+}
+
+/* Adds one message to the batch, or sends it to syslog.  */
+static void write_log_rec(int verb, int flags, time_t stamp, char *text)
+{
+   static time_t stamp_time = -1;
+   static char stamp_buf[32];
+   struct tm tm;
+   int len;
+   int priority;
+   
 #ifdef HAVE_SYSLOG_H
-	else if((syslog_enable != 0) || (syslog_switch != 0))
+   if((debug == 0) && ((syslog_enable != 0) || (syslog_switch != 0)))
+     {
+	if(verb > 1)
+	  priority = LOG_DEBUG;
+	else if((flags & LOG_ERRNO) != 0)
+	  priority = LOG_ERR;
+	else if (strncmp(text, "Error - ", 8))
+	  priority = LOG_ERR;
+	else
+	  priority = LOG_WARNING;
+	syslog(priority, "%s", text);
+	return;
+     }
+#endif
+   
+   len = strlen(text);
+   if(log_batch_len + len + sizeof(stamp_buf) + 2 > LOG_BATCH_SIZE)
+     flush_log_batch();
+   
+   if((flags & LOG_STAMP) != 0)
+     {
+	/* Same format as ctime(), without the weekday and year.  */
+	if(stamp != stamp_time)
 	  {
-	     if(verb > 1)
-		priority = LOG_DEBUG;
-	     else if (strncmp(buf, "Error - ", 8))
-		priority = LOG_ERR;
-	     else
-		priority = LOG_WARNING;
-	     syslog(priority, "%s", buf);
+	     stamp_time = stamp;
+	     localtime_r(&stamp, &tm);
+	     strftime(stamp_buf, sizeof(stamp_buf), "%b %e %H:%M:%S ", &tm);
 	  }
-#endif
-	else
-	  fprintf(fp, "%s %s", temp, buf);
+	strcpy(log_batch + log_batch_len, stamp_buf);
+	log_batch_len += strlen(stamp_buf);
+     }
+   
+   memcpy(log_batch + log_batch_len, text, len);
+   log_batch_len += len;
+   if((flags & LOG_ERRNO) != 0)
+     log_batch[log_batch_len++] = '\n';
+}
+
+/* Writes out the messages that are ready in the ring.  */
+static void drain_log(void)
+{
+   struct log_rec *rec;
+   unsigned long tail;
+   unsigned long dropped;
+   unsigned int len;
+   char line[64];
+   
+   if(((syslog_enable == 0) && (syslog_switch == 0)) || (debug != 0))
+     open_log_file();
+   
+   tail = log_tail;
+   while(tail != log_head)
+     {
+	rec = (struct log_rec *)(log_ring + (tail & (LOG_RING_SIZE - 1)));
+	if(rec->ready == 0)
+	  break;
+	__sync_synchronize();
+	
+	len = rec->len;
+	if((rec->flags & LOG_PAD) == 0)
+	  write_log_rec(rec->verb, rec->flags, rec->stamp, (char *)(rec + 1));
+	
+	/* Cleared, so that a new record here isn't taken as ready.  */
+	memset(rec, 0, len);
+	__sync_synchronize();
+	tail += len;
+	log_tail = tail;
+     }
+   
+   if((dropped = __sync_lock_test_and_set(&log_dropped, 0)) != 0)
+     {
+	snprintf(line, sizeof(line), "Dropped %lu log messages\n", dropped);
+	write_log_rec(1, LOG_STAMP, time(NULL), line);
+     }
+   
+   flush_log_batch();
+}
+
+#ifdef LOG_WRITER_THREAD
+static void *log_writer_loop(void *arg)
+{
+   struct timespec ts;
+   int stop;
+   
+   do
+     {
+	stop = log_stop;
+	pthread_mutex_lock(&log_mutex);
+	drain_log();
+	pthread_mutex_unlock(&log_mutex);
 	
-	if((syslog_enable == 0) && (syslog_switch == 0))
+	ts.tv_sec = 0;
+	ts.tv_nsec = LOG_FLUSH_TIME * 1000000;
+	if(stop == 0)
+	  nanosleep(&ts, NULL);
+     } while(stop == 0);
+   
+   return NULL;
+}
+
+/* Flushes the ring and stops the writer when the process exits.  */
+static void stop_log_writer(void)
+{
+   if(log_writer != 1)
+     return;
+   
+   log_stop = 1;
+   pthread_join(log_thread, NULL);
+   log_writer = 0;
+   log_stop = 0;
+}
+
+/* The writer mustn't be in the middle of a batch when we fork.  */
+static void log_fork_prepare(void)
+{
+   if(log_writer == 1)
+     pthread_mutex_lock(&log_mutex);
+}
+
+static void log_fork_parent(void)
+{
+   if(log_writer == 1)
+     pthread_mutex_unlock(&log_mutex);
+}
+
+/* The child has no writer thread, it's started again on the first message.
+ * Messages still in the ring are written by the parent.  */
+static void log_fork_child(void)
+{
+   if(log_writer == 1)
+     pthread_mutex_init(&log_mutex, NULL);
+   log_writer = 0;
+   
+   if(log_tail != log_head)
+     memset(log_ring, 0, LOG_RING_SIZE);
+   log_head = log_tail = 0;
+   log_dropped = 0;
+}
+
+static void start_log_writer(void)
+{
+   static int registered = 0;
+   sigset_t all;
+   sigset_t old;
+   
+   /* Signals are handled by the main thread, and a handler mustn't start
+    * a second writer.  */
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+   
+   if(log_writer == 0)
+     {
+	if(registered == 0)
 	  {
-	     set_lock(fd, F_UNLCK);
-	     while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-	       {
-	       }
+	     registered = 1;
+	     pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+	     atexit(stop_log_writer);
 	  }
+	
+	if(pthread_create(&log_thread, NULL, log_writer_loop, NULL) == 0)
+	  log_writer = 1;
+	else
+	  log_writer = -1;
+     }
+   
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+#endif
+
+/* Puts a message in the ring. Without a writer thread, it's written out
+ * right away.  */
+static void queue_log(int verb, int flags, char *text, int len)
+{
+   struct log_rec *rec;
+   
+   if((rec = reserve_log_rec(sizeof(struct log_rec) + len + 1)) != NULL)
+     {
+	rec->verb = verb;
+	rec->flags = flags;
+	rec->stamp = time(NULL);
+	memcpy((char *)(rec + 1), text, len);
+	((char *)(rec + 1))[len] = '\0';
+	__sync_synchronize();
+	rec->ready = 1;
+     }
+   
+#ifdef LOG_WRITER_THREAD
+   if(log_writer == 0)
+     start_log_writer();
+   if(log_writer == 1)
+     return;
+#endif
+   
+   if(log_draining == 0)
+     {
+	log_draining = 1;
+	drain_log();
+	log_draining = 0;
      }
 }
 
+/* Makes the writer reopen the log file. Called from the SIGHUP handler.  */
+void reopen_log(void)
+{
+   log_reopen = 1;
+}
+
+/* Print to log file */
+void (logprintf)(int verb, const char *format, ...)
+{
+   char buf[4096];
+   va_list args;
+   int len;
+   
+   if((verb > verbosity) || (format == NULL))
+     return;
+   
+   va_start(args, format);
+   len = vsnprintf(buf, sizeof(buf), format, args);
+   va_end(args);
+   
+   if(len < 0)
+     return;
+   if(len >= sizeof(buf))
+     len = sizeof(buf) - 1;
+   
+   queue_log(verb, LOG_STAMP, buf, len);
+}
+
+/* Prints a received command to the log file, unless it's too large */
+void (logbuf)(int verb, char *buf)
+{
+   if(strnlen(buf, 3500) < 3500)
+     logprintf(verb, "%s\n", buf);
+   else
+     logprintf(verb, "too large buf\n");
+}
+
 /* Write the motd. Creates the motd file if it doesn't exist. Overwrites
    current motd if overwrite is set to 1. Returns 1 on created file and
    0 if it already exists. */
@@ -2274,66 +3510,15 @@ int welcome_mess(struct user_t *user)
 }
 
 /* Prints the error to the log file */
-void logerror(int verb, int error)
+void (logerror)(int verb, int error)
 {
-   char path[MAX_FDP_LEN+1];
-   FILE *fp=NULL;
-   int fd=0;
-   int erret;
-   int priority;
+   char *text;
    
    if(verb > verbosity)
      return;
    
-   if((syslog_enable == 0) && (syslog_switch == 0))
-     {
-	snprintf(path, MAX_FDP_LEN, "%s/%s", config_dir, LOG_FILE);
-   	
-	while(((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) && (errno == EINTR))
-	  {
-	  }	     
-	
-	if(fd < 0)
-	  return;
-   
-	/* Set the lock */
-	if(set_lock(fd, F_WRLCK) == 0)
-	  {
-	     close(fd);
-	     return;
-	  }
-   
-	if((fp = fdopen(fd, "a")) == NULL)
-	  {
-	     set_lock(fd, F_UNLCK);
-	     close(fd);
-	     return;
-	  }
-     }
-   
-   if(debug != 0)
-     printf("%s\n", strerror(error));
-#ifdef HAVE_SYSLOG_H
-   else if((syslog_enable != 0) || (syslog_switch != 0))
-     {
-	if(verb > 1)
-	   priority = LOG_DEBUG;
-	else
-	   priority = LOG_ERR;
-	syslog(priority, "%s", strerror(error));
-     }
-#endif
-   else
-     fprintf(fp, "%s\n", strerror(error));
-   
-   if((syslog_enable == 0) && (syslog_switch == 0))
-     {
-	set_lock(fd, F_UNLCK);
-	
-	while(((erret = fclose(fp)) != 0) && (errno == EINTR))
-	  {
-	  }		
-     }
+   text = strerror(error);
+   queue_log(verb, LOG_ERRNO, text, strlen(text));
 }   
 
 /* Adds line to end of a file */
@@ -2566,6 +3751,7 @@ int remove_exp_from_file(time_t now_time, char *file)
    char fileline[1024];
    char fileword[201];
    time_t exp_time;
+   int removed = 0;
    
    if((newfile = malloc(strlen(file) + 2)) == NULL)
      {
@@ -2662,6 +3848,8 @@ int remove_exp_from_file(time_t now_time, char *file)
 	
 	if((exp_time == 0) || (exp_time > now_time))
 	  fprintf(newfp, "%s", fileline);
+	else
+	  removed++;
      }   
    set_lock(newfd, F_UNLCK);
    set_lock(fd, F_UNLCK);
@@ -2688,7 +3876,12 @@ int remove_exp_from_file(time_t now_time, char *file)
 	return -1;
      }
    
-   rename(newfile, file);
+   /* Leave the file alone if nothing expired, so that it isn't taken for
+    * a changed list.  */
+   if(removed > 0)
+     rename(newfile, file);
+   else
+     unlink(newfile);
    free(newfile);
    return 0;
 }
@@ -2808,6 +4001,7 @@ int add_perm(char *buf, struct user_t *user)
 	
 	ret = add_line_to_file(line, path);    
 	
+	update_reg_perms(nick, (ret == 1) ? old_perm : 0);
 	targ_user->permissions = old_perm;
 	
 	return ret;
@@ -2881,6 +4075,7 @@ int remove_perm(char *buf, struct user_t *user)
 	     ret = add_line_to_file(line, path);
 	  }
 	
+	update_reg_perms(nick, ((old_perm > 0) && (ret == 1)) ? old_perm : 0);
 	targ_user->permissions = old_perm;
 	
 	return ret;
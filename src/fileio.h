@@ -24,6 +24,13 @@ int check_if_allowed(struct user_t *user);
 int check_if_registered(char *user_nick);
 int check_pass(char *buf, struct user_t *user);
 int get_permissions(char *user_nick);
+void update_reg_user(char *nick, char *line);
+void update_reg_perms(char *nick, int perms);
+int init_reg_list(void);
+void remove_reg_list(void);
+int init_watch(void);
+void reload_list(char *buf);
+void watch_action(void);
 int write_config_file(void);
 int set_lock(int fd, int type);
 void create_banlist(void);
@@ -42,6 +49,8 @@ int send_motd(struct user_t *user);
 int write_motd(char *buf, int overwrite);
 int welcome_mess(struct user_t *user);
 void logerror(int verb, int error);
+void logbuf(int verb, char *buf);
+void reopen_log(void);
 int add_line_to_file(char *line, char *file);
 int remove_line_from_file(char *line, char *file, int port);
 int my_scandir(char *dirname, char *namelist[]);
@@ -49,3 +58,18 @@ int remove_exp_from_file(time_t now_time, char *file);
 int add_perm(char *buf, struct user_t *user);
 int remove_perm(char *buf, struct user_t *user);
 int check_if_on_linklist(char *ip, int port);
+
+/* The logging functions are wrapped so that the verbosity is checked
+ * before any arguments are evaluated. Messages above MAX_VERBOSITY, which
+ * is set with "configure --enable-max_verbosity=N", are left out of the
+ * build.  */
+#ifndef MAX_VERBOSITY
+# define MAX_VERBOSITY      5
+#endif
+#define LOG_ENABLED(verb)  (((verb) <= MAX_VERBOSITY) && ((verb) <= verbosity))
+#define logprintf(verb, ...) \
+   do { if(LOG_ENABLED(verb)) logprintf(verb, __VA_ARGS__); } while(0)
+#define logerror(verb, error) \
+   do { if(LOG_ENABLED(verb)) logerror(verb, error); } while(0)
+#define logbuf(verb, buf) \
+   do { if(LOG_ENABLED(verb)) logbuf(verb, buf); } while(0)
@@ -30,6 +30,7 @@
 # include <malloc.h>
 #endif
 #include <string.h>
+#include <ctype.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -87,10 +88,21 @@
  **/
 #include "FBHandler.h"
 
+/* Set at startup if accept_workers is used. The processes that accept users
+ * then bind the port with SO_REUSEPORT instead of passing it around.  */
+static int reuse_port = 0;
+static int draining_listener = 0;       /* 1 while the connections queued on
+					 * full listening sockets are taken */
+
+/* Runs periodic_jobs() every ALARM_TIME seconds.  */
+static struct timeout_t periodic_timer;
+
 /* Set default variables, used if config does not exist or is bad */
 int set_default_vars(void)
 {
    users_per_fork = 1000;
+   send_threads = 0;
+   accept_workers = 0;
    min_share = 0;
    max_users = 1000;
    hublist_upload = 1;
@@ -180,13 +192,17 @@ void new_forked_process(void)
 {
    struct user_t *user;
    struct sockaddr_un remote_addr;
+#ifdef SO_PEERCRED
+   struct ucred cred;
+   socklen_t cred_len;
+#endif
    int len, flags;
    
    memset(&remote_addr, 0, sizeof(struct sockaddr_un));
    /* Allocate space for the new user */
-   if((user = malloc(sizeof(struct user_t))) == NULL)
+   if((user = pool_alloc(POOL_USER)) == NULL)
      {	
-	logprintf(1, "Error - In new_forked_process()/malloc(): ");
+	logprintf(1, "Error - In new_forked_process()/pool_alloc(): ");
 	logerror(1, errno);
 	quit = 1;
 	return;
@@ -203,7 +219,7 @@ void new_forked_process(void)
      {	
 	logprintf(1, "Error - In new_forked_process()/accept(): ");
 	logerror(1, errno);
-	free(user);
+	pool_free(POOL_USER, user);
 	return;
      }
    
@@ -212,7 +228,7 @@ void new_forked_process(void)
 	logprintf(1, "Error - In new_forked_process()/in fcntl(): ");
 	logerror(1, errno);
 	close(user->sock);
-	free(user);
+	pool_free(POOL_USER, user);
 	return;
      } 
    
@@ -222,7 +238,7 @@ void new_forked_process(void)
 	logprintf(1, "Error - In new_forked_process()/in fcntl(): ");
 	logerror(1, errno);
 	close(user->sock);
-	free(user);
+	pool_free(POOL_USER, user);
 	return;
      }
    
@@ -230,8 +246,30 @@ void new_forked_process(void)
    user->type = FORKED;
    user->rem = 0;
    user->buf = NULL;
-   user->outbuf = NULL;
+   user->buf_len = 0;
+   user->buf_size = 0;
+   user->out_head = NULL;
+   user->out_tail = NULL;
+   user->out_len = 0;
+   user->out_full = 0;
+   user->out_pending = 0;
+   user->channel = NULL;
+   user->sock_index = -1;
+   user->counted = 0;
+   init_user_timers(user);
    sprintf(user->hostname, "forked_process");   
+   
+   /* The pid of the process is what its users have in the user list, so
+    * messages to them can be sent to this process only.  */
+   user->proc_pid = 0;
+#ifdef SO_PEERCRED
+   cred_len = sizeof(struct ucred);
+   if(getsockopt(user->sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0)
+     user->proc_pid = (int)cred.pid;
+#endif
+   
+   /* With SO_REUSEPORT, a new process accepts users until it's full.  */
+   user->accepting = (BYTE)reuse_port;
    memset(user->nick, 0, MAX_NICK_LEN+1);
    
    /* Add the user at the first place in the list.  */
@@ -249,9 +287,14 @@ void fork_process(void)
    int erret;
    struct sockaddr_un remote_addr;
    struct user_t *user;
+   struct channel_t *chan;
    int flags;
 
    memset(&remote_addr, 0, sizeof(struct sockaddr_un));
+   
+   /* The channel has to be there before the fork, so both get it.  */
+   chan = new_channel();
+   
    if((pid = fork()) == -1)
      {
 	logprintf(1, "Fork failed, exiting process\n");
@@ -267,6 +310,8 @@ void fork_process(void)
 	remove_all(UNKEYED | NON_LOGGED | REGULAR | REGISTERED | OP 
 		   | OP_ADMIN, 1, 1);
 	logprintf(5, "Forked new process, childs pid is %d and parents pid is %d\n", pid, getpid());
+	if(chan != NULL)
+	  set_channel_pid(chan, pid);
 	/* And set current pid of process */
 	pid = getpid();
      }
@@ -274,6 +319,11 @@ void fork_process(void)
    /* And if we are the child */
    else
      {
+	/* Don't touch the parents event loop, or the channels of the other
+	 * processes.  */
+	close_event_loop();
+	drop_channels(chan);
+	
 	/* Close the listening sockets */
 	while(((erret =  close(listening_unx_socket)) != 0) && (errno == EINTR))
 	  logprintf(1, "Error - In fork_process()/close(): Interrupted system call. Trying again.\n");	
@@ -293,8 +343,12 @@ void fork_process(void)
 	     logerror(1, errno);
 	  }
 	
-	/* Set the alarm */
-	alarm(ALARM_TIME);
+	/* Only the parent watches the files.  */
+	if(watch_fd != -1)
+	  {	     
+	     close(watch_fd);
+	     watch_fd = -1;
+	  }
 	
 	/* And remove all connections to forked process. We only want 
 	 * connections between parent and child, not between children. Also
@@ -302,18 +356,21 @@ void fork_process(void)
 	 * those.*/
 	remove_all(SCRIPT | LINKED | FORKED, 0, 0);
 	
+	/* Only the parent forks.  */
+	do_fork = 0;
+	
 	/* If some other process already has opened the socket, we'll exit.  */
-	if(set_listening_pid((int)getpid()) <= 0)
+	if((reuse_port == 0) && (set_listening_pid((int)getpid()) <= 0))
 	  exit(EXIT_SUCCESS);
 	
 	/* Open the human listening sockets.  */
-	if((listening_socket = get_listening_socket(listening_port, 0)) == -1)
+	if((listening_socket = get_listening_socket(listening_port, 0, reuse_port)) == -1)
 	  {
 	     logprintf(1, "Error - In fork_process(): Couldn't open listening socket\n");
 	     quit = 1;
 	  }
 	
-	if((admin_listening_socket = get_listening_socket(admin_port, admin_localhost)) == -1)
+	if((admin_listening_socket = get_listening_socket(admin_port, admin_localhost, reuse_port)) == -1)
 	  {
 	     logprintf(1, "Admin listening socket disabled\n");
 	  }	
@@ -338,9 +395,9 @@ void fork_process(void)
 	     return;
 	  }
 	
-	if((user = malloc(sizeof(struct user_t))) == NULL)
+	if((user = pool_alloc(POOL_USER)) == NULL)
 	  {	     
-	     logprintf(1, "Error - In fork_process()/malloc(): ");
+	     logprintf(1, "Error - In fork_process()/pool_alloc(): ");
 	     logerror(1, errno);
 	     quit = 1;
 	     return;
@@ -350,7 +407,19 @@ void fork_process(void)
 	user->type = FORKED;
 	user->rem = 0;
 	user->buf = NULL;
-	user->outbuf = NULL;
+	user->buf_len = 0;
+	user->buf_size = 0;
+	user->out_head = NULL;
+	user->out_tail = NULL;
+	user->out_len = 0;
+	user->out_full = 0;
+	user->out_pending = 0;
+	user->channel = NULL;
+	user->sock_index = -1;
+	user->counted = 0;
+	init_user_timers(user);
+	user->proc_pid = (int)getppid();
+	user->accepting = 0;
 	memset(user->nick, 0, MAX_NICK_LEN+1);
 	sprintf(user->hostname, "parent_process");
 
@@ -359,7 +428,7 @@ void fork_process(void)
 	     logprintf(1, "Error - In fork_process()/in fcntl(): ");
 	     logerror(1, errno);
 	     close(user->sock);
-	     free(user);
+	     pool_free(POOL_USER, user);
 	     return;
 	  }
 	
@@ -369,11 +438,15 @@ void fork_process(void)
 	     logprintf(1, "Error - In fork_process()/in fcntl(): ");
 	     logerror(1, errno);
 	     close(user->sock);
-	     free(user);
+	     pool_free(POOL_USER, user);
 	     return;
 	  }
 	
 	
+	/* From now on, the parent gets everything through the channel.  */
+	if(chan != NULL)
+	  open_channel(chan, user);
+	
 	/* Add the user at the first place in the list */
 	add_non_human_to_list(user);
      }
@@ -396,6 +469,14 @@ void switch_listening_process(char *buf, struct user_t *user)
    /* If a process has closed the listening sockets.  */
    if((pid > 0) && (strncmp(buf, "$ClosedListen", 13) == 0))
      {
+	/* With SO_REUSEPORT, a new process takes the place of the full one.  */
+	if(reuse_port != 0)
+	  {
+	     user->accepting = 0;
+	     do_fork++;
+	     return;
+	  }
+	
 	if(nbr_of_forked == 1)
 	  {
 	     do_fork = 1;
@@ -415,18 +496,19 @@ void switch_listening_process(char *buf, struct user_t *user)
 				   | REGISTERED | OP | OP_ADMIN | ADMIN 
 				   | NON_LOGGED_ADM);
 	
-	if((nbr_of_users < users_per_fork) 
-	   && (nbr_of_users < (max_sockets-5)))
+	if((nbr_of_users < users_per_fork) && (nbr_of_users < (max_sockets-5)))
 	  {
 	     if(listening_socket == -1)
 	       {
 		  if(set_listening_pid((int)getpid()) > 0)
 		    {
 		       /* Open the listening sockets.  */
-		       if((listening_socket = get_listening_socket(listening_port, 0)) == -1)
+		       if((listening_socket = get_listening_socket(listening_port, 0, 0)) == -1)
 			 logprintf(1, "Error - In switch_listening_process(): Couldn't open listening socket\n");
 		       
-		       admin_listening_socket = get_listening_socket(admin_port, admin_localhost);
+		       admin_listening_socket = get_listening_socket(admin_port, admin_localhost, 0);
+		       add_event_listener(&listening_socket);
+		       add_event_listener(&admin_listening_socket);
 		    }	
 	       }
 	  }
@@ -483,6 +565,8 @@ void do_upload_to_hublist(void)
    else
      {
 	pid = -2;
+	close_event_loop();
+	drop_channels(NULL);
 	remove_all(0xFFFF, 0, 0);
 	
 	while(((erret =  close(listening_unx_socket)) != 0) && (errno == EINTR))
@@ -503,6 +587,12 @@ void do_upload_to_hublist(void)
 	     logerror(1, errno);
 	  }
 	
+	if(watch_fd != -1)
+	  {	     
+	     close(watch_fd);
+	     watch_fd = -1;
+	  }
+	
 	upload_to_hublist(nbrusers);
      }
    upload = 0;
@@ -512,12 +602,10 @@ void do_upload_to_hublist(void)
 /* Removes all users of specified type.  */
 void remove_all(int type, int send_quit, int remove_from_list)
 {
-   struct sock_t *human_user;
    struct user_t *non_human;
-   struct sock_t *next_human;
    struct user_t *next_non_human;
+   int i;
    
-   human_user = human_sock_list;
    non_human = non_human_user_list;
    
    /* First non-humans.  */
@@ -530,14 +618,12 @@ void remove_all(int type, int send_quit, int remove_from_list)
 	
 	non_human = next_non_human;
      }   
-   while(human_user != NULL)
+   
+   /* Backwards, since the last user takes the place of a removed one.  */
+   for(i = human_sock_count - 1; i >= 0; i--)
      {
-	next_human = human_user->next;
-
-	if((human_user->user->type & type) != 0)
-	  remove_user(human_user->user, send_quit, remove_from_list);
-	
-	human_user = next_human;
+	if((i < human_sock_count) && ((human_socks[i].type & type) != 0))
+	  remove_user(human_socks[i].user, send_quit, remove_from_list);
      }
 }
 
@@ -546,15 +632,67 @@ void term_signal(int z)
    quit = 1;
 }
 
-/* This will execute every ALARM_TIME seconds, it checks timeouts and uploads 
- * to public hublist */
-void alarm_signal(int z)
+/* Reopens the log file, for use after it has been rotated.  */
+void hup_signal(int z)
 {
-   struct user_t *non_human;
-   struct sock_t *human_user;
+   reopen_log();
+}
+
+/* Removes a user that hasn't logged in within LOGIN_TIMEOUT seconds.  */
+void login_timeout(void *arg)
+{
+   struct user_t *user = arg;
+   
+   if((user->type & (UNKEYED | NON_LOGGED | NON_LOGGED_ADM)) != 0)
+     {
+	logprintf(2, "Timeout for non logged in user at %s, removing user\n", user->hostname);
+	set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+     }
+}
+
+/* Removes a linked hub that hasn't been heard from in ALARM_TIME seconds. */
+void linked_hub_timeout(void *arg)
+{
+   struct user_t *user = arg;
+   
+   if(user->timeout == 0)
+     {
+	logprintf(2, "Linked hub at %s, port %d is offline\n", user->hostname, user->key);
+	set_user_rem(user, REMOVE_USER);
+	return;
+     }
+   
+   user->timeout = 0;
+   add_timer(&user->timers[TIMER_KEEPALIVE], ALARM_TIME, linked_hub_timeout, user);
+}
+
+/* Sends an empty command to a logged in user that has nothing else queued
+ * every KEEPALIVE_TIME seconds, so a connection that has gone dead gives a
+ * write error and the user is removed.  */
+void keepalive_timeout(void *arg)
+{
+   struct user_t *user = arg;
    
+   if(((user->type & (REGULAR | REGISTERED | OP | OP_ADMIN)) != 0)
+      && (user->out_head == NULL))
+     send_to_user("|", user);
+   
+   add_timer(&user->timers[TIMER_KEEPALIVE], KEEPALIVE_TIME, keepalive_timeout, user);
+}
+
+/* Lets the user search again, searchspam_time seconds after the last 
+ * search.  */
+void search_wait_timeout(void *arg)
+{
+   ((struct user_t *)arg)->search_wait = 0;
+}
+
+/* This will execute every ALARM_TIME seconds, it uploads to public hublist 
+ * and writes the config among other things.  */
+static void periodic_jobs(void *arg)
+{
    if((debug != 0) && (pid > 0))
-     logprintf(2, "Got alarm signal\n");
+     logprintf(2, "Running periodic jobs\n");
    
    /* Send the hub_timer sub to the scripts.  */
 #ifdef HAVE_PERL
@@ -562,39 +700,6 @@ void alarm_signal(int z)
      command_to_scripts("$Script hub_timer|");
 #endif
    
-   /* Check timeouts */
-   non_human = non_human_user_list;
-   while(non_human != NULL)
-     {
-	if((non_human->timeout == 0) && (non_human->type == LINKED))
-	  {
-	     logprintf(2, "Linked hub at %s, port %d is offline\n", non_human->hostname, non_human->key);
-	     non_human->rem = REMOVE_USER;	 	     
-	  }
-	non_human = non_human->next;
-     }
-   
-   human_user = human_sock_list;
-   while(human_user != NULL)
-     {	
-	if((human_user->user->type & 
-	    (UNKEYED | NON_LOGGED | NON_LOGGED_ADM)) != 0)
-	  {
-	     logprintf(2, "Timeout for non logged in user at %s, removing user\n", human_user->user->hostname);
-	     human_user->user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
-	  }
-	human_user = human_user->next;
-     }
-   
-   /* And reset all timeout values */
-   non_human = non_human_user_list;
-   while(non_human != NULL)
-     {
-	if(non_human->type == LINKED)
-	  non_human->timeout = 0;
-	non_human = non_human->next;
-     }
-   
    /* And make clear for upload to public hub list */
    if(pid > 0)
      {
@@ -613,7 +718,7 @@ void alarm_signal(int z)
 
    remove_expired();
 
-   alarm(ALARM_TIME);
+   add_timer(&periodic_timer, ALARM_TIME, periodic_jobs, NULL);
 }
 
 void init_sig(void)
@@ -643,10 +748,10 @@ void init_sig(void)
    sigaction(SIGTERM, &sv, NULL);
    sigaction(SIGINT, &sv, NULL);
    
-   sv.sa_handler = alarm_signal;
+   sv.sa_handler = hup_signal;
    
-   /* And set handler for the alarm call.  */
-   sigaction(SIGALRM, &sv, NULL);   
+   /* Let the log file be rotated.  */
+   sigaction(SIGHUP, &sv, NULL);
 }
 
 /* Send info about one user to another. If all is 1, send to all */
@@ -739,7 +844,7 @@ void send_user_info(struct user_t *from_user, char *to_user_nick, int all)
    else if((to_user = get_human_user(to_user_nick)) != NULL)
      send_to_user(send_buf, to_user);
    else
-     send_to_non_humans(send_buf, FORKED, NULL);
+     send_to_owner(send_buf, to_user_nick, NULL);
    free(send_buf);
 }
 
@@ -881,774 +986,865 @@ void hub_mess(struct user_t *user, int mess_type)
    free(send_string);
 }
 
-/* This function handles every command in the received packet one by one */
-/* Returns 0 if user should be removed */
-int handle_command(char *buf, struct user_t *user)
+/* The handlers for the commands in command_list. Each one gets the command,
+ * which ends with the '|' and is followed by a null character, and the user
+ * who sent it. The type of the user has already been checked against the
+ * types in command_list. They return 0 if the user should be removed.  */
+
+/* The Key command */
+static int cmd_key(char *buf, struct user_t *user)
+{
+   if(validate_key(buf, user) == 0)
+     {
+	logprintf(1, "User at %s provided bad $Key, removing user\n", user->hostname);
+	return 0;
+     }
+   return 1;
+}
+
+/* The ValidateNick command. Only for non logged in users. If client wants
+ * to change nick, it first has to disconnect. Also allowed for scripts to
+ * register their nick in the nicklist.  */
+static int cmd_validate_nick(char *buf, struct user_t *user)
+{
+   if((user->type == SCRIPT) && (pid <= 0))
+     return 1;
+   
+   /**
+    * SSP: Replace validate_nick function with $FBLogin request.
+    **/
+   //send_FBLogin_Request(user);
+   
+   return validate_nick(buf, user);
+}
+
+/* The Version command */
+static int cmd_version(char *buf, struct user_t *user)
+{
+   return version(buf, user);
+}
+
+/* The GetNickList command */
+static int cmd_get_nick_list(char *buf, struct user_t *user)
+{
+   send_nick_list(user);
+   return 1;
+}
+
+/* The MyINFO command */
+static int cmd_my_info(char *buf, struct user_t *user)
+{
+   return my_info(buf, user);
+}
+
+/* The GetINFO command */
+static int cmd_get_info(char *buf, struct user_t *user)
+{
+   get_info(buf, user);
+   return 1;
+}
+
+/* The To: From: command */
+static int cmd_to_from(char *buf, struct user_t *user)
+{
+   to_from(buf, user);
+   return 1;
+}
+
+/* The ConnectToMe command */
+static int cmd_connect_to_me(char *buf, struct user_t *user)
+{
+   connect_to_me(buf, user);
+   return 1;
+}
+
+/* The RevConnectToMe command */
+static int cmd_rev_connect_to_me(char *buf, struct user_t *user)
+{
+   rev_connect_to_me(buf, user);
+   return 1;
+}
+
+/* The Search command */
+static int cmd_search(char *buf, struct user_t *user)
+{
+   search(buf, user);
+   return 1;
+}
+
+/* The SR command */
+static int cmd_sr(char *buf, struct user_t *user)
+{
+   sr(buf, user);
+   return 1;
+}
+
+/* The MyPass command */
+static int cmd_my_pass(char *buf, struct user_t *user)
+{
+   return my_pass(buf + 8, user);
+}
+
+/* The kick command */
+static int cmd_kick(char *buf, struct user_t *user)
+{
+   if((user->type & (OP | OP_ADMIN | ADMIN | FORKED | SCRIPT)) != 0)
+     kick(buf, user, 1);
+   else
+     logprintf(2, "%s tried to kick without having priviledges\n", user->nick);
+   return 1;
+}
+
+/* The OpForceMove command */
+static int cmd_op_force_move(char *buf, struct user_t *user)
+{
+   if((user->type & (OP | OP_ADMIN | ADMIN | FORKED)) != 0)
+     op_force_move(buf, user);
+   else
+     logprintf(2, "%s tried to redirect without having priviledges\n", user->nick);
+   return 1;
+}
+
+/* Commands that should be forwarded from forked processes */
+static int cmd_forward(char *buf, struct user_t *user)
+{
+   char *oplist;
+   
+   if(strncmp(buf, "$OpList ", 8) == 0)
+     {
+	/* The oplist ends with two '|', but the command only goes to the
+	 * first one, so it's copied to have room for the second.  */
+	if((oplist = malloc(sizeof(char) * (strlen(buf) + 2))) == NULL)
+	  {
+	     logprintf(1, "Error - In cmd_forward()/malloc(): ");
+	     logerror(1, errno);
+	     quit = 1;
+	     return 1;
+	  }
+	sprintf(oplist, "%s|", buf);
+	relay_to_non_humans(REC_OPLIST, oplist, FORKED, user);
+	send_to_humans(oplist, REGULAR | REGISTERED | OP | OP_ADMIN, user);
+	free(oplist);
+	return 1;
+     }
+   
+   relay_to_non_humans((strncmp(buf, "$Quit ", 6) == 0) ? REC_QUIT : REC_TEXT,
+		       buf, FORKED, user);
+   send_to_humans(buf, REGULAR | REGISTERED | OP | OP_ADMIN, user);
+   return 1;
+}
+
+/* Sets up the channel between the parent and a forked process */
+static int cmd_channel(char *buf, struct user_t *user)
+{
+   channel_handshake(buf, user);
+   return 1;
+}
+
+/* Internal commands for mangement through telnet port and 
+ * communication between processes. $OpenListen is sent to the children, 
+ * $ClosedListen and $RejListen to the parent.  */
+static int cmd_listen(char *buf, struct user_t *user)
+{
+   if((strncmp(buf, "$OpenListen", 11) == 0) ? (pid == 0) : (pid > 0))
+     switch_listening_process(buf, user);
+   return 1;
+}
+
+static int cmd_disc_user(char *buf, struct user_t *user)
+{
+   disc_user(buf, user);
+   return 1;
+}
+
+static int cmd_reload_list(char *buf, struct user_t *user)
+{
+   reload_list(buf);
+   return 1;
+}
+
+static int cmd_force_move(char *buf, struct user_t *user)
+{
+   redirect_all(buf + 11, user);
+   return 1;
+}
+
+static int cmd_quit_program(char *buf, struct user_t *user)
+{
+   if(user->type == ADMIN)
+     uprintf(user, "\r\nShutting down hub...\r\n");
+   quit = 1;
+   return 1;
+}
+
+static int cmd_exit(char *buf, struct user_t *user)
+{
+   logprintf(1, "Got exit from admin at %s, hanging up\n", user->hostname);
+   return 0;
+}
+
+static int cmd_redirect_all(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\nRedirecting all users...\r\n");
+   logprintf(1, "Admin at %s redirected all users\n", user->hostname);
+   redirect_all(buf + 13, user);
+   return 1;
+}
+
+static int cmd_admin_pass(char *buf, struct user_t *user)
+{
+   if(check_admin_pass(buf, user) == 0)
+     {
+	logprintf(2, "User from %s provided bad Admin Pass\n", user->hostname);
+	return 0;
+     }
+   return 1;
+}
+
+static int cmd_set(char *buf, struct user_t *user)
+{
+   set_var(buf, user); 
+   return 1;
+}
+
+static int cmd_ban(char *buf, struct user_t *user)
 {
    int ret;
-   char *temp;
    char tempstr[MAX_HOST_LEN+1]; 
-   char *fbuser	= FBHANDLER_FBUSER;
-  
-   temp = NULL;
-   while(buf != NULL)
-     {
-	/* Check if it's a '$' or a '<' first in the command string */
-	if((strchr(buf, '$') != NULL) && (strchr(buf, '<') == NULL))
-	  temp = strchr(buf, '$');
-	else if((strchr(buf, '$') == NULL) && (strchr(buf, '<') != NULL))
-	  temp = strchr(buf, '<');
-	else if((strchr(buf, '$') == NULL) && (strchr(buf, '<') == NULL))
+   
+   ret = ballow(buf+5, BAN, user);
+   if(user->type == ADMIN)
+     {			    
+	if(ret == -1)
 	  {
-	     /* This is what happends every time a command doesn't fit in one
-	      * single package. */
-	     return 1;
+	     send_to_user("\r\nCouldn't add entry to ban list\r\n", user);
+	     logprintf(4, "Error - Failed adding entry to ban list\n");
+	  }
+	else if(ret == 0)
+	  {
+	     send_to_user("\r\nEntry is already on the list\r\n", user);
 	  }
-	
 	else
-	  (strchr(buf, '$') < strchr(buf, '<'))
-	  ? (temp = strchr(buf, '$'))  /* The '$' is first */
-	    : (temp = strchr(buf, '<')); /* The '<' is first */
-	
-	buf = temp;
-	temp = NULL;
-	/* First check if it's a whole command */
-	if(strchr(buf, '|') != NULL)
 	  {
-	     /* Copy command to temporary buf so we don't get more sent to the
-	      * function than neccessary */
-	     if((temp = malloc(sizeof(char) * (cut_string(buf, '|') + 3))) == NULL)
-	       {
-		  logprintf(1, "Error - In handle_command()/malloc(): ");
-		  logerror(1, errno);
-		  quit = 1;
-		  return -1;
-	       }
-             strncpy(temp, buf, cut_string(buf, '|') + 1);
-	     if(cut_string(buf, '|') > 0)
-	       temp[cut_string(buf, '|')+1] = '\0';
-	     
-	     /* The Key command */
-	     if(strncmp(temp, "$Key ", 5) == 0)
-	       {
-		  if(user->type == UNKEYED)
-		    {
-		       if(validate_key(buf, user) == 0)
-			 {
-			    logprintf(1, "User at %s provided bad $Key, removing user\n", user->hostname);
-			    free(temp);
-			    return 0;
-			 }
-		    }
-	       }
-	     
-	     /* The ValidateNick command */
-	     else if(strncmp(temp, "$ValidateNick ", 14) == 0)
-	       {
-		  /* Only for non logged in users. If client wants to change
-		   * nick, it first has to disconnect.  */
-		  /* Also allowed for scripts to register their nick in the
-		   * nicklist.  */
-		  if((user->type == NON_LOGGED) 
-		     || ((user->type == SCRIPT) && (pid > 0)))
-		    {
-				/**
-				 * SSP: Replace validate_nick function with $FBLogin request.
-				 **/
-				 //send_FBLogin_Request(user);
-			
-		     if(validate_nick(temp, user) == 0)
-			 {
-			    free(temp);
-			    return 0;
-			 }
-		    }
-	       }
-	     
-	     /* The Version command */
-	     else if(strncmp(temp, "$Version ", 9) == 0)
-	       {
-		  if(user->type != ADMIN)
-		    {
-		       if(version(temp, user) == 0)
-			 {
-			    free(temp);
-			    return 0;
-			 }
-		    }		  
-	       }
-	     
-	     /* The GetNickList command */
-	     else if(strncasecmp(temp, "$GetNickList", 12) == 0)
-	       {
-		  send_nick_list(user);
-	       }
-	     
-	     /* The MyINFO command */
-	     else if(strncmp(temp, "$MyINFO $", 9) == 0)
-	       {
-		  if(user->type != ADMIN)
-		    {
-		       if(my_info(temp, user) == 0)
-		       {
-			    free(temp);
-			    return 0;
-			 }
-		    }
-	       }
-	     
-	     /* The GetINFO command */
-	     else if(strncasecmp(temp, "$GetINFO ", 9) == 0)
-	       {
-		  /* Only for logged in users */
-		  if((user->type & (UNKEYED | NON_LOGGED | LINKED)) == 0)
-		    get_info(temp, user);
-	       }
-	     
-	     /* The To: From: command */
-	     else if(strncmp(temp, "$To: ", 5) == 0)
-	       {
-		  /* Only for logged in users */
-		  if((user->type & (UNKEYED | NON_LOGGED | SCRIPT | LINKED)) == 0)
-		    to_from(temp, user);
-	       }
-	     
-	     /* The ConnectToMe command */
-	     else if(strncmp(temp, "$ConnectToMe ", 13) == 0)
-	       {
-		  if((user->type & (REGULAR | REGISTERED | OP | OP_ADMIN 
-				   | FORKED)) != 0)
-		    connect_to_me(temp, user);
-	       }
-	     
-	     /* The RevConnectToMe command */
-	     else if(strncmp(temp, "$RevConnectToMe ", 16) == 0)
-	       {
-		  if((user->type & (REGULAR | REGISTERED | OP | OP_ADMIN 
-				   | FORKED)) != 0)
-		    rev_connect_to_me(temp, user);
-	       }
-	     
-	     /* The Search command */
-	     else if(strncmp(temp, "$Search ", 8) == 0)
-	       {
-		  if((user->type & (REGULAR | REGISTERED | OP | OP_ADMIN 
-				   | FORKED | SCRIPT)) != 0)
-		    search(temp, user);
-	       }
-	     
-	     /* The SR command */
-	     else if(strncmp(temp, "$SR ", 4) == 0)
-	       {
-		  if((user->type & (REGULAR | REGISTERED | OP | OP_ADMIN 
-				   | FORKED)) != 0)
-		    sr(temp, user);
-	       }
-	     
-	     /* The MyPass command */
-	     else if(strncmp(temp, "$MyPass ", 8) == 0)
-	       {
-		  if(user->type == NON_LOGGED)
-		    {
-		       if(my_pass(temp + 8, user) == 0)
-			 {
-			    free(temp);
-			    return 0;
-			 }
-		    }
-	       }
-	     
-	     /* The kick command */
-	     else if(strncasecmp(temp, "$Kick ", 6) == 0)
-	       {
-		  if((user->type & (OP | OP_ADMIN | ADMIN | FORKED | SCRIPT)) != 0)
-		    {
-		       kick(temp, user, 1);
-		    }
-		  else
-		    logprintf(2, "%s tried to kick without having priviledges\n", user->nick);
-	       }
-	     
-	     /* The OpForceMove command */
-	     else if(strncmp(temp, "$OpForceMove ", 13) == 0)
-	       {
-		  if((user->type & (OP | OP_ADMIN | ADMIN | FORKED)) != 0)
-		    {
-		       op_force_move(temp, user);
-		    }
-		  else
-		    logprintf(2, "%s tried to redirect without having priviledges\n", user->nick);
-	       }
-	     
-	     /* The chat command, starts with <nick> */
-	     else if(*temp == '<')
-	       {
-		  if((user->type & (SCRIPT | UNKEYED | LINKED | NON_LOGGED)) == 0)
-		    chat(temp, user);
-	       }
-	     
-	     /* Commands that should be forwarded from forked processes */
-	     else if((strncmp(temp, "$Hello ", 7) == 0)
-		     || (strncmp(temp, "$Quit ", 6) == 0)
-		     || (strncmp(temp, "$OpList ", 8) == 0))
-	       {
-		  if(user->type == FORKED)
-		    {
-		       if(strncmp(temp, "$OpList ", 8) == 0)
-			 /* The oplist ends with two '|' */
-			 strcat(temp, "|");
-		       send_to_non_humans(temp, FORKED, user);
-		       send_to_humans(temp, REGULAR | REGISTERED | OP 
-				      | OP_ADMIN, user);       
-		    }
-	       }
-	     
-	     /* Internal commands for mangement through telnet port and 
-	      * communication between processes */
-	     else if((strncmp(temp, "$ClosedListen", 13) == 0)
-		     && (user->type == FORKED) && (pid > 0))
-	       {
-		  switch_listening_process(temp, user);
-	       }	     
-	     
-	     else if((strncmp(temp, "$OpenListen", 11) == 0)
-		     && (user->type == FORKED) && (pid == 0))
-	       {
-		  switch_listening_process(temp, user);		 
-	       }
-	     
-	     else if((strncmp(temp, "$RejListen", 10) == 0)
-		     && (user->type == FORKED) && (pid > 0))
-	       {
-		  switch_listening_process(temp, user);
-	       }
-	     
-	     else if((strncmp(temp, "$DiscUser", 9) == 0)
-		     && (user->type == FORKED))
-	       {
-		  disc_user(temp, user);
-	       }	     	     	    	     
-	     	     	     
-	     else if((strncasecmp(temp, "$ForceMove ", 11) == 0)
-		     && (user->type == FORKED))
-	       {		  
-		  redirect_all(temp + 11, user);
-	       }	     
-	     
-	     else if((strncasecmp(temp, "$QuitProgram", 12) == 0) 
-		     && ((user->type == FORKED) || (user->type == ADMIN) 
-			 || (user->type == SCRIPT)))
-	       {
-		  if(user->type == ADMIN)
-		    uprintf(user, "\r\nShutting down hub...\r\n");
-		  quit = 1;
-	       }
-	     
-	     else if(strncasecmp(temp, "$Exit", 5) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       logprintf(1, "Got exit from admin at %s, hanging up\n", user->hostname);
-		       free(temp);
-		       return 0;
-		    }
-	       }
-	     
-	     else if((strncasecmp(temp, "$RedirectAll ", 13) == 0) && (user->type == ADMIN))
-	       {
-		  uprintf(user, "\r\nRedirecting all users...\r\n");
-		  logprintf(1, "Admin at %s redirected all users\n", user->hostname);
-		  redirect_all(temp+13, user);
-	       }
-	     
-	     else if((strncasecmp(temp, "$AdminPass", 10) == 0) && (user->type == NON_LOGGED_ADM))
-	       {
-		  if(check_admin_pass(temp, user) == 0)
-		    {
-		       logprintf(2, "User from %s provided bad Admin Pass\n", user->hostname);
-		       free(temp);
-		       return 0;
-		    }
-	       }
-	     
-	     else if(strncasecmp(temp, "$Set ", 5) == 0)
-	       {
-		  if((user->type & (FORKED | SCRIPT | ADMIN)) != 0)
-		    set_var(temp, user); 
-	       }
-	     
-	     else if(strncasecmp(temp, "$Ban ", 5) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = ballow(temp+5, BAN, user);
-		       if(user->type == ADMIN)
-			 {			    
-			    if(ret == -1)
-			      {
-				 send_to_user("\r\nCouldn't add entry to ban list\r\n", user);
-				 logprintf(4, "Error - Failed adding entry to ban list\n");
-			      }
-			    else if(ret == 0)
-			      {
-				 send_to_user("\r\nEntry is already on the list\r\n", user);
-			      }
-			    else
-			      {
-				 send_to_user("\r\nAdded entry to ban list\r\n", user);
-				 sscanf(temp+5, "%120[^|]", tempstr);
-				 logprintf(3, "Admin at %s added %s to banlist\n", user->hostname, tempstr);
-			      }
-			 }		       
-		    }	 
-	       }
-	     else if(strncasecmp(temp, "$Allow ", 7) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = ballow(temp+7, ALLOW, user);
-		       if(user->type == ADMIN)
-			 {			    
-			    if(ret == -1)
-			      {
-				 send_to_user("\r\nCouldn't add entry to allow list\r\n", user);
-				 logprintf(4, "Error - Failed adding entry to allow list\n");
-			      }
-			    else if(ret == 0)
-			      {
-				 send_to_user("\r\nEntry is already on the list\r\n", user);
-			      }
-			    else
-			      {
-				 send_to_user("\r\nAdded entry to allow list\r\n", user);
-				 sscanf(temp+7, "%120[^|]", tempstr);
-				 logprintf(3, "Admin at %s added %s to allow list\n", user->hostname, tempstr);
-			      }
-			 }		       
-		    }	 
-	       }
-	     else if(strncasecmp(temp, "$Unban ", 7) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = unballow(temp+7, BAN);
-		       if(user->type == ADMIN)
-			 {			    
-			    if(ret == -1)
-			      {
-				 send_to_user("\r\nCouldn't remove entry from ban list\r\n", user);
-				 logprintf(1, "Error - Failed removing entry from ban list\n");
-			      }
-			    else if(ret == 0)
-			      {
-				 send_to_user("\r\nEntry wasn't found in list\r\n", user);
-			      }
-			    else
-			      {
-				 send_to_user("\r\nRemoved entry from ban list\r\n", user);
-				 sscanf(temp+7, "%120[^|]", tempstr);
-				 logprintf(3, "Admin at %s removed %s from ban list\n", user->hostname, tempstr);
-			      }
-			 }	 
-		    }		  
-	       }
-	     else if(strncasecmp(temp, "$Unallow ", 9) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = unballow(temp+9, ALLOW);
-		       if(user->type == ADMIN)
-			 {			    
-			    if(ret == -1)
-			      {
-				 send_to_user("\r\nCouldn't remove entry from allow list\r\n", user);
-				 logprintf(1, "Error - Failed removing entry from allow list\n");
-			      }
-			    else if(ret == 0)
-			      {
-				 send_to_user("\r\nEntry wasn't found in list\r\n", user);
-			      }
-			    else
-			      {
-				 send_to_user("\r\nRemoved entry from allow list\r\n", user);
-				 sscanf(temp+9, "%120[^|]", tempstr);
-				 logprintf(3, "Admin at %s removed %s from allow list\n", user->hostname, tempstr);
-			      }
-			 }	 
-		    }		  
-	       }
-	     else if(strncasecmp(temp, "$GetBanList", 11) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       uprintf(user, "\r\n");
-		       send_user_list(BAN, user);
-		       uprintf(user, "\r\n");
-		    }
-	       }
-	     else if(strncasecmp(temp, "$GetAllowList", 13) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       uprintf(user, "\r\n");
-		       send_user_list(ALLOW, user);
-		       uprintf(user, "\r\n");
-		    }
-	       }
-	     else if(strncasecmp(temp, "$GetRegList", 11) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       uprintf(user, "\r\n");
-		       send_user_list(REG, user);
-		       uprintf(user, "\r\n");
-		    }
-	       }
-	     else if(strncasecmp(temp, "$GetConfig", 10) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       uprintf(user, "\r\n");
-		       send_user_list(CONFIG, user);
-		       uprintf(user, "\r\n");
-		    }
-	       }
-	     else if(strncasecmp(temp, "$GetMotd", 8) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       uprintf(user, "\r\n");
-		       send_motd(user);
-		       send_to_user("\r\n", user);
-		    }
-	       }
-	     else if(strncasecmp(temp, "$GetLinkList", 12) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       uprintf(user, "\r\n");
-		       send_user_list(LINK, user);
-		       uprintf(user, "\r\n");
-		    }
-	       }
-	     else if(strncasecmp(temp, "$AddRegUser ", 12) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = add_reg_user(temp, user);
-		       if(user->type == ADMIN)
-			 {			    
-			    if(ret == -1)
-			      send_to_user("\r\nCouldn't add user to reg list\r\n", user);
-			    else if(ret == 2)
-			      send_to_user("\r\nBad format for $AddRegUser. Correct format is:\r\n$AddRegUser <nickname> <password> <opstatus>|\r\n", user);
-			    else if(ret == 3)
-			      send_to_user("\r\nThat nickname is already registered\r\n", user);
-			    else
-			      {			    
-				 send_to_user("\r\nAdded user to reglist\r\n", user);
-				 logprintf(3, "Admin at %s added entry to reglist\n", user->hostname);
-			      }		       
-			 }
-		    }
-	       }	     
-	     else if(strncasecmp(temp, "$RemoveRegUser ", 15) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = remove_reg_user(temp+15, user);
-		       if(user->type == ADMIN)
-			 {			     
-			    if(ret == 0)
-			      send_to_user("\r\nUser wasn't found in reg list\r\n", user);
-			    else if(ret == -1)
-			      send_to_user("\r\nCouldn't remove user from reg list\r\n", user);
-			    else
-			      {			    
-				 send_to_user("\r\nRemoved user from reglist\r\n", user);
-				 logprintf(3, "Admin at %s removed entry from reglist\n", user->hostname);
-			      }		       			    
-			 }
-		    }
-	       }		  
-	     else if(strncasecmp(temp, "$AddLinkedHub ", 14) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = add_linked_hub(temp);
-		       if(user->type == ADMIN)
-			 {			    
-			    if(ret == -1)
-			      send_to_user("\r\nCouldn't add hub to link list\r\n", user);
-			    else if(ret == 2)
-			      send_to_user("\r\nBad format for $AddLinkedHub. Correct format is:\r\n$AddLinkedHub <ip> <port>|\r\n", user);
-			    else if(ret == 3)
-			      send_to_user("\r\nThat hub is already in the linklist\r\n", user);
-			    else
-			      {			    
-				 send_to_user("\r\nAdded hub to linklist\r\n", user);
-				 logprintf(3, "Admin at %s added entry to linklist\n", user->hostname);
-			      }
-			 }		       		       
-		    }
-	       }
-	     else if(strncasecmp(temp, "$RemoveLinkedHub ", 17) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = remove_linked_hub(temp+17);
-		       if(user->type == ADMIN)
-			 {			    
-			    if(ret == 0)
-			      send_to_user("\r\nHub wasn't found in link list\r\n", user);
-			    else if(ret == -1)
-			      send_to_user("\r\nCouldn't remove hub from link list\r\n", user);
-			    else if(ret == 2)
-			      send_to_user("\r\nBad format for $RemoveLinkedHub. Correct format is:\r\n$RemoveLinkedHub <ip> <port>|\r\n", user);
-			    else
-			      {			    
-				 send_to_user("\r\nRemoved hub from linklist\r\n", user);
-				 logprintf(3, "Admin at %s removed entry from linklist\n", user->hostname);
-			      }		       
-			 }
-		    }		  
-	       }
-		 /**
-		  * SSP: Adding new command.
-		  **/
-		 else if(strncmp(temp, fbuser, strlen(fbuser)))
-		 {
-		  if((user->type & (FORKED | REGULAR | REGISTERED | OP | OP_ADMIN)) != 0)
-			  validate_fbuser(temp+strlen(fbuser), user);
-		    printf("\n $FBUser command received");
-		 }
-	     else if(strncmp(temp, "$MultiSearch ", 13) == 0)
-	       {
-		  if((user->type & (FORKED | REGULAR | REGISTERED | OP | OP_ADMIN)) != 0)
-		    multi_search(temp, user);
-	       }
-	     else if(strncmp(temp, "$MultiConnectToMe ", 18) == 0)
-	       {
-		  if((user->type & (FORKED | REGULAR | REGISTERED | OP | OP_ADMIN)) != 0)
-		    multi_connect_to_me(temp, user);
-	       }
-	     else if(strncasecmp(temp, "$GetHost ", 9) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    get_host(temp, user, HOST);
-	       }	     
-	     else if(strncasecmp(temp, "$GetIP ", 7) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    get_host(temp, user, IP);
-	       }	     
-	     else if(strncasecmp(temp, "$Commands", 9) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    send_commands(user);
-	       }
-	     else if(strncasecmp(temp, "$MassMessage ", 13) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       uprintf(user, "\r\nSent Mass Message\r\n");
-		       send_mass_message(temp + 13, user);
-		    }		  
-	       }
-	     else if(strncasecmp(temp, "$AddPerm ", 9) == 0)
-	       {
-		  if((user->type & (ADMIN | FORKED | SCRIPT)) != 0)
-		    {
-		       ret = add_perm(temp, user);
-		       if(user->type == ADMIN)
-			 {
-			    if(ret == -1)
-			      uprintf(user, "\r\nCouldn't add permission to user\r\n");
-			    else if(ret == 2)
-			      uprintf(user, "\r\nBad format for $AaddPerm. Correct format is:\r\n$AddPerm <nick> <permission>|\r\nand permission is one of: BAN_ALLOW, USER_INFO, MASSMESSAGE, USER_ADMIN\r\n");
-			    else if(ret == 3)
-			      uprintf(user, "\r\nUser already has that permission.\r\n");
-			    else if(ret == 4)
-			      uprintf(user, "\r\nUser is not an operator.\r\n");
-			    else
-			      {
-				 uprintf(user, "\r\nAdded permission to user.\r\n");
-				 logprintf(3, "Administrator at %s added permission to user\n", user->hostname);
-			      }		       
-			 }		  
-		    }		  
-	       }
-	     else if(strncasecmp(temp, "$RemovePerm ", 12) == 0)
-	       {
-		  if((user->type & (ADMIN | FORKED | SCRIPT)) != 0)
-		    {
-		       ret = remove_perm(temp, user);
-		       if(user->type == ADMIN)
-			 {
-			    if(ret == -1)
-			      uprintf(user, "\r\nCouldn't remove permission from user.\r\n");
-			    else if(ret == 2)
-			      uprintf(user, "\r\nBad format for $RemovePerm. Correct format is:\r\n$RemovePerm <nick> <permission>|\r\nand permission is one of: BAN_ALLOW, USER_INFO, MASSMESSAGE, USER_ADMIN\r\n");
-			    else if(ret == 3)
-			      uprintf(user, "\r\nUser does not have that permission.\r\n");
-			    else if(ret == 4)
-			      uprintf(user, "\r\nUser is not an operator.\r\n");
-			    else
-			      {
-				 uprintf(user, "\r\nRemoved permission from user.\r\n");
-				 logprintf(3, "Administrator at %s removed permission from user\n", user->hostname);
-			      }		       
-			 }		  
-		    }		  
-	       }
-	     else if(strncasecmp(temp, "$ShowPerms ", 11) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       if((ret = show_perms(user, temp)) == 2)
-			 uprintf(user, "\r\nBad format for $ShowPerms. Correct format is:\r\n$ShowPerms <nick>|");
-		       else if(ret == 3)
-			 uprintf(user, "\r\nUser is not an operator.\r\n");		       
-		    }		  
-	       }
-	     else if(strncasecmp(temp, "$ShowPerms ", 11) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {
-		       if((ret = show_perms(user, temp)) == 2)
-			 uprintf(user, "\r\nBad format for $ShowPerms. Correct format is:\r\n$ShowPerms <nick>|");
-		       else if(ret == 3)
-			 uprintf(user, "\r\nUser is not an operator.\r\n");		       
-		    }		  
-	       }
-	     else if(strncasecmp(temp, "$NickBan ", 9) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = ballow(temp+9, NICKBAN, user);
-		       if(user->type == ADMIN)
-			 {		       
-			    if(ret == -1)
-			      {			      
-				 uprintf(user, "\r\nCouldn't add entry to nickban list\r\n");
-				 logprintf(4, "Error - Failed adding entry to nickban list\n");
-			      }		  
-			    else if(ret == 2)
-			      uprintf(user, "\r\nEntry is already on the list\r\n");
-			    else
-			      {			      
-				 uprintf(user, "\r\nAdded entry to nickban list\r\n");
-				 sscanf(temp+9, "%120[^|]", tempstr);
-				 logprintf(3, "Administrator at %s added %s to nickban list\n", user->hostname, tempstr);
-			      }		  
-			 }	
-		    }		     
-	       }
-	     else if(strncasecmp(temp, "$GetNickBanList", 15) == 0)
-	       {
-		  if(user->type == ADMIN)
-		    {		       
-		       uprintf(user, "\r\nNickban list:\r\n");
-		       send_user_list(NICKBAN, user);
-		       uprintf(user, "\r\n");
-		    }
-	       }
-	     else if(strncasecmp(temp, "$UnNickBan ", 11) == 0)
-	       {
-		  if((user->type & (ADMIN | SCRIPT)) != 0)
-		    {
-		       ret = unballow(temp+11, NICKBAN);
-		       if(user->type == ADMIN)
-			 {		       
-			    if(ret == -1)
-			      {			      
-				 uprintf(user, "\r\nCouldn't remove entry from nickban list\r\n");
-				 logprintf(4, "Error - Failed adding entry to nickban list\n");
-			      }		  
-			    else if(ret == 2)
-			      uprintf(user, "\r\nEntry wasn't found in list\r\n");
-			    else
-			      {			      
-				 uprintf(user, "\r\nRemoved entry from nickban list\r\n");
-				 sscanf(temp+9, "%120[^|]", tempstr);
-				 logprintf(3, "Administrator at %s removed %s from nickban list\n", user->hostname, tempstr);
-			      }		  
-			 }		      	
-		    }
-	       }	     	     
-	     /* Commands from script processes */
-#ifdef HAVE_PERL		  
-	     else if(strncasecmp(temp, "$NewScript", 10) == 0)
-	       {
-		  if(user->type == FORKED)
-		    {		       
-		       user->type = SCRIPT;
-		       sprintf(user->hostname, "script_process");
-		       sprintf(user->nick, "script process");
-		    }		  
-	       }
-	     else if(strncmp(temp, "$Script ", 8) == 0)
-	       {		  
-		  if(pid > 0)
-		    {
-		       if(user->type == FORKED)
-			 non_format_to_scripts(temp);
-		    }
-		  else
-		    {		       
-		       if(user->type == SCRIPT)
-			 sub_to_script(temp + 8);		     
-		    }
-	       }
-	     else if(strncasecmp(temp, "$ReloadScripts", 14) == 0)
-	       {
-		  if((user->type & (ADMIN | FORKED)) != 0)
-		    {	
-		       if(user->type == ADMIN)
-			 uprintf(user, "\r\nReloading scripts...\r\n");
-		       if(pid > 0)
-			 script_reload = 1;
-		       
-		       else
-			 send_to_non_humans(temp, FORKED, user);
-		    }
-	       }
-	     else if(strncasecmp(temp, "$ScriptToUser ", 14) == 0)
-	       {
-		  if((user->type & (SCRIPT | FORKED)) != 0)
-		    script_to_user(temp, user);
-	       }
-	     else if(strncasecmp(temp, "$DataToAll ", 11) == 0)
-	       {
-		  if(user->type == SCRIPT)
-		    {
-		       send_to_non_humans(temp, FORKED, user);		      
-		       send_to_humans(temp + 11, REGULAR | REGISTERED | OP | OP_ADMIN, user);
-		    }
-		  else if(user->type == FORKED)
-		    send_to_humans(temp + 11, REGULAR | REGISTERED | OP | OP_ADMIN, user);
-	       }
+	     send_to_user("\r\nAdded entry to ban list\r\n", user);
+	     sscanf(buf+5, "%120[^|]", tempstr);
+	     logprintf(3, "Admin at %s added %s to banlist\n", user->hostname, tempstr);
+	  }
+     }		       
+   return 1;
+}
+
+static int cmd_allow(char *buf, struct user_t *user)
+{
+   int ret;
+   char tempstr[MAX_HOST_LEN+1]; 
+   
+   ret = ballow(buf+7, ALLOW, user);
+   if(user->type == ADMIN)
+     {			    
+	if(ret == -1)
+	  {
+	     send_to_user("\r\nCouldn't add entry to allow list\r\n", user);
+	     logprintf(4, "Error - Failed adding entry to allow list\n");
+	  }
+	else if(ret == 0)
+	  {
+	     send_to_user("\r\nEntry is already on the list\r\n", user);
+	  }
+	else
+	  {
+	     send_to_user("\r\nAdded entry to allow list\r\n", user);
+	     sscanf(buf+7, "%120[^|]", tempstr);
+	     logprintf(3, "Admin at %s added %s to allow list\n", user->hostname, tempstr);
+	  }
+     }		       
+   return 1;
+}
+
+static int cmd_unban(char *buf, struct user_t *user)
+{
+   int ret;
+   char tempstr[MAX_HOST_LEN+1]; 
+   
+   ret = unballow(buf+7, BAN);
+   if(user->type == ADMIN)
+     {			    
+	if(ret == -1)
+	  {
+	     send_to_user("\r\nCouldn't remove entry from ban list\r\n", user);
+	     logprintf(1, "Error - Failed removing entry from ban list\n");
+	  }
+	else if(ret == 0)
+	  {
+	     send_to_user("\r\nEntry wasn't found in list\r\n", user);
+	  }
+	else
+	  {
+	     send_to_user("\r\nRemoved entry from ban list\r\n", user);
+	     sscanf(buf+7, "%120[^|]", tempstr);
+	     logprintf(3, "Admin at %s removed %s from ban list\n", user->hostname, tempstr);
+	  }
+     }	 
+   return 1;
+}
+
+static int cmd_unallow(char *buf, struct user_t *user)
+{
+   int ret;
+   char tempstr[MAX_HOST_LEN+1]; 
+   
+   ret = unballow(buf+9, ALLOW);
+   if(user->type == ADMIN)
+     {			    
+	if(ret == -1)
+	  {
+	     send_to_user("\r\nCouldn't remove entry from allow list\r\n", user);
+	     logprintf(1, "Error - Failed removing entry from allow list\n");
+	  }
+	else if(ret == 0)
+	  {
+	     send_to_user("\r\nEntry wasn't found in list\r\n", user);
+	  }
+	else
+	  {
+	     send_to_user("\r\nRemoved entry from allow list\r\n", user);
+	     sscanf(buf+9, "%120[^|]", tempstr);
+	     logprintf(3, "Admin at %s removed %s from allow list\n", user->hostname, tempstr);
+	  }
+     }	 
+   return 1;
+}
+
+static int cmd_get_ban_list(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\n");
+   send_user_list(BAN, user);
+   uprintf(user, "\r\n");
+   return 1;
+}
+
+static int cmd_get_allow_list(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\n");
+   send_user_list(ALLOW, user);
+   uprintf(user, "\r\n");
+   return 1;
+}
+
+static int cmd_get_reg_list(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\n");
+   send_user_list(REG, user);
+   uprintf(user, "\r\n");
+   return 1;
+}
+
+static int cmd_get_config(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\n");
+   send_user_list(CONFIG, user);
+   uprintf(user, "\r\n");
+   return 1;
+}
+
+static int cmd_get_stats(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\n");
+   send_output_stats(user);
+   send_pool_stats(user);
+   uprintf(user, "\r\n");
+   return 1;
+}
+
+static int cmd_get_motd(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\n");
+   send_motd(user);
+   send_to_user("\r\n", user);
+   return 1;
+}
+
+static int cmd_get_link_list(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\n");
+   send_user_list(LINK, user);
+   uprintf(user, "\r\n");
+   return 1;
+}
+
+static int cmd_add_reg_user(char *buf, struct user_t *user)
+{
+   int ret;
+   
+   ret = add_reg_user(buf, user);
+   if(user->type == ADMIN)
+     {			    
+	if(ret == -1)
+	  send_to_user("\r\nCouldn't add user to reg list\r\n", user);
+	else if(ret == 2)
+	  send_to_user("\r\nBad format for $AddRegUser. Correct format is:\r\n$AddRegUser <nickname> <password> <opstatus>|\r\n", user);
+	else if(ret == 3)
+	  send_to_user("\r\nThat nickname is already registered\r\n", user);
+	else
+	  {			    
+	     send_to_user("\r\nAdded user to reglist\r\n", user);
+	     logprintf(3, "Admin at %s added entry to reglist\n", user->hostname);
+	  }		       
+     }
+   return 1;
+}
+
+static int cmd_remove_reg_user(char *buf, struct user_t *user)
+{
+   int ret;
+   
+   ret = remove_reg_user(buf+15, user);
+   if(user->type == ADMIN)
+     {			     
+	if(ret == 0)
+	  send_to_user("\r\nUser wasn't found in reg list\r\n", user);
+	else if(ret == -1)
+	  send_to_user("\r\nCouldn't remove user from reg list\r\n", user);
+	else
+	  {			    
+	     send_to_user("\r\nRemoved user from reglist\r\n", user);
+	     logprintf(3, "Admin at %s removed entry from reglist\n", user->hostname);
+	  }		       			    
+     }
+   return 1;
+}
+
+static int cmd_add_linked_hub(char *buf, struct user_t *user)
+{
+   int ret;
+   
+   ret = add_linked_hub(buf);
+   if(user->type == ADMIN)
+     {			    
+	if(ret == -1)
+	  send_to_user("\r\nCouldn't add hub to link list\r\n", user);
+	else if(ret == 2)
+	  send_to_user("\r\nBad format for $AddLinkedHub. Correct format is:\r\n$AddLinkedHub <ip> <port>|\r\n", user);
+	else if(ret == 3)
+	  send_to_user("\r\nThat hub is already in the linklist\r\n", user);
+	else
+	  {			    
+	     send_to_user("\r\nAdded hub to linklist\r\n", user);
+	     logprintf(3, "Admin at %s added entry to linklist\n", user->hostname);
+	  }
+     }		       		       
+   return 1;
+}
+
+static int cmd_remove_linked_hub(char *buf, struct user_t *user)
+{
+   int ret;
+   
+   ret = remove_linked_hub(buf+17);
+   if(user->type == ADMIN)
+     {			    
+	if(ret == 0)
+	  send_to_user("\r\nHub wasn't found in link list\r\n", user);
+	else if(ret == -1)
+	  send_to_user("\r\nCouldn't remove hub from link list\r\n", user);
+	else if(ret == 2)
+	  send_to_user("\r\nBad format for $RemoveLinkedHub. Correct format is:\r\n$RemoveLinkedHub <ip> <port>|\r\n", user);
+	else
+	  {			    
+	     send_to_user("\r\nRemoved hub from linklist\r\n", user);
+	     logprintf(3, "Admin at %s removed entry from linklist\n", user->hostname);
+	  }		       
+     }
+   return 1;
+}
+
+/**
+ * SSP: Adding new command.
+ **/
+static int cmd_fbuser(char *buf, struct user_t *user)
+{
+   logprintf(5, "$FBUser command received\n");
+   validate_fbuser(buf + strlen(FBHANDLER_FBUSER), user);
+   return 1;
+}
+
+static int cmd_multi_search(char *buf, struct user_t *user)
+{
+   multi_search(buf, user);
+   return 1;
+}
+
+static int cmd_multi_connect_to_me(char *buf, struct user_t *user)
+{
+   multi_connect_to_me(buf, user);
+   return 1;
+}
+
+static int cmd_get_host(char *buf, struct user_t *user)
+{
+   get_host(buf, user, HOST);
+   return 1;
+}
+
+static int cmd_get_ip(char *buf, struct user_t *user)
+{
+   get_host(buf, user, IP);
+   return 1;
+}
+
+static int cmd_commands(char *buf, struct user_t *user)
+{
+   send_commands(user);
+   return 1;
+}
+
+static int cmd_mass_message(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\nSent Mass Message\r\n");
+   send_mass_message(buf + 13, user);
+   return 1;
+}
+
+static int cmd_add_perm(char *buf, struct user_t *user)
+{
+   int ret;
+   
+   ret = add_perm(buf, user);
+   if(user->type == ADMIN)
+     {
+	if(ret == -1)
+	  uprintf(user, "\r\nCouldn't add permission to user\r\n");
+	else if(ret == 2)
+	  uprintf(user, "\r\nBad format for $AaddPerm. Correct format is:\r\n$AddPerm <nick> <permission>|\r\nand permission is one of: BAN_ALLOW, USER_INFO, MASSMESSAGE, USER_ADMIN\r\n");
+	else if(ret == 3)
+	  uprintf(user, "\r\nUser already has that permission.\r\n");
+	else if(ret == 4)
+	  uprintf(user, "\r\nUser is not an operator.\r\n");
+	else
+	  {
+	     uprintf(user, "\r\nAdded permission to user.\r\n");
+	     logprintf(3, "Administrator at %s added permission to user\n", user->hostname);
+	  }		       
+     }		  
+   return 1;
+}
+
+static int cmd_remove_perm(char *buf, struct user_t *user)
+{
+   int ret;
+   
+   ret = remove_perm(buf, user);
+   if(user->type == ADMIN)
+     {
+	if(ret == -1)
+	  uprintf(user, "\r\nCouldn't remove permission from user.\r\n");
+	else if(ret == 2)
+	  uprintf(user, "\r\nBad format for $RemovePerm. Correct format is:\r\n$RemovePerm <nick> <permission>|\r\nand permission is one of: BAN_ALLOW, USER_INFO, MASSMESSAGE, USER_ADMIN\r\n");
+	else if(ret == 3)
+	  uprintf(user, "\r\nUser does not have that permission.\r\n");
+	else if(ret == 4)
+	  uprintf(user, "\r\nUser is not an operator.\r\n");
+	else
+	  {
+	     uprintf(user, "\r\nRemoved permission from user.\r\n");
+	     logprintf(3, "Administrator at %s removed permission from user\n", user->hostname);
+	  }		       
+     }		  
+   return 1;
+}
+
+static int cmd_show_perms(char *buf, struct user_t *user)
+{
+   int ret;
+   
+   if((ret = show_perms(user, buf)) == 2)
+     uprintf(user, "\r\nBad format for $ShowPerms. Correct format is:\r\n$ShowPerms <nick>|");
+   else if(ret == 3)
+     uprintf(user, "\r\nUser is not an operator.\r\n");		       
+   return 1;
+}
+
+static int cmd_nick_ban(char *buf, struct user_t *user)
+{
+   int ret;
+   char tempstr[MAX_HOST_LEN+1]; 
+   
+   ret = ballow(buf+9, NICKBAN, user);
+   if(user->type == ADMIN)
+     {		       
+	if(ret == -1)
+	  {			      
+	     uprintf(user, "\r\nCouldn't add entry to nickban list\r\n");
+	     logprintf(4, "Error - Failed adding entry to nickban list\n");
+	  }		  
+	else if(ret == 2)
+	  uprintf(user, "\r\nEntry is already on the list\r\n");
+	else
+	  {			      
+	     uprintf(user, "\r\nAdded entry to nickban list\r\n");
+	     sscanf(buf+9, "%120[^|]", tempstr);
+	     logprintf(3, "Administrator at %s added %s to nickban list\n", user->hostname, tempstr);
+	  }		  
+     }	
+   return 1;
+}
+
+static int cmd_get_nick_ban_list(char *buf, struct user_t *user)
+{
+   uprintf(user, "\r\nNickban list:\r\n");
+   send_user_list(NICKBAN, user);
+   uprintf(user, "\r\n");
+   return 1;
+}
+
+static int cmd_un_nick_ban(char *buf, struct user_t *user)
+{
+   int ret;
+   char tempstr[MAX_HOST_LEN+1]; 
+   
+   ret = unballow(buf+11, NICKBAN);
+   if(user->type == ADMIN)
+     {		       
+	if(ret == -1)
+	  {			      
+	     uprintf(user, "\r\nCouldn't remove entry from nickban list\r\n");
+	     logprintf(4, "Error - Failed adding entry to nickban list\n");
+	  }		  
+	else if(ret == 2)
+	  uprintf(user, "\r\nEntry wasn't found in list\r\n");
+	else
+	  {			      
+	     uprintf(user, "\r\nRemoved entry from nickban list\r\n");
+	     sscanf(buf+9, "%120[^|]", tempstr);
+	     logprintf(3, "Administrator at %s removed %s from nickban list\n", user->hostname, tempstr);
+	  }		  
+     }		      	
+   return 1;
+}
+
+/* Commands from script processes */
+#ifdef HAVE_PERL
+static int cmd_new_script(char *buf, struct user_t *user)
+{
+   set_user_type(user, SCRIPT);
+   sprintf(user->hostname, "script_process");
+   sprintf(user->nick, "script process");
+   return 1;
+}
+
+static int cmd_script(char *buf, struct user_t *user)
+{
+   if(pid > 0)
+     {
+	if(user->type == FORKED)
+	  non_format_to_scripts(buf);
+     }
+   else
+     {		       
+	if(user->type == SCRIPT)
+	  sub_to_script(buf + 8);		     
+     }
+   return 1;
+}
+
+static int cmd_reload_scripts(char *buf, struct user_t *user)
+{
+   if(user->type == ADMIN)
+     uprintf(user, "\r\nReloading scripts...\r\n");
+   if(pid > 0)
+     script_reload = 1;
+   else
+     send_to_non_humans(buf, FORKED, user);
+   return 1;
+}
+
+static int cmd_script_to_user(char *buf, struct user_t *user)
+{
+   script_to_user(buf, user);
+   return 1;
+}
+
+static int cmd_data_to_all(char *buf, struct user_t *user)
+{
+   if(user->type == SCRIPT)
+     send_to_non_humans(buf, FORKED, user);		      
+   send_to_humans(buf + 11, REGULAR | REGISTERED | OP | OP_ADMIN, user);
+   return 1;
+}
 #endif
-	  }
-	
-	/* Send to scripts */
+
+#define LOGGED_IN (REGULAR | REGISTERED | OP | OP_ADMIN)
+
+/* The commands that start with '$'. name is what the command has to start
+ * with, nocase is 1 if that is compared case insensitive, and types are the
+ * types of users that may send the command. len and wlen, the length of the
+ * name and of the command word in it, are set by init_commands().  */
+static struct command_t command_list[] =
+{
+     {"$Key ",             0, UNKEYED,                        cmd_key},
+     {"$ValidateNick ",    0, NON_LOGGED | SCRIPT,            cmd_validate_nick},
+     {"$Version ",         0, ANY_TYPE & ~ADMIN,              cmd_version},
+     {"$GetNickList",      1, ANY_TYPE,                       cmd_get_nick_list},
+     {"$MyINFO $",         0, ANY_TYPE & ~ADMIN,              cmd_my_info},
+     {"$GetINFO ",         1, ANY_TYPE & ~(UNKEYED | NON_LOGGED | LINKED), cmd_get_info},
+     {"$To: ",             0, ANY_TYPE & ~(UNKEYED | NON_LOGGED | SCRIPT | LINKED), cmd_to_from},
+     {"$ConnectToMe ",     0, LOGGED_IN | FORKED,             cmd_connect_to_me},
+     {"$RevConnectToMe ",  0, LOGGED_IN | FORKED,             cmd_rev_connect_to_me},
+     {"$Search ",          0, LOGGED_IN | FORKED | SCRIPT,    cmd_search},
+     {"$SR ",              0, LOGGED_IN | FORKED,             cmd_sr},
+     {"$MyPass ",          0, NON_LOGGED,                     cmd_my_pass},
+     {"$Kick ",            1, ANY_TYPE,                       cmd_kick},
+     {"$OpForceMove ",     0, ANY_TYPE,                       cmd_op_force_move},
+     {"$Hello ",           0, FORKED,                         cmd_forward},
+     {"$Quit ",            0, FORKED,                         cmd_forward},
+     {"$OpList ",          0, FORKED,                         cmd_forward},
+     {"$ClosedListen",     0, FORKED,                         cmd_listen},
+     {"$OpenListen",       0, FORKED,                         cmd_listen},
+     {"$RejListen",        0, FORKED,                         cmd_listen},
+     {"$DiscUser",         0, FORKED,                         cmd_disc_user},
+     {"$Channel",          0, FORKED,                         cmd_channel},
+     {"$ForceMove ",       1, FORKED,                         cmd_force_move},
+     {"$ReloadList ",      1, FORKED,                         cmd_reload_list},
+     {"$QuitProgram",      1, FORKED | ADMIN | SCRIPT,        cmd_quit_program},
+     {"$Exit",             1, ADMIN,                          cmd_exit},
+     {"$RedirectAll ",     1, ADMIN,                          cmd_redirect_all},
+     {"$AdminPass",        1, NON_LOGGED_ADM,                 cmd_admin_pass},
+     {"$Set ",             1, FORKED | SCRIPT | ADMIN,        cmd_set},
+     {"$Ban ",             1, ADMIN | SCRIPT,                 cmd_ban},
+     {"$Allow ",           1, ADMIN | SCRIPT,                 cmd_allow},
+     {"$Unban ",           1, ADMIN | SCRIPT,                 cmd_unban},
+     {"$Unallow ",         1, ADMIN | SCRIPT,                 cmd_unallow},
+     {"$GetBanList",       1, ADMIN,                          cmd_get_ban_list},
+     {"$GetAllowList",     1, ADMIN,                          cmd_get_allow_list},
+     {"$GetRegList",       1, ADMIN,                          cmd_get_reg_list},
+     {"$GetConfig",        1, ADMIN,                          cmd_get_config},
+     {"$GetStats",         1, ADMIN,                          cmd_get_stats},
+     {"$GetMotd",          1, ADMIN,                          cmd_get_motd},
+     {"$GetLinkList",      1, ADMIN,                          cmd_get_link_list},
+     {"$AddRegUser ",      1, ADMIN | SCRIPT,                 cmd_add_reg_user},
+     {"$RemoveRegUser ",   1, ADMIN | SCRIPT,                 cmd_remove_reg_user},
+     {"$AddLinkedHub ",    1, ADMIN | SCRIPT,                 cmd_add_linked_hub},
+     {"$RemoveLinkedHub ", 1, ADMIN | SCRIPT,                 cmd_remove_linked_hub},
+     {FBHANDLER_FBUSER,    0, LOGGED_IN | FORKED,             cmd_fbuser},
+     {"$MultiSearch ",     0, LOGGED_IN | FORKED,             cmd_multi_search},
+     {"$MultiConnectToMe ", 0, LOGGED_IN | FORKED,            cmd_multi_connect_to_me},
+     {"$GetHost ",         1, ADMIN,                          cmd_get_host},
+     {"$GetIP ",           1, ADMIN,                          cmd_get_ip},
+     {"$Commands",         1, ADMIN,                          cmd_commands},
+     {"$MassMessage ",     1, ADMIN,                          cmd_mass_message},
+     {"$AddPerm ",         1, ADMIN | FORKED | SCRIPT,        cmd_add_perm},
+     {"$RemovePerm ",      1, ADMIN | FORKED | SCRIPT,        cmd_remove_perm},
+     {"$ShowPerms ",       1, ADMIN,                          cmd_show_perms},
+     {"$NickBan ",         1, ADMIN | SCRIPT,                 cmd_nick_ban},
+     {"$GetNickBanList",   1, ADMIN,                          cmd_get_nick_ban_list},
+     {"$UnNickBan ",       1, ADMIN | SCRIPT,                 cmd_un_nick_ban},
 #ifdef HAVE_PERL
-	if(((user->type & (REGULAR | REGISTERED | OP | OP_ADMIN)) != 0)
-	   && (temp != NULL) && (strlen(temp) > 2) 
-	   && (strncasecmp(temp, "$ReloadScripts", 14) != 0))
-	  {	     
-	     command_to_scripts("$Script data_arrival %c%c%s%c%c", 
-				'\005', '\005', user->nick, '\005', '\005');
-	     non_format_to_scripts(temp);
-	  }	
+     {"$NewScript",        1, FORKED,                         cmd_new_script},
+     {"$Script ",          0, FORKED | SCRIPT,                cmd_script},
+     {"$ReloadScripts",    1, ADMIN | FORKED,                 cmd_reload_scripts},
+     {"$ScriptToUser ",    1, SCRIPT | FORKED,                cmd_script_to_user},
+     {"$DataToAll ",       1, SCRIPT | FORKED,                cmd_data_to_all},
 #endif
-	
-	if((buf = strchr(buf, '|')) != NULL)
-	  buf++; 
+     {NULL,                0, 0,                              NULL}
+};
 
-	if(temp != NULL)
-	  free(temp);
-     } 
+/* Index of command_list, on the length and the first and last character of
+ * the command word, case insensitive. Collisions go to the next free slot.  */
+static struct command_t *command_table[COMMAND_TABLE_SIZE];
+
+#define COMMAND_SLOT(len, first, last) \
+   (((len) * 37 + tolower(first) * 7 + tolower(last)) & (COMMAND_TABLE_SIZE - 1))
+
+/* Builds the index of command_list. Called once at startup.  */
+void init_commands(void)
+{
+   struct command_t *cmd;
+   int i;
+   
+   memset(command_table, 0, sizeof(command_table));
+   for(cmd = command_list; cmd->name != NULL; cmd++)
+     {
+	cmd->len = strlen(cmd->name);
+	cmd->wlen = strcspn(cmd->name + 1, " |");
+	i = COMMAND_SLOT(cmd->wlen, (unsigned char)cmd->name[1], 
+			 (unsigned char)cmd->name[cmd->wlen]);
+	while(command_table[i] != NULL)
+	  i = (i + 1) & (COMMAND_TABLE_SIZE - 1);
+	command_table[i] = cmd;
+     }
+}
+
+/* Returns the entry in command_list for the command in buf, which starts
+ * with a '$', or NULL if there is none.  */
+static struct command_t *find_command(char *buf)
+{
+   struct command_t *cmd;
+   char *end;
+   int wlen;
+   int i;
+   
+   for(end = buf + 1; (*end != ' ') && (*end != '|') && (*end != '\0'); end++);
+   if((wlen = end - buf - 1) == 0)
+     return NULL;
+   
+   i = COMMAND_SLOT(wlen, (unsigned char)buf[1], (unsigned char)end[-1]);
+   while((cmd = command_table[i]) != NULL)
+     {
+	if((cmd->wlen == wlen) 
+	   && (((cmd->nocase != 0) 
+		? strncasecmp(buf, cmd->name, cmd->len)
+		: strncmp(buf, cmd->name, cmd->len)) == 0))
+	  return cmd;
+	i = (i + 1) & (COMMAND_TABLE_SIZE - 1);
+     }
+   return NULL;
+}
+
+/* Handles one command. buf points to the command, which is len characters
+ * long, ends with the '|' and is followed by a null character. The command
+ * is handled where it was received, so it may be modified, but not beyond
+ * the '|'.  */
+/* Returns 0 if user should be removed */
+int handle_command(char *buf, int len, struct user_t *user)
+{
+   struct command_t *cmd;
+   char *temp;
+   char *lt;
+  
+   /* Skip anything in front of the first '$' or '<' of the command */
+   temp = memchr(buf, '$', len);
+   lt = memchr(buf, '<', len);
+   if((lt != NULL) && ((temp == NULL) || (lt < temp)))
+     temp = lt;
+   if(temp == NULL)
+     return 1;
+   
+   /* The chat command, starts with <nick> */
+   if(*temp == '<')
+     {
+	if((user->type & (SCRIPT | UNKEYED | LINKED | NON_LOGGED)) == 0)
+	  chat(temp, user);
+     }
+   
+   else if(((cmd = find_command(temp)) != NULL)
+	   && ((user->type & cmd->types) != 0))
+     {
+	if(cmd->func(temp, user) == 0)
+	  return 0;
+     }
+   
+   /* Send to scripts */
+#ifdef HAVE_PERL
+   if(((user->type & (REGULAR | REGISTERED | OP | OP_ADMIN)) != 0)
+      && (strlen(temp) > 2) 
+      && (strncasecmp(temp, "$ReloadScripts", 14) != 0))
+     {	     
+	command_to_scripts("$Script data_arrival %c%c%s%c%c", 
+			   '\005', '\005', user->nick, '\005', '\005');
+	non_format_to_scripts(temp);
+     }	
+#endif
+   
    return 1;
 }
 
@@ -1664,6 +1860,7 @@ int new_human_user(int sock)
    int socknum;
    int erret;
    int flags;
+   int room;
    
    memset(&client, 0, sizeof(struct sockaddr_in));
    
@@ -1672,6 +1869,9 @@ int new_human_user(int sock)
    while(((socknum = accept(sock, (struct sockaddr *)&client, 
 	     &namelen)) == -1) && ((errno == EAGAIN) || (errno == EINTR)))
      {
+	/* Nothing more is queued on a socket that is about to be closed.  */
+	if((errno == EAGAIN) && (draining_listener != 0))
+	  return -2;
 	i++;
 	usleep(500);
 	/* Giving up after half a second */
@@ -1680,9 +1880,9 @@ int new_human_user(int sock)
      }
    
    /* Allocate space for the new user */
-   if((user = malloc(sizeof(struct user_t))) == NULL)
+   if((user = pool_alloc(POOL_USER)) == NULL)
      {	
-	logprintf(1, "Error - In new_human_user()/malloc(): ");
+	logprintf(1, "Error - In new_human_user()/pool_alloc(): ");
 	logerror(1, errno);
 	quit = 1;
 	return -1;
@@ -1691,8 +1891,8 @@ int new_human_user(int sock)
    /* Set the sock of the user.  */
    user->sock = socknum;
 
-   /* Reset the last search time */
-   user->last_search = 0;
+   /* The user may search right away */
+   user->search_wait = 0;
    
    /* Avoid dead peers */
    if(setsockopt(user->sock, SOL_SOCKET, SO_KEEPALIVE, &yes,
@@ -1701,7 +1901,7 @@ int new_human_user(int sock)
 	logprintf(1, "Error - In new_human_user()/set_sock_opt(): ");
 	logerror(1, errno);
 	close(user->sock);
-	free(user);
+	pool_free(POOL_USER, user);
 	return -1;
      }
    
@@ -1710,7 +1910,7 @@ int new_human_user(int sock)
 	logprintf(1, "Error - In new_human_user()/in fcntl(): ");
 	logerror(1, errno);
 	close(user->sock);
-	free(user);
+	pool_free(POOL_USER, user);
 	return -1;
      }
    
@@ -1720,7 +1920,7 @@ int new_human_user(int sock)
 	logprintf(1, "Error - In new_human_user()/in fcntl(): ");
 	logerror(1, errno);
 	close(user->sock);
-	free(user);
+	pool_free(POOL_USER, user);
 	return -1;
      }   
    
@@ -1749,9 +1949,20 @@ int new_human_user(int sock)
    user->share = 0;
    user->timeout = 0;
    user->buf = NULL;
-   user->outbuf = NULL;
+   user->buf_len = 0;
+   user->buf_size = 0;
+   user->out_head = NULL;
+   user->out_tail = NULL;
+   user->out_len = 0;
+   user->out_full = 0;
+   user->out_pending = 0;
+   user->channel = NULL;
+   user->sock_index = -1;
+   user->counted = 0;
+   user->accepting = 0;
+   init_user_timers(user);
    user->rem = 0;
-   user->last_search = (time_t)0;
+   user->search_wait = 0;
    
    sprintf(user->nick, "Non_logged_in_user");
    
@@ -1766,6 +1977,7 @@ int new_human_user(int sock)
 		  uprintf(user, "$ForceMove %s|", redirect_host);
 	       }
 	     
+	     close_out_queue(user);
 	     while(((erret =  close(user->sock)) != 0) && (errno == EINTR))
 	       logprintf(1, "Error - In new_human_user()/close(): Interrupted system call. Trying again.\n");	
 	     
@@ -1775,7 +1987,7 @@ int new_human_user(int sock)
 		  logerror(1, errno);
 	       }   
 	    
-	     free(user);
+	     pool_free(POOL_USER, user);
 	     return 1;
 	  }
      }
@@ -1792,6 +2004,7 @@ int new_human_user(int sock)
 	       {	     
 		  hub_mess(user, BAN_MESS);
 		  logprintf(4, "User %s from %s (%s) denied\n",  user->nick, user->hostname, inet_ntoa(client.sin_addr));
+		  close_out_queue(user);
 		  while(((erret =  close(user->sock)) != 0) && (errno == EINTR))
 		    logprintf(1, "Error - In new_human_user()/close(): Interrupted system call. Trying again.\n");	
 		  
@@ -1801,7 +2014,7 @@ int new_human_user(int sock)
 		       logerror(1, errno);
 		    }  
 		  
-		  free(user);
+		  pool_free(POOL_USER, user);
 		  return 1;
 	       }	
 	  }
@@ -1812,6 +2025,7 @@ int new_human_user(int sock)
 	       {	     
 		  hub_mess(user, BAN_MESS);
 		  logprintf(4, "User %s from %s (%s) denied\n",  user->nick, user->hostname, inet_ntoa(client.sin_addr));
+		  close_out_queue(user);
 		  while(((erret =  close(user->sock)) != 0) && (errno == EINTR))
 		    logprintf(1, "Error - In new_human_user()/close(): Interrupted system call. Trying again.\n");	
 		  
@@ -1821,13 +2035,14 @@ int new_human_user(int sock)
 		       logerror(1, errno);
 		    }  
 		  
-		  free(user);
+		  pool_free(POOL_USER, user);
 		  return 1;
 	       }	
 	  }
 	
 	if((banret == -1) || (allowret == -1))
 	  {	
+	     close_out_queue(user);
 	     while(((erret =  close(user->sock)) != 0) && (errno == EINTR))
 	       logprintf(1, "Error - In new_human_user()/close(): Interrupted system call. Trying again.\n");	
 	     
@@ -1836,7 +2051,7 @@ int new_human_user(int sock)
 		  logprintf(1, "Error - In new_human_user()/close(): ");
 		  logerror(1, errno);
 	       }  
-	     free(user);
+	     pool_free(POOL_USER, user);
 	     return -1;
 	  }   
      }
@@ -1844,6 +2059,11 @@ int new_human_user(int sock)
    /* Add sock struct of the user.  */
    add_socket(user);
    
+   /* The user is removed if it hasn't logged in when the timer fires.  */
+   add_timer(&user->timers[TIMER_LOGIN], LOGIN_TIMEOUT, login_timeout, user);
+   if(sock == listening_socket)
+     add_timer(&user->timers[TIMER_KEEPALIVE], KEEPALIVE_TIME, keepalive_timeout, user);
+   
    if(sock == listening_socket)
      logprintf(4, "New connection on socket %d from user at %s\n", user->sock, user->hostname);
    else if(sock == admin_listening_socket)
@@ -1853,21 +2073,42 @@ int new_human_user(int sock)
    if(sock == listening_socket)
      {
 	if(check_key != 0)
-	  user->type = UNKEYED;
+	  set_user_type(user, UNKEYED);
 	send_lock(user);
 	hub_mess(user, INIT_MESS);
      }
    else if(sock == admin_listening_socket)
      {
-	user->type = NON_LOGGED_ADM;
+	set_user_type(user, NON_LOGGED_ADM);
 	hub_mess(user, INIT_ADMIN_MESS);
      }   
    
-   if((count_users(UNKEYED | NON_LOGGED | REGULAR | REGISTERED | OP | OP_ADMIN
-		   | ADMIN | NON_LOGGED_ADM) >= users_per_fork)
-      || (max_sockets <= count_users(0xFFFF)+10))
+   if((draining_listener == 0)
+      && ((count_users(UNKEYED | NON_LOGGED | REGULAR | REGISTERED | OP 
+		       | OP_ADMIN | ADMIN | NON_LOGGED_ADM) >= users_per_fork)
+	  || (max_sockets <= count_users(0xFFFF)+10)))
      {
-	set_listening_pid(0);	
+	if(reuse_port == 0)
+	  set_listening_pid(0);	
+	remove_event_listener(&listening_socket);
+	remove_event_listener(&admin_listening_socket);
+	
+	/* A SO_REUSEPORT socket isn't handed over, and the kernel resets the
+	 * connections still queued on it when it's closed, so they are taken
+	 * here first, even if that goes a little over users_per_fork. If it's
+	 * the sockets that are running out, only as many are taken as there
+	 * are sockets left for.  */
+	if(reuse_port != 0)
+	  {
+	     room = max_sockets - 5 - count_users(0xFFFF);
+	     draining_listener = 1;
+	     for(i = 0; (i < LISTEN_BACKLOG) && (room > 0)
+		 && (new_human_user(listening_socket) != -2); i++, room--);
+	     if(admin_listening_socket != -1)
+	       for(i = 0; (i < LISTEN_BACKLOG) && (room > 0)
+		   && (new_human_user(admin_listening_socket) != -2); i++, room--);
+	     draining_listener = 0;
+	  }
 	while(((erret =  close(listening_socket)) != 0) && (errno == EINTR))
 	  logprintf(1, "Error - In new_human_user()/close(): Interrupted system call. Trying again.\n");	
 	
@@ -1900,6 +2141,9 @@ void add_non_human_to_list(struct user_t *user)
    /* Add the user at the first place in the list */
    user->next = non_human_user_list;
    non_human_user_list = user;
+   count_user(user, 1);
+   
+   add_event_user(user);
 }
 
 /* Remove a non-human user.  */
@@ -1917,6 +2161,8 @@ void remove_non_human(struct user_t *our_user)
 	  {	    
 	     if(our_user->type != LINKED) 
 	       {
+		  close_channel(our_user);
+		  remove_event_user(our_user);
 		  while(((erret =  close(user->sock)) != 0) && (errno == EINTR))
 		    logprintf(1, "Error - In remove_non_human()/close(): Interrupted system call. Trying again.\n");	
 		  
@@ -1931,15 +2177,16 @@ void remove_non_human(struct user_t *our_user)
 	       non_human_user_list = user->next;
 	     else
 	       last_user->next = user->next;
+	     count_user(our_user, -1);
+	     cancel_user_timers(our_user);
 	     if(our_user->type != LINKED)
 	       {
 		  if(our_user->buf != NULL)
-		    free(our_user->buf);
-		  if(our_user->outbuf != NULL)
-		    free(our_user->outbuf);
+		    free_string(our_user->buf);
+		  free_out_queue(our_user);
 	       }
 	     	  
-	     free(our_user);	     
+	     pool_free(POOL_USER, our_user);	     
 	     
 	     return;
 	  }
@@ -1948,58 +2195,160 @@ void remove_non_human(struct user_t *our_user)
      }
 }
 
+/* Marks a slot in the hashtable of human users where a user has been 
+ * removed, so that users after it in the probe sequence are still found.  */
+static struct user_t removed_human;
+
+/* Returns the slot of the user with nick in slots, case sensitive if exact 
+ * is set, or -1 if it isn't there.  */
+static int find_human_slot(struct user_t **slots, unsigned int size, 
+			   char *nick, unsigned int hash, int exact)
+{
+   struct user_t *user;
+   unsigned int i;
+   
+   for(i = hash & (size - 1); (user = slots[i]) != NULL; i = (i + 1) & (size - 1))
+     {
+	if((user != &removed_human) && (user->hash == hash)
+	   && (((exact != 0) && (strcmp(user->nick, nick) == 0))
+	       || ((exact == 0) && (strcasecmp(user->nick, nick) == 0))))
+	  return (int)i;
+     }
+   return -1;
+}
+
+/* Puts user in the first free slot of its probe sequence.  */
+static void put_human_slot(struct user_t *user)
+{
+   unsigned int i, mask;
+   
+   mask = human_hash_table.size - 1;
+   for(i = user->hash & mask; (human_hash_table.slots[i] != NULL)
+       && (human_hash_table.slots[i] != &removed_human); i = (i + 1) & mask);
+   
+   if(human_hash_table.slots[i] == NULL)
+     human_hash_table.used++;
+   human_hash_table.slots[i] = user;
+   human_hash_table.live++;
+}
+
+/* Moves up to count slots from the old slots to the new ones, and frees 
+ * the old slots when they are all moved.  */
+static void move_human_slots(unsigned int count)
+{
+   struct user_t *user;
+   
+   while((human_hash_table.old_slots != NULL) && (count-- > 0))
+     {
+	user = human_hash_table.old_slots[human_hash_table.old_pos];
+	if((user != NULL) && (user != &removed_human))
+	  {
+	     /* The old slot is marked so that the user is only found in the
+	      * new slots, where it may be removed.  */
+	     put_human_slot(user);
+	     human_hash_table.old_slots[human_hash_table.old_pos] = &removed_human;
+	  }
+	if(++human_hash_table.old_pos == human_hash_table.old_size)
+	  {
+	     free(human_hash_table.old_slots);
+	     human_hash_table.old_slots = NULL;
+	  }
+     }
+}
+
+/* Starts moving the users to a new set of slots, twice as many if the table
+ * is getting full of users and the same number if it's mostly removed 
+ * marks.  */
+static int grow_human_hash(void)
+{
+   struct user_t **slots;
+   unsigned int size;
+   
+   /* The last move has to be finished first.  */
+   move_human_slots(human_hash_table.old_size);
+   
+   size = human_hash_table.size;
+   if(human_hash_table.live * 2 >= size)
+     size *= 2;
+   
+   if((slots = calloc(size, sizeof(struct user_t *))) == NULL)
+     {
+	logprintf(1, "Error - In grow_human_hash()/calloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   
+   human_hash_table.old_slots = human_hash_table.slots;
+   human_hash_table.old_size = human_hash_table.size;
+   human_hash_table.old_pos = 0;
+   human_hash_table.slots = slots;
+   human_hash_table.size = size;
+   human_hash_table.used = 0;
+   human_hash_table.live = 0;
+   return 1;
+}
+
 /* Add a human user to the hashtable.  */
 void add_human_to_hash(struct user_t *user)
 {
-   int hashv;
+   user->hash = nick_hash(user->nick);
+   
+   move_human_slots(HUMAN_HASH_MOVES);
    
-   hashv = get_hash(user->nick);
+   /* Keep at least a quarter of the slots empty, so that probe sequences 
+    * stay short.  */
+   if((human_hash_table.used + 1) * 4 > human_hash_table.size * 3)
+     {
+	if((grow_human_hash() == -1) 
+	   && (human_hash_table.used + 1 >= human_hash_table.size))
+	  return;
+     }
    
-   /* Adds the user first in the linked list of the specified hash value.  */
-   user->next = human_hash_table[hashv];
-   human_hash_table[hashv] = user;
+   put_human_slot(user);
 }
 
 /* Returns a human user from a certain nick.  */
 struct user_t* get_human_user(char *nick)
 {
-   struct user_t *user;
+   unsigned int hash;
+   int i;
    
-   user = human_hash_table[get_hash(nick)];
- 
-   while((user != NULL) 
-	 && !((strncasecmp(user->nick, nick, strlen(nick)) == 0) 
-	      && (strlen(nick) == strlen(user->nick))))
-     user = user->next;
+   hash = nick_hash(nick);
+   if((i = find_human_slot(human_hash_table.slots, human_hash_table.size,
+			   nick, hash, 0)) != -1)
+     return human_hash_table.slots[i];
    
-   return user;
+   if((human_hash_table.old_slots != NULL)
+      && ((i = find_human_slot(human_hash_table.old_slots, 
+			       human_hash_table.old_size, nick, hash, 0)) != -1))
+     return human_hash_table.old_slots[i];
+   
+   return NULL;
 }
 
 /* Removes a human user from hashtable.  */
 void remove_human_from_hash(char *nick)
 {
-   struct user_t *user, *last_user;
-   int hashv;
-   
-   hashv = get_hash(nick);
-   user = human_hash_table[hashv];
-   last_user = NULL;
+   unsigned int hash;
+   int i;
    
-   while(user != NULL)
+   hash = nick_hash(nick);
+   if((i = find_human_slot(human_hash_table.slots, human_hash_table.size,
+			   nick, hash, 1)) != -1)
      {
-	if((strncmp(user->nick, nick, strlen(nick)) == 0)
-	   && (strlen(nick) == strlen(user->nick)))
-	  {
-	     if(last_user == NULL)
-	       human_hash_table[hashv] = user->next;
-	     else
-	       last_user->next = user->next;
-
-	     return;
-	  }
-	last_user = user;
-	user = user->next;
+	human_hash_table.slots[i] = &removed_human;
+	human_hash_table.live--;
      }
+   
+   /* A user that hasn't been moved yet is marked in the old slots, so it's
+    * skipped when they are moved.  */
+   else if((human_hash_table.old_slots != NULL)
+	   && ((i = find_human_slot(human_hash_table.old_slots, 
+				    human_hash_table.old_size, nick, hash, 1)) != -1))
+     human_hash_table.old_slots[i] = &removed_human;
+   
+   move_human_slots(HUMAN_HASH_MOVES);
 }
 
 /* Removes a human user.  */
@@ -2023,6 +2372,8 @@ void remove_human_user(struct user_t *user)
 	  add_total_share(-user->share);
      }
    
+   cancel_user_timers(user);
+   remove_event_user(user);
    while(((erret =  close(user->sock)) != 0) && (errno == EINTR))
      logprintf(1, "Error - In remove_human_user()/close(): Interrupted system call. Trying again.\n");	
    
@@ -2034,22 +2385,20 @@ void remove_human_user(struct user_t *user)
    
    if(user->buf != NULL)
      {	     
-	free(user->buf);
+	free_string(user->buf);
 	user->buf = NULL;
+	user->buf_len = 0;
+	user->buf_size = 0;
      }   
-   if(user->outbuf != NULL)
-     {		     
-	free(user->outbuf);
-	user->outbuf = NULL;
-     }   
+   free_out_queue(user);
    if(user->email != NULL)
      {		     
-	free(user->email);
+	free_string(user->email);
 	user->email = NULL;
      }   
    if(user->desc != NULL)
      {		     
-	free(user->desc);
+	free_string(user->desc);
 	user->desc = NULL;
      }      
    
@@ -2067,7 +2416,7 @@ void remove_human_user(struct user_t *user)
 #endif 
       
    /* And free the user.  */
-   free(user);
+   pool_free(POOL_USER, user);
       
    if((count_users(UNKEYED | NON_LOGGED | REGULAR | REGISTERED | OP 
 		   | OP_ADMIN | ADMIN) == 0) && (pid == 0)
@@ -2086,7 +2435,7 @@ void remove_user(struct user_t *our_user, int send_quit, int remove_from_list)
 	if((our_user->type & (REGULAR | REGISTERED | OP | OP_ADMIN)) != 0)
 	  {
 	     sprintf(quit_string, "$Quit %s|", our_user->nick);
-	     send_to_non_humans(quit_string, FORKED, NULL);
+	     relay_to_non_humans(REC_QUIT, quit_string, FORKED, NULL);
 	     send_to_humans(quit_string, REGULAR | REGISTERED | OP | OP_ADMIN,
 			    our_user);
 	  }
@@ -2094,7 +2443,7 @@ void remove_user(struct user_t *our_user, int send_quit, int remove_from_list)
 		&& (strncmp(our_user->nick, "script process", 14) != 0))
 	   {
 	     sprintf(quit_string, "$Quit %s|", our_user->nick);
-	     send_to_non_humans(quit_string, FORKED, NULL);
+	     relay_to_non_humans(REC_QUIT, quit_string, FORKED, NULL);
 	     send_to_humans(quit_string, REGULAR | REGISTERED | OP | OP_ADMIN,
 			    our_user);
 	  }
@@ -2117,11 +2466,10 @@ void clear_user_list(void)
 {
    struct user_t *non_human;
    struct user_t *next_non_human;
-   struct sock_t *human_user;
-   struct sock_t *next_human_user;
+   struct user_t *user;
+   int i;
    
    non_human = non_human_user_list;
-   human_user = human_sock_list;
    
    while(non_human != NULL)
      {
@@ -2133,14 +2481,13 @@ void clear_user_list(void)
 	non_human = next_non_human;
      }
    
-   while(human_user != NULL) 
+   /* Backwards, since the last user takes the place of a removed one.  */
+   for(i = human_sock_count - 1; i >= 0; i--)
      {
-	next_human_user = human_user->next;
-	if(human_user->user->rem != 0)
-	  remove_user(human_user->user, human_user->user->rem & SEND_QUIT,
-		      human_user->user->rem & REMOVE_FROM_LIST);
-	
-	human_user = next_human_user;
+	if((i >= human_sock_count) || (human_socks[i].rem == 0))
+	  continue;
+	user = human_socks[i].user;
+	remove_user(user, user->rem & SEND_QUIT, user->rem & REMOVE_FROM_LIST);
      }
 }
 
@@ -2149,15 +2496,153 @@ void clear_user_list(void)
 /* Returns -1 on error,                */
 /* 0 on connection closed,             */
 /* 1 on received message               */
+/* Makes room for size bytes and a null character in users buf */
+static int grow_in_buf(struct user_t *user, int size)
+{
+   int new_size;
+   char *new_buf;
+   
+   if(size < user->buf_size)
+     return 1;
+   
+   new_size = (user->buf_size == 0) ? IN_BUF_SIZE : user->buf_size;
+   while(new_size <= size)
+     new_size *= 2;
+   
+   if((new_buf = alloc_string(new_size)) == NULL)
+     {
+	logprintf(1, "Error - In grow_in_buf()/alloc_string(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   if(user->buf_len > 0)
+     memcpy(new_buf, user->buf, user->buf_len);
+   free_string(user->buf);
+   user->buf = new_buf;
+   user->buf_size = new_size;
+   return 1;
+}
+
+/* Handles buf_len bytes of input from a user, which may end in the middle 
+ * of a command. There has to be room for a null character after them.  */
+static int handle_input(char *buf, int buf_len, struct user_t *user)
+{
+   char *start, *end, *bar;
+   char save;
+   int ret;
+   
+   /* If nothing is left from earlier packets, the commands are handled
+    * right where they were received. Otherwise the packet is added to
+    * the unfinished command in users buf.  */
+   if(user->buf_len == 0)
+     start = buf;
+   else
+     {
+	if(grow_in_buf(user, user->buf_len + buf_len) < 0)
+	  return -1;
+	memcpy(user->buf + user->buf_len, buf, buf_len);
+	user->buf_len += buf_len;
+	start = user->buf;
+	buf_len = user->buf_len;
+     }
+   end = start + buf_len;
+   *end = '\0';
+   
+   logprintf(5, "PID: %d Received command from %s, type 0x%X: %s\n", 
+	     (int)getpid(), user->hostname, user->type, start);
+   
+   /* Handle every whole command. Each one is null terminated after the
+    * '|' while it's handled.  */
+   while((bar = memchr(start, '|', end - start)) != NULL)
+     {
+	bar++;
+	save = *bar;
+	*bar = '\0';
+	ret = handle_command(start, bar - start, user);
+	*bar = save;
+	if(ret == 0)
+	  {
+	     set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+	     user->buf_len = 0;
+	     return 0;
+	  }
+	start = bar;
+     }
+   
+   /* Save what's left of the last command until the rest of it arrives */
+   buf_len = end - start;
+   if(buf_len == 0)
+     {
+	user->buf_len = 0;
+	if(user->buf_size > IN_BUF_SIZE)
+	  {
+	     free_string(user->buf);
+	     user->buf = NULL;
+	     user->buf_size = 0;
+	  }
+     }
+   
+   /* The buf shouldn't be able to grow too much. If it gets 
+    * really big, it's probably due to some kind of attack.  */
+   else if(buf_len >= MAX_BUF_SIZE)
+     {
+	if(user->rem == 0)
+	  logprintf(1, "User from %s had too big buf, kicking user\n", user->hostname);
+	set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+	user->buf_len = 0;
+     }
+   else if(start != user->buf)
+     {
+	if((user->buf_len == 0) && (grow_in_buf(user, buf_len) < 0))
+	  return -1;
+	memmove(user->buf, start, buf_len);
+	user->buf_len = buf_len;
+     }
+   
+   return 1;
+}
+
+/* Handles a record from the channel of a forked process. buf is in the 
+ * ring, it may be modified, but not beyond len. Text is handled as if it 
+ * came from the socket. The broadcasts were checked by the process that got
+ * them from a user, so they are passed on without being looked at again.  */
+/* Returns 0 if user should be removed */
+int handle_record(int type, char *buf, int len, struct user_t *user)
+{
+   if(type != REC_TEXT)
+     logprintf(5, "PID: %d Received record %d from %s: %s\n", 
+	       (int)getpid(), type, user->hostname, buf);
+   
+   switch(type)
+     {
+      case REC_SEARCH:
+	send_to_humans(buf, LOGGED_IN, NULL);
+	relay_to_non_humans(REC_SEARCH, buf, FORKED, user);
+	return 1;
+	
+      case REC_MYINFO:
+	relay_to_non_humans(REC_MYINFO, buf, FORKED | SCRIPT, user);
+	send_to_humans(buf, LOGGED_IN, user);
+	return 1;
+	
+      case REC_QUIT:
+      case REC_OPLIST:
+	relay_to_non_humans(type, buf, FORKED, user);
+	send_to_humans(buf, LOGGED_IN, user);
+	return 1;
+	
+      default:
+	return handle_input(buf, len, user);
+     }
+}
+
 int socket_action(struct user_t *user)
 {
    int buf_len;
-   char *command_buf;
    char buf[MAX_MESS_SIZE + 1];
    int i = 0;
    
-   command_buf = NULL;
-   
    /* Error or connection closed? */
    while(((buf_len = recv(user->sock, buf, MAX_MESS_SIZE, 0)) == -1) 
 	 && ((errno == EAGAIN) || (errno == EINTR)))
@@ -2171,6 +2656,9 @@ int socket_action(struct user_t *user)
 
    if(buf_len <= 0)
      {	
+	if(user->type == FORKED)
+	  drain_channel(user);
+	
 	/* Connection closed */
 	if(buf_len == 0)
 	  {
@@ -2181,7 +2669,7 @@ int socket_action(struct user_t *user)
 		    logprintf(1, "%s from %s at socket %d hung up\n", user->nick, user->hostname, user->sock);
 		  else
 		    logprintf(1, "User at socket %d from %s hung up\n", user->sock, user->hostname);
-		  user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;		  		
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);		  		
 	       }
 	     else
 	       {
@@ -2192,13 +2680,21 @@ int socket_action(struct user_t *user)
 			 kill_forked_process();
 		    }
 
-		  user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 		  
 		  /* If it was a forked process, check if we have a listening
-		   * process. I we don't, we fork.  */
-		  if((user->type == FORKED) && (get_listening_pid() == 0) 
-		     && (pid > 0)) 
-		    do_fork = 1;
+		   * process. I we don't, we fork. With SO_REUSEPORT, a process
+		   * that accepted users is replaced.  */
+		  if((user->type == FORKED) && (pid > 0))
+		    {
+		       if(reuse_port != 0)
+			 {
+			    if(user->accepting != 0)
+			      do_fork++;
+			 }
+		       else if(get_listening_pid() == 0)
+			 do_fork = 1;
+		    }
 	       }
 	     return 0;
 	  } 
@@ -2210,10 +2706,10 @@ int socket_action(struct user_t *user)
 		    logprintf(1, "%s from %s at socket %d hung up (Connection reset by peer)\n", user->nick, user->hostname, user->sock);
 		  else
 		    logprintf(1, "User at socket %d from %s hung up (Connection reset by peer)\n", user->sock, user->hostname);
-		  user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	       }	     
 	     else
-	       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	       set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	     return 0;	       
 	  }
 	else if(errno == ETIMEDOUT)
@@ -2224,10 +2720,10 @@ int socket_action(struct user_t *user)
 		    logprintf(1, "%s from %s at socket %d hung up (Connection timed out)\n", user->nick, user->hostname, user->sock);
 		  else
 		    logprintf(1, "User at socket %d from %s hung up (Connection timed out)\n", user->sock, user->hostname);
-		  user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	       }	     
 	     else
-	       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	       set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	     return 0;
 	  }
 	else if(errno == EHOSTUNREACH)
@@ -2238,10 +2734,10 @@ int socket_action(struct user_t *user)
 		    logprintf(1, "%s from %s at socket %d hung up (No route to host)\n", user->nick, user->hostname, user->sock);
 		  else
 		    logprintf(1, "User at socket %d from %s hung up (No route to host)\n", user->sock, user->hostname);
-		  user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	       }
 	     else
-	       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
+	       set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
 	     return 0;	       
 	  }
 	else
@@ -2252,146 +2748,7 @@ int socket_action(struct user_t *user)
 	  }
      } 
    else 
-     {
-	/* Set the char after the last received one in buf to null in case the memory
-	 * position was set to something else than null before */
-	buf[buf_len] = '\0';
-	
-	/* If the inbuf is empty */
-	if(user->buf == NULL)
-	  {
-	     if((command_buf = malloc(sizeof(char) * (buf_len + 1))) == NULL)
-	       {
-		  logprintf(1, "Error - In socket_action()/malloc(): ");
-		  logerror(1, errno);
-		  quit = 1;
-		  return -1;
-	       }
-	     strcpy(command_buf, buf);
-	     if(strchr(command_buf, '|') != NULL)
-	       {
-		  if(handle_command(command_buf, user) == 0)
-		    {
-		       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
-		       free(command_buf);
-		       return 0;
-		    }
-	       }
-	     
-	     /* If the string doesn't contain the '|' at all */
-	     if(strchr(buf, '|') == NULL)
-	       {
-		  if((user->buf = malloc(sizeof(char) * (buf_len + 1))) == NULL)
-		    {
-		       logprintf(1, "Error - In socket_action()/malloc(): ");
-		       logerror(1, errno);
-		       quit = 1;
-		       free(command_buf);
-		       return -1;
-		    }
-		  strcpy(user->buf, buf);
-	       }
-	     else
-	       /* If the string continues after the last '|' */
-	       {
-		  if((user->buf = malloc(sizeof(char) * strlen(strrchr(buf, '|')))) == NULL)
-		    {
-		       logprintf(1, "Error - In socket_action()/malloc(): ");
-		       logerror(1, errno);
-		       quit = 1;
-		       free(command_buf);
-		       return -1;
-		    }
-		  strcpy(user->buf, strrchr(buf, '|') + 1);
-	       }
-	  }
-	else
-	  /* We have something in the inbuf */
-	  {
-	     if((command_buf = malloc(sizeof(char) * (buf_len + strlen(user->buf) + 1))) == NULL)
-	       {
-		  logprintf(1, "Error - In socket_action()/malloc(): ");
-		  logerror(1, errno);
-		  quit = 1;
-		  return -1;
-	       }
-	     strcpy(command_buf, user->buf);
-	     strcat(command_buf, buf);
-	     if(strchr(command_buf, '|') != NULL)
-	       {
-		  if(handle_command(command_buf, user) == 0)
-		    {
-		       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
-		       free(command_buf);
-		       return 0;
-		    }
-	       }
-	     
-	     /* If the string doesn't contain a '|' */
-	     if(strchr(buf, '|') == NULL)
-	       {
-		  if((user->buf = realloc(user->buf, sizeof(char) 
-		      * (buf_len + strlen(user->buf) + 1))) == NULL)
-		    {
-		       logprintf(1, "Error - In socket_action()/realloc(): ");
-		       logerror(1, errno);
-		       quit = 1;
-		       free(command_buf);
-		       return -1;
-		    }
-		  strcat(user->buf,  buf);
-		  
-		  /* The buf shouldn't be able to grow too much. If it gets 
-		   * really big, it's probably due to some kind of attack */
-		  if(strlen(user->buf) >= MAX_BUF_SIZE)
-		    {
-		       if(user->rem == 0)
-			 logprintf(1, "User from %s had too big buf, kicking user\n", user->hostname);
-		       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
-		    }
-	       }	     
-	     
-	     /* If the string continues after the last '|' */
-	     else if(strlen(strrchr(buf, '|')) > 1)
-	       {
-		  if((user->buf = realloc(user->buf, sizeof(char) 
-			   * strlen(strrchr(buf, '|')))) == NULL)
-		    {
-		       logprintf(1, "Error - In socket_action()/realloc(): ");
-		       logerror(1, errno);
-		       quit = 1;
-		       free(command_buf);
-		       return -1;
-		    }
-		  strcpy(user->buf, strrchr(buf, '|') + 1);
-   
-		  /* The buf shouldn't be able to grow too much. If it gets 
-		   * really big, it's probably due to some kind of attack.  */
-		  if(strlen(user->buf) >= MAX_BUF_SIZE)
-		    {
-		       if(user->rem == 0)
-			 logprintf(1, "User from %s had to big buf, kicking user\n", user->hostname);
-		       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
-		    }
-	       }
-	     
-	  
-	     /* The string ends with the '|' */
-	     else
-	       {	
-		  free(user->buf);
-		  user->buf = NULL;	
-	       }
-	  }
-	
-	logprintf(5, "PID: %d Received command from %s, type 0x%X: %s\n", 
-		    (int)getpid(), user->hostname, user->type, command_buf);
-
-	if(command_buf != NULL)
-	  free(command_buf);
-
-	return 1;
-     }
+     return handle_input(buf, buf_len, user);
 }
 
 /* Handles udp packages. */
@@ -2524,8 +2881,11 @@ int main(int argc, char *argv[])
    verbosity = 4;
    redir_on_min_share = 1;
    hub_full_mess = NULL;
+   watch_fd = -1;
    non_human_user_list = NULL;
-   human_sock_list = NULL;
+   human_socks = NULL;
+   human_sock_count = 0;
+   human_sock_size = 0;
    memset(logfile, 0, MAX_FDP_LEN+1);
    syslog_enable = 0;
    syslog_switch = 0;
@@ -2679,7 +3039,9 @@ int main(int argc, char *argv[])
    /* This is only a list of addresses to users, not users, so it won't be that
     * space consuming although this will use more memory than a linked list.
     * It's simply faster operation on behalf of more memory usage. */
-   if((human_hash_table = calloc(max_sockets + 1, sizeof(struct user_t *))) == NULL)
+   memset(&human_hash_table, 0, sizeof(struct human_table));
+   human_hash_table.size = HUMAN_HASH_SPACES;
+   if((human_hash_table.slots = calloc(HUMAN_HASH_SPACES, sizeof(struct user_t *))) == NULL)
      {
 	printf("Couldn't initiate human_hash_table.\n");
 	perror("calloc");
@@ -2731,7 +3093,7 @@ int main(int argc, char *argv[])
        return 1;
 
    /* Test if we can open the listening socket.  */
-   if((listening_socket = get_listening_socket(listening_port, 0)) == -1)
+   if((listening_socket = get_listening_socket(listening_port, 0, 0)) == -1)
      {
 	printf("Bind failed.\nRemember, to use a listening port below 1024, you need to be root.\nAlso, make sure that you don't have another instance of the program\nalready running.\n");
 	close(listening_unx_socket);
@@ -2775,7 +3137,9 @@ int main(int argc, char *argv[])
    /* With -d, for debug, we will run in console so skip this part. */
    if(debug == 0)
       {
-	 /* Make program a daemon */
+	 /* Make program a daemon. The messages above mustn't be left in
+	  * the buffer, stdout is closed in the child.  */
+	 fflush(stdout);
 	 pid = fork();
 	 if(pid < 0)
 	   {
@@ -2823,11 +3187,18 @@ int main(int argc, char *argv[])
 	exit(EXIT_FAILURE);
      }
    
+   if(init_sem(&reg_list_sem) ==  -1)
+     {
+	logprintf(1, "Couldn't initialize the registry semaphore.\n");
+	exit(EXIT_FAILURE);
+     }
+   
    if(init_share_shm() == -1)
      {
 	logprintf(1, "Couldn't initialize the total share shared memory segment.\n");
 	semctl(total_share_sem, 0, IPC_RMID, NULL);
 	semctl(user_list_sem, 0, IPC_RMID, NULL);
+	semctl(reg_list_sem, 0, IPC_RMID, NULL);
      }
    
     if(init_user_list() == -1)
@@ -2835,15 +3206,26 @@ int main(int argc, char *argv[])
 	logprintf(1, "Couldn't initialize the user list.\n");
 	semctl(total_share_sem, 0, IPC_RMID, NULL);
 	semctl(user_list_sem, 0, IPC_RMID, NULL);
+	semctl(reg_list_sem, 0, IPC_RMID, NULL);
+     }
+   
+   if(init_reg_list() == -1)
+     {
+	logprintf(1, "Couldn't initialize the registry.\n");
+	semctl(total_share_sem, 0, IPC_RMID, NULL);
+	semctl(user_list_sem, 0, IPC_RMID, NULL);
+	semctl(reg_list_sem, 0, IPC_RMID, NULL);
      }
+   
+   /* If the files can't be watched, they are checked on each lookup.  */
+   if(init_watch() == -1)
+     logprintf(1, "Couldn't watch %s for changes.\n", config_dir);
 	
    init_sig();
+   init_commands();
 
-   /* Send initial alarm */
-   if((kill(pid, SIGALRM)) < 0)
-     {
-	return 1;
-     }
+   /* Run the periodic jobs once at startup, they start their own timer.  */
+   periodic_jobs(NULL);
 
    /* Init perl scripts */
 #ifdef HAVE_PERL	
@@ -2854,9 +3236,21 @@ int main(int argc, char *argv[])
    
 #endif 
    
-   /* Fork process which holds the listening sockets.  */
+   if(accept_workers > 0)
+     {
+#ifdef SO_REUSEPORT
+	reuse_port = 1;
+#else
+	logprintf(1, "SO_REUSEPORT isn't supported, accept_workers is ignored\n");
+#endif
+     }
+   
+   /* Fork process which holds the listening sockets. With SO_REUSEPORT, 
+    * the others that accept users are forked from the loop below.  */
    if(pid > 0)
      fork_process();
+   if((pid > 0) && (reuse_port != 0))
+     do_fork = accept_workers - 1;
    
    while(quit == 0)
      {
@@ -2888,11 +3282,12 @@ int main(int argc, char *argv[])
 #endif
 	  }
 	get_socket_action();
+	run_timers();
 	clear_user_list();
-	if((do_fork == 1) && (pid > 0))
+	while((do_fork > 0) && (pid > 0))
 	  {	     
+	     do_fork--;
 	     fork_process();
-	     do_fork = 0;
 	  }	
      }
    quit_program();
@@ -26,7 +26,12 @@
  * frequently.  */
 #define BYTE char
 
-#define ALARM_TIME         900             /* Seconds between alarm calls */ 
+#define ALARM_TIME         900             /* Seconds between the periodic jobs */ 
+#define LOGIN_TIMEOUT      120             /* Seconds a new user has to log in */
+#define KEEPALIVE_TIME     120             /* Seconds between keepalives to an idle
+					    * logged in user */
+#define TIMER_SLOTS        1024            /* Slots in the timer wheel, one per second,
+					    * must be a power of two */
 #define MAX_NICK_LEN       50              /* Maximum length of nickname, 20 is max in win client */
 #define MAX_HOST_LEN       121             /* Maximum length of hostname */
 #define MAX_VERSION_LEN    30              /* Maximum length of version name */
@@ -35,9 +40,42 @@
 #define MAX_HUB_DESC       100             /* Maximum length of hub description */
 #define MAX_ADMIN_PASS_LEN 50              /* Maximum length of admin pass */
 #define MAX_BUF_SIZE       1000000         /* Maximum length of users buf */
+#define IN_BUF_SIZE        1024            /* Users buf is kept if it's this small */
 #define MAX_FDP_LEN	   100		   /* Maximum length of file/dir/path variables */
-#define USER_LIST_ENT_SIZE 173             /* Size of an entry in the user list, 
-					    * nick length + host length.  */
+#define USER_LIST_SPACES   64              /* Initial number of slots in the user
+					    * list index, must be a power of two */
+#define REG_LIST_SPACES    256             /* Initial number of slots in the registry
+					    * index, must be a power of two */
+#define HUMAN_HASH_SPACES  64              /* Initial number of slots in the hashtable
+					    * of human users, must be a power of two */
+#define HUMAN_HASH_MOVES   8               /* Slots moved to a grown hashtable of 
+					    * human users per add or remove */
+#define HUMAN_SOCK_SPACES  256             /* Initial size of the array of human users */
+#define POOL_SLAB_SIZE     65536           /* Bytes allocated at a time for a pool of
+					    * users or strings */
+#define LISTEN_BACKLOG     100             /* Connections queued on a listening socket */
+#define MAX_EVENTS         256             /* Maximum number of events per epoll_wait */
+#define MAX_IOVEC          64              /* Maximum number of buffers per writev */
+#define COMMAND_TABLE_SIZE 128             /* Slots in the command index, must be a
+					    * power of two */
+#define WC_BUCKETS         256             /* Hash buckets for the states of a wildcard
+					    * set, must be a power of two */
+#define WC_MAX_STATES      256             /* States a wildcard set may build before
+					    * it starts over */
+#define OUT_HIGH_WATERMARK 262144          /* Stop reading from a user that has this
+					    * many bytes waiting to be sent */
+#define OUT_LOW_WATERMARK  65536           /* and start again when it's down to this */
+#define MAX_SEND_THREADS   32              /* Maximum value of send_threads */
+#define SEND_THREAD_MIN    64              /* Users with output before the flush phase
+					    * is split among the send threads */
+#define LOG_RING_SIZE      262144          /* Bytes of log messages queued per process,
+					    * must be a power of two */
+#define LOG_BATCH_SIZE     65536           /* Bytes written to the log file at a time */
+#define LOG_FLUSH_TIME     50              /* Milliseconds between log file writes */
+#define CHANNEL_RING_SIZE  1048576         /* Bytes of records in each direction 
+					    * between the parent and a forked 
+					    * process, must be a power of two */
+#define MAX_CHANNELS       256             /* Forked processes that get a channel */
 
 #define CONFIG_FILE        "config"        /* Name of config file */
 #define MOTD_FILE          "motd"          /* Name of file containing the motd */
@@ -76,6 +114,8 @@
 #define LINKED             0x100
 #define SCRIPT             0x200
 #define NON_LOGGED_ADM     0x400
+#define ANY_TYPE           0x7FF           /* All of the types above */
+#define USER_TYPES         11              /* Number of types above */
 
 /* The different OP permissions */
 #define BAN_ALLOW          0x1
@@ -102,18 +142,98 @@
 # endif
 #endif
 
+/* Types of the records sent between processes through a channel. The 
+ * commands that are broadcast from one process to all the others have their
+ * own types, so they are forwarded without being looked at again.  */
+#define REC_TEXT           0               /* Any commands, as from the socket */
+#define REC_SEARCH         1
+#define REC_MYINFO         2               /* $MyINFO $ALL */
+#define REC_QUIT           3
+#define REC_OPLIST         4
+
+/* Pools that pool_alloc() takes objects from. The rest of the pools are for
+ * strings of different sizes, see alloc_string().  */
+#define POOL_USER          0               /* struct user_t */
+#define POOL_STRING        1               /* The smallest strings */
+#define POOL_COUNT         6
+
+/* The timers of a user, indexes in user->timers  */
+#define TIMER_LOGIN        0               /* Login timeout of a human user */
+#define TIMER_KEEPALIVE    1               /* Keepalive of a human user, or of a
+					    * linked hub */
+#define TIMER_SEARCH       2               /* End of the wait between searches */
+#define USER_TIMERS        3
+
 /* Possible values for user->rem  */
 #define REMOVE_USER        0x1 
 #define SEND_QUIT          0x2
 #define REMOVE_FROM_LIST   0x4
 
 
+/* A buffer that is sent to one or more users. When a message can't be sent 
+ * right away, the users queue holds a reference to the buffer instead of a 
+ * copy of it, so a broadcast is only copied once no matter how many users 
+ * are lagging behind. The buffer isn't changed after it's created.  */
+struct buffer_t
+{
+   int refs;                          /* Number of references to the buffer */
+   int len;                           /* Length of data */
+   char data[1];                      /* The data, terminated with a null */
+};
+
+/* A timer in the timer wheel, see add_timer().  */
+struct timeout_t
+{
+   struct timeout_t *next;            /* Next timer in the same slot, NULL if
+				       * the timer isn't running */
+   struct timeout_t *prev;
+   time_t expires;                    /* Time when the timer fires */
+   void (*func)(void *arg);           /* Called when the timer fires */
+   void *arg;
+};
+
+/* An entry in a users queue of outgoing data.  */
+struct out_t
+{
+   struct buffer_t *buf;
+   int offset;                        /* Number of bytes already sent */
+   struct out_t *next;
+};
+
+/* The fields that are used when sending to a user come first, so that they
+ * share a cache line. The names and the rest of the users info come after
+ * them.  */
 struct user_t 
 { 
    int sock;                          /* What socket the user is on */ 
+   int  type;                         /* Type of user, types defined above. */
+   BYTE rem;                          /* 1 if user is to be removed */
+   BYTE out_full;                     /* 1 if the queue has passed the high
+				       * watermark, then nothing is read from
+				       * the user until it's below the low */
+   BYTE out_pending;                  /* 1 if the queue is flushed at the end of
+				       * get_socket_action() */
+   BYTE timeout;                      /* Check user timeout */
+   BYTE counted;                      /* 1 while the user is in one of the lists
+				       * and counted by count_users() */
+   struct out_t *out_head;            /* Queue of stuff that will be sent to a user */
+   struct out_t *out_tail;            /* Last in the queue */
+   int  out_len;                      /* Number of bytes in the queue */
+   int  sock_index;                   /* Index in human_socks, -1 if the user 
+				       * isn't there */
+   struct channel_t *channel;         /* Shared memory channel to a forked 
+				       * process, or NULL */
+   struct user_t *next;               /* Next user in list*/
+   unsigned int hash;                 /* nick_hash() of the nick, set when a 
+				       * human user is added to the hashtable */
+   int  buf_len;                      /* Number of bytes saved in buf */
+   char *buf;                         /* If a command doesnt't fit in one packet,
+				       * it's saved here for later */
+   int  buf_size;                     /* Allocated size of buf */
+   int  permissions;                  /* Operator permissions (listed above) */
+   
    long unsigned ip;                  /* Ip address of user */ 
    char hostname[MAX_HOST_LEN+1];     /* Hostname of user */
-   int  type;                         /* Type of user, types defined above. */
    char nick[MAX_NICK_LEN+1];         /* Nickname of user */ 
    char version[MAX_VERSION_LEN+1];   /* Version of client */ 
    char *email;                       /* Email of user, optional */ 
@@ -125,24 +245,81 @@ struct user_t
 				       255: Unknown */ 
    BYTE flag;                         /* Users flag, represented by one byte */ 
    long long share;                   /* Size of users share in bytes */
-   char *buf;                         /* If a command doesnt't fit in one packet,
-				       * it's saved here for later */
-   char *outbuf;                      /* Buf of stuff that will be sent to a user */
-   BYTE timeout;                      /* Check user timeout */
-   struct user_t *next;               /* Next user in list*/
    int key;                           /* Start value for the generated key */
-   BYTE rem;                          /* 1 if user is to be removed */
-   time_t last_search;                /* Time of the last search attempt */
-   int  permissions;                  /* Operator permissions (listed above) */
+   BYTE search_wait;                  /* 1 while the user has to wait before
+				       * searching again */
+   int  proc_pid;                     /* Pid of a forked process, 0 if it isn't
+				       * known */
+   BYTE accepting;                    /* 1 for a forked process that accepts
+				       * users with SO_REUSEPORT */
+   struct timeout_t timers[USER_TIMERS]; /* Timers of the user, see TIMER_LOGIN */
 };
 
-/* This is used for a linked list of the humans. This is to get faster 
- * send_to_all:s. I'm pretending it contains the user's sockets, but it really
- * only contains pointers to the users.  */
-struct sock_t 
+/* An entry in human_socks. Loops over all human users only need the sock,
+ * type and rem of each, so they are kept here in a dense array and the user_t
+ * is only looked at for the users that are picked. The type and rem are
+ * copies, set together with the ones in the user_t by set_user_type() and
+ * set_user_rem().  */
+struct human_sock_t
 {
    struct user_t *user;
-   struct sock_t *next;
+   int sock;
+   unsigned short type;               /* All user types fit in 16 bits */
+   BYTE rem;
+};
+
+/* Open addressed hashtable of human users, with linear probing. When it 
+ * grows, the users are moved to the new slots a few at a time, so that no 
+ * single login has to move all of them.  */
+struct human_table
+{
+   struct user_t **slots;             /* NULL, a user or a removed mark */
+   unsigned int size;                 /* Number of slots, a power of two */
+   unsigned int used;                 /* Slots that aren't NULL */
+   unsigned int live;                 /* Slots that have a user */
+   struct user_t **old_slots;         /* Slots that are being moved, or NULL */
+   unsigned int old_size;
+   unsigned int old_pos;              /* Next slot in old_slots to move */
+};
+
+/* A state in the automaton of a wildcard set. It stands for the positions 
+ * in the patterns that the string so far can have reached.  */
+struct wc_state
+{
+   int *pos;                          /* Sorted positions in the items */
+   int count;                         /* Number of positions */
+   int accept;                        /* 1 if a pattern has been matched */
+   unsigned int hash;
+   int hash_next;                     /* Next state in the same bucket */
+   int next[256];                     /* State after each character, -1 if
+				       * it isn't built yet */
+};
+
+/* A set of patterns with wildcards that is matched in one pass, see 
+ * add_wildcard() and match_wildcard_set().  */
+struct wildcard_set
+{
+   int *items;                        /* The patterns, one after the other */
+   int item_count;
+   struct wc_state *states;
+   int state_count;
+   int state_size;
+   int buckets[WC_BUCKETS];
+   int *mark;                         /* Used when a state is built */
+   int *scratch;
+   int stamp;
+   int flushes;                       /* Times the states have been reset */
+};
+
+/* A command in the table that handle_command() dispatches from.  */
+struct command_t
+{
+   char *name;                        /* What the command starts with */
+   int nocase;                        /* 1 if name is case insensitive */
+   int types;                         /* Types of users allowed to send it */
+   int (*func)(char *buf, struct user_t *user);
+   int len;                           /* Length of name */
+   int wlen;                          /* Length of the command word in name */
 };
 
 /* This is system defined as "semun" on some systems, but not defined at all on
@@ -158,9 +335,14 @@ union my_semun
 /* Global variables */
 pid_t  pid;                         /* Pid of process if parent, if it's a child, pid is 0, for scripts, it's -1 and for hublist upload processes it's -2  */
 int    users_per_fork;              /* Users in hub when fork occurs */
+int    send_threads;                /* Threads that help each process send */
+int    accept_workers;              /* Processes accepting users at once, 0 for one at a time */
 struct user_t *non_human_user_list; /* List of non-human users */
-struct user_t **human_hash_table;  /* Hashtable of human users */
-struct sock_t *human_sock_list;
+struct human_table human_hash_table; /* Hashtable of human users */
+struct human_sock_t *human_socks;   /* All human users, in no particular order,
+				     * to get faster send_to_all:s */
+int    human_sock_count;            /* Number of users in human_socks */
+int    human_sock_size;             /* Allocated size of human_socks */
 unsigned int listening_port;        /* Port on which we listen for connections */
 unsigned int admin_port;            /* Administration port */
 BYTE   admin_localhost;             /* 1 to bind administration port localhost only */
@@ -168,6 +350,7 @@ int    admin_listening_socket;      /* Socket for incoming connections from admi
 int    listening_socket;            /* Socket for incoming connections from clients */
 int    listening_unx_socket;        /* Socket for forked processes to connect to */
 int    listening_udp_socket;        /* Socket for incoming multi-hub messages */
+int    watch_fd;                    /* inotify descriptor watching config_dir, parent only */
 char   hub_name[MAX_HUB_NAME+1];    /* Name of the hub. */
 BYTE   debug;                       /* 1 for debug mode, else 0 */
 BYTE   registered_only;             /* 1 for registered only mode, else 0 */
@@ -190,6 +373,7 @@ int    total_share_shm;    /* Identifier for the shared memory segment that cont
 int    total_share_sem;    /* Semaphore Id for the shared momry segment above.  */
 int    user_list_shm_shm;  /* Identifier for shared memory segment containing the shared memory segment for the user list :)  */
 int    user_list_sem;      /* And a semaphore to control access to it.  */ 
+int    reg_list_sem;       /* Semaphore for the registry of registered users.  */
 char   admin_pass[MAX_ADMIN_PASS_LEN+1];
 char   link_pass[MAX_ADMIN_PASS_LEN+1]; /* Password for hub linking */
 char   default_pass[MAX_ADMIN_PASS_LEN+1];
@@ -198,7 +382,7 @@ BYTE   quit;
 BYTE   do_write;
 BYTE   do_send_linked_hubs;
 BYTE   do_purge_user_list;
-BYTE   do_fork;
+int    do_fork;                     /* Number of processes to fork */
 BYTE   script_reload;
 char   config_dir[MAX_FDP_LEN+1];
 char   un_sock_path[MAX_FDP_LEN+1];
@@ -228,14 +412,20 @@ int    udp_action(void);
 void   remove_user(struct user_t *our_user, int send_quit, int remove_from_list);
 void   send_init(int sock);
 void   do_upload_to_hublist(void);
-int    handle_command(char *buf, struct user_t *user);
+int    handle_command(char *buf, int len, struct user_t *user);
+int    handle_record(int type, char *buf, int len, struct user_t *user);
+void   init_commands(void);
 void   send_user_info(struct user_t *from_user, char *to_user_nick, int all);
 void   init_sig(void);
 void   remove_all(int type, int send_quit, int remove_from_list);
 void   new_forked_process(void);
 void   kill_forked_process(void);
 void   term_signal(int z);
-void   alarm_signal(int z);
+void   login_timeout(void *arg);
+void   linked_hub_timeout(void *arg);
+void   keepalive_timeout(void *arg);
+void   search_wait_timeout(void *arg);
+void   hup_signal(int z);
 int    set_default_vars(void);
 void   new_admin_connection();
 void   add_non_human_to_list(struct user_t *user);
@@ -41,7 +41,11 @@
 #elif HAVE_SYS_SELECT_H
 # include <sys/select.h>
 #endif
+#if HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 #include <sys/un.h>
+#include <sys/uio.h>
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
 # include <time.h>
@@ -53,16 +57,139 @@
 # endif
 #endif
 #include <errno.h>
+#include <signal.h>
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+# include <pthread.h>
+# define SEND_THREADS
+#endif
+#if HAVE_SYS_EPOLL_H && HAVE_SYS_EVENTFD_H && HAVE_SYS_MMAN_H
+# include <sys/eventfd.h>
+# include <sys/mman.h>
+# define CHANNELS
+#endif
 
 
 #include "main.h"
 #include "utils.h"
 #include "fileio.h"
 #include "network.h"
+#include "userlist.h"
 #ifdef HAVE_PERL
 # include "perl_utils.h"
 #endif
 
+/* While the ready sockets are handled in get_socket_action(), output is only
+ * queued. The users that got something are kept in pending_users and their
+ * queues are flushed together at the end, so each of them gets everything
+ * in one system call.  */
+static int output_corked = 0;
+static struct user_t **pending_users = NULL;
+static int pending_count = 0;
+static int pending_size = 0;
+static int *pending_errors = NULL;  /* errno of a failed flush, per user */
+
+#ifdef SEND_THREADS
+/* If send_threads is set, a large flush phase is split between that many 
+ * threads and the main thread, each of them taking the users whose socket 
+ * maps to it. The main thread waits until all of them are done, so no user 
+ * is ever touched by two threads at the same time. The threads only write,
+ * accepting users, reading from them and handling their commands is all
+ * done by the main thread.  */
+static pthread_t send_thread[MAX_SEND_THREADS];
+static unsigned int send_seen[MAX_SEND_THREADS];
+static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t send_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t send_done = PTHREAD_COND_INITIALIZER;
+static unsigned int send_round = 0;  /* Bumped when a flush is handed out */
+static int send_started = 0;         /* Threads running in this process */
+static int send_shards = 0;          /* Threads taking part in this round */
+static int send_busy = 0;            /* Of those, the ones not done yet */
+static int send_failed = 0;
+#endif
+
+#ifdef CHANNELS
+/* The parent and each forked process send each other records through a 
+ * channel, two rings in shared memory, instead of text through the unix
+ * socket. Each ring has one writer, who only moves head, and one reader, who
+ * only moves tail. A record is a rec_t followed by the payload and a null 
+ * character, padded to REC_ALIGN. One that doesn't fit before the end of
+ * the ring is put at the start, after a REC_SKIP record.  */
+struct rec_t
+{
+   unsigned int len;                  /* Length of the payload */
+   unsigned int type;                 /* One of the REC_ types */
+};
+
+struct ring_t
+{
+   volatile unsigned int head;        /* Where the next record is written */
+   char pad1[60];                     /* Keeps head and tail on separate 
+				       * cache lines */
+   volatile unsigned int tail;        /* Where the next record is read */
+   volatile int waiting;              /* 1 if the writer has records that 
+				       * didn't fit */
+   char pad2[56];
+   char data[CHANNEL_RING_SIZE];
+};
+
+/* A record that is kept by the writer until there is room in the ring.  */
+struct rec_queue_t
+{
+   struct rec_queue_t *next;
+   int type;
+   int len;
+   char data[1];
+};
+
+/* The channel is created by the parent before it forks. The child uses it
+ * right away, the parent when it has got "$Channel <pid>|" on the socket of 
+ * the child. The parent answers with "$Channel|", and the child starts to 
+ * read the ring after that, so nothing that was sent on the socket is 
+ * overtaken.  */
+struct channel_t
+{
+   struct ring_t *rings;              /* Both rings, the first one is read
+				       * by the child */
+   struct ring_t *in;                 /* The ring this process reads */
+   struct ring_t *out;                /* and the one it writes */
+   int efd[2];                        /* eventfd of the child and the parent */
+   int in_fd;                         /* Signaled when there are records in 
+				       * in, or room in out */
+   int out_fd;                        /* Signals the other process */
+   int pid;                           /* Pid of the child */
+   struct user_t *user;               /* The process at the other end */
+   BYTE used;
+   BYTE in_ok;                        /* 1 when in is read */
+   BYTE out_ok;                       /* 1 when records are written to out */
+   BYTE kick;                         /* 1 if out_fd is signaled in the flush
+				       * phase */
+   struct rec_queue_t *queue_head;    /* Records waiting for room in out */
+   struct rec_queue_t *queue_tail;
+   int queue_len;
+};
+
+# define REC_SKIP          0xFFFF
+# define REC_ALIGN         8
+# define REC_SIZE(len)     \
+   ((sizeof(struct rec_t) + (len) + REC_ALIGN) & ~(REC_ALIGN - 1))
+# define IS_CHANNEL(ptr)   (((char *)(ptr) >= (char *)channels) \
+			    && ((char *)(ptr) < (char *)(channels + MAX_CHANNELS)))
+
+static struct channel_t channels[MAX_CHANNELS];
+static int channels_kicked = 0;
+#endif
+
+/* Output counters of this process.  */
+static unsigned long stat_messages = 0;   /* Messages sent or queued */
+static unsigned long stat_coalesced = 0;  /* Messages sent in the flush phase */
+static unsigned long stat_syscalls = 0;   /* Calls to send() and writev() */
+static unsigned long stat_split = 0;      /* Flush phases split among threads */
+static unsigned long stat_records = 0;    /* Records written to channels */
+static unsigned long stat_rec_queued = 0; /* Records that waited for room */
+static unsigned long stat_wakeups = 0;    /* Channel eventfd signals */
+static unsigned long stat_routed = 0;     /* Messages sent to the process of
+					   * the user they were for */
+
 /* Sends as many packets as it takes. */
 /* This was taken from Beej's guide to network programming: */
 /* http://www.ecst.csuchico.edu/~beej/guide/net/html/ */
@@ -136,32 +263,316 @@ void add_fd(struct pollfd *newfd, int sock)
    
    return;
 }
+
+# if !HAVE_SYS_EPOLL_H
+/* Same as add_fd, but also waits for the socket to become writable if the
+ * user has queued data, and doesn't read from users with full queues.  */
+static void add_user_fd(struct pollfd *newfd, struct user_t *user)
+{
+   add_fd(newfd, user->sock);
+   
+   if(user->out_full != 0)
+     newfd->events = 0;
+   if(user->out_head != NULL)
+     newfd->events |= POLLOUT;
+}
+# endif
 #endif
 
-/* Get action from one of the sockets */
-void get_socket_action(void)
+#if HAVE_SYS_EPOLL_H
+/* The epoll instance of this process. The interest set is kept up to date
+ * as sockets are opened and closed, so it doesn't have to be rebuilt for 
+ * each call to get_socket_action().  */
+static int epoll_fd = -1;
+
+/* The batch of events that get_socket_action() is currently dispatching.  */
+static struct epoll_event events[MAX_EVENTS];
+static int events_next = 0;
+static int events_count = 0;
+
+/* Returns the events to wait for on the socket of a user.  */
+static unsigned int user_events(struct user_t *user)
+{
+   unsigned int ev_flags = 0;
+   
+   if(user->out_full == 0)
+     ev_flags |= (EPOLLIN | EPOLLPRI);
+   if(user->out_head != NULL)
+     ev_flags |= EPOLLOUT;
+   
+   return ev_flags;
+}
+
+/* Adds sock to the interest set. ptr is handed back with its events.  */
+static int add_epoll_fd(int sock, void *ptr, unsigned int ev_flags)
+{
+   struct epoll_event ev;
+   
+   if((epoll_fd == -1) || (sock == -1))
+     return 0;
+   
+   memset(&ev, 0, sizeof(struct epoll_event));
+   ev.events = ev_flags;
+   ev.data.ptr = ptr;
+   
+   if((epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) 
+      && (errno != EEXIST))
+     {
+	logprintf(1, "Error - In add_epoll_fd()/epoll_ctl(): ");
+	logerror(1, errno);
+	return -1;
+     }
+   
+   return 0;
+}
+
+/* Removes sock from the interest set. This has to be done before the socket
+ * is closed, since the kernel only drops it by itself when no other process
+ * holds the socket open.  */
+static void remove_epoll_fd(int sock, void *ptr)
+{
+   struct epoll_event ev;
+   int i;
+   
+   if((epoll_fd == -1) || (sock == -1))
+     return;
+   
+   /* Kernels before 2.6.9 require a non-NULL event, even for EPOLL_CTL_DEL */
+   memset(&ev, 0, sizeof(struct epoll_event));
+   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, &ev);
+   
+   /* Events in the current batch that are still waiting to be dispatched
+    * may not point to a user that is about to be freed.  */
+   for(i = events_next; i < events_count; i++)
+     {
+	if(events[i].data.ptr == ptr)
+	  events[i].data.ptr = NULL;
+     }
+}
+#endif
+
+/* Creates the epoll instance of this process and adds the listening sockets
+ * and all established connections to it.  */
+void init_event_loop(void)
+{
+#if HAVE_SYS_EPOLL_H
+   struct user_t *non_human;
+   int i;
+   
+   if((epoll_fd = epoll_create(MAX_EVENTS)) == -1)
+     {
+	logprintf(1, "Error - In init_event_loop()/epoll_create(): ");
+	logerror(1, errno);
+	quit = 1;
+	return;
+     }
+   
+   if(pid > 0)
+     {
+	add_epoll_fd(listening_unx_socket, &listening_unx_socket, EPOLLIN);
+	add_epoll_fd(listening_udp_socket, &listening_udp_socket, EPOLLIN);
+	add_epoll_fd(watch_fd, &watch_fd, EPOLLIN);
+     }
+   else if(pid == 0)
+     {
+	add_epoll_fd(listening_socket, &listening_socket, EPOLLIN);
+	add_epoll_fd(admin_listening_socket, &admin_listening_socket, EPOLLIN);
+     }
+   
+   non_human = non_human_user_list;
+   while(non_human != NULL)
+     {
+	if(non_human->type != LINKED)
+	  add_epoll_fd(non_human->sock, non_human, user_events(non_human));
+#ifdef CHANNELS
+	if(non_human->channel != NULL)
+	  add_epoll_fd(non_human->channel->in_fd, non_human->channel, EPOLLIN);
+#endif
+	non_human = non_human->next;
+     }
+   
+   for(i = 0; i < human_sock_count; i++)
+     add_epoll_fd(human_socks[i].sock, human_socks[i].user, 
+		  user_events(human_socks[i].user));
+#endif
+}
+
+/* A forked process shares the epoll instance with its parent, so the child
+ * has to drop it before it adds or removes any sockets. A new instance is 
+ * created on the next call to get_socket_action().  */
+void close_event_loop(void)
+{
+#if HAVE_SYS_EPOLL_H
+   if(epoll_fd != -1)
+     close(epoll_fd);
+   
+   epoll_fd = -1;
+   events_next = 0;
+   events_count = 0;
+#endif
+}
+
+/* Adds the socket of a user to the event loop.  */
+void add_event_user(struct user_t *user)
+{
+#if HAVE_SYS_EPOLL_H
+   if(user->type != LINKED)
+     add_epoll_fd(user->sock, user, user_events(user));
+#endif
+}
+
+/* Updates the events that are waited for on the socket of a user, after its
+ * queue has become empty or non-empty or has passed one of the watermarks.  */
+static void update_event_user(struct user_t *user)
+{
+#if HAVE_SYS_EPOLL_H
+   struct epoll_event ev;
+   
+   if((epoll_fd == -1) || (user->type == LINKED))
+     return;
+   
+   memset(&ev, 0, sizeof(struct epoll_event));
+   ev.events = user_events(user);
+   ev.data.ptr = user;
+   
+   if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, user->sock, &ev) == -1)
+     {
+	logprintf(1, "Error - In update_event_user()/epoll_ctl(): ");
+	logerror(1, errno);
+     }
+#endif
+}
+
+/* Removes the socket of a user from the event loop.  */
+void remove_event_user(struct user_t *user)
+{
+#if HAVE_SYS_EPOLL_H
+   if(user->type != LINKED)
+     remove_epoll_fd(user->sock, user);
+#endif
+}
+
+/* Adds one of the listening sockets to the event loop. sock is a pointer to 
+ * the global holding the socket, which is also how its events are told
+ * apart from user events.  */
+void add_event_listener(int *sock)
+{
+#if HAVE_SYS_EPOLL_H
+   add_epoll_fd(*sock, sock, EPOLLIN);
+#endif
+}
+
+/* Removes one of the listening sockets from the event loop.  */
+void remove_event_listener(int *sock)
+{
+#if HAVE_SYS_EPOLL_H
+   remove_epoll_fd(*sock, sock);
+#endif
+}
+
+static void write_action(struct user_t *user);
+static void flush_output(void);
+#ifdef CHANNELS
+static void channel_action(struct channel_t *chan);
+static void wake_kicked_channels(void);
+#endif
+
+/* Waits for action on the sockets and handles it.  */
+static void dispatch_socket_action(void)
 {
+#if HAVE_SYS_EPOLL_H
+   struct epoll_event *ev;
+#else
    struct user_t *non_human, *next_non_human;
-   struct sock_t *human_user, *next_human_user;
-#ifdef HAVE_POLL
+   int i;
+# ifdef HAVE_POLL
    struct pollfd *ufds;
    struct pollfd *fds;
    int num;
    int total;
    int matched;
-#else
+# else
    fd_set fds;
+   fd_set wfds;
    struct timeval tv;
+# endif
 #endif
 
-#ifdef HAVE_POLL
+#if HAVE_SYS_EPOLL_H
+   if(epoll_fd == -1)
+     {
+	init_event_loop();
+	if(epoll_fd == -1)
+	  return;
+     }
+   
+   /* The very central epoll_wait, where the program should spend most of 
+    * its time */
+   if((events_count = epoll_wait(epoll_fd, events, MAX_EVENTS, timer_wait())) <= 0)
+     {
+	events_count = 0;
+	return;
+     }
+   
+   events_next = 0;
+   while(events_next < events_count)
+     {
+	ev = &events[events_next];
+	events_next++;
+	
+	/* The user was removed earlier in this batch.  */
+	if(ev->data.ptr == NULL)
+	  continue;
+	
+	/* Check if it's a new admin connection */
+	if(ev->data.ptr == (void *)&admin_listening_socket)
+	  new_human_user(admin_listening_socket);
+	
+	/* Check if it's a new connection */
+	else if(ev->data.ptr == (void *)&listening_socket)
+	  new_human_user(listening_socket);
+	
+	/* Or if it's a new forked process */
+	else if(ev->data.ptr == (void *)&listening_unx_socket)
+	  new_forked_process();
+	
+	/* Or a linked hub */
+	else if(ev->data.ptr == (void *)&listening_udp_socket)
+	  udp_action();
+	
+	/* Or a change to one of the files */
+	else if(ev->data.ptr == (void *)&watch_fd)
+	  watch_action();
+	
+#ifdef CHANNELS
+	/* Or records from another process */
+	else if(IS_CHANNEL(ev->data.ptr))
+	  channel_action((struct channel_t *)ev->data.ptr);
+#endif
+	
+	/* Otherwise it's an established connection.  */
+	else
+	  {
+	     if((ev->events & EPOLLOUT) != 0)
+	       write_action((struct user_t *)ev->data.ptr);
+	     if((ev->events & (EPOLLIN | EPOLLPRI | EPOLLHUP | EPOLLERR)) != 0)
+	       socket_action((struct user_t *)ev->data.ptr);
+	  }
+     }
+   
+   events_next = 0;
+   events_count = 0;
+#elif defined HAVE_POLL
    non_human = non_human_user_list;
-   human_user = human_sock_list;
    
    total = count_users(0xFFFF);
 
    if(pid > 0)
-     total += 2;
+     {	
+	total += 2;
+	if(watch_fd != -1)
+	  total++;
+     }
    else if(pid == 0)
      {
 	if(listening_socket != -1)
@@ -185,6 +596,11 @@ void get_socket_action(void)
 	add_fd(&ufds[0], listening_unx_socket);
 	add_fd(&ufds[1], listening_udp_socket);
 	num = 2;
+	if(watch_fd != -1)
+	  {	     
+	     add_fd(&ufds[2], watch_fd);
+	     num = 3;
+	  }
      }
    else if((pid == 0) && (listening_socket != -1))
      {
@@ -202,22 +618,21 @@ void get_socket_action(void)
      {
 	if(non_human->type != LINKED)
 	  {	     
-	     add_fd(&ufds[num], non_human->sock);
+	     add_user_fd(&ufds[num], non_human);
 	     num++;
 	  }	
 	non_human = non_human->next;
      }
    
    /* ...and all human users.  */
-   while(human_user != NULL)
+   for(i = 0; i < human_sock_count; i++)
      {
-	add_fd(&ufds[num], human_user->user->sock);
-	human_user = human_user->next;
+	add_user_fd(&ufds[num], human_socks[i].user);
 	num++;
      }
         
    /* The very central poll, where the program should spend most of its time */   
-   if((num = poll(ufds, total, 1000)) <= 0)
+   if((num = poll(ufds, total, timer_wait())) <= 0)
      {
 	free(ufds);
 	return;
@@ -226,7 +641,7 @@ void get_socket_action(void)
    for(num = 0; num < total; num++)
      {
 	fds = &ufds[num];
-	if(((fds->revents & POLLIN) != 0) || ((fds->revents & POLLPRI) != 0))
+	if((fds->revents & (POLLIN | POLLPRI | POLLOUT | POLLHUP | POLLERR)) != 0)
 	  {
 	     matched = 0;
 	     /* Check if it's a new admin connection */
@@ -255,6 +670,12 @@ void get_socket_action(void)
 		  udp_action();
 		  matched = 1;
 	       }			
+	     /* Or a change to one of the files */
+	     else if((pid > 0) && (watch_fd != -1) && (fds->fd == watch_fd))
+	       {
+		  watch_action();
+		  matched = 1;
+	       }
 	     
 	     /* Run through established non-human user connections.  */
 	     non_human = non_human_user_list;
@@ -265,7 +686,10 @@ void get_socket_action(void)
 		    {
 		       if(fds->fd == non_human->sock)
 			 {
-			    socket_action(non_human);
+			    if((fds->revents & POLLOUT) != 0)
+			      write_action(non_human);
+			    if((fds->revents & ~POLLOUT) != 0)
+			      socket_action(non_human);
 			    matched = 1;
 			 }
 		    }
@@ -277,21 +701,17 @@ void get_socket_action(void)
 	     /* And run through established human user connections.  */
 	     if(pid == 0)
 	       {	     
-		  human_user = human_sock_list;
-		  while((matched == 0) && (human_user != NULL))
+		  for(i = 0; (matched == 0) && (i < human_sock_count); i++)
 		    {
-		       next_human_user = human_user->next;
-		       if(human_user->user->type != LINKED)
+		       if((human_socks[i].type != LINKED)
+			  && (fds->fd == human_socks[i].sock))
 			 {
-			    if(fds->fd == human_user->user->sock)
-			      {
-				 socket_action(human_user->user);
-				 matched = 1;
-			      }
+			    if((fds->revents & POLLOUT) != 0)
+			      write_action(human_socks[i].user);
+			    if((fds->revents & ~POLLOUT) != 0)
+			      socket_action(human_socks[i].user);
+			    matched = 1;
 			 }
-		       /* Using a temporary user instead of user = user->next;
-			so freed memory won't be accessed */
-		       human_user = next_human_user;
 		    }
 	       }	
 	  }
@@ -301,13 +721,13 @@ void get_socket_action(void)
 #else
    memset(&fds, 0, sizeof(fd_set));
    memset(&tv, 0, sizeof(struct timeval));
-   tv.tv_sec = 1;
-   tv.tv_usec = 0;
+   tv.tv_sec = timer_wait() / 1000;
+   tv.tv_usec = (timer_wait() % 1000) * 1000;
    
    non_human = non_human_user_list;
-   human_user = human_sock_list;
    
    FD_ZERO(&fds);
+   FD_ZERO(&wfds);
    
    /* Add our listening tcp, udp  and unix socket to the set if we are the parent */
    if(admin_listening_socket != -1)
@@ -320,30 +740,53 @@ void get_socket_action(void)
      {
 	FD_SET(listening_unx_socket, &fds);
 	FD_SET(listening_udp_socket, &fds);
+	if(watch_fd != -1)
+	  FD_SET(watch_fd, &fds);
      }
    
    /* ...the established non-human users...  */
    while(non_human != NULL)
      {
 	if(non_human->type != LINKED)
-	  FD_SET(non_human->sock, &fds);
+	  {
+	     if(non_human->out_full == 0)
+	       FD_SET(non_human->sock, &fds);
+	     if(non_human->out_head != NULL)
+	       FD_SET(non_human->sock, &wfds);
+	  }
 	
 	non_human = non_human->next;
      }
    
    /* ...and all human users.  */
-   while(human_user != NULL)
+   for(i = 0; i < human_sock_count; i++)
      {
-	FD_SET(human_user->user->sock, &fds);
-	human_user = human_user->next;
+	if(human_socks[i].user->out_full == 0)
+	  FD_SET(human_socks[i].sock, &fds);
+	if(human_socks[i].user->out_head != NULL)
+	  FD_SET(human_socks[i].sock, &wfds);
      }   
    
    /* The very central select, where the program should spend most of its time */
-   if(select(max_sockets, &fds, NULL, NULL, &tv) <= 0)
+   if(select(max_sockets, &fds, &wfds, NULL, &tv) <= 0)
      {
 	return;
      }
    
+   /* Send queued data to the users that can take it.  */
+   non_human = non_human_user_list;
+   while(non_human != NULL)
+     {
+	if((non_human->type != LINKED) && FD_ISSET(non_human->sock, &wfds))
+	  write_action(non_human);
+	non_human = non_human->next;
+     }
+   for(i = 0; i < human_sock_count; i++)
+     {
+	if(FD_ISSET(human_socks[i].sock, &wfds))
+	  write_action(human_socks[i].user);
+     }
+   
      /* Check if it's a new admin connection */
    if((admin_listening_socket != -1) && FD_ISSET(admin_listening_socket, &fds))
      {
@@ -366,6 +809,10 @@ void get_socket_action(void)
    if((FD_ISSET(listening_udp_socket, &fds)) && (pid > 0))
      udp_action();
    
+   /* Or a change to one of the files */
+   if((pid > 0) && (watch_fd != -1) && (FD_ISSET(watch_fd, &fds)))
+     watch_action();
+   
    /* Run through established non-human user connections.  */
    non_human = non_human_user_list;
    while(non_human != NULL)
@@ -385,27 +832,31 @@ void get_socket_action(void)
      }
    
    /* And run through established human user connections.  */
-   human_user = human_sock_list;
-    while(human_user != NULL)
+   for(i = 0; i < human_sock_count; i++)
      {
-	next_human_user = human_user->next;
-	if(human_user->user->type != LINKED)
-	  {	     
-	     if(FD_ISSET(human_user->user->sock, &fds))
-	       {
-		  socket_action(human_user->user);
-		  return;
-	       }
-	  }	      
-	/* Using a temporary user instead of user = user->next; 
-	 so freed memory won't be accessed */
-	human_user = next_human_user;
+	if((human_socks[i].type != LINKED) 
+	   && FD_ISSET(human_socks[i].sock, &fds))
+	  {
+	     socket_action(human_socks[i].user);
+	     return;
+	  }
      }
 #endif
 }
 
-/* Returns a socket to listen for connections, or -1 on failure */
-int get_listening_socket(int port, int set_to_localhost)
+/* Get action from one of the sockets. Everything that is sent while the
+ * sockets are handled is flushed once at the end.  */
+void get_socket_action(void)
+{
+   output_corked = 1;
+   dispatch_socket_action();
+   flush_output();
+}
+
+/* Returns a socket to listen for connections, or -1 on failure. If 
+ * reuse_port is set, other processes can bind the same port and the kernel
+ * spreads the connections between them.  */
+int get_listening_socket(int port, int set_to_localhost, int reuse_port)
 {
    int sock;
    int yes = 1;
@@ -428,6 +879,17 @@ int get_listening_socket(int port, int set_to_localhost)
      {
 	return -1;
      }
+   
+#ifdef SO_REUSEPORT
+   if((reuse_port != 0) && (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes,
+				       sizeof(int)) == -1))
+     {
+	logprintf(1, "Error - In get_listening_socket()/setsockopt(): ");
+	logerror(1, errno);
+	close(sock);
+	return -1;
+     }
+#endif
    memset(&hub_addr, 0, sizeof(struct sockaddr_in));
    hub_addr.sin_family = AF_INET;
    if (set_to_localhost) {
@@ -446,7 +908,7 @@ int get_listening_socket(int port, int set_to_localhost)
      }
    
    /* Listen on socket */
-   if(listen(sock, 100) == -1)
+   if(listen(sock, LISTEN_BACKLOG) == -1)
      {
 	logprintf(1, "Error - In get_listening_socket()/listen(): ");
 	logerror(1, errno);
@@ -886,95 +1348,1098 @@ void send_linked_hubs(void)
 /* Add a users socket to the socket list.  */
 void add_socket(struct user_t *user)
 {
-   struct sock_t *sock;
+   struct human_sock_t *socks;
+   int size;
    
-   if((sock = malloc(sizeof(struct sock_t))) == NULL)
+   if(human_sock_count == human_sock_size)
      {
-	logprintf(1, "Error in add_socket()/malloc(): ");
-	logerror(1, errno);
-	quit = 1;
-	return;
+	size = (human_sock_size == 0) ? HUMAN_SOCK_SPACES : human_sock_size * 2;
+	if((socks = realloc(human_socks, sizeof(struct human_sock_t) * size)) == NULL)
+	  {
+	     logprintf(1, "Error in add_socket()/realloc(): ");
+	     logerror(1, errno);
+	     quit = 1;
+	     return;
+	  }
+	human_socks = socks;
+	human_sock_size = size;
      }
    
-   /* Set the user to whom this sock points to.  */
-   sock->user = user;
+   /* And add the user last in the array.  */
+   user->sock_index = human_sock_count;
+   human_socks[human_sock_count].user = user;
+   human_socks[human_sock_count].sock = user->sock;
+   human_socks[human_sock_count].type = (unsigned short)user->type;
+   human_socks[human_sock_count].rem = user->rem;
+   human_sock_count++;
+   count_user(user, 1);
    
-   /* And add the socket to the list.  */
-   sock->next = human_sock_list;
-   human_sock_list = sock;
+   add_event_user(user);
 }
 
-/* Removes a socket from the list.  */
+/* Removes a socket from the list. The last user in the array takes its 
+ * place, so loops that may remove users go through the array backwards.  */
 void remove_socket(struct user_t *user)
 {
-   struct sock_t *sock, *last_sock;
+   int i;
    
-   sock = human_sock_list;
-   last_sock = NULL;
+   if(((i = user->sock_index) < 0) || (i >= human_sock_count)
+      || (human_socks[i].user != user))
+     return;
+   
+   human_sock_count--;
+   human_socks[i] = human_socks[human_sock_count];
+   human_socks[i].user->sock_index = i;
+   user->sock_index = -1;
+   count_user(user, -1);
+}
+
+/* Creates a buffer that can be queued for several users. The caller holds
+ * the first reference.  */
+static struct buffer_t *new_buffer(char *buf, int len)
+{
+   struct buffer_t *buffer;
    
-   while(sock != NULL)
+   if((buffer = malloc(sizeof(struct buffer_t) + len)) == NULL)
      {
-	if(sock->user == user)
-	  {
-	     if(last_sock == NULL) 
-	       human_sock_list = sock->next;	     
-	     else
-	       last_sock->next = sock->next;
-	     
-	     /* Remove the sock:  */
-	     free(sock);
-	     
-	     return;
-	  }
-	last_sock = sock;
-	sock = sock->next;
+	logprintf(1, "Error - In new_buffer()/malloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return NULL;
      }
+   
+   buffer->refs = 1;
+   buffer->len = len;
+   memcpy(buffer->data, buf, len);
+   buffer->data[len] = '\0';
+   
+   return buffer;
 }
 
-/* Sends a string to all non-human users who are included in type, ex_user is
- * excluded.  */
-void send_to_non_humans(char *buf, int type, struct user_t *ex_user)
+/* Drops a reference to a buffer and frees it if it was the last one. The
+ * send threads may drop references to the same buffer at the same time.  */
+static void release_buffer(struct buffer_t *buffer)
 {
-   register struct user_t *user;
+   if(__sync_sub_and_fetch(&buffer->refs, 1) == 0)
+     free(buffer);
+}
+
+/* Puts a reference to buffer, starting at offset, last in the users queue.  */
+static int queue_buffer(struct user_t *user, struct buffer_t *buffer, int offset)
+{
+   struct out_t *out;
    
-   user = non_human_user_list;
+   if((out = malloc(sizeof(struct out_t))) == NULL)
+     {
+	logprintf(1, "Error - In queue_buffer()/malloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
    
-   while(user != NULL)
+   out->buf = buffer;
+   out->offset = offset;
+   out->next = NULL;
+   buffer->refs++;
+   
+   if(user->out_tail == NULL)
+     user->out_head = out;
+   else
+     user->out_tail->next = out;
+   user->out_tail = out;
+   user->out_len += buffer->len - offset;
+   
+   /* Wait for the socket to become writable. While output is corked, this 
+    * is left to flush_output().  */
+   if((user->out_head == out) && (output_corked == 0))
+     update_event_user(user);
+   
+   return 1;
+}
+
+/* Sends as much as possible of the users queue, up to MAX_IOVEC buffers
+ * for each call to writev(). Returns -1 if writev() failed with something
+ * else than EAGAIN or EINTR, otherwise 0.  */
+static int flush_out_queue(struct user_t *user)
+{
+   struct iovec iov[MAX_IOVEC];
+   struct out_t *out;
+   int iovcnt;
+   int total;
+   int full;
+   int n;
+   
+   while(user->out_head != NULL)
      {
-	if(((type & user->type) != 0) && (user != ex_user))
-	  send_to_user(buf, user);
+	total = 0;
+	iovcnt = 0;
+	for(out = user->out_head; (out != NULL) && (iovcnt < MAX_IOVEC); 
+	    out = out->next)
+	  {
+	     iov[iovcnt].iov_base = out->buf->data + out->offset;
+	     iov[iovcnt].iov_len = out->buf->len - out->offset;
+	     total += iov[iovcnt].iov_len;
+	     iovcnt++;
+	  }
 	
-	user = user->next;
+	__sync_fetch_and_add(&stat_syscalls, 1);
+	if((n = writev(user->sock, iov, iovcnt)) == -1)
+	  return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+	
+	user->out_len -= n;
+	
+	/* The socket is full if not everything was sent.  */
+	full = (n < total) ? 1 : 0;
+	
+	/* Drop the buffers that were sent completely.  */
+	while((out = user->out_head) != NULL)
+	  {
+	     if(n < out->buf->len - out->offset)
+	       {
+		  out->offset += n;
+		  break;
+	       }
+	     n -= out->buf->len - out->offset;
+	     user->out_head = out->next;
+	     if(user->out_head == NULL)
+	       user->out_tail = NULL;
+	     release_buffer(out->buf);
+	     free(out);
+	  }
+	
+	if(full != 0)
+	  return 0;
      }
+   
+   return 0;
 }
 
-/* Sends a string to all human users who are included in type, ex_user is 
- * excluded.  */
-void send_to_humans(char *buf, int type, struct user_t *ex_user)
+/* Called when the socket of a user with queued data has become writable.  */
+static void write_action(struct user_t *user)
 {
-   register struct sock_t *sock;
+   int was_full;
    
-   sock = human_sock_list;
+   if(user->out_head == NULL)
+     return;
    
-   while(sock != NULL)
+   if(flush_out_queue(user) == -1)
      {
-	if(((type & sock->user->type) != 0) && (sock->user != ex_user))
-	  send_to_user(buf, sock->user);
-	sock = sock->next;
+	if((user->rem == 0) && ((user->type & (FORKED | SCRIPT)) == 0))
+	  {
+	     logprintf(5, "Error - When trying to send to user %s at %s - In write_action()/writev(), pid: %d: ",
+		       user->nick, user->hostname, getpid());
+	     logerror(5, errno);
+	     logprintf(5, "Removing user %s at %s\n", user->nick, user->hostname);
+	     set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+	  }
+	return;
      }
+   
+   was_full = user->out_full;
+   if(user->out_len < OUT_LOW_WATERMARK)
+     user->out_full = 0;
+   
+   if((user->out_head == NULL) || (user->out_full != was_full))
+     update_event_user(user);
 }
 
-/* Returns ip in string format.  */
-char *ip_to_string(unsigned long ip)
+/* Frees everything in the users queue.  */
+void free_out_queue(struct user_t *user)
 {
-   struct sockaddr_in client;
-
-   memset(&client, 0, sizeof(struct sockaddr_in));   
-   client.sin_addr.s_addr = ip;
+   struct out_t *out;
+   int i;
    
-   return inet_ntoa(client.sin_addr);
-}
-
+   while((out = user->out_head) != NULL)
+     {
+	user->out_head = out->next;
+	release_buffer(out->buf);
+	free(out);
+     }
+   
+   user->out_tail = NULL;
+   user->out_len = 0;
+   
+   if(user->out_pending != 0)
+     {
+	for(i = 0; i < pending_count; i++)
+	  {
+	     if(pending_users[i] == user)
+	       pending_users[i] = NULL;
+	  }
+	user->out_pending = 0;
+     }
+}
+
+/* Sends what can be sent of the users queue right away and frees the rest.
+ * Used when a user is dropped before it's added to the lists, so that it
+ * gets what it was sent while output was corked.  */
+void close_out_queue(struct user_t *user)
+{
+   flush_out_queue(user);
+   free_out_queue(user);
+}
+
+/* Puts a user on the list of users to flush at the end of 
+ * get_socket_action().  */
+static void add_pending_user(struct user_t *user)
+{
+   struct user_t **new_pending;
+   int *new_errors;
+   
+   if(pending_count == pending_size)
+     {
+	if((new_pending = realloc(pending_users, sizeof(struct user_t *) 
+				  * (pending_size + 64))) == NULL)
+	  {
+	     logprintf(1, "Error - In add_pending_user()/realloc(): ");
+	     logerror(1, errno);
+	     quit = 1;
+	     return;
+	  }
+	pending_users = new_pending;
+	
+	if((new_errors = realloc(pending_errors, sizeof(int) 
+				 * (pending_size + 64))) == NULL)
+	  {
+	     logprintf(1, "Error - In add_pending_user()/realloc(): ");
+	     logerror(1, errno);
+	     quit = 1;
+	     return;
+	  }
+	pending_errors = new_errors;
+	pending_size += 64;
+     }
+   
+   pending_users[pending_count++] = user;
+   user->out_pending = 1;
+}
+
+/* Flushes the queues of the pending users whose socket falls in shard out
+ * of shards.  */
+static void flush_shard(int shard, int shards)
+{
+   struct user_t *user;
+   int i;
+   
+   for(i = 0; i < pending_count; i++)
+     {
+	if(((user = pending_users[i]) == NULL) || ((user->sock % shards) != shard))
+	  continue;
+	
+	user->out_pending = 0;
+	pending_errors[i] = (flush_out_queue(user) == -1) ? errno : 0;
+     }
+}
+
+#ifdef SEND_THREADS
+static void *send_thread_loop(void *arg)
+{
+   int index = (int)(long)arg;
+   
+   pthread_mutex_lock(&send_mutex);
+   while(1)
+     {
+	while(send_round == send_seen[index])
+	  pthread_cond_wait(&send_start, &send_mutex);
+	send_seen[index] = send_round;
+	
+	if(index >= send_shards)
+	  continue;
+	
+	pthread_mutex_unlock(&send_mutex);
+	flush_shard(index + 1, send_shards + 1);
+	pthread_mutex_lock(&send_mutex);
+	
+	if(--send_busy == 0)
+	  pthread_cond_signal(&send_done);
+     }
+   
+   return NULL;
+}
+
+/* The threads aren't copied by fork(), the child starts its own if it 
+ * needs them.  */
+static void send_fork_child(void)
+{
+   pthread_mutex_init(&send_mutex, NULL);
+   pthread_cond_init(&send_start, NULL);
+   pthread_cond_init(&send_done, NULL);
+   send_started = 0;
+}
+
+/* Starts send threads until there are n of them.  */
+static void start_send_threads(int n)
+{
+   static int registered = 0;
+   sigset_t all;
+   sigset_t old;
+   int ret;
+   
+   if(registered == 0)
+     {
+	registered = 1;
+	pthread_atfork(NULL, NULL, send_fork_child);
+     }
+   
+   if(n > MAX_SEND_THREADS)
+     n = MAX_SEND_THREADS;
+   
+   /* Signals are left to the main thread.  */
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+   
+   while(send_started < n)
+     {
+	send_seen[send_started] = send_round;
+	if((ret = pthread_create(&send_thread[send_started], NULL, 
+				 send_thread_loop, (void *)(long)send_started)) != 0)
+	  {
+	     logprintf(1, "Error - In start_send_threads()/pthread_create(): ");
+	     logerror(1, ret);
+	     send_failed = 1;
+	     break;
+	  }
+	send_started++;
+     }
+   
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Hands out the flush phase to shards threads and takes the first shard in
+ * the main thread.  */
+static void flush_threaded(int shards)
+{
+   stat_split++;
+   
+   pthread_mutex_lock(&send_mutex);
+   send_shards = shards;
+   send_busy = shards;
+   send_round++;
+   pthread_cond_broadcast(&send_start);
+   pthread_mutex_unlock(&send_mutex);
+   
+   flush_shard(0, shards + 1);
+   
+   pthread_mutex_lock(&send_mutex);
+   while(send_busy > 0)
+     pthread_cond_wait(&send_done, &send_mutex);
+   pthread_mutex_unlock(&send_mutex);
+}
+#endif
+
+/* The flush phase. Sends the queues of the users that got something while
+ * output was corked and stops corking.  */
+static void flush_output(void)
+{
+   struct user_t *user;
+   int i;
+   
+   output_corked = 0;
+   
+#ifdef CHANNELS
+   if(channels_kicked != 0)
+     wake_kicked_channels();
+#endif
+   
+#ifdef SEND_THREADS
+   if((send_threads > 0) && (pending_count >= SEND_THREAD_MIN)
+      && (send_started < send_threads) && (send_failed == 0))
+     start_send_threads(send_threads);
+   if((send_threads > 0) && (send_started > 0) 
+      && (pending_count >= SEND_THREAD_MIN))
+     flush_threaded((send_threads < send_started) ? send_threads : send_started);
+   else
+#endif
+     flush_shard(0, 1);
+   
+   for(i = 0; i < pending_count; i++)
+     {
+	if((user = pending_users[i]) == NULL)
+	  continue;
+	
+	if(pending_errors[i] != 0)
+	  {
+	     if((user->rem == 0) && ((user->type & (FORKED | SCRIPT)) == 0))
+	       {
+		  logprintf(5, "Error - When trying to send to user %s at %s - In flush_output()/writev(), pid: %d: ",
+			    user->nick, user->hostname, getpid());
+		  logerror(5, pending_errors[i]);
+		  logprintf(5, "Removing user %s at %s\n", user->nick, user->hostname);
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+		  continue;
+	       }
+	  }
+	
+	/* What's left is sent when the socket becomes writable.  */
+	if(user->out_head != NULL)
+	  update_event_user(user);
+     }
+   
+   pending_count = 0;
+}
+
+/* Sends the output counters of this process to a user.  */
+void send_output_stats(struct user_t *user)
+{
+   uprintf(user, "Messages sent: %lu\r\n", stat_messages);
+   uprintf(user, "Messages coalesced in the flush phase: %lu\r\n", stat_coalesced);
+   uprintf(user, "Send system calls: %lu\r\n", stat_syscalls);
+   uprintf(user, "Flush phases split among send threads: %lu\r\n", stat_split);
+   uprintf(user, "Records sent through channels: %lu\r\n", stat_records);
+   uprintf(user, "Records that waited for room in a channel: %lu\r\n", stat_rec_queued);
+   uprintf(user, "Channel wakeups: %lu\r\n", stat_wakeups);
+   uprintf(user, "Messages routed to one process: %lu\r\n", stat_routed);
+}
+
+#ifdef CHANNELS
+/* Signals an eventfd.  */
+static void signal_eventfd(int fd)
+{
+   stat_wakeups++;
+   if((eventfd_write(fd, 1) == -1) && (errno != EAGAIN))
+     {
+	logprintf(1, "Error - In signal_eventfd()/eventfd_write(): ");
+	logerror(1, errno);
+     }
+}
+
+/* Wakes the other end of a channel. While output is corked, that's left to
+ * the flush phase, so it's only woken once for everything it got.  */
+static void kick_channel(struct channel_t *chan)
+{
+   if(output_corked == 0)
+     signal_eventfd(chan->out_fd);
+   else
+     {
+	chan->kick = 1;
+	channels_kicked = 1;
+     }
+}
+
+/* Wakes the channels that were written to while output was corked.  */
+static void wake_kicked_channels(void)
+{
+   int i;
+   
+   channels_kicked = 0;
+   for(i = 0; i < MAX_CHANNELS; i++)
+     {
+	if(channels[i].kick != 0)
+	  {
+	     channels[i].kick = 0;
+	     signal_eventfd(channels[i].out_fd);
+	  }
+     }
+}
+
+/* Writes a record to a ring. Returns -1 if there isn't room for it.  */
+static int ring_write(struct ring_t *ring, int type, char *buf, int len)
+{
+   struct rec_t *rec;
+   unsigned int head;
+   unsigned int off;
+   unsigned int size;
+   unsigned int skip = 0;
+   
+   size = REC_SIZE(len);
+   head = ring->head;
+   off = head & (CHANNEL_RING_SIZE - 1);
+   if(off + size > CHANNEL_RING_SIZE)
+     skip = CHANNEL_RING_SIZE - off;
+   
+   if((head - ring->tail) + skip + size > CHANNEL_RING_SIZE)
+     return -1;
+   
+   if(skip != 0)
+     {
+	rec = (struct rec_t *)(ring->data + off);
+	rec->len = 0;
+	rec->type = REC_SKIP;
+	head += skip;
+	off = 0;
+     }
+   
+   rec = (struct rec_t *)(ring->data + off);
+   rec->len = len;
+   rec->type = type;
+   memcpy((char *)(rec + 1), buf, len);
+   ((char *)(rec + 1))[len] = '\0';
+   
+   /* The record has to be in place before the reader can see it.  */
+   __sync_synchronize();
+   ring->head = head + size;
+   
+   return 0;
+}
+
+/* Writes as many of the queued records as there is room for. If some are
+ * left, the reader is asked to wake this process when it has made room.  */
+static void write_queued(struct channel_t *chan)
+{
+   struct rec_queue_t *rec;
+   int written = 0;
+   
+   while(1)
+     {
+	while(((rec = chan->queue_head) != NULL)
+	      && (ring_write(chan->out, rec->type, rec->data, rec->len) == 0))
+	  {
+	     chan->queue_head = rec->next;
+	     chan->queue_len -= rec->len;
+	     free(rec);
+	     written = 1;
+	  }
+	
+	if(chan->queue_head == NULL)
+	  {
+	     chan->queue_tail = NULL;
+	     break;
+	  }
+	
+	/* Try once more after the flag is set, in case the reader made room
+	 * before it could see it.  */
+	if(chan->out->waiting != 0)
+	  break;
+	chan->out->waiting = 1;
+	__sync_synchronize();
+     }
+   
+   if(written != 0)
+     kick_channel(chan);
+}
+
+/* Sends a record to a forked process through its channel. If the ring is 
+ * full, the record is queued, and so is everything after it until the 
+ * queue is empty, so the order is kept.  */
+static void channel_send(struct user_t *user, int type, char *buf, int len)
+{
+   struct channel_t *chan;
+   struct rec_queue_t *rec;
+   
+   chan = user->channel;
+   stat_records++;
+   
+   if(REC_SIZE(len) > CHANNEL_RING_SIZE / 2)
+     {
+	logprintf(1, "Error - In channel_send(): Record of %d bytes doesn't fit in the channel\n", len);
+	return;
+     }
+   
+   if((chan->queue_head == NULL) 
+      && (ring_write(chan->out, type, buf, len) == 0))
+     {
+	kick_channel(chan);
+	return;
+     }
+   
+   if((rec = malloc(sizeof(struct rec_queue_t) + len)) == NULL)
+     {
+	logprintf(1, "Error - In channel_send()/malloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return;
+     }
+   
+   rec->next = NULL;
+   rec->type = type;
+   rec->len = len;
+   memcpy(rec->data, buf, len);
+   rec->data[len] = '\0';
+   
+   if(chan->queue_tail == NULL)
+     chan->queue_head = rec;
+   else
+     chan->queue_tail->next = rec;
+   chan->queue_tail = rec;
+   chan->queue_len += len;
+   stat_rec_queued++;
+   
+   if(chan->queue_len >= MAX_BUF_SIZE)
+     {
+	if(user->rem == 0)
+	  logprintf(1, "Channel to %s had too much queued, removing process\n", user->hostname);
+	set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+     }
+   
+   write_queued(chan);
+   kick_channel(chan);
+}
+
+/* Handles the records that are waiting in the channel. Each one is handled
+ * where it is in the ring, it's only passed when it's done.  */
+static void read_channel(struct channel_t *chan)
+{
+   struct ring_t *ring;
+   struct rec_t *rec;
+   unsigned int tail;
+   unsigned int off;
+   int ret = 1;
+   
+   ring = chan->in;
+   tail = ring->tail;
+   
+   while((ret != 0) && (tail != ring->head))
+     {
+	/* Don't read the record before head.  */
+	__sync_synchronize();
+	off = tail & (CHANNEL_RING_SIZE - 1);
+	rec = (struct rec_t *)(ring->data + off);
+	if(rec->type == REC_SKIP)
+	  tail += CHANNEL_RING_SIZE - off;
+	else
+	  {
+	     ret = handle_record(rec->type, (char *)(rec + 1), rec->len, 
+				 chan->user);
+	     tail += REC_SIZE(rec->len);
+	  }
+	
+	/* The writer may reuse the space as soon as tail has passed it.  */
+	__sync_synchronize();
+	ring->tail = tail;
+     }
+   
+   if(ret == 0)
+     set_user_rem(chan->user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+   
+   /* Wake the writer if it waits for room.  */
+   __sync_synchronize();
+   if(ring->waiting != 0)
+     {
+	ring->waiting = 0;
+	signal_eventfd(chan->out_fd);
+     }
+}
+
+/* Called when the eventfd of a channel has been signaled, because there are
+ * new records or because there is room for the queued ones.  */
+static void channel_action(struct channel_t *chan)
+{
+   eventfd_t value;
+   
+   eventfd_read(chan->in_fd, &value);
+   
+   if(chan->in_ok != 0)
+     read_channel(chan);
+   if(chan->queue_head != NULL)
+     write_queued(chan);
+}
+
+/* Frees a channel in this process.  */
+static void free_channel(struct channel_t *chan)
+{
+   struct rec_queue_t *rec;
+   
+   remove_epoll_fd(chan->in_fd, chan);
+   
+   while((rec = chan->queue_head) != NULL)
+     {
+	chan->queue_head = rec->next;
+	free(rec);
+     }
+   
+   munmap(chan->rings, 2 * sizeof(struct ring_t));
+   close(chan->efd[0]);
+   close(chan->efd[1]);
+   memset(chan, 0, sizeof(struct channel_t));
+}
+
+/* Returns a new non-blocking eventfd, or -1 on failure.  */
+static int new_eventfd(void)
+{
+   int fd;
+   int flags;
+   
+   if((fd = eventfd(0, 0)) == -1)
+     {
+	logprintf(1, "Error - In new_eventfd()/eventfd(): ");
+	logerror(1, errno);
+	return -1;
+     }
+   
+   if(((flags = fcntl(fd, F_GETFL, 0)) < 0)
+      || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+     {
+	logprintf(1, "Error - In new_eventfd()/fcntl(): ");
+	logerror(1, errno);
+	close(fd);
+	return -1;
+     }
+   
+   return fd;
+}
+#endif
+
+/* Creates the channel to a process that is about to be forked. Returns NULL
+ * if no channel could be created, then the process only uses the socket.  */
+struct channel_t *new_channel(void)
+{
+#ifdef CHANNELS
+   struct channel_t *chan = NULL;
+   int i;
+   
+   for(i = 0; (i < MAX_CHANNELS) && (chan == NULL); i++)
+     {
+	/* A process that exited before it connected leaves its channel.  */
+	if((channels[i].used != 0) && (channels[i].user == NULL)
+	   && (kill(channels[i].pid, 0) == -1) && (errno == ESRCH))
+	  free_channel(&channels[i]);
+	
+	if(channels[i].used == 0)
+	  chan = &channels[i];
+     }
+   
+   if(chan == NULL)
+     {
+	logprintf(3, "All channels are in use, the new process uses the socket\n");
+	return NULL;
+     }
+   
+   if((chan->rings = mmap(NULL, 2 * sizeof(struct ring_t), 
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 
+			  -1, 0)) == MAP_FAILED)
+     {
+	logprintf(1, "Error - In new_channel()/mmap(): ");
+	logerror(1, errno);
+	return NULL;
+     }
+   
+   if((chan->efd[0] = new_eventfd()) == -1)
+     {
+	munmap(chan->rings, 2 * sizeof(struct ring_t));
+	return NULL;
+     }
+   
+   if((chan->efd[1] = new_eventfd()) == -1)
+     {
+	close(chan->efd[0]);
+	munmap(chan->rings, 2 * sizeof(struct ring_t));
+	return NULL;
+     }
+   
+   chan->in_fd = -1;
+   chan->out_fd = -1;
+   chan->used = 1;
+   
+   return chan;
+#else
+   return NULL;
+#endif
+}
+
+/* Sets up the parents end of a channel, after the child has been forked.  */
+void set_channel_pid(struct channel_t *chan, int child_pid)
+{
+#ifdef CHANNELS
+   chan->pid = child_pid;
+   chan->in = &chan->rings[1];
+   chan->out = &chan->rings[0];
+   chan->in_fd = chan->efd[1];
+   chan->out_fd = chan->efd[0];
+#endif
+}
+
+/* Frees the channels that a newly forked process got from its parent, 
+ * except for keep, which is its own.  */
+void drop_channels(struct channel_t *keep)
+{
+#ifdef CHANNELS
+   int i;
+   
+   for(i = 0; i < MAX_CHANNELS; i++)
+     {
+	if((channels[i].used == 0) || (&channels[i] == keep))
+	  continue;
+	
+	if(channels[i].user != NULL)
+	  channels[i].user->channel = NULL;
+	free_channel(&channels[i]);
+     }
+   channels_kicked = 0;
+#endif
+}
+
+/* Sets up the childs end of a channel. user is the parent process. The 
+ * records are written right away, but the parent doesn't read them until
+ * it has got the pid of the child on the socket.  */
+void open_channel(struct channel_t *chan, struct user_t *user)
+{
+#ifdef CHANNELS
+   char buf[30];
+   
+   chan->pid = (int)getpid();
+   chan->in = &chan->rings[0];
+   chan->out = &chan->rings[1];
+   chan->in_fd = chan->efd[0];
+   chan->out_fd = chan->efd[1];
+   chan->user = user;
+   user->channel = chan;
+   
+   sprintf(buf, "$Channel %d|", chan->pid);
+   send_to_user(buf, user);
+   chan->out_ok = 1;
+   
+   add_epoll_fd(chan->in_fd, chan, EPOLLIN);
+#endif
+}
+
+/* Handles $Channel. In the parent, it attaches the channel of the child
+ * that sent it and answers with $Channel, in the child, that answer means 
+ * that the channel is read from now on.  */
+void channel_handshake(char *buf, struct user_t *user)
+{
+#ifdef CHANNELS
+   struct channel_t *chan;
+   int child_pid;
+   int i;
+   
+   if(pid == 0)
+     {
+	if(((chan = user->channel) != NULL) && (chan->in_ok == 0))
+	  {
+	     chan->in_ok = 1;
+	     signal_eventfd(chan->in_fd);
+	  }
+	return;
+     }
+   
+   if((pid < 0) || (user->channel != NULL) 
+      || (sscanf(buf, "$Channel %d", &child_pid) != 1))
+     return;
+   
+   for(i = 0; i < MAX_CHANNELS; i++)
+     {
+	chan = &channels[i];
+	if((chan->used == 0) || (chan->user != NULL) || (chan->pid != child_pid))
+	  continue;
+	
+	/* The answer is the last thing that is sent on the socket.  */
+	send_to_user("$Channel|", user);
+	
+	chan->user = user;
+	user->channel = chan;
+	if(user->proc_pid == 0)
+	  user->proc_pid = child_pid;
+	chan->in_ok = 1;
+	chan->out_ok = 1;
+	add_epoll_fd(chan->in_fd, chan, EPOLLIN);
+	
+	/* The child may already have written records.  */
+	signal_eventfd(chan->in_fd);
+	return;
+     }
+   
+   logprintf(1, "Error - In channel_handshake(): No channel for process %d\n", child_pid);
+#endif
+}
+
+/* Handles the records that are waiting in the channel of a process whose
+ * socket has been closed, as they would have been read before the end of
+ * the socket.  */
+void drain_channel(struct user_t *user)
+{
+#ifdef CHANNELS
+   if((user->channel != NULL) && (user->channel->in_ok != 0))
+     read_channel(user->channel);
+#endif
+}
+
+/* Frees the channel of a process that is removed.  */
+void close_channel(struct user_t *user)
+{
+#ifdef CHANNELS
+   struct channel_t *chan;
+   
+   if((chan = user->channel) == NULL)
+     return;
+   
+   user->channel = NULL;
+   free_channel(chan);
+#endif
+}
+
+/* Sends len bytes of buf to a user that isn't a linked hub. If the user 
+ * already has queued data, or if not everything can be sent, the rest is 
+ * queued and sent by write_action() when the socket becomes writable. The 
+ * queued data is taken from *shared, which is created from buf if it's NULL,
+ * so that a message sent to many users is only copied once.  */
+static void send_or_queue(char *buf, int len, struct user_t *user,
+			  struct buffer_t **shared)
+{
+   int sent = 0;
+   
+#ifdef CHANNELS
+   if((user->channel != NULL) && (user->channel->out_ok != 0))
+     {
+	channel_send(user, REC_TEXT, buf, len);
+	return;
+     }
+#endif
+   
+   stat_messages++;
+   
+   if((user->out_head == NULL) && (output_corked == 0))
+     {
+	sent = len;
+	stat_syscalls++;
+	if(sendall(user->sock, buf, &sent) == 0)
+	  return;
+	
+	if((errno != EAGAIN) && (errno != EINTR))
+	  {
+	     /* If it's a forked or a script process, this error can mean
+	      * that the process is trying to send to us at the same time 
+	      * as we are trying to send to it, so the rest is queued.  */
+	     if((user->rem == 0) && ((user->type & (FORKED | SCRIPT)) == 0))
+	       {
+		  logprintf(5, "Error - When trying to send to user %s at %s - In send_or_queue()/sendall()/send(), pid: %d: ",
+			    user->nick, user->hostname, getpid());
+		  logerror(5, errno);
+		  logprintf(5, "Removing user %s at %s\n", user->nick, user->hostname);
+		  if(len < 3500)
+		    logprintf(5, "buf: %s\n", buf);
+		  else
+		    logprintf(5, "too large buf\n");
+		  set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+		  return;
+	       }
+	  }
+     }
+   
+   if(*shared == NULL)
+     {
+	if((*shared = new_buffer(buf, len)) == NULL)
+	  return;
+     }
+   if(queue_buffer(user, *shared, sent) == -1)
+     return;
+   
+   /* A user that didn't have anything queued before is flushed at the end 
+    * of get_socket_action().  */
+   if((output_corked != 0) && (user->out_pending == 0) 
+      && (user->out_head == user->out_tail))
+     add_pending_user(user);
+   if(user->out_pending != 0)
+     stat_coalesced++;
+   
+   if(user->out_len >= MAX_BUF_SIZE)
+     {
+	if(user->rem == 0)
+	  logprintf(1, "User from %s had too big buf, removing user\n", user->hostname);
+	set_user_rem(user, REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST);
+	return;
+     }
+   
+   /* Stop reading from a human user that doesn't keep up, since most of what
+    * it sends is answered. Forked processes and scripts are always read, 
+    * otherwise two processes could end up waiting for each other.  */
+   if((user->out_full == 0) && (user->out_len >= OUT_HIGH_WATERMARK)
+      && ((user->type & (FORKED | SCRIPT)) == 0))
+     {
+	user->out_full = 1;
+	update_event_user(user);
+     }
+}
+
+/* Sends a string to all non-human users who are included in type, ex_user is
+ * excluded.  */
+void send_to_non_humans(char *buf, int type, struct user_t *ex_user)
+{
+   relay_to_non_humans(REC_TEXT, buf, type, ex_user);
+}
+
+/* Same as send_to_non_humans(), but buf is one command that forked processes
+ * with a channel get as a record of type rec.  */
+void relay_to_non_humans(int rec, char *buf, int type, struct user_t *ex_user)
+{
+   register struct user_t *user;
+   struct buffer_t *shared = NULL;
+   int len;
+   
+   len = strlen(buf);
+   user = non_human_user_list;
+   
+   while(user != NULL)
+     {
+	if(((type & user->type) != 0) && (user != ex_user))
+	  {
+	     if(user->type == LINKED)
+	       send_to_user(buf, user);
+#ifdef CHANNELS
+	     else if((user->channel != NULL) && (user->channel->out_ok != 0))
+	       channel_send(user, rec, buf, len);
+#endif
+	     else
+	       send_or_queue(buf, len, user, &shared);
+	  }
+	
+	user = user->next;
+     }
+   
+   if(shared != NULL)
+     release_buffer(shared);
+}
+
+/* Forwards a message for nick, who isn't connected to this process. The 
+ * parent looks up the process that nick is connected to in the user list
+ * and sends it there only. If that process isn't known, the message goes to
+ * all forked processes except ex_user. In a forked process, the only one 
+ * is the parent.  */
+void send_to_owner(char *buf, char *nick, struct user_t *ex_user)
+{
+   struct user_t *user;
+   int owner;
+   
+   if((pid > 0) && ((owner = get_users_pid(nick)) > 0))
+     {
+	for(user = non_human_user_list; user != NULL; user = user->next)
+	  {
+	     if((user->type == FORKED) && (user->proc_pid == owner))
+	       {
+		  if(user != ex_user)
+		    {
+		       send_to_user(buf, user);
+		       stat_routed++;
+		    }
+		  return;
+	       }
+	  }
+     }
+   
+   send_to_non_humans(buf, FORKED, ex_user);
+}
+
+/* Sends a string to all human users who are included in type, ex_user is 
+ * excluded.  */
+void send_to_humans(char *buf, int type, struct user_t *ex_user)
+{
+   struct buffer_t *shared = NULL;
+   int len;
+   int i;
+   
+   len = strlen(buf);
+   
+   for(i = 0; i < human_sock_count; i++)
+     {
+	if(((type & human_socks[i].type) != 0) 
+	   && (human_socks[i].user != ex_user))
+	  send_or_queue(buf, len, human_socks[i].user, &shared);
+     }
+   
+   if(shared != NULL)
+     release_buffer(shared);
+}
+
+/* Returns ip in string format.  */
+char *ip_to_string(unsigned long ip)
+{
+   struct sockaddr_in client;
+
+   memset(&client, 0, sizeof(struct sockaddr_in));   
+   client.sin_addr.s_addr = ip;
+   
+   return inet_ntoa(client.sin_addr);
+}
+
 /* Checks if an ip is an address used in internal networks.  */
 int is_internal_address (long unsigned ip)
 {   
@@ -990,7 +2455,6 @@ int is_internal_address (long unsigned ip)
 /* Sends string to user */
 void send_to_user(char *buf, struct user_t *user)
 {
-   int len, len2;
    int sock;
    int erret;
    int flags;
@@ -998,8 +2462,7 @@ void send_to_user(char *buf, struct user_t *user)
    struct sockaddr_in myhost;
    struct sockaddr_in linked_hub;
    int yes=1;
-   char *new_outbuf, *temp;
-   register char *send_buf;
+   struct buffer_t *shared = NULL;
    
    memset(&myhost, 0, sizeof(struct sockaddr_in));
    memset(&linked_hub, 0, sizeof(struct sockaddr_in));
@@ -1082,86 +2545,8 @@ void send_to_user(char *buf, struct user_t *user)
      }
    else
      {
-	/* If there already is something in the outbuf we add current buf to
-	 * the end of users outbuf.  */
-	if(user->outbuf == NULL)
-	  send_buf = buf;
-	
-	else
-	  {
-	     if((user->outbuf = realloc(user->outbuf, sizeof(char) * (strlen(user->outbuf) + strlen(buf) + 1))) == NULL)
-	       {
-		  logprintf(1, "Error - In send_to_user()/realloc(): ");
-		  logerror(1, errno);
-		  quit = 1;
-		  return;
-	       }
-	     strcat(user->outbuf, buf);
-	     send_buf = user->outbuf;
-	  }
-	len = len2 = strlen(send_buf);
-	if(sendall(user->sock, send_buf, &len) == -1)
-	  {
-	     if(user->outbuf == NULL)
-	       {
-		  if((user->outbuf = malloc(sizeof(char) * (strlen(buf) + 1))) == NULL)
-		    {
-		       logprintf(1, "Error - In send_to_user()/malloc(): ");
-		       logerror(1, errno);
-		       quit = 1;
-		       return;
-		    }
-		  strcpy(user->outbuf, buf);
-	       }
-	     
-	     if((errno != EAGAIN) && (errno != EINTR))
-	       {
-		  /* If it's a forked or a script process, this error can mean
-		   * that the process is trying to send to us at the same time 
-		   * as we are trying to send to it.  */
-		  if(((user->rem == 0) && (user->type & (FORKED | SCRIPT)) == 0)
-		     || ((user->outbuf != NULL)
-			 && (strlen(user->outbuf) >= MAX_BUF_SIZE)))
-		    {
-		       logprintf(5, "Error - When trying to send to user %s at %s - In send_to_user()/sendall()/send(), pid: %d, buf: %s: ",
-				 user->nick, user->hostname, getpid(), buf);
-		       logerror(5, errno);
-		       logprintf(5, "Removing user %s at %s\n", user->nick, user->hostname);
-		       if(strlen(buf) < 3500)
-			 logprintf(5, "buf: %s\n", buf);
-		       else
-			 logprintf(5, "too large buf\n");
-		       user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
-		    }
-		  return;
-	       }
-	     if(strlen(user->outbuf) >= MAX_BUF_SIZE)
-	       {
-		  if(user->rem == 0)
-		    logprintf(1, "User from %s had too big buf, removing user\n", user->hostname);
-		  user->rem = REMOVE_USER | SEND_QUIT | REMOVE_FROM_LIST;
-		  return;
-	       }
-	     if(len != 0)
-	       {
-		  if((new_outbuf = malloc(sizeof(char) * (len2 - len + 1))) == NULL)
-		    {
-		       logprintf(1, "Error - In send_to_user()/malloc(): ");
-		       logerror(1, errno);
-		       quit = 1;
-		       return;
-		    }
-		  strcpy(new_outbuf, user->outbuf + len);
-		  temp = user->outbuf;
-		  user->outbuf = new_outbuf;
-		  free(temp);
-	       }
-	     
-	  }
-	else if(user->outbuf != NULL)
-	  {
-	     free(user->outbuf);
-	     user->outbuf = NULL;
-	  }
+	send_or_queue(buf, strlen(buf), user, &shared);
+	if(shared != NULL)
+	  release_buffer(shared);
      }
 }
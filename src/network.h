@@ -20,7 +20,13 @@
 int    sendall(int s, char *buf, int *len);
 int    set_hub_hostname(void);
 void   get_socket_action(void);
-int    get_listening_socket(int port, int set_to_localhost);
+void   init_event_loop(void);
+void   close_event_loop(void);
+void   add_event_user(struct user_t *user);
+void   remove_event_user(struct user_t *user);
+void   add_event_listener(int *sock);
+void   remove_event_listener(int *sock);
+int    get_listening_socket(int port, int set_to_localhost, int reuse_port);
 int    get_listening_unx_socket(void);
 int    get_listening_udp_socket(int port);
 char   *hostname_from_ip(long unsigned ip);
@@ -29,7 +35,19 @@ void   send_linked_hubs(void);
 void   add_socket(struct user_t *user);
 void   remove_socket(struct user_t *user);
 void   send_to_non_humans(char *buf, int type, struct user_t *ex_user);
+void   relay_to_non_humans(int rec, char *buf, int type, struct user_t *ex_user);
+void   send_to_owner(char *buf, char *nick, struct user_t *ex_user);
 void   send_to_humans(char *buf, int type, struct user_t *ex_user);
 char  *ip_to_string(unsigned long ip);
 int    is_internal_address (long unsigned ip);
 void   send_to_user(char *buf, struct user_t *user);
+void   free_out_queue(struct user_t *user);
+void   close_out_queue(struct user_t *user);
+void   send_output_stats(struct user_t *user);
+struct channel_t *new_channel(void);
+void   set_channel_pid(struct channel_t *chan, int child_pid);
+void   drop_channels(struct channel_t *keep);
+void   open_channel(struct channel_t *chan, struct user_t *user);
+void   channel_handshake(char *buf, struct user_t *user);
+void   drain_channel(struct user_t *user);
+void   close_channel(struct user_t *user);
@@ -67,11 +67,7 @@ int perl_init(void)
    int i, k, len;
    int sock;
    struct sockaddr_un remote_addr;
-   char temp_nick[MAX_NICK_LEN+1];
-   char temp_host[MAX_HOST_LEN+1];
-   char *buf, *bufp;
-   int spaces=0, entries=0;
-   int l;
+   char *nicks, *nickp, *endp;
    int erret;
    int flags;
    
@@ -112,6 +108,10 @@ int perl_init(void)
 	  {
 	     pid = -1;
 	     
+	     /* Don't touch the parents event loop or channels.  */
+	     close_event_loop();
+	     drop_channels(NULL);
+	     
 	     /* Close the listening sockets */
 	     while(((erret =  close(listening_unx_socket)) != 0) && (errno == EINTR))
 	       logprintf(1, "Error - In perl_init()/close(): Interrupted system call. Trying again.\n");
@@ -131,9 +131,6 @@ int perl_init(void)
 		  logerror(1, errno);
 	       }
 	     
-	     /* Set the alarm */
-	     alarm(ALARM_TIME);
-	     
 	     /* And connect to parent process */
 	     if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
 	       {		  
@@ -177,9 +174,9 @@ int perl_init(void)
 	      * we use non_human_user_list.  */
 
 	     /* Allocate space for the new user */
-	     if((non_human_user_list = malloc(sizeof(struct user_t))) == NULL)
+	     if((non_human_user_list = pool_alloc(POOL_USER)) == NULL)
 	       {		  
-		  logprintf(1, "Error - In parl_init()/malloc(): ");
+		  logprintf(1, "Error - In parl_init()/pool_alloc(): ");
 		  logerror(1, errno);
 		  quit = 1;
 		  free(script_list[i]);
@@ -190,7 +187,18 @@ int perl_init(void)
 	     non_human_user_list->rem = 0;	
 	     non_human_user_list->type = SCRIPT;
 	     non_human_user_list->buf = NULL;
-	     non_human_user_list->outbuf = NULL;
+	     non_human_user_list->buf_len = 0;
+	     non_human_user_list->buf_size = 0;
+	     non_human_user_list->out_head = NULL;
+	     non_human_user_list->out_tail = NULL;
+	     non_human_user_list->out_len = 0;
+	     non_human_user_list->out_full = 0;
+	     non_human_user_list->out_pending = 0;
+	     non_human_user_list->channel = NULL;
+	     non_human_user_list->sock_index = -1;
+	     non_human_user_list->counted = 0;
+	     non_human_user_list->accepting = 0;
+	     init_user_timers(non_human_user_list);
 	     non_human_user_list->next = NULL;
 	     non_human_user_list->email = NULL;
 	     non_human_user_list->desc = NULL;
@@ -202,6 +210,10 @@ int perl_init(void)
 	     /* Remove all users.  */	    
 	     remove_all(~SCRIPT, 0, 0);
 	     
+	     /* The users of the old list are still counted.  */
+	     reset_user_counts();
+	     count_user(non_human_user_list, 1);
+	     
 	     /* Initialize the perl interpreter for this process */
 	     if((my_perl = perl_alloc()) == NULL) 
 	       {	
@@ -244,43 +256,18 @@ int perl_init(void)
 	     /* Get info of all users.  */
 	     if(i == 0)
 	       {				  		
-		  sem_take(user_list_sem);
-		  
-		  /* Attach to the shared segment */
-		  if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-		     == (char *)-1)
-		    {		       
-		       logprintf(1, "Error - In perl_init()/shmat(): ");
-		       logerror(1, errno);
-		       sem_give(user_list_sem);
-		       quit = 1;
-		       return -1;
-		    }
+		  if((nicks = get_user_list_nicks()) == NULL)
+		    return -1;
 		  
-		  if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
-		    {		       
-		       logprintf(1, "Error - In perl_init(): Couldn't get number of entries\n");
-		       shmdt(buf);
-		       sem_give(user_list_sem);
-		       quit = 1;
-		       return -1;
-		    }		  		  
-		  
-		  bufp = buf + 30;
-		  
-		  for(l = 1; l <= spaces; l++)
-		    {		       
-		       if(*bufp != '\0')
-			 {			    
-			    sscanf(bufp, "%50s %120s", temp_nick, temp_host);
-			    uprintf(non_human_user_list, 
-				    "$GetINFO %s $Script|", temp_nick);
-			 }		       
-		       
-		       bufp += USER_LIST_ENT_SIZE;
+		  nickp = nicks;
+		  while((endp = strchr(nickp, ' ')) != NULL)
+		    {
+		       *endp = '\0';
+		       uprintf(non_human_user_list, 
+			       "$GetINFO %s $Script|", nickp);
+		       nickp = endp + 1;
 		    }
-		  shmdt(buf);
-		  sem_give(user_list_sem);		 
+		  free(nicks);
 	       }	     
 	     return 1;
 	  }
@@ -386,9 +373,9 @@ void sub_to_script(char *buf)
 	/* If the user isn't already here, allocate a new user.  */
 	if((temp_user = get_human_user(temp_nick)) == NULL)
 	  {	     
-	     if((temp_user = malloc(sizeof(struct user_t))) == NULL)
+	     if((temp_user = pool_alloc(POOL_USER)) == NULL)
 	       {		  
-		  logprintf(1, "Error - In sub_to_script()/malloc(): ");
+		  logprintf(1, "Error - In sub_to_script()/pool_alloc(): ");
 		  logerror(1, errno);
 		  quit = 1;
 		  return;
@@ -397,27 +384,38 @@ void sub_to_script(char *buf)
 	     temp_user->email = NULL;
 	     temp_user->desc = NULL;
 	     temp_user->buf = NULL;
-	     temp_user->outbuf = NULL;
+	     temp_user->buf_len = 0;
+	     temp_user->buf_size = 0;
+	     temp_user->out_head = NULL;
+	     temp_user->out_tail = NULL;
+	     temp_user->out_len = 0;
+	     temp_user->out_full = 0;
+	     temp_user->out_pending = 0;
+	     temp_user->channel = NULL;
+	     temp_user->sock_index = -1;
+	     temp_user->counted = 0;
+	     temp_user->accepting = 0;
+	     init_user_timers(temp_user);
 	  }
 	else
 	  {
 	     remove_human_from_hash(temp_user->nick);
 	     
 	     if(temp_user->email != NULL)
-	       free(temp_user->email);
+	       free_string(temp_user->email);
 	     temp_user->email = NULL;
 	     
 	     if(temp_user->desc != NULL)
-	       free(temp_user->desc);
+	       free_string(temp_user->desc);
 	     temp_user->desc = NULL;
 	     
 	     if(temp_user->buf != NULL)
-	       free(temp_user->buf);
+	       free_string(temp_user->buf);
 	     temp_user->buf = NULL;
+	     temp_user->buf_len = 0;
+	     temp_user->buf_size = 0;
 	     
-	     if(temp_user->outbuf != NULL)
-	       free(temp_user->outbuf);
-	     temp_user->outbuf = NULL;
+	     free_out_queue(temp_user);
 	  }
 	
 	temp_user->type = NON_LOGGED;
@@ -429,7 +427,7 @@ void sub_to_script(char *buf)
 	
 	temp_user->rem = 0;
 	temp_user->key = 0;
-	temp_user->last_search = (time_t)0;
+	temp_user->search_wait = 0;
 	
 	/* The sock won't be used in the script, so set it to 0.  */
 	temp_user->sock = 0;
@@ -606,24 +604,23 @@ void sub_to_script(char *buf)
 	  {
 	     if(temp_user->buf != NULL)
 	       {
-		  free(temp_user->buf);
+		  free_string(temp_user->buf);
 		  temp_user->buf = NULL;
+		  temp_user->buf_len = 0;
+		  temp_user->buf_size = 0;
 	       }
-	     if(temp_user->outbuf != NULL)
-	       {
-		  free(temp_user->outbuf);
-		  temp_user->outbuf = NULL;
-	       }
+	     free_out_queue(temp_user);
 	     if(temp_user->email != NULL)
 	       {
-		  free(temp_user->email);
+		  free_string(temp_user->email);
 		  temp_user->email = NULL;
 	       }
 	     if(temp_user->desc != NULL)
 	       {
-		  free(temp_user->desc);
+		  free_string(temp_user->desc);
 		  temp_user->desc = NULL;
 	       }
+	     cancel_user_timers(temp_user);
 	     remove_human_from_hash(temp_user->nick);
 	     
 	  }
@@ -17,13 +17,31 @@
  */
 
 
-/* The user list is a shared memory segment that contains a list of all users 
- * and their hostnames. The first 20 bytes in the segment are reserved for two
- * integers; one which holds the number of spaces for entries in the list, and 
- * the other contains the actual number of entries, i.e, the amount of 
- * connected users.  
- * After the first 20 bytes, an integer is held which tells the current 
- * process that is listening for connections.  */
+/* The user list is a shared memory segment that contains all users in the 
+ * hub. It starts with a header that holds the size of the list, the number
+ * of entries and the pid of the process that is listening for connections.
+ * After the header comes a hash index with one integer per space, and then
+ * the entries themselves, packed at the beginning of the entry array.
+ * The index is hashed on the case folded nick and is open addressed, an 
+ * index slot is 0 if it's empty, -1 if the entry in it has been removed and 
+ * otherwise the number of the entry plus one. There is room for half as many
+ * entries as there are spaces in the index, so the probe sequences stay 
+ * short. Last in the segment are the $NickList and the $OpList, kept ready 
+ * to be sent. New users are added at the end of them. When a user leaves,
+ * the lists are only marked as stale, and they are built again from the 
+ * entries by the next process that reads them, so a quit never has to 
+ * search them.
+ * Every process keeps the list mapped. When the list is resized, it's moved
+ * to a new segment and the generation in the control segment is increased,
+ * which tells the other processes to map the new segment the next time they
+ * use the list.
+ * Readers never block. The control segment holds a sequence number that 
+ * writers increase before and after they change the list, so it's odd while
+ * a change is in progress. A reader copies what it needs from the list and
+ * starts over if the sequence number was odd or has changed meanwhile. 
+ * Writers exclude each other with a futex, or with user_list_sem where
+ * futexes aren't available. Nothing may be sent or looked up while reading
+ * the list, since the read may have to be done again.  */
 
 #ifdef HAVE_CONFIG_H
 # include "config.h"
@@ -38,6 +56,7 @@
 #include <sys/sem.h>
 #include <sys/ipc.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "main.h"
 #include "userlist.h"
@@ -45,18 +64,409 @@
 #include "fileio.h"
 #include "network.h"
 
-int init_user_list(void)
+struct user_list_head
+{
+   int spaces;                        /* Number of slots in the index, always
+				       * a power of two */
+   int capacity;                      /* Number of entries there is room for */
+   int entries;                       /* Number of entries, i.e, the number
+				       * of connected users */
+   int deleted;                       /* Number of removed slots in the index */
+   int listening_pid;                 /* Process holding the listening sockets */
+   int nick_list_len;                 /* Length of the $NickList */
+   int op_list_len;                   /* Length of the $OpList */
+   int nick_list_stale;               /* 1 if the $NickList has to be built */
+   int op_list_stale;                 /* 1 if the $OpList has to be built */
+};
+
+/* The segment that user_list_shm_shm refers to.  */
+struct user_list_ctl
+{
+   int shm_id;                        /* Id of the user list segment */
+   unsigned int generation;           /* Increased every time the list is
+				       * moved to a new segment */
+   unsigned int seq;                  /* Odd while the list is being changed */
+   int lock;                          /* Futex taken by writers */
+};
+
+struct user_list_ent
+{
+   unsigned int hash;                 /* nick_hash() of the nick */
+   char nick[MAX_NICK_LEN+1];
+   char hostname[MAX_HOST_LEN+1];
+   long unsigned ip;
+   int pid;                           /* Process that the user is connected to */
+   int type;
+   long long share;
+   int op;                            /* 1 if the user is on the $OpList */
+};
+
+static struct user_list_ctl *user_list_ctl = NULL;
+static struct user_list_head *user_list = NULL;
+static unsigned int user_list_gen;
+
+#define USER_LIST_INDEX(head) ((int *)((head) + 1))
+#define USER_LIST_ENTRIES(head) ((struct user_list_ent *)(USER_LIST_INDEX(head) + (head)->spaces))
+#define USER_LIST_NICK_LIST(head) ((char *)(USER_LIST_ENTRIES(head) + (head)->capacity))
+#define USER_LIST_OP_LIST(head) (USER_LIST_NICK_LIST(head) + list_size((head)->capacity))
+
+#define NICK_LIST_START "$NickList "
+#define OP_LIST_START "$OpList "
+
+/* Returns the size of a $NickList or $OpList with room for capacity nicks.  */
+static size_t list_size(int capacity)
+{
+   return sizeof(NICK_LIST_START) + capacity * (MAX_NICK_LEN + 2) + 2;
+}
+
+/* Returns the size of a user list segment with spaces slots.  */
+static size_t user_list_size(int spaces)
+{
+   return sizeof(struct user_list_head) + spaces * sizeof(int) 
+     + (spaces / 2) * sizeof(struct user_list_ent) + 2 * list_size(spaces / 2);
+}
+
+/* Returns this process' mapping of the user list, and maps the list again if
+ * it has been moved to a new segment since the last call. A writer may move
+ * the list while it's being mapped, so the generation is read before the
+ * segment id and checked again afterwards, and the mapping is done again if
+ * it changed. The old segment may then already be gone, so shmat() failing
+ * is only an error if the generation stayed the same.  */
+static struct user_list_head *attach_user_list(char *func)
+{
+   struct user_list_head *head;
+   unsigned int gen;
+   int shm_id;
+   
+   while(1)
+     {
+	gen = *(volatile unsigned int *)&user_list_ctl->generation;
+	__sync_synchronize();
+	
+	if((user_list != NULL) && (user_list_gen == gen))
+	  return user_list;
+	
+	shm_id = *(volatile int *)&user_list_ctl->shm_id;
+	head = (struct user_list_head *)shmat(shm_id, NULL, 0);
+	__sync_synchronize();
+	
+	if(*(volatile unsigned int *)&user_list_ctl->generation != gen)
+	  {
+	     /* The list moved while it was being mapped.  */
+	     if(head != (struct user_list_head *)-1)
+	       shmdt((char *)head);
+	     continue;
+	  }
+	
+	if(head == (struct user_list_head *)-1)
+	  {
+	     if(((errno == EIDRM) || (errno == EINVAL))
+		&& (*(volatile int *)&user_list_ctl->shm_id != shm_id))
+	       {
+		  /* The segment id was replaced before the generation was
+		   * increased, try again.  */
+		  sched_yield();
+		  continue;
+	       }
+	     logprintf(1, "Error - In %s()/shmat(): ", func);
+	     logerror(1, errno);
+	     quit = 1;
+	     return NULL;
+	  }
+	break;
+     }
+   
+   if(user_list != NULL)
+     shmdt((char *)user_list);
+   
+   user_list = head;
+   user_list_gen = gen;
+   
+   return user_list;
+}
+
+/* Replaces the user list with the segment new_shm_id, which is mapped at 
+ * newhead, and removes the old segment. Only done by writers.  */
+static void replace_user_list(int new_shm_id, struct user_list_head *newhead)
+{
+   int old_shm_id;
+   
+   old_shm_id = user_list_ctl->shm_id;
+   
+   /* The new segment is made known before the old one is removed, so a 
+    * reader that still finds the old id sees the generation change. The
+    * segment is destroyed when the last process has detached from it, so
+    * readers that still use it are safe.  */
+   set_user_list_shm_id(new_shm_id);
+   shmdt((char *)user_list);
+   shmctl(old_shm_id, IPC_RMID, NULL);
+   
+   user_list = newhead;
+   user_list_gen = user_list_ctl->generation;
+}
+
+/* Takes the writer lock and marks the list as being changed.  */
+static void write_lock_user_list(void)
+{
+#if HAVE_LINUX_FUTEX_H
+   futex_take(&user_list_ctl->lock);
+#else
+   sem_take(user_list_sem);
+#endif
+   user_list_ctl->seq++;
+   __sync_synchronize();
+}
+
+/* Marks the change as done and gives back the writer lock.  */
+static void write_unlock_user_list(void)
+{
+   __sync_synchronize();
+   user_list_ctl->seq++;
+#if HAVE_LINUX_FUTEX_H
+   futex_give(&user_list_ctl->lock);
+#else
+   sem_give(user_list_sem);
+#endif
+}
+
+/* Starts a read of the list and returns the sequence number to check it
+ * against.  */
+static unsigned int read_begin_user_list(void)
+{
+   unsigned int seq;
+   
+   while(((seq = *(volatile unsigned int *)&user_list_ctl->seq) & 1) != 0)
+     sched_yield();
+   
+   __sync_synchronize();
+   return seq;
+}
+
+/* Returns 1 if the list was changed during the read that started with seq,
+ * in which case the read must be done again.  */
+static int read_retry_user_list(unsigned int seq)
+{
+   __sync_synchronize();
+   return (*(volatile unsigned int *)&user_list_ctl->seq != seq) ? 1 : 0;
+}
+
+/* Returns the index slot of nick, or -1 if the nick isn't on the list.
+ * Readers may see the index while it's being changed, so the probe is bounded
+ * and the entry numbers are checked. The last byte of a nick in the list is
+ * always zero.  */
+static int find_slot(struct user_list_head *head, char *nick, unsigned int hash)
+{
+   int *index;
+   struct user_list_ent *ent;
+   int mask;
+   int i, n, k;
+   
+   index = USER_LIST_INDEX(head);
+   ent = USER_LIST_ENTRIES(head);
+   mask = head->spaces - 1;
+   
+   for(i = hash & mask, n = 0; n < head->spaces; i = (i + 1) & mask, n++)
+     {
+	if((k = index[i]) == 0)
+	  break;
+	if((k > 0) && (k <= head->capacity) && (ent[k-1].hash == hash)
+	   && (strcasecmp(ent[k-1].nick, nick) == 0))
+	  return i;
+     }
+   
+   return -1;
+}
+
+/* Returns the index slot that points to entry number entnum.  */
+static int find_entry_slot(struct user_list_head *head, int entnum)
+{
+   int *index;
+   int mask;
+   int i;
+   
+   index = USER_LIST_INDEX(head);
+   mask = head->spaces - 1;
+   
+   for(i = USER_LIST_ENTRIES(head)[entnum].hash & mask; index[i] != 0; 
+       i = (i + 1) & mask)
+     {
+	if(index[i] == entnum + 1)
+	  return i;
+     }
+   
+   return -1;
+}
+
+/* Puts entry number entnum in the first free slot of its probe sequence.  */
+static void insert_slot(struct user_list_head *head, int entnum)
+{
+   int *index;
+   int mask;
+   int i;
+   
+   index = USER_LIST_INDEX(head);
+   mask = head->spaces - 1;
+   
+   for(i = USER_LIST_ENTRIES(head)[entnum].hash & mask; index[i] > 0;
+       i = (i + 1) & mask);
+   
+   if(index[i] == -1)
+     head->deleted--;
+   
+   index[i] = entnum + 1;
+}
+
+/* Rebuilds the index from the entries, which gets rid of removed slots.  */
+static void rebuild_index(struct user_list_head *head)
 {
    int i;
+   
+   memset(USER_LIST_INDEX(head), 0, head->spaces * sizeof(int));
+   head->deleted = 0;
+   
+   for(i = 0; i < head->entries; i++)
+     insert_slot(head, i);
+}
+
+/* Adds nick to the end of the $NickList if op is 0 and of the $OpList
+ * otherwise. A stale list is left alone, since it has to be built anyway,
+ * and could have run out of room.  */
+static void add_to_list(struct user_list_head *head, int op, char *nick)
+{
+   int *len;
+   
+   if(((op != 0) ? head->op_list_stale : head->nick_list_stale) != 0)
+     return;
+   
+   len = (op != 0) ? &head->op_list_len : &head->nick_list_len;
+   
+   /* Overwrite the "||" at the end.  */
+   *len -= 2;
+   *len += sprintf(((op != 0) ? USER_LIST_OP_LIST(head) 
+		    : USER_LIST_NICK_LIST(head)) + *len, "%s$$||", nick);
+}
+
+/* Builds the $NickList if op is 0 and the $OpList otherwise from the
+ * entries. Only done by writers.  */
+static void build_list(struct user_list_head *head, int op)
+{
+   struct user_list_ent *ent;
+   char *list, *p;
+   int len;
+   int i;
+   
+   list = (op != 0) ? USER_LIST_OP_LIST(head) : USER_LIST_NICK_LIST(head);
+   ent = USER_LIST_ENTRIES(head);
+   
+   p = list + sprintf(list, "%s", (op != 0) ? OP_LIST_START : NICK_LIST_START);
+   for(i = 0; i < head->entries; i++)
+     {
+	if((op != 0) && (ent[i].op == 0))
+	  continue;
+	len = strlen(ent[i].nick);
+	memcpy(p, ent[i].nick, len);
+	p += len;
+	*p++ = '$';
+	*p++ = '$';
+     }
+   strcpy(p, "||");
+   
+   if(op != 0)
+     {
+	head->op_list_len = p + 2 - list;
+	head->op_list_stale = 0;
+     }
+   else
+     {
+	head->nick_list_len = p + 2 - list;
+	head->nick_list_stale = 0;
+     }
+}
+
+/* Creates a new user list segment with room for spaces slots and copies the
+ * entries of the current one to it, and then replaces the current list with 
+ * it. Only done by writers. Returns -1 on error.  */
+static int resize_user_list(struct user_list_head *oldhead, int spaces)
+{
+   struct user_list_head *newhead;
+   int new_user_list_shm;
+   
+   /* Get identifier for the new shared data segment.  */
+   if((new_user_list_shm = shmget(IPC_PRIVATE, user_list_size(spaces), 0600)) < 0)
+     {	
+	logprintf(1, "Error - In resize_user_list()/shmget(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   
+   /* Attach to the shared segment */
+   if((newhead = (struct user_list_head *)shmat(new_user_list_shm, NULL, 0))
+      == (struct user_list_head *)-1)
+     {	
+	logprintf(1, "Error - In resize_user_list()/shmat(): ");
+	logerror(1, errno);
+	shmctl(new_user_list_shm, IPC_RMID, NULL);
+	quit = 1;
+	return -1;
+     }
+   
+   newhead->spaces = spaces;
+   newhead->capacity = spaces / 2;
+   newhead->entries = oldhead->entries;
+   newhead->listening_pid = oldhead->listening_pid;
+   newhead->nick_list_stale = oldhead->nick_list_stale;
+   newhead->op_list_stale = oldhead->op_list_stale;
+   
+   /* The entries are packed, so they are copied in one go. Then the index
+    * is built from them.  */
+   memcpy(USER_LIST_ENTRIES(newhead), USER_LIST_ENTRIES(oldhead), 
+	  oldhead->entries * sizeof(struct user_list_ent));
+   rebuild_index(newhead);
+   
+   /* A list that is up to date only has the nicks of the entries, so it
+    * fits. A stale one may still have the nicks of users that have left,
+    * more than there is room for after a purge, so it's not copied but 
+    * built when it's read.  */
+   if(oldhead->nick_list_stale == 0)
+     {
+	newhead->nick_list_len = oldhead->nick_list_len;
+	memcpy(USER_LIST_NICK_LIST(newhead), USER_LIST_NICK_LIST(oldhead),
+	       oldhead->nick_list_len + 1);
+     }
+   else
+     {
+	newhead->nick_list_len = 0;
+	USER_LIST_NICK_LIST(newhead)[0] = '\0';
+     }
+   if(oldhead->op_list_stale == 0)
+     {
+	newhead->op_list_len = oldhead->op_list_len;
+	memcpy(USER_LIST_OP_LIST(newhead), USER_LIST_OP_LIST(oldhead),
+	       oldhead->op_list_len + 1);
+     }
+   else
+     {
+	newhead->op_list_len = 0;
+	USER_LIST_OP_LIST(newhead)[0] = '\0';
+     }
+   
+   replace_user_list(new_user_list_shm, newhead);
+   
+   return 1;
+}
+
+int init_user_list(void)
+{
    int user_list_shm_id;
-   char *buf, *bufp;
+   struct user_list_head *head;
    
    if(init_user_list_shm_shm() == -1)
      return -1;
       
-   /* Get identifier for the shared data segment, starting with space for 50
-    * users, plus some space for the number of entries and spaces.  */
-   if((user_list_shm_id = shmget(IPC_PRIVATE, 50*USER_LIST_ENT_SIZE+35, 0600)) < 0)
+   /* Get identifier for the shared data segment, starting with room for
+    * USER_LIST_SPACES slots.  */
+   if((user_list_shm_id = shmget(IPC_PRIVATE, user_list_size(USER_LIST_SPACES), 0600)) < 0)
      {	
 	logprintf(1, "Error - In init_user_list()/shmget(): ");
 	logerror(1, errno);
@@ -68,8 +478,8 @@ int init_user_list(void)
    set_user_list_shm_id(user_list_shm_id);
    
    /* Attach to the shared segment */
-   if((buf = (char *)shmat(user_list_shm_id, NULL, 0))
-      == (char *)-1)
+   if((head = (struct user_list_head *)shmat(user_list_shm_id, NULL, 0))
+      == (struct user_list_head *)-1)
      {	
 	logprintf(1, "Error - In init_user_list()/shmat(): ");
 	logerror(1, errno);
@@ -79,23 +489,20 @@ int init_user_list(void)
 	return -1;
      }
    
-   shmdt((char *)user_list_shm_id);
-   
-   /* Print the current number of entries.  */
-   sprintf(buf, "%d %d", 50, 0);
-
-   bufp = buf + 20;
-   sprintf(bufp, "%d", 0);
-   
-   /* Initialize the entries to 0.  */
-   bufp = buf + 30;
-   for(i = 1; i <= 50; i++)
-     {	
-	*bufp = '\0';
-	bufp += USER_LIST_ENT_SIZE;
-     }   
-   
-   shmdt(buf);
+   /* A new segment is zeroed, so the index is already empty.  */
+   head->spaces = USER_LIST_SPACES;
+   head->capacity = USER_LIST_SPACES / 2;
+   head->entries = 0;
+   head->deleted = 0;
+   head->listening_pid = 0;
+   head->nick_list_len = sprintf(USER_LIST_NICK_LIST(head), "%s||", NICK_LIST_START);
+   head->op_list_len = sprintf(USER_LIST_OP_LIST(head), "%s||", OP_LIST_START);
+   head->nick_list_stale = 0;
+   head->op_list_stale = 0;
+   
+   /* Children inherit the mapping when they are forked.  */
+   user_list = head;
+   user_list_gen = user_list_ctl->generation;
    
    return 1;
 }
@@ -107,503 +514,525 @@ int init_user_list_shm_shm(void)
    /* Get identifier for the shared segment that contains the identifier for
     * the user list. Since the id for the user list may change when it's 
     * resized, it has to be done this way.  */
-   if((user_list_shm_shm = shmget(IPC_PRIVATE, sizeof(int), 0600)) < 0)
+   if((user_list_shm_shm = shmget(IPC_PRIVATE, sizeof(struct user_list_ctl),
+				  0600)) < 0)
      {	 
 	logprintf(1, "Error - In init_user_list_shm_shm()/shmget(): ");
 	logerror(1, errno);
 	quit = 1;
 	return -1;
      }
-   return 1;
-}
-
-/* Gets the current id of the shared memory segment that contains the user list.  */
-int get_user_list_shm_id(void)
-{
-   int *shmid;
-   int id;
    
-   /* Attach to the shared memory segment.  */
-   if((shmid = (int *)shmat(user_list_shm_shm, NULL, 0))
-      == (int *)-1)
+   /* This one never moves, so it's mapped for good.  */
+   if((user_list_ctl = (struct user_list_ctl *)shmat(user_list_shm_shm, NULL, 0))
+      == (struct user_list_ctl *)-1)
      {	
-	logprintf(1, "Error - In get_user_list_shm_id()/shmat(): ");
+	logprintf(1, "Error - In init_user_list_shm_shm()/shmat(): ");
 	logerror(1, errno);
+	shmctl(user_list_shm_shm, IPC_RMID, NULL);
+	user_list_ctl = NULL;
+	quit = 1;
 	return -1;
      }
    
-   id = *shmid;
-   shmdt((char *)shmid);
-   return id;
+   user_list_ctl->shm_id = -1;
+   user_list_ctl->generation = 0;
+   user_list_ctl->seq = 0;
+   user_list_ctl->lock = 0;
+   return 1;
 }
 
-/* Sets the current id of the shared memory segment that contains the user list.  */
+/* Gets the current id of the shared memory segment that contains the user list.  */
+int get_user_list_shm_id(void)
+{
+   return user_list_ctl->shm_id;
+}
+
+/* Sets the current id of the shared memory segment that contains the user
+ * list, and lets the other processes know that the list has moved.  */
 void set_user_list_shm_id(int id)
 {
-   int *shmid;
-   
-   /* Attach to the shared memory segment.  */
-   if((shmid = (int *)shmat(user_list_shm_shm, NULL, 0))
-      == (int *)-1)
-     {	
-	logprintf(1, "Error - In set_user_list_shm_id()/shmat(): ");
-	logerror(1, errno);
-	return;
-     }
-   
-   *shmid = id;
-   shmdt((char *)shmid);
+   user_list_ctl->shm_id = id;
+   __sync_synchronize();
+   user_list_ctl->generation++;
 }
 
-/* Adds a user to the list. Returns 0 if user list needs to be increased.  */
+/* Adds a user to the list. Returns 0 if user list needs to be increased.  
+ * If the user already is on the list and is connected to this process, the
+ * entry is updated instead.  */
 int add_user_to_list(struct user_t *user)
 {
-   char *buf, *bufp;
-   int spaces=0, entries=0;
-   int i;
-
-   if(check_if_on_user_list(user->nick) != NULL)
-     return 1;
+   struct user_list_head *head;
+   struct user_list_ent *ent;
+   unsigned int hash;
+   int slot;
+   int op, ret;
    
-   sem_take(user_list_sem);
+   hash = nick_hash(user->nick);
+   op = -1;
    
-   /* Attach to the shared segment */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In add_user_to_list()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return -1;
+   while(1)
+     {
+	write_lock_user_list();
+	
+	if((head = attach_user_list("add_user_to_list")) == NULL)
+	  {
+	     write_unlock_user_list();
+	     return -1;
+	  }
+	
+	if(((slot = find_slot(head, user->nick, hash)) != -1) || (op != -1))
+	  break;
+	
+	/* It's a new user, so check if it's an op. The reglist isn't read
+	 * while holding the lock.  */
+	write_unlock_user_list();
+	ret = check_if_registered(user->nick);
+	op = ((ret == 2) || (ret == 3)) ? 1 : 0;
      }
    
-   /* Check how many entries are in the list.  */
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
+   if(slot != -1)
      {
-	logprintf(1, "Error - In add_user_to_list(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return -1;
+	ent = &USER_LIST_ENTRIES(head)[USER_LIST_INDEX(head)[slot]-1];
+	if(ent->pid == (int)getpid())
+	  {
+	     ent->ip = user->ip;
+	     ent->type = user->type;
+	     ent->share = user->share;
+	  }
+	write_unlock_user_list();
+	return 1;
      }
-
-   bufp = buf + 30;
-
-   for(i = 1; i <= spaces; i++) 
+   
+   if(head->entries >= head->capacity)
      {
-	if(*bufp == '\0')
-	  {
-	     /* And add users nick and hostname.  */
-	     snprintf(bufp, USER_LIST_ENT_SIZE, "%s %s", user->nick, user->hostname);
-	     sprintf(buf, "%d %d", spaces, entries+1);
-	     /* Detach from the segment.  */
-	     shmdt(buf);
-	     sem_give(user_list_sem);
-	     return 1;
-	  }	
-	bufp += USER_LIST_ENT_SIZE;
+	write_unlock_user_list();
+	return 0;
      }
    
-   shmdt(buf);
-   sem_give(user_list_sem);   
-   return 0;
+   /* And add the user at the end of the entries.  */
+   ent = &USER_LIST_ENTRIES(head)[head->entries];
+   memset(ent, 0, sizeof(struct user_list_ent));
+   ent->hash = hash;
+   strcpy(ent->nick, user->nick);
+   strcpy(ent->hostname, user->hostname);
+   ent->ip = user->ip;
+   ent->pid = (int)getpid();
+   ent->type = user->type;
+   ent->share = user->share;
+   ent->op = op;
+   insert_slot(head, head->entries);
+   head->entries++;
+   
+   add_to_list(head, 0, ent->nick);
+   if(op != 0)
+     add_to_list(head, 1, ent->nick);
+   
+   write_unlock_user_list();   
+   return 1;
 }
 
 /* Removes a user from the list. Returns 1 if user is remove, 0 if user 
  * wasn't found and -1 on error.  */
 int remove_user_from_list(char *nick)
 {
-   char *buf, *bufp;
-   char temp_nick[MAX_NICK_LEN+1];
-   int spaces=0, entries=0;
-   int i;
+   struct user_list_head *head;
+   struct user_list_ent *ent;
+   int *index;
+   int slot, last_slot;
+   int entnum, last;
    
-   sem_take(user_list_sem);
+   write_lock_user_list();
    
-   /* Attach to the shared segment */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In remove_user_from_list()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
+   if((head = attach_user_list("remove_user_from_list")) == NULL)
+     {
+	write_unlock_user_list();
 	return -1;
      }
    
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
+   if((slot = find_slot(head, nick, nick_hash(nick))) == -1)
      {
-	logprintf(1, "Error - In remove_user_from_list(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return -1;
+	write_unlock_user_list();
+	return 0;
+     }
+   
+   index = USER_LIST_INDEX(head);
+   ent = USER_LIST_ENTRIES(head);
+   entnum = index[slot] - 1;
+   last = head->entries - 1;
+   
+   head->nick_list_stale = 1;
+   if(ent[entnum].op != 0)
+     head->op_list_stale = 1;
+   
+   index[slot] = -1;
+   head->deleted++;
+   
+   /* Keep the entries packed by moving the last one into the hole.  */
+   if(entnum != last)
+     {
+	last_slot = find_entry_slot(head, last);
+	memcpy(&ent[entnum], &ent[last], sizeof(struct user_list_ent));
+	index[last_slot] = entnum + 1;
      }
+   head->entries--;
+   
+   /* Too many removed slots make the probe sequences long.  */
+   if(head->deleted > head->spaces / 4)
+     rebuild_index(head);
+   
+   write_unlock_user_list();
+   
+   return 1;
+}
 
-   bufp = buf + 30;     
+/* Checks in the reglist if nick is an op and puts it on or takes it off the
+ * $OpList. Called when the reglist has been changed.  */
+void update_op_in_user_list(char *nick)
+{
+   struct user_list_head *head;
+   struct user_list_ent *ent;
+   int slot;
+   int op, ret;
+   
+   ret = check_if_registered(nick);
+   op = ((ret == 2) || (ret == 3)) ? 1 : 0;
    
-   for(i = 1; i <= spaces; i++) 
+   write_lock_user_list();
+   
+   if((head = attach_user_list("update_op_in_user_list")) == NULL)
      {
-	if(*bufp != '\0')
-	  {	     
-	     sscanf(bufp, "%50s", temp_nick);
-	     if((strncasecmp(temp_nick, nick, strlen(nick)) == 0)
-		&& (strlen(nick) == strlen(temp_nick)))
-	       {
-		  sprintf(buf, "%d %d", spaces, entries-1);
-		  /* Set the first character in the nick to null.  */
-		  *bufp = '\0';
-		  shmdt(buf);
-		  sem_give(user_list_sem);
-		  return 1;
-	       }
-	  }	
-	bufp += USER_LIST_ENT_SIZE;
+	write_unlock_user_list();
+	return;
      }
    
-   shmdt(buf);
-   sem_give(user_list_sem);
+   if((slot = find_slot(head, nick, nick_hash(nick))) != -1)
+     {
+	ent = &USER_LIST_ENTRIES(head)[USER_LIST_INDEX(head)[slot]-1];
+	if((ent->op == 0) && (op != 0))
+	  add_to_list(head, 1, ent->nick);
+	else if((ent->op != 0) && (op == 0))
+	  head->op_list_stale = 1;
+	ent->op = op;
+     }
    
-   return 0;
+   write_unlock_user_list();
 }
 
 /* Check if user is on the list. Returns the nick with the case in the 
  * userlist if found, otherwise NULL is returned.  */
 char *check_if_on_user_list(char *nick)
 {
-   char *buf, *bufp;
+   struct user_list_head *head;
    static char temp_nick[MAX_NICK_LEN+1];
-   int spaces=0, entries=0;
-   int i;
+   unsigned int hash;
+   unsigned int seq;
+   int slot;
    
-   sem_take(user_list_sem);
+   hash = nick_hash(nick);
    
-   /* Attach to the shared segment */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In check_if_on_user_list()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return NULL;
-     }
-   
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
+   do
      {
-	logprintf(1, "Error - In check_if_on_user_list(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return NULL;
+	seq = read_begin_user_list();
+	
+	if((head = attach_user_list("check_if_on_user_list")) == NULL)
+	  return NULL;
+	
+	if((slot = find_slot(head, nick, hash)) != -1)
+	  memcpy(temp_nick, 
+		 USER_LIST_ENTRIES(head)[USER_LIST_INDEX(head)[slot]-1].nick,
+		 MAX_NICK_LEN+1);
      }
+   while(read_retry_user_list(seq));
+   
+   return (slot != -1) ? temp_nick : NULL;
+}
 
-   bufp = buf + 30;
+/* Puts users hostname in buffy.  */
+void get_users_hostname(char *nick, char *buffy)
+{
+   struct user_list_head *head;
+   unsigned int hash;
+   unsigned int seq;
+   int slot;
+   
+   hash = nick_hash(nick);
    
-   for(i = 1; i <= spaces; i++) 
+   do
      {
-	if(*bufp != '\0')
-	  {	     
-	     sscanf(bufp, "%50s", temp_nick);
-	     if((strncasecmp(temp_nick, nick, strlen(nick)) == 0)
-		&& (strlen(nick) == strlen(temp_nick)))
-	       {
-		  /* The user is here, so detach and return 1.  */
-		  shmdt(buf);
-		  sem_give(user_list_sem);
-		  return temp_nick;
-	       }
-	  }	
+	/* If user isn't found, put null in returning string */
+	*buffy = '\0';
+	
+	seq = read_begin_user_list();
 	
-	bufp += USER_LIST_ENT_SIZE;
+	if((head = attach_user_list("get_users_hostname")) == NULL)
+	  return;
+	
+	if((slot = find_slot(head, nick, hash)) != -1)
+	  memcpy(buffy, 
+		 USER_LIST_ENTRIES(head)[USER_LIST_INDEX(head)[slot]-1].hostname,
+		 MAX_HOST_LEN+1);
      }
-   
-   shmdt(buf);
-   sem_give(user_list_sem);
-   
-   return NULL;
+   while(read_retry_user_list(seq));
 }
-   
 
-/* If there aren't space in our user list, increase it.  */
-void increase_user_list(void)
+/* Returns the pid of the process that nick is connected to, or 0 if nick 
+ * isn't on the list.  */
+int get_users_pid(char *nick)
 {
-   char *oldbuf, *newbuf, *oldbufp, *newbufp;
-   char temp_nick[MAX_NICK_LEN+1];
-   char temp_host[MAX_HOST_LEN+1];
-   int spaces=0, entries=0, oldpid=0;
-   int new_user_list_shm;
-   int i;
+   struct user_list_head *head;
+   unsigned int hash;
+   unsigned int seq;
+   int owner;
+   int slot;
    
-   sem_take(user_list_sem);
+   hash = nick_hash(nick);
    
-   /* Attach to the shared segment */
-   if((oldbuf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In increase_user_list()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
+   do
+     {
+	owner = 0;
+	
+	seq = read_begin_user_list();
+	
+	if((head = attach_user_list("get_users_pid")) == NULL)
+	  return 0;
+	
+	if((slot = find_slot(head, nick, hash)) != -1)
+	  owner = USER_LIST_ENTRIES(head)[USER_LIST_INDEX(head)[slot]-1].pid;
      }
+   while(read_retry_user_list(seq));
+   
+   return owner;
+}
+
+/* Count all users in the whole hub.  */
+int count_all_users(void)
+{
+   struct user_list_head *head;
+   unsigned int seq;
+   int entries;
    
-   /* Check how many entries are in the list.  */
-   if(sscanf(oldbuf, "%d %d", &spaces, &entries) != 2)
+   do
      {
-	logprintf(1, "Error - In increase_user_list(): Couldn't get number of entries\n");
-	shmdt(oldbuf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
-     }   
-    
-   /* Get identifier for the shared data segment, adding space for 50
-    * users, plus some space for the number of entries.  */
-   if((new_user_list_shm = shmget(IPC_PRIVATE, (spaces+50)*USER_LIST_ENT_SIZE+35, 0600)) < 0)
-     {	
-	logprintf(1, "Error - In increase_user_list()/shmget(): ");
-	logerror(1, errno);
-	shmdt(oldbuf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
+	seq = read_begin_user_list();
+	
+	if((head = attach_user_list("count_all_users")) == NULL)
+	  return -1;
+	
+	entries = head->entries;
      }
+   while(read_retry_user_list(seq));
    
-   /* Attach to the shared segment */
-   if((newbuf = (char *)shmat(new_user_list_shm, NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In increase_user_list()/shmat(): ");
-	logerror(1, errno);
-	shmctl(get_user_list_shm_id(), IPC_RMID, NULL);
-	quit = 1;
-	return;
-     }
+   return entries;
+}
+
+/* Returns a string with the nicks of all users on the list, each followed by
+ * a space. The string must be freed after use.  */
+char *get_user_list_nicks(void)
+{
+   struct user_list_head *head;
+   struct user_list_ent *ent;
+   char *nicks = NULL, *nicksp;
+   size_t size = 0, needed;
+   unsigned int seq;
+   int entries;
+   int i;
    
-   /* Print the current number of entries.  */
-   sprintf(newbuf, "%d %d", spaces+50, entries);
+   do
+     {
+	seq = read_begin_user_list();
+	
+	if((head = attach_user_list("get_user_list_nicks")) == NULL)
+	  {
+	     free(nicks);
+	     return NULL;
+	  }
+	
+	/* The number of entries may change under us, but never beyond the
+	 * capacity of the segment.  */
+	needed = head->capacity * (MAX_NICK_LEN + 1) + 1;
+	if(needed > size)
+	  {
+	     free(nicks);
+	     if((nicks = malloc(sizeof(char) * needed)) == NULL)
+	       {
+		  logprintf(1, "Error - In get_user_list_nicks()/malloc(): ");
+		  logerror(1, errno);
+		  quit = 1;
+		  return NULL;
+	       }
+	     size = needed;
+	  }
+	
+	entries = head->entries;
+	if(entries > head->capacity)
+	  entries = head->capacity;
+	
+	nicksp = nicks;
+	ent = USER_LIST_ENTRIES(head);
+	for(i = 0; i < entries; i++)
+	  {
+	     strcpy(nicksp, ent[i].nick);
+	     nicksp += strlen(nicksp);
+	     *nicksp++ = ' ';
+	  }
+	*nicksp = '\0';
+     }
+   while(read_retry_user_list(seq));
    
-   oldbufp = oldbuf + 20;
-   newbufp = newbuf + 20;
+   return nicks;
+}
 
-   sscanf(oldbufp, "%d", &oldpid);
-   sprintf(newbufp, "%d", oldpid);
+/* If there aren't space in our user list, increase it. The list is doubled
+ * in size, so it doesn't have to be copied very often.  */
+void increase_user_list(void)
+{
+   struct user_list_head *head;
    
-   oldbufp = oldbuf + 30;
-   newbufp = newbuf + 30;
+   write_lock_user_list();
    
-   for(i = 1; i <= spaces; i++) 
+   if((head = attach_user_list("increase_user_list")) == NULL)
      {
-	if(*oldbufp != '\0')
-	  {
-	     /* Get the users nick and hostname.  */
-	     sscanf(oldbufp, "%s %s", temp_nick, temp_host);
-	   
-	     /* Print it in the new shared segment.  */
-	     sprintf(newbufp, "%s %s", temp_nick, temp_host);
-	     newbufp += USER_LIST_ENT_SIZE;
-	  }	
-	oldbufp += USER_LIST_ENT_SIZE;
+	write_unlock_user_list();
+	return;
      }
-
-   /* Detach from the old segment and remove it.  */
-   shmdt(oldbuf);
-   shmctl(get_user_list_shm_id(), IPC_RMID, NULL);
    
-   /* And set the global user_list_shm to what our new segment id is.  */
-   set_user_list_shm_id(new_user_list_shm);
+   /* Someone else may already have made room.  */
+   if(head->entries < head->capacity)
+     {
+	write_unlock_user_list();
+	return;
+     }
    
-   /* Detach from the new one as well.  */
-   shmdt(newbuf);
+   resize_user_list(head, head->spaces * 2);
    
    /* Finally, give back the semaphore.  */
-   sem_give(user_list_sem);
+   write_unlock_user_list();
 }
 
 /* This function is run every ALARM_TIME seconds and checks if the user_list
  * is larger than it needs to be. If it is, it makes it smaller.  */
 void purge_user_list(void)
 {
-   char *oldbuf, *newbuf, *oldbufp, *newbufp;
-   char temp_nick[MAX_NICK_LEN+1];
-   char temp_host[MAX_HOST_LEN+1];
-   int oldspaces=0, entries=0, oldpid=0;
+   struct user_list_head *head;
    int newspaces;
-   int new_user_list_shm;
-   int i;
-   int diff;
    
-   sem_take(user_list_sem);
+   write_lock_user_list();
    
-   /* Attach to the shared segment */
-   if((oldbuf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In purge_user_list()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
-     }
-   
-   /* Check how many entries are in the list.  */
-   if(sscanf(oldbuf, "%d %d", &oldspaces, &entries) != 2)
-     {	
-	logprintf(1, "Error - In purge_user_list(): Couldn't get number of entries\n");
-	shmdt(oldbuf);
-	sem_give(user_list_sem);
-	quit = 1;
+   if((head = attach_user_list("purge_user_list")) == NULL)
+     {
+	write_unlock_user_list();
 	return;
      }
    
-   /* Check if we need to make the userlist smaller.  */
-   
-   /* Difference between spaces and entries in blocks of 50s.  */
-   diff = (oldspaces-entries)/50;
+   /* Halve the list as long as it would be at most half full afterwards.  */
+   newspaces = head->spaces;
+   while((newspaces > USER_LIST_SPACES) 
+	 && (head->entries <= newspaces / 8))
+     newspaces /= 2;
    
-   /* If the difference is less than 50, we're satisfied.  */
-   if(diff < 1)
+   /* If the list is used enough, we're satisfied.  */
+   if(newspaces == head->spaces)
      {
-	shmdt(oldbuf);
-	sem_give(user_list_sem);
+	write_unlock_user_list();
 	return;
      }   
    
-   newspaces = oldspaces - diff*50;
+   resize_user_list(head, newspaces);
    
-   if(newspaces < 50)
-     newspaces = 50;
-   
-   /* Get identifier for the shared data segment, adding space for 50
-    *  users, plus some space for the number of entries.  */
-   if((new_user_list_shm = shmget(IPC_PRIVATE, newspaces*USER_LIST_ENT_SIZE+35, 0600)) < 0)
-     {	
-	logprintf(1, "Error - In purge_user_list()/shmget(): ");
-	logerror(1, errno);
-	shmdt(oldbuf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
-     }
-   
-   /* Attach to the shared segment */
-   if((newbuf = (char *)shmat(new_user_list_shm, NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In purge_user_list()/shmat(): ");
-	logerror(1, errno);
-	shmctl(get_user_list_shm_id(), IPC_RMID, NULL);
-	quit = 1;
-	return;
-     }
-   
-   /* Print the current number of entries.  */
-   sprintf(newbuf, "%d %d", newspaces, entries);
-   
-   oldbufp = oldbuf + 20;
-   newbufp = newbuf + 20;
+   /* Finally, give back the semaphore.  */
+   write_unlock_user_list();
+}
 
-   sscanf(oldbufp, "%d", &oldpid);
-   sprintf(newbufp, "%d", oldpid);
-   
-   oldbufp = oldbuf + 30;
-   newbufp = newbuf + 30;
+/* Returns a copy of the $NickList if op is 0 and of the $OpList otherwise.
+ * The string must be freed after use.  */
+static char *read_list(int op)
+{
+   struct user_list_head *head;
+   char *list = NULL;
+   size_t size = 0, needed;
+   unsigned int seq;
+   int len, stale;
    
-   for(i = 1; i <= oldspaces; i++)
+   do
      {
-	if(*oldbufp != '\0')
-	  {	     
-	     /* Get the users nick and hostname.  */
-	     sscanf(oldbufp, "%s %s", temp_nick, temp_host);
-	     
-	     /* Print it in the new shared segment.  */
-	     sprintf(newbufp, "%s %s", temp_nick, temp_host);
-	     newbufp += USER_LIST_ENT_SIZE;
-	  }	
-	oldbufp += USER_LIST_ENT_SIZE;
+	seq = read_begin_user_list();
+	
+	if((head = attach_user_list("read_list")) == NULL)
+	  {
+	     free(list);
+	     return NULL;
+	  }
+	
+	stale = (op != 0) ? head->op_list_stale : head->nick_list_stale;
+	if((stale != 0) && (read_retry_user_list(seq) == 0))
+	  {
+	     /* Someone has left since the list was built.  */
+	     write_lock_user_list();
+	     if((head = attach_user_list("read_list")) == NULL)
+	       {
+		  write_unlock_user_list();
+		  free(list);
+		  return NULL;
+	       }
+	     if(((op != 0) ? head->op_list_stale : head->nick_list_stale) != 0)
+	       build_list(head, op);
+	     write_unlock_user_list();
+	     continue;
+	  }
+	
+	needed = list_size(head->capacity);
+	if(needed > size)
+	  {
+	     free(list);
+	     if((list = malloc(sizeof(char) * needed)) == NULL)
+	       {
+		  logprintf(1, "Error - In read_list()/malloc(): ");
+		  logerror(1, errno);
+		  quit = 1;
+		  return NULL;
+	       }
+	     size = needed;
+	  }
+	
+	len = (op != 0) ? head->op_list_len : head->nick_list_len;
+	if((len < 0) || ((size_t)len >= size))
+	  len = 0;
+	
+	memcpy(list, (op != 0) ? USER_LIST_OP_LIST(head) 
+	       : USER_LIST_NICK_LIST(head), len);
+	list[len] = '\0';
      }
+   while(read_retry_user_list(seq));
    
-   /* Detach from the old segment and remove it.  */
-   shmdt(oldbuf);
-   shmctl(get_user_list_shm_id(), IPC_RMID, NULL);
-   
-   /* And set the global user_list_shm to what our new segment id is.  */
-   set_user_list_shm_id(new_user_list_shm);
-   
-   /* Detach from the new one as well.  */
-   shmdt(newbuf);
-   
-   /* Finally, give back the semaphore.  */
-   sem_give(user_list_sem);
+   return list;
 }
 
 /* Send all nicknames, but only those of properly logged in users */
 void send_nick_list(struct user_t *user)
 {
-   char *buf, *bufp;
-   char temp_nick[MAX_NICK_LEN+1];
-   char temp_host[MAX_HOST_LEN+1];
-   int spaces, entries;
-   int i;
+   char temp_nick[MAX_NICK_LEN+3];
+   char *nick_list;
    char *op_list;
    
-   send_to_user("$NickList ", user);
+   if((nick_list = get_nick_list()) == NULL)
+     return;
    
    /* If the user isn't on the list, send it back anyway */
-   if((user->type & (UNKEYED | NON_LOGGED)) != 0)
+   if(((user->type & (UNKEYED | NON_LOGGED)) != 0) && (user->nick[0] != '\0'))
      {
-	if(user->nick[0] != '\0')
-	  {
-	     sprintf(temp_nick, "%s$$", user->nick);
-	     send_to_user(temp_nick, user);
-	  }
+	send_to_user(NICK_LIST_START, user);
+	sprintf(temp_nick, "%s$$", user->nick);
+	send_to_user(temp_nick, user);
+	send_to_user(nick_list + strlen(NICK_LIST_START), user);
      }
-   
-   sem_take(user_list_sem);
-   
-   /* Attach to the shared segment */
-   if((buf = shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {
-	logprintf(1, "Error - In send_nick_list()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
-     }
-   
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
-     {
-	logprintf(1, "Error - In send_nick_list(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
-     }
-   
-   bufp = buf + 30;
-   
-   for(i = 1; i <= spaces; i++)
-     {
-	if(*bufp != '\0')
-	  {
-	     sscanf(bufp, "%50s %120s", temp_nick, temp_host);
-	     send_to_user(temp_nick, user);
-	     send_to_user("$$", user);
-	  }
-	bufp += USER_LIST_ENT_SIZE;
-     }
-   
-   shmdt(buf);
-   sem_give(user_list_sem);
-   
-   /* Add the two '|' at the end */
-   send_to_user("||", user);
+   else
+     send_to_user(nick_list, user);
+   free(nick_list);
    
    /* And send the oplist */
-   op_list = get_op_list();
+   if((op_list = get_op_list()) == NULL)
+     return;
    send_to_user(op_list, user);
    free(op_list);
    
@@ -612,129 +1041,47 @@ void send_nick_list(struct user_t *user)
      send_to_user("\r\n", user);
 }
 
+/* Returns the nick list as a string. The used string must be freed after
+ * use.  */
+char *get_nick_list(void)
+{
+   return read_list(0);
+}
+
 /* Returns the op list as a string. The used string must me freed after 
  * use.  */
 char *get_op_list(void)
 {
-   char *buf, *bufp;
-   int ret;
-   char temp_nick[MAX_NICK_LEN+1];
-   char temp_host[MAX_HOST_LEN+1];
-   char *op_list;
-   int spaces=0, entries=0;
-   int i;
-   
-   if((op_list = malloc(sizeof(char) * 9)) == NULL)
-     {
-	logprintf(1, "Error - In get_op_list()/malloc(): ");
-	logerror(1, errno);
-	quit = 1;
-	return NULL;
-     }
-   
-   sprintf(op_list, "%s", "$OpList ");
-   
-   sem_take(user_list_sem);
-   
-   /* Attach to the shared segment */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {
-	logprintf(1, "Error - In get_op_list()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return NULL;
-     }
-   
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
-     {
-	logprintf(1, "Error - In get_op_list(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return NULL;
-     }
-   
-   bufp = buf + 30;
-   
-   for(i = 1; i <= spaces; i++)
-     {
-	if(*bufp != '\0')
-	  {
-	     sscanf(bufp, "%50s %120s", temp_nick, temp_host);
-	     ret = check_if_registered(temp_nick);
-	     if((ret == 2) || (ret == 3))
-	       {
-		  if((op_list = realloc(op_list, sizeof(char)
-					* (strlen(op_list) + strlen(temp_nick) + 3))) == NULL)
-		    {
-		       logprintf(1, "Error - In get_op_list()/realloc(): ");
-		       logerror(1, errno);
-		       shmdt(buf);
-		       sem_give(user_list_sem);
-		       quit = 1;
-		       return NULL;
-		    }
-		  sprintfa(op_list, "%s$$", temp_nick);
-	       }
-	  }
-	bufp += USER_LIST_ENT_SIZE;
-     }
-   
-   shmdt(buf);
-   sem_give(user_list_sem);
-   
-   /* Add two '|' at the end */
-   if((op_list = realloc(op_list, sizeof(char)
-			 * (strlen(op_list) + 3))) == NULL)
-     {
-	logprintf(1, "Error - In get_op_list()/realloc(): ");
-	logerror(1, errno);
-	quit = 1;
-	return NULL;
-     }
-   
-   strcat(op_list, "||");
-   return op_list;
+   return read_list(1);
 }
 
 /* Sets the pid of the current listening process. Returns 0 if the listening
  * sockets are already taken.  */
 int set_listening_pid(int newpid)
 {
-   char *buf, *bufp;
+   struct user_list_head *head;
    int oldpid;
    
-   sem_take(user_list_sem);
+   write_lock_user_list();
    
-   /* Attach to the shared segment */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In set_listening_pid()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
+   if((head = attach_user_list("set_listening_pid")) == NULL)
+     {
+	write_unlock_user_list();
 	return -1;
      }
    
-   bufp = buf + 20;
-   
-   sscanf(bufp, "%d", &oldpid);
+   oldpid = head->listening_pid;
    
    if((oldpid != 0) && (oldpid != (int)getpid()))
      {
-	shmdt(buf);
-	sem_give(user_list_sem);
+	write_unlock_user_list();
 	return 0;
      }
    
-   sprintf(bufp, "%d", newpid);
+   head->listening_pid = newpid;
 
-   shmdt(buf);
    
-   sem_give(user_list_sem);
+   write_unlock_user_list();
    
    return 1;
 }
@@ -742,29 +1089,20 @@ int set_listening_pid(int newpid)
 /* Returns the pid of the current listening process.  */
 int get_listening_pid(void)
 {
-   char *buf, *bufp;
+   struct user_list_head *head;
+   unsigned int seq;
    int oldpid;
    
-   sem_take(user_list_sem);
-   
-   /* Attach to the shared segment */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In get_listening_pid()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return -1;
+   do
+     {
+	seq = read_begin_user_list();
+	
+	if((head = attach_user_list("get_listening_pid")) == NULL)
+	  return -1;
+	
+	oldpid = head->listening_pid;
      }
-   
-   bufp = buf + 20;
-   
-   sscanf(bufp, "%d", &oldpid);
-
-   shmdt(buf);
-   
-   sem_give(user_list_sem);
+   while(read_retry_user_list(seq));
    
    return oldpid;
 }
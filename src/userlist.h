@@ -22,10 +22,16 @@ int  get_user_list_shm_id(void);
 void set_user_list_shm_id(int id);
 int  add_user_to_list(struct user_t *user);
 int  remove_user_from_list(char *nick);
+void update_op_in_user_list(char *nick);
 char *check_if_on_user_list(char *nick);
+void get_users_hostname(char *nick, char *buffy);
+int  get_users_pid(char *nick);
+int  count_all_users(void);
+char *get_user_list_nicks(void);
 void increase_user_list(void);
 void purge_user_list(void);
 void send_user_list(int type, struct user_t *user);
+char *get_nick_list(void);
 char *get_op_list(void);
 int  set_listening_pid(int pid);
 int  get_listening_pid(void);
@@ -45,6 +45,10 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#if HAVE_LINUX_FUTEX_H
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
 
 #include "main.h"
 #include "utils.h"
@@ -111,71 +115,75 @@ int trim_string(char *buf)
    return 1;
 }
 
+/* Number of users of each type in the lists of this process, indexed by
+ * the bit of the type.  */
+static int type_counts[USER_TYPES];
+
+/* Returns the index in type_counts of a type.  */
+static int type_index(int type)
+{
+   int i;
+   
+   for(i = 0; (i < USER_TYPES - 1) && ((type & (1 << i)) == 0); i++);
+   return i;
+}
+
 /* Counts number of users which are included in type.  */
 int count_users(int type)
 {
    int count;
-   struct user_t *non_human;
-   struct sock_t *human_user;
+   int i;
    
    count = 0;
-   non_human = non_human_user_list;
-   human_user = human_sock_list;
-   
-   /* Start with non-human users.  */
-   while(non_human != NULL)
+   for(i = 0; i < USER_TYPES; i++)
      {
-	if((type & non_human->type) != 0)
-	  count++;
-  
-	non_human = non_human->next;
-     }
-   
-   /* And the human users.  */
-   while(human_user != NULL)
-     {
-	if((type & human_user->user->type) != 0)
-	  count++;
-	
-	human_user = human_user->next;
+	if((type & (1 << i)) != 0)
+	  count += type_counts[i];
      }
    
    return count;
 }
 
-
-/* Count all users in the whole hub.  */
-int count_all_users(void)
+/* Adds a user to the counts if add is 1, or removes it if add is -1. Called 
+ * when the user is added to or removed from one of the lists.  */
+void count_user(struct user_t *user, int add)
 {
-   char *buf;
-   int spaces=0, entries=0;
+   if((add > 0) == (user->counted != 0))
+     return;
    
-   sem_take(user_list_sem);
-   
-   /* Attach to the shared segment */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In count_all_users()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return -1;
-     }
-   
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
-     {	
-	logprintf(1, "Error - In count_all_users(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return -1;
+   type_counts[type_index(user->type)] += add;
+   user->counted = (add > 0) ? 1 : 0;
+}
+
+/* Changes the type of a user, and moves it to the right count if it's 
+ * counted.  */
+void set_user_type(struct user_t *user, int type)
+{
+   if(user->counted != 0)
+     {
+	type_counts[type_index(user->type)]--;
+	type_counts[type_index(type)]++;
      }
-   shmdt(buf);
-   sem_give(user_list_sem);
-   return entries;
+   user->type = type;
+   if(user->sock_index >= 0)
+     human_socks[user->sock_index].type = (unsigned short)type;
 }
-   
+
+/* Sets what is to be done with a user at the next clear_user_list().  */
+void set_user_rem(struct user_t *user, int rem)
+{
+   user->rem = (BYTE)rem;
+   if(user->sock_index >= 0)
+     human_socks[user->sock_index].rem = (BYTE)rem;
+}
+
+/* Forgets all counts, for a process that starts over with new lists.  */
+void reset_user_counts(void)
+{
+   memset(type_counts, 0, sizeof(type_counts));
+}
+
+
 /* Sends initial $Lock string to client */
 void send_lock(struct user_t *user)
 {
@@ -310,95 +318,34 @@ int validate_key(char *buf, struct user_t *user)
      }
    if(strncmp(buf+5, key, strlen(key)) != 0)
       return 0;
-   user->type = NON_LOGGED;
+   set_user_type(user, NON_LOGGED);
    return 1;
 }
 
-/* Puts users hostname in buffy.  */
-void get_users_hostname(char *nick, char *buffy)
+/* Returns a hash value of a nickname that doesn't depend on the case of the 
+ * nick, since nicks are compared case insensitive. This is FNV-1a over the 
+ * folded characters with a final mix, so that all characters affect the low
+ * bits that are used to index the tables.  */
+unsigned int nick_hash(char *nick)
 {
-   char *buf, *bufp;
-   char temp_nick[MAX_NICK_LEN+1];
-   char temp_host[MAX_HOST_LEN+1];
-   int spaces=0, entries=0;
-   int i;
+   register unsigned char *s;
+   register unsigned int c;
+   register unsigned int hash = 2166136261U;
    
-   sem_take(user_list_sem);
-   
-   /* Attach to the shared segment.  */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In get_users_hostname()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
+   for(s = (unsigned char *)nick; *s != '\0'; s++)
+     {
+	c = *s;
+	if((c >= 'A') && (c <= 'Z'))
+	  c += 'a' - 'A';
+	hash ^= c;
+	hash *= 16777619U;
      }
    
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
-     {	
-	logprintf(1, "Error - In remove_user_from_list(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
-	return;
-     }   
-   
-   bufp = buf + 30;
-   
-   for(i = 1; i <= spaces; i++)
-     {	
-	if(*bufp != '\0')
-	  {	     
-	     sscanf(bufp, "%50s %120s", temp_nick, temp_host);
-	     if((strncasecmp(temp_nick, nick, strlen(nick)) == 0)
-		&& (strlen(nick) == strlen(temp_nick)))
-	       {		  
-		  /* The user is here, so detach and put the hostname in the
-		   * buf.  */
-		  sprintf(buffy, "%s", temp_host);
-		  shmdt(buf);
-		  sem_give(user_list_sem);
-		  return;
-	       }	     
-	  }	
-	bufp += USER_LIST_ENT_SIZE;
-     }
-   
-   /* If user wasn't found, put null in returning string */
-   *buffy = '\0';
-   
-   shmdt(buf);
-   sem_give(user_list_sem);
-}
-
-/* Returns a hash value from a users nickname. It's important that this 
- * function generates values as random as possible, but also stays fast.  */
-int get_hash(char *nick)
-{
-   register char *s1, *s2;
-   register int i = 0;
-   register int hash = 0;
-
-   /* First char in nick.  */
-   s1 = nick;
-   
-   /* Last char in nick.  */
-   s2 = nick + strlen(nick) - 1;
-   
-   do 
-     {      	
-	hash |= ((*s1 & 0x1) << i);
-	i++;
-	hash |= ((*s2 & 0x1) << i);
-	i++;
-	s1++;
-	s2--;
-     } while((s1 <= s2) && (hash < max_sockets));
-   
-   while(hash > max_sockets)
-     hash >>= 1;
+   hash ^= hash >> 16;
+   hash *= 0x85EBCA6BU;
+   hash ^= hash >> 13;
+   hash *= 0xC2B2AE35U;
+   hash ^= hash >> 16;
    
    return hash;
 }
@@ -474,6 +421,51 @@ void sem_give(int sem)
      }   
 }
 
+#if HAVE_LINUX_FUTEX_H
+/* Takes a lock that lives in shared memory. The lock is 0 when it's free,
+ * 1 when it's taken and 2 when it's taken and someone is waiting for it, so
+ * neither taking nor giving it makes a system call unless there is
+ * contention.  */
+void futex_take(int *lock)
+{
+   int c;
+   
+   if((c = __sync_val_compare_and_swap(lock, 0, 1)) == 0)
+     return;
+   
+   if(c != 2)
+     c = __sync_lock_test_and_set(lock, 2);
+   
+   while(c != 0)
+     {
+	if((syscall(SYS_futex, lock, FUTEX_WAIT, 2, NULL, NULL, 0) < 0)
+	   && (errno != EAGAIN) && (errno != EINTR))
+	  {
+	     logprintf(1, "Error - In futex_take()/futex(): ");
+	     logerror(1, errno);
+	     quit = 1;
+	  }
+	c = __sync_lock_test_and_set(lock, 2);
+     }
+}
+
+/* Gives a lock taken with futex_take().  */
+void futex_give(int *lock)
+{
+   if(__sync_fetch_and_sub(lock, 1) == 1)
+     return;
+   
+   /* Someone is waiting.  */
+   *(volatile int *)lock = 0;
+   if(syscall(SYS_futex, lock, FUTEX_WAKE, 1, NULL, NULL, 0) < 0)
+     {
+	logprintf(1, "Error - In futex_give()/futex(): ");
+	logerror(1, errno);
+	quit = 1;
+     }
+}
+#endif
+
 /* Initializes the shared memory segment with to total share.  */
 int init_share_shm(void)
 {
@@ -658,6 +650,581 @@ int match_with_wildcards(char *buf1, char *buf2)
    return 1;
 }
 
+/* The items of the patterns in a wildcard set. A literal character is 
+ * stored as its value.  */
+#define WC_STAR            -1
+#define WC_END             -2
+
+/* Returns the state for the sorted positions pos, adding it if it's new.
+ * Returns -1 on error.  */
+static int wc_add_state(struct wildcard_set *set, int *pos, int count)
+{
+   struct wc_state *state;
+   struct wc_state *new_states;
+   unsigned int hash = 2166136261U;
+   int accept = 0;
+   int i;
+   
+   for(i = 0; i < count; i++)
+     {
+	hash = (hash ^ pos[i]) * 16777619U;
+	if(set->items[pos[i]] == WC_END)
+	  accept = 1;
+     }
+   
+   for(i = set->buckets[hash & (WC_BUCKETS - 1)]; i >= 0; 
+       i = set->states[i].hash_next)
+     {
+	state = &set->states[i];
+	if((state->hash == hash) && (state->count == count)
+	   && (memcmp(state->pos, pos, sizeof(int) * count) == 0))
+	  return i;
+     }
+   
+   if(set->state_count == set->state_size)
+     {
+	if((new_states = realloc(set->states, sizeof(struct wc_state) 
+				 * (set->state_size + 16))) == NULL)
+	  {
+	     logprintf(1, "Error - In wc_add_state()/realloc(): ");
+	     logerror(1, errno);
+	     quit = 1;
+	     return -1;
+	  }
+	set->states = new_states;
+	set->state_size += 16;
+     }
+   
+   state = &set->states[set->state_count];
+   if((state->pos = malloc(sizeof(int) * (count + 1))) == NULL)
+     {
+	logprintf(1, "Error - In wc_add_state()/malloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   if(count > 0)
+     memcpy(state->pos, pos, sizeof(int) * count);
+   state->count = count;
+   state->accept = accept;
+   for(i = 0; i < 256; i++)
+     state->next[i] = -1;
+   state->hash = hash;
+   state->hash_next = set->buckets[hash & (WC_BUCKETS - 1)];
+   set->buckets[hash & (WC_BUCKETS - 1)] = set->state_count;
+   
+   return set->state_count++;
+}
+
+/* Adds position p to the positions that are built in set->scratch, and the
+ * position after it if p is a wildcard, since that can match nothing.  */
+static void wc_add_pos(struct wildcard_set *set, int p, int *count)
+{
+   while(set->mark[p] != set->stamp)
+     {
+	set->mark[p] = set->stamp;
+	set->scratch[(*count)++] = p;
+	if(set->items[p] != WC_STAR)
+	  break;
+	p++;
+     }
+}
+
+static int wc_compare_pos(const void *a, const void *b)
+{
+   return *(const int *)a - *(const int *)b;
+}
+
+/* Throws away all states and starts over with the dead state 0, which 
+ * doesn't match anything, and the start state 1. Returns -1 on error.  */
+static int wc_reset_states(struct wildcard_set *set)
+{
+   int i, count;
+   
+   for(i = 0; i < set->state_count; i++)
+     free(set->states[i].pos);
+   set->state_count = 0;
+   for(i = 0; i < WC_BUCKETS; i++)
+     set->buckets[i] = -1;
+   set->flushes++;
+   
+   if(wc_add_state(set, NULL, 0) < 0)
+     return -1;
+   for(i = 0; i < 256; i++)
+     set->states[0].next[i] = 0;
+   
+   /* Every pattern starts at 0 or right after the end of another.  */
+   set->stamp++;
+   count = 0;
+   wc_add_pos(set, 0, &count);
+   for(i = 0; i < set->item_count - 1; i++)
+     if(set->items[i] == WC_END)
+       wc_add_pos(set, i + 1, &count);
+   qsort(set->scratch, count, sizeof(int), wc_compare_pos);
+   
+   return wc_add_state(set, set->scratch, count);
+}
+
+/* Finds the state that follows state cur on character c. Returns -1 on
+ * error.  */
+static int wc_step(struct wildcard_set *set, int cur, int c)
+{
+   int *pos;
+   int i, p, count, pos_count, next, flushes;
+   
+   pos = set->states[cur].pos;
+   pos_count = set->states[cur].count;
+   
+   /* Don't let the states grow without limit. Since cur is gone after a
+    * reset, its positions are kept until the next state is built, and the
+    * transition isn't saved.  */
+   flushes = set->flushes;
+   if(set->state_count >= WC_MAX_STATES)
+     {
+	set->states[cur].pos = NULL;
+	if(wc_reset_states(set) < 0)
+	  {
+	     free(pos);
+	     return -1;
+	  }
+     }
+   
+   set->stamp++;
+   count = 0;
+   for(i = 0; i < pos_count; i++)
+     {
+	p = pos[i];
+	if(set->items[p] == WC_STAR)
+	  wc_add_pos(set, p, &count);
+	else if(set->items[p] == c)
+	  wc_add_pos(set, p + 1, &count);
+     }
+   qsort(set->scratch, count, sizeof(int), wc_compare_pos);
+   
+   if(flushes != set->flushes)
+     free(pos);
+   
+   if((next = wc_add_state(set, set->scratch, count)) < 0)
+     return -1;
+   if(flushes == set->flushes)
+     set->states[cur].next[c] = next;
+   return next;
+}
+
+/* Creates an empty set of wildcard patterns. Returns NULL on error.  */
+struct wildcard_set *new_wildcard_set(void)
+{
+   struct wildcard_set *set;
+   
+   if((set = malloc(sizeof(struct wildcard_set))) == NULL)
+     {
+	logprintf(1, "Error - In new_wildcard_set()/malloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return NULL;
+     }
+   memset(set, 0, sizeof(struct wildcard_set));
+   return set;
+}
+
+void free_wildcard_set(struct wildcard_set *set)
+{
+   int i;
+   
+   if(set == NULL)
+     return;
+   for(i = 0; i < set->state_count; i++)
+     free(set->states[i].pos);
+   if(set->states != NULL)
+     free(set->states);
+   if(set->items != NULL)
+     free(set->items);
+   if(set->mark != NULL)
+     free(set->mark);
+   if(set->scratch != NULL)
+     free(set->scratch);
+   free(set);
+}
+
+/* Adds a pattern to the set. The pattern is written like for 
+ * match_with_wildcards(). Returns 0 if the pattern isn't valid and -1 on 
+ * error.  */
+int add_wildcard(struct wildcard_set *set, char *pattern)
+{
+   int *new_items;
+   int len, i;
+   unsigned char *s;
+   
+   len = strlen(pattern) + 1;
+   if((new_items = realloc(set->items, sizeof(int) 
+			   * (set->item_count + len))) == NULL)
+     {
+	logprintf(1, "Error - In add_wildcard()/realloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   set->items = new_items;
+   
+   i = set->item_count;
+   for(s = (unsigned char *)pattern; *s != '\0'; s++)
+     {
+	if(*s == '*')
+	  {
+	     /* Two wildcards in a row are the same as one.  */
+	     if((i == set->item_count) || (set->items[i-1] != WC_STAR))
+	       set->items[i++] = WC_STAR;
+	  }
+	
+	/* After a '\', only '*' and '\' is allowed.  */
+	else if(*s == '\\')
+	  {
+	     s++;
+	     if((*s != '*') && (*s != '\\'))
+	       return 0;
+	     set->items[i++] = *s;
+	  }
+	else
+	  set->items[i++] = *s;
+     }
+   
+   if(i == set->item_count)
+     return 0;
+   set->items[i++] = WC_END;
+   set->item_count = i;
+   
+   /* The positions are marked when the states are built.  */
+   if((new_items = realloc(set->mark, sizeof(int) * i)) == NULL)
+     {
+	logprintf(1, "Error - In add_wildcard()/realloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   set->mark = new_items;
+   if((new_items = realloc(set->scratch, sizeof(int) * i)) == NULL)
+     {
+	logprintf(1, "Error - In add_wildcard()/realloc(): ");
+	logerror(1, errno);
+	quit = 1;
+	return -1;
+     }
+   set->scratch = new_items;
+   memset(set->mark, 0, sizeof(int) * i);
+   set->stamp = 0;
+   
+   /* The states that are already built don't know about the new 
+    * pattern.  */
+   for(i = 0; i < set->state_count; i++)
+     free(set->states[i].pos);
+   set->state_count = 0;
+   
+   return 1;
+}
+
+/* Returns 1 if str matches any of the patterns in the set, 0 if it doesn't
+ * and -1 on error. The automaton is built as it's needed, so most calls only
+ * follow one already built transition for each character in str.  */
+int match_wildcard_set(struct wildcard_set *set, char *str)
+{
+   unsigned char *s;
+   int cur, next;
+   
+   if(set->item_count == 0)
+     return 0;
+   
+   if((set->state_count == 0) && (wc_reset_states(set) < 0))
+     return -1;
+   
+   cur = 1;
+   for(s = (unsigned char *)str; *s != '\0'; s++)
+     {
+	if(((next = set->states[cur].next[*s]) < 0)
+	   && ((next = wc_step(set, cur, *s)) < 0))
+	  return -1;
+	
+	/* Nothing can match anymore */
+	if((cur = next) == 0)
+	  return 0;
+     }
+   return set->states[cur].accept;
+}
+
+/* A pool of objects of one size, carved out of slabs of POOL_SLAB_SIZE 
+ * bytes. Freed objects are kept in a free list for the next one that is 
+ * needed. Slabs are never given back, since the number of users in a 
+ * process tends to come back to where it was. The pools aren't shared, a 
+ * forked process gets its own copy.  */
+struct pool_t
+{
+   char *name;
+   int size;                          /* Bytes per object, a multiple of 16 */
+   void *free_list;                   /* Freed objects, each one points to the
+				       * next */
+   char *slab_pos;                    /* Next unused object in the last slab */
+   char *slab_end;
+   unsigned long slabs;               /* Slabs allocated */
+   unsigned long in_use;              /* Objects that are taken */
+   unsigned long reused;              /* Objects taken from the free list */
+};
+
+/* Strings start with a header that has the number of the pool they came 
+ * from, or -1 if they were too big for the pools and came from malloc().  */
+#define STRING_HEADER      16
+#define POOL_ROUND(size)   (((size) + 15) & ~15)
+
+static struct pool_t pools[POOL_COUNT] = 
+{
+     {"Users", POOL_ROUND(sizeof(struct user_t))},
+     {"Strings up to 32 bytes", 32 + STRING_HEADER},
+     {"Strings up to 64 bytes", 64 + STRING_HEADER},
+     {"Strings up to 128 bytes", 128 + STRING_HEADER},
+     {"Strings up to 256 bytes", 256 + STRING_HEADER},
+     {"Strings up to 1024 bytes", IN_BUF_SIZE + STRING_HEADER}
+};
+
+static unsigned long big_strings = 0;     /* Strings that came from malloc() */
+
+/* Returns an object from one of the pools, or NULL if there was no memory
+ * left for a new slab.  */
+void *pool_alloc(int pool_nbr)
+{
+   struct pool_t *pool;
+   void *obj;
+   
+   pool = &pools[pool_nbr];
+   if((obj = pool->free_list) != NULL)
+     {
+	pool->free_list = *(void **)obj;
+	pool->reused++;
+     }
+   else
+     {
+	if(pool->slab_pos + pool->size > pool->slab_end)
+	  {
+	     if((pool->slab_pos = malloc(POOL_SLAB_SIZE)) == NULL)
+	       {
+		  pool->slab_end = NULL;
+		  return NULL;
+	       }
+	     pool->slab_end = pool->slab_pos + POOL_SLAB_SIZE;
+	     pool->slabs++;
+	  }
+	obj = pool->slab_pos;
+	pool->slab_pos += pool->size;
+     }
+   pool->in_use++;
+   
+   return obj;
+}
+
+/* Puts an object back in the pool it came from.  */
+void pool_free(int pool_nbr, void *obj)
+{
+   if(obj == NULL)
+     return;
+   
+   *(void **)obj = pools[pool_nbr].free_list;
+   pools[pool_nbr].free_list = obj;
+   pools[pool_nbr].in_use--;
+}
+
+/* Returns room for size bytes from the smallest pool of strings they fit 
+ * in, or from malloc() if they don't fit in any. It's freed with 
+ * free_string(). Returns NULL if there's no memory left.  */
+char *alloc_string(int size)
+{
+   char *str;
+   int i;
+   
+   for(i = POOL_STRING; (i < POOL_COUNT) 
+       && (size > pools[i].size - STRING_HEADER); i++);
+   
+   if(i < POOL_COUNT)
+     str = pool_alloc(i);
+   else
+     {
+	str = malloc(size + STRING_HEADER);
+	i = -1;
+	if(str != NULL)
+	  big_strings++;
+     }
+   if(str == NULL)
+     return NULL;
+   
+   *(int *)str = i;
+   return str + STRING_HEADER;
+}
+
+/* Frees a string from alloc_string().  */
+void free_string(char *str)
+{
+   int i;
+   
+   if(str == NULL)
+     return;
+   
+   str -= STRING_HEADER;
+   if((i = *(int *)str) == -1)
+     {
+	big_strings--;
+	free(str);
+     }
+   else
+     pool_free(i, str);
+}
+
+/* Sends the number of objects in each pool of this process to user.  */
+void send_pool_stats(struct user_t *user)
+{
+   int i;
+   
+   for(i = 0; i < POOL_COUNT; i++)
+     uprintf(user, "%s in use: %lu, reused: %lu, slabs: %lu\r\n", 
+	     pools[i].name, pools[i].in_use, pools[i].reused, pools[i].slabs);
+   uprintf(user, "Bigger strings in use: %lu\r\n", big_strings);
+}
+
+/* The timer wheel has a slot for each second, and a timer is put in the 
+ * slot of the second it expires. Timers that expire further away than
+ * TIMER_SLOTS seconds wait for more than one turn of the wheel.  */
+static struct timeout_t wheel[TIMER_SLOTS];
+static time_t wheel_time = 0;             /* Next second to run timers for */
+
+/* Returns the current second. It's taken from the same clock as in 
+ * timer_wait(), so that the wheel doesn't wait for a second that has already
+ * started according to timer_wait().  */
+static time_t timer_now(void)
+{
+   struct timeval tv;
+   
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec;
+}
+
+/* Starts timer, so that func(arg) is called from run_timers() in seconds 
+ * seconds. A timer that is already running is started over.  */
+void add_timer(struct timeout_t *timer, int seconds, void (*func)(void *), void *arg)
+{
+   struct timeout_t *slot;
+   
+   cancel_timer(timer);
+   
+   if(wheel_time == 0)
+     wheel_time = timer_now();
+   
+   timer->expires = timer_now() + seconds;
+   timer->func = func;
+   timer->arg = arg;
+   
+   /* A timer that should already have fired is run on the next call.  */
+   if(timer->expires < wheel_time)
+     slot = &wheel[wheel_time & (TIMER_SLOTS - 1)];
+   else
+     slot = &wheel[timer->expires & (TIMER_SLOTS - 1)];
+   
+   if(slot->next == NULL)
+     {
+	slot->next = slot;
+	slot->prev = slot;
+     }
+   
+   /* Last in the slot.  */
+   timer->next = slot;
+   timer->prev = slot->prev;
+   slot->prev->next = timer;
+   slot->prev = timer;
+}
+
+/* Stops a timer, if it's running.  */
+void cancel_timer(struct timeout_t *timer)
+{
+   if(timer->next == NULL)
+     return;
+   
+   timer->prev->next = timer->next;
+   timer->next->prev = timer->prev;
+   timer->next = NULL;
+   timer->prev = NULL;
+}
+
+/* Runs the timers that have expired. It's called from the main loop, so the
+ * timers aren't run in a signal handler. The expired timers of a slot are
+ * moved to a list of their own before any of them is run, and each one is
+ * taken off it before it's run, so a timer function may start or cancel any
+ * timer, or remove a user, without breaking the walk.  */
+void run_timers(void)
+{
+   struct timeout_t due, *slot, *timer, *next;
+   time_t now;
+   
+   if(wheel_time == 0)
+     return;
+   
+   now = timer_now();
+   
+   /* If the clock has jumped, one turn of the wheel covers all timers.  */
+   if(now - wheel_time >= TIMER_SLOTS)
+     wheel_time = now - TIMER_SLOTS + 1;
+   
+   for(; wheel_time <= now; wheel_time++)
+     {
+	slot = &wheel[wheel_time & (TIMER_SLOTS - 1)];
+	if(slot->next == NULL)
+	  continue;
+	
+	due.next = &due;
+	due.prev = &due;
+	for(timer = slot->next; timer != slot; timer = next)
+	  {
+	     next = timer->next;
+	     if(timer->expires <= wheel_time)
+	       {
+		  cancel_timer(timer);
+		  timer->next = &due;
+		  timer->prev = due.prev;
+		  due.prev->next = timer;
+		  due.prev = timer;
+	       }
+	  }
+	
+	while((timer = due.next) != &due)
+	  {
+	     cancel_timer(timer);
+	     timer->func(timer->arg);
+	  }
+     }
+}
+
+/* Marks all timers of a new user as not running.  */
+void init_user_timers(struct user_t *user)
+{
+   int i;
+   
+   for(i = 0; i < USER_TIMERS; i++)
+     user->timers[i].next = NULL;
+}
+
+/* Stops all timers of a user that is going away.  */
+void cancel_user_timers(struct user_t *user)
+{
+   int i;
+   
+   for(i = 0; i < USER_TIMERS; i++)
+     cancel_timer(&user->timers[i]);
+}
+
+/* Returns the number of milliseconds until the timers should be run next. */
+int timer_wait(void)
+{
+   struct timeval tv;
+   
+   gettimeofday(&tv, NULL);
+   if((wheel_time == 0) || (tv.tv_sec < wheel_time))
+     return 1000 - tv.tv_usec / 1000;
+   return 0;
+}
+
 /* This function prints all names in the hashtable for a certain process. It
  * can be commented out and can be used anywhere. */
 /*void print_usernames(void)
@@ -669,14 +1236,13 @@ int match_with_wildcards(char *buf1, char *buf2)
    sem_take(user_list_sem);
    logprintf(1, "Printing all users in process %d\n", getpid());
    
-   for(i = 0; i <= max_sockets; i++)
+   for(i = 0; i < human_hash_table.size; i++)
      {
-	user = human_hash_table[i];
-	while(user != NULL) 
+	user = human_hash_table.slots[i];
+	if((user != NULL) && (user->nick[0] != '\0'))
 	  {
 	     logprintf(1, "User %d:s nick: %s\n", count, user->nick);
 	     count++;
-	     user = user->next;
 	  }
      }
    sem_give(user_list_sem);
@@ -22,17 +22,38 @@ int    cut_string(char *buf, char c);
 void   sprintfa(char *buf, const char *format, ...);
 int    trim_string(char *buf);
 int    count_users(int type);
-int    count_all_users(void);
+void   count_user(struct user_t *user, int add);
+void   set_user_type(struct user_t *user, int type);
+void   set_user_rem(struct user_t *user, int rem);
+void   reset_user_counts(void);
 void   uprintf(struct user_t *user, char *format, ...);
 void   send_lock(struct user_t *user);
 int    validate_key(char *buf, struct user_t *user);
-void   get_users_hostname(char *nick, char *buf);
-int    get_hash(char *nick);
+unsigned int nick_hash(char *nick);
 int    init_sem(int *sem);
 int    init_share_shm(void);
 void   sem_take(int sem);
 void   sem_give(int sem);
+#if HAVE_LINUX_FUTEX_H
+void   futex_take(int *lock);
+void   futex_give(int *lock);
+#endif
 void   add_total_share(long long add);
 long long get_total_share(void);
 double get_uptime();
 int    match_with_wildcards(char *buf1, char *buf2);
+struct wildcard_set *new_wildcard_set(void);
+void   free_wildcard_set(struct wildcard_set *set);
+int    add_wildcard(struct wildcard_set *set, char *pattern);
+int    match_wildcard_set(struct wildcard_set *set, char *str);
+void   *pool_alloc(int pool_nbr);
+void   pool_free(int pool_nbr, void *obj);
+char   *alloc_string(int size);
+void   free_string(char *str);
+void   send_pool_stats(struct user_t *user);
+void   add_timer(struct timeout_t *timer, int seconds, void (*func)(void *), void *arg);
+void   cancel_timer(struct timeout_t *timer);
+void   init_user_timers(struct user_t *user);
+void   cancel_user_timers(struct user_t *user);
+void   run_timers(void);
+int    timer_wait(void);
@@ -409,6 +409,10 @@ XS(xs_get_variable)
      XSRETURN_PV(link_pass);
    else if(!strncmp(var_name, "users_per_fork", 14))
      XSRETURN_IV(users_per_fork);
+   else if(!strncmp(var_name, "send_threads", 12))
+     XSRETURN_IV(send_threads);
+   else if(!strncmp(var_name, "accept_workers", 14))
+     XSRETURN_IV(accept_workers);
    else if(!strncmp(var_name, "listening_port", 14))
      XSRETURN_IV(listening_port);
    else if(!strncmp(var_name, "admin_port", 10))
@@ -783,12 +787,6 @@ XS(xs_check_if_registered)
 
 XS(xs_get_user_list)
 {
-   char *buf, *bufp;
-   char temp_nick[MAX_NICK_LEN+1];
-   char temp_host[MAX_HOST_LEN+1];
-   int spaces=0, entries=0;
-   int i;  
-
    dXSARGS;
    
    if(items != 0)
@@ -797,62 +795,8 @@ XS(xs_get_user_list)
    if(user_list != NULL)
      free(user_list);
    
-   if((user_list = malloc(sizeof(char) * 2)) == NULL)
-     {	
-	logprintf(1, "Error - In get_user_list()/malloc(): ");
-	logerror(1, errno);
-	quit = 1;
-	XSRETURN_UNDEF;
-     }
-   
-   *user_list = '\0';
-   
-   sem_take(user_list_sem);
-   
-   /* Attach to the shared segment */
-   if((buf = (char *)shmat(get_user_list_shm_id(), NULL, 0))
-      == (char *)-1)
-     {	
-	logprintf(1, "Error - In get_user_list()/shmat(): ");
-	logerror(1, errno);
-	sem_give(user_list_sem);
-	quit = 1;
-	XSRETURN_UNDEF;
-     }
-   
-   if(sscanf(buf, "%d %d", &spaces, &entries) != 2)
-     {	
-	logprintf(1, "Error - In get_op_list(): Couldn't get number of entries\n");
-	shmdt(buf);
-	sem_give(user_list_sem);
-	quit = 1;
-	XSRETURN_UNDEF;
-     }
-   
-   bufp = buf + 30;
-   
-   for(i = 1; i <= spaces; i++)
-     {       
-	if(*bufp != '\0')
-	  {	     
-	     sscanf(bufp, "%50s %120s", temp_nick, temp_host);
-	     if((user_list = realloc(user_list, sizeof(char)
-		* (strlen(user_list) + strlen(temp_nick) + 2))) == NULL)
-	       {		       
-		  logprintf(1, "Error - In get_user_list()/realloc(): ");
-		  logerror(1, errno);
-		  shmdt(buf);
-		  sem_give(user_list_sem);
-		  quit = 1;
-		  XSRETURN_UNDEF;
-	       }		  
-	     sprintfa(user_list, "%s ", temp_nick);	       	     
-	  }	
-	bufp += USER_LIST_ENT_SIZE;
-     }
-   
-   shmdt(buf);
-   sem_give(user_list_sem);        
+   if((user_list = get_user_list_nicks()) == NULL)
+     XSRETURN_UNDEF;
    
    XSRETURN_PV(user_list);
 }